@@ -17,24 +17,41 @@ namespace lox {
 
 struct literal_expr {
   literal literal;
+  // Index into the interpreter's constant pool, filled in by the resolver.
+  int constant = -1;
+};
+
+// Where a variable lives, worked out ahead of time by the resolver:
+// - local: a slot in the current call's stack frame
+// - upvalue: a variable captured from an enclosing function
+// - global: a slot in the global table
+enum class binding_kind { unresolved, local, upvalue, global };
+
+struct binding {
+  binding_kind kind  = binding_kind::unresolved;
+  int          index = -1;
 };
 
 struct variable_expr {
-  token name;
+  token   name;
+  binding resolved;
 };
 
 using expr = std::variant<literal_expr, variable_expr, box<struct group_expr>,
                           box<struct assign_expr>, box<struct unary_expr>,
                           box<struct logical_expr>, box<struct binary_expr>,
-                          box<struct call_expr>, box<struct conditional_expr>>;
+                          box<struct call_expr>, box<struct conditional_expr>,
+                          box<struct suspend_expr>, box<struct array_expr>,
+                          box<struct index_expr>, box<struct set_index_expr>>;
 
 struct group_expr {
   expr ex;
 };
 
 struct assign_expr {
-  token name;
-  expr  value;
+  token   name;
+  expr    value;
+  binding resolved;
 };
 
 struct unary_expr {
@@ -66,6 +83,34 @@ struct conditional_expr {
   expr alt;
 };
 
+// `yield value` or `await value` (which the keyword says): both suspend the
+// function they're in, if it's a generator or async function respectively.
+struct suspend_expr {
+  token keyword;
+  expr  value;
+};
+
+// `[a, b, c]`
+struct array_expr {
+  token             bracket;
+  std::vector<expr> elements;
+};
+
+// `object[index]`
+struct index_expr {
+  expr  object;
+  token bracket;
+  expr  index;
+};
+
+// `object[index] = value`
+struct set_index_expr {
+  expr  object;
+  token bracket;
+  expr  index;
+  expr  value;
+};
+
 struct expression_stmt {
   expr ex;
 };
@@ -77,6 +122,9 @@ struct print_stmt {
 struct variable_stmt {
   token               name;
   std::optional<expr> init;
+  binding             resolved;
+  // Whether it's ever assigned to after being declared (locals only)
+  bool                assigned = false;
 };
 
 struct return_stmt {
@@ -97,10 +145,25 @@ struct block_stmt {
   std::vector<stmt> stmts;
 };
 
+// A variable captured by a closure, either from the enclosing function's
+// stack frame or from the enclosing function's own captures.
+struct capture {
+  bool local;
+  int  index;
+};
+
+// Calling a generator (a function that yields) or an async function creates
+// a coroutine (see coroutine.hpp) to run it in, which can be suspended.
+enum class function_kind { plain, generator, async };
+
 struct function_stmt {
-  token              name;
-  std::vector<token> params;
-  std::vector<stmt>  body;
+  token                name;
+  std::vector<token>   params;
+  std::vector<stmt>    body;
+  binding              resolved;
+  std::vector<capture> captures;
+  // Async is declared, a generator is found out by the resolver
+  function_kind        kind = function_kind::plain;
 };
 
 struct if_stmt {
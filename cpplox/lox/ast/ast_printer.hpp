@@ -74,6 +74,31 @@ struct ast_printer {
                        std::visit(*this, e->then), std::visit(*this, e->alt));
   }
 
+  auto operator()(const box<suspend_expr>& e) -> std::string {
+    return fmt::format("({} {})", e->keyword.lexeme,
+                       std::visit(*this, e->value));
+  }
+
+  auto operator()(const box<array_expr>& e) -> std::string {
+    std::vector<std::string> elements(std::size(e->elements));
+    std::ranges::transform(e->elements, std::begin(elements),
+                           [this](const expr& ex) {
+                             return std::visit(*this, ex);
+                           });
+    return fmt::format("[{}]", fmt::join(elements, ","));
+  }
+
+  auto operator()(const box<index_expr>& e) -> std::string {
+    return fmt::format("{}[{}]", std::visit(*this, e->object),
+                       std::visit(*this, e->index));
+  }
+
+  auto operator()(const box<set_index_expr>& e) -> std::string {
+    return fmt::format("(= {}[{}] {})", std::visit(*this, e->object),
+                       std::visit(*this, e->index),
+                       std::visit(*this, e->value));
+  }
+
   auto operator()(const expression_stmt& s) -> std::string {
     return fmt::format("expr: {}", std::visit(*this, s.ex));
   }
@@ -4,7 +4,6 @@
 #include <fmt/core.h>
 #include <fmt/ostream.h>
 
-#include <iostream>
 
 namespace lox {
 
@@ -18,11 +17,6 @@ parser_error::parser_error(token token, std::string message)
 runtime_error::runtime_error(token token, const std::string& message)
     : std::runtime_error(message), token_(std::move(token)) {}
 
-bool errors::errored         = false;
-bool errors::runtime_errored = false;
-
-std::ostream* errors::output = &std::cout;
-
 void errors::report(int line, std::string_view message) {
   fmt::print(*output, "[line {}] Error: {}\n", line, message);
   errored = true;
@@ -38,8 +32,8 @@ void errors::report_parser_error(const parser_error& err) {
 }
 
 void errors::report_runtime_error(const runtime_error& err) {
-  fmt::print("[line {}] Error: '{}' {}\n", err.token_.line, err.token_.lexeme,
-             err.what());
+  fmt::print(*output, "[line {}] Error: '{}' {}\n", err.token_.line,
+             err.token_.lexeme, err.what());
   runtime_errored = true;
 }
 
@@ -2,6 +2,7 @@
 
 #include <lox/token/token.hpp>
 
+#include <iostream>
 #include <ostream>
 #include <stdexcept>
 #include <string_view>
@@ -24,16 +25,21 @@ struct runtime_error final : public std::runtime_error {
   token token_;
 };
 
-// Really, this acts like a namespace.
+// errors is where a pipeline (scanner, parser, resolver and interpreter)
+// reports errors to, and remembers whether there were any. Each interpreter
+// has its own (see interpreter::diagnostics), so interpreters on different
+// threads have nothing in common.
 struct errors {
-  static void report(int line, std::string_view message);
-  static void report_parser_error(const parser_error& err);
-  static void report_runtime_error(const runtime_error& err);
+  explicit errors(std::ostream& output = std::cout) : output(&output) {}
 
-  static bool errored;
-  static bool runtime_errored;
+  void report(int line, std::string_view message);
+  void report_parser_error(const parser_error& err);
+  void report_runtime_error(const runtime_error& err);
 
-  static std::ostream* output;
+  bool errored         = false;
+  bool runtime_errored = false;
+
+  std::ostream* output;
 };
 
 } // namespace lox
@@ -0,0 +1,101 @@
+#include <lox/interpreter/interpreter.hpp>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+namespace lox {
+
+namespace {
+
+// Ticks between looking at the clock and the heap. Small enough to notice a
+// deadline within a fraction of a millisecond, big enough for the looking to
+// cost nothing much.
+constexpr std::int64_t SLICE = 1 << 14;
+// Ticks when there are no budgets: never checked at all
+constexpr std::int64_t FOREVER = std::numeric_limits<std::int64_t>::max();
+
+auto over_heap_limit(std::size_t limit, usage used) -> budget_exceeded {
+  return {fmt::format("went over its heap limit ({} bytes)", limit), used};
+}
+
+} // namespace
+
+budget_exceeded::budget_exceeded(std::string const& limit, usage used)
+    : std::runtime_error(
+          fmt::format("{} (after {} steps, {:.3f}s and {} bytes of heap)",
+                      limit, used.fuel, used.seconds, used.heap)),
+      used(used) {}
+
+auto interpreter::budgeted() const -> bool {
+  return options_.fuel > 0 or options_.time_limit > 0 or
+         options_.heap_limit > 0;
+}
+
+void interpreter::start_budgets() {
+  fuel_used_ = 0;
+  started_   = std::chrono::steady_clock::now();
+  // What earlier runs made and left behind doesn't count against this one
+  heap_base_ = meter_ != nullptr ? meter_->bytes.load() : 0;
+  if (meter_ != nullptr) {
+    meter_->limit = heap_base_ + static_cast<std::int64_t>(options_.heap_limit);
+    meter_->exceeded = [this](std::int64_t bytes) {
+      auto now = used();
+      now.heap = static_cast<std::size_t>(bytes - heap_base_);
+      throw over_heap_limit(options_.heap_limit, now);
+    };
+  }
+
+  slice_ = budgeted() ? std::min<std::int64_t>(SLICE, fuel_left()) : FOREVER;
+  ticks_ = slice_;
+}
+
+auto interpreter::fuel_left() const -> std::int64_t {
+  if (options_.fuel == 0) return FOREVER;
+  return static_cast<std::int64_t>(options_.fuel - fuel_used_);
+}
+
+auto interpreter::used() const -> usage {
+  auto const heap = meter_ != nullptr ? meter_->bytes.load() : 0;
+  return {
+      .fuel    = fuel_used_ + static_cast<std::uint64_t>(slice_ - ticks_),
+      .seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - started_)
+                     .count(),
+      .heap    = heap > heap_base_
+                     ? static_cast<std::size_t>(heap - heap_base_)
+                     : 0,
+  };
+}
+
+void interpreter::check_budgets() {
+  // The slice has been used up exactly, and ticks_ is 0
+  fuel_used_ += static_cast<std::uint64_t>(std::exchange(slice_, 0));
+
+  auto const now = used();
+  if (options_.fuel > 0 and now.fuel >= options_.fuel) {
+    throw budget_exceeded(
+        fmt::format("ran out of fuel ({} steps)", options_.fuel), now);
+  }
+  if (options_.time_limit > 0 and now.seconds >= options_.time_limit) {
+    throw budget_exceeded(
+        fmt::format("ran out of time ({:.3f}s)", options_.time_limit), now);
+  }
+  if (options_.heap_limit > 0 and now.heap > options_.heap_limit) {
+    throw over_heap_limit(options_.heap_limit, now);
+  }
+
+  slice_ = std::min<std::int64_t>(SLICE, fuel_left());
+  ticks_ = slice_;
+}
+
+void interpreter::check_heap() const {
+  auto const now = used();
+  if (options_.heap_limit > 0 and now.heap > options_.heap_limit) {
+    throw over_heap_limit(options_.heap_limit, now);
+  }
+}
+
+} // namespace lox
@@ -0,0 +1,12 @@
+#include <lox/interpreter/bytecode.hpp>
+
+namespace lox {
+
+auto prototype::token_at(instruction const* ip) const -> token const& {
+  static token const none{};
+
+  auto const origin = origins[static_cast<std::size_t>(ip - code.data())];
+  return origin >= 0 ? tokens[static_cast<std::size_t>(origin)] : none;
+}
+
+} // namespace lox
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <lox/ast/ast.hpp>
+#include <lox/token/token.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace lox {
+
+namespace ir {
+struct function;
+} // namespace ir
+
+// clang-format off
+// The operand of each instruction is in brackets.
+enum class opcode : std::uint8_t {
+  // Push a value
+  constant,      // [index into the interpreter's constant pool]
+  nil, true_, false_,
+
+  pop,
+  // Pops locals down to the first [slot], closing any captured ones
+  unwind,
+
+  // Variables, by [slot/index]. set_* leaves the value on the stack.
+  get_local, set_local,
+  get_upvalue, set_upvalue,
+  get_global, set_global, define_global,
+
+  // Operators, using the operands on top of the stack
+  equal, not_equal, greater, greater_equal, less, less_equal,
+  add, subtract, multiply, divide,
+  negate, not_,
+
+  // Arrays. set_index leaves the value on the stack.
+  array,         // [element count], the elements being on top of the stack
+  get_index, set_index,
+
+  // Control flow, to an absolute [instruction index]. The conditional jumps
+  // leave the condition on the stack.
+  jump, jump_if_false, jump_if_true,
+
+  call,          // [argument count]
+  // A call whose result is returned straight away (the return follows it).
+  // A bytecode callee takes over the caller's frame instead of pushing one.
+  tail_call,     // [argument count]
+  closure,       // [index into the prototype's functions]
+  return_,
+  // Suspend a generator's or async function's frame (see coroutine.hpp) on
+  // the value on top of the stack, which is replaced by what it's resumed
+  // with. An await that has nothing to wait for carries straight on.
+  yield, await,
+
+  print,
+  // Prints an expression statement's value (see compiler)
+  echo,
+
+  // Quickened forms of the operators, which the VM swaps in once it has seen
+  // what types they are used with. The compiler never emits them.
+  equal_num, not_equal_num, greater_num, greater_equal_num,
+  less_num, less_equal_num,
+  add_num, add_str, subtract_num, multiply_num,
+  negate_num,
+
+  NUM_OPCODES
+};
+// clang-format on
+
+struct instruction {
+  opcode       op;
+  std::int32_t arg;
+};
+
+// An instruction's opcode as it is now. Quickening rewrites opcodes in place
+// from whichever thread is running them (see interpreter.cpp), so reading
+// one from code that might be running anywhere has to be atomic too.
+inline auto load_op(instruction const& instr) -> opcode {
+  return std::atomic_ref(const_cast<opcode&>(instr.op))
+      .load(std::memory_order_relaxed);
+}
+
+// A prototype is a function compiled to bytecode. Running one creates a
+// function value, which pairs it with the upvalues it captured.
+struct prototype {
+  std::string          name;
+  int                  arity = 0;
+  function_kind        kind = function_kind::plain;
+  // Most stack slots the body uses, locals included, checked on each call
+  int                  max_stack = 0;
+  std::vector<capture> captures;
+
+  // Instructions are rewritten in place as they run (see quickening)
+  std::vector<instruction>                code;
+  std::vector<std::shared_ptr<prototype>> functions;
+
+  // Where each instruction came from, for error messages: an index into
+  // tokens (or -1) per instruction.
+  std::vector<int>   origins;
+  std::vector<token> tokens;
+
+  // The same function lowered to optimised SSA (see ir.hpp), if it was asked
+  // for and the function could be.
+  std::shared_ptr<ir::function> ir;
+
+  [[nodiscard]] auto token_at(instruction const* ip) const -> token const&;
+};
+
+} // namespace lox
@@ -0,0 +1,62 @@
+#include <lox/interpreter/channel.hpp>
+
+#include <utility>
+
+namespace lox {
+
+void channel::send(value value) {
+  std::scoped_lock const lock(mutex_);
+
+  if (receivers_.empty()) {
+    values_.push_back(std::move(value));
+    return;
+  }
+
+  auto const next = std::move(receivers_.front());
+  receivers_.pop_front();
+  next(std::move(value));
+}
+
+auto channel::receive() -> value {
+  std::unique_lock lock(mutex_);
+
+  if (not values_.empty()) {
+    value next = std::move(values_.front());
+    values_.pop_front();
+    return next;
+  }
+
+  parker waiting;
+  value  received;
+  receivers_.emplace_back([&](lox::value value) {
+    received = std::move(value);
+    waiting.unpark();
+  });
+  waiting.park(lock);
+  return received;
+}
+
+auto channel::try_receive() -> std::optional<value> {
+  std::scoped_lock const lock(mutex_);
+
+  if (values_.empty()) return std::nullopt;
+  value next = std::move(values_.front());
+  values_.pop_front();
+  return next;
+}
+
+void channel::receive(std::function<void(value)> then) {
+  std::unique_lock lock(mutex_);
+
+  if (values_.empty()) {
+    receivers_.push_back(std::move(then));
+    return;
+  }
+
+  value next = std::move(values_.front());
+  values_.pop_front();
+  lock.unlock();
+  then(std::move(next));
+}
+
+} // namespace lox
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <lox/interpreter/value.hpp>
+#include <lox/pool/scheduler.hpp>
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+
+namespace lox {
+
+// A channel carries values between tasks (see interpreter::spawn), in the
+// order they were sent. It's unbounded: sending never waits, and receiving
+// waits (parks, on a task) until there's something to receive.
+//
+// Values are sent as they are. Making sure they don't share anything mutable
+// with the sender is up to whoever sends them.
+struct channel {
+  void send(value value);
+  auto receive() -> value;
+  // The next value if there is one, without waiting.
+  auto try_receive() -> std::optional<value>;
+  // Receives without waiting: `then` is called with the next value, straight
+  // away if there is one and otherwise by whoever sends it, on their thread
+  // (with the channel locked).
+  void receive(std::function<void(value)> then);
+
+private:
+  std::mutex        mutex_;
+  std::deque<value> values_;
+  // Waiting to receive, first come first served
+  std::deque<std::function<void(value)>> receivers_;
+};
+
+} // namespace lox
@@ -0,0 +1,392 @@
+#include <lox/interpreter/compiler.hpp>
+#include <lox/interpreter/interpreter.hpp>
+#include <lox/ir/ir.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+namespace lox {
+
+namespace {
+
+auto is_yield(expr const& e) -> bool {
+  auto const* suspend = std::get_if<box<suspend_expr>>(&e);
+  return suspend != nullptr and (*suspend)->keyword.type == token_type::YIELD;
+}
+
+} // namespace
+
+auto compiler::compile(std::vector<stmt> const& stmts)
+    -> std::shared_ptr<prototype> {
+  auto script  = std::make_shared<prototype>();
+  script->name = "script";
+
+  proto_  = script.get();
+  locals_ = 0;
+  height_ = 0;
+  loops_.clear();
+
+  body(stmts);
+  emit(opcode::nil, 0, 1);
+  emit(opcode::return_, 0, -1);
+
+  proto_ = nullptr;
+  return script;
+}
+
+auto compiler::emit(opcode op, int arg, int effect) -> int {
+  proto_->code.push_back({op, arg});
+  proto_->origins.push_back(-1);
+
+  height_           += effect;
+  proto_->max_stack  = std::max(proto_->max_stack, height_);
+
+  return here() - 1;
+}
+
+auto compiler::emit(opcode op, int arg, int effect, token const& origin)
+    -> int {
+  auto const at = emit(op, arg, effect);
+
+  // Operators on the same line tend to come from the same token
+  auto& tokens = proto_->tokens;
+  if (tokens.empty() or tokens.back().line != origin.line or
+      tokens.back().lexeme != origin.lexeme) {
+    tokens.push_back(origin);
+  }
+  proto_->origins.back() = static_cast<int>(tokens.size()) - 1;
+
+  return at;
+}
+
+void compiler::patch(int jump) { proto_->code[jump].arg = here(); }
+
+auto compiler::here() const -> int {
+  return static_cast<int>(proto_->code.size());
+}
+
+void compiler::body(std::vector<stmt> const& stmts) {
+  // Echoing expression statements is how the REPL shows results. Function
+  // bodies have always been run the same way, so they echo too, except for
+  // yields: a generator's yields are what it shows.
+  for (auto const& s : stmts) {
+    auto const* e = std::get_if<expression_stmt>(&s);
+    if (e != nullptr and not is_yield(e->ex)) {
+      std::visit(*this, e->ex);
+      emit(opcode::echo, 0, -1);
+    } else {
+      std::visit(*this, s);
+    }
+  }
+}
+
+void compiler::get(binding const& var, token const& name) {
+  switch (var.kind) {
+  case binding_kind::local:
+    emit(opcode::get_local, var.index, 1);
+    break;
+  case binding_kind::upvalue:
+    emit(opcode::get_upvalue, var.index, 1);
+    break;
+  case binding_kind::global:
+    emit(opcode::get_global, var.index, 1, name);
+    break;
+  default:
+    emit(opcode::get_global, interpreter_.global(name.lexeme), 1, name);
+  }
+}
+
+void compiler::set(binding const& var, token const& name) {
+  switch (var.kind) {
+  case binding_kind::local:
+    emit(opcode::set_local, var.index, 0);
+    break;
+  case binding_kind::upvalue:
+    emit(opcode::set_upvalue, var.index, 0);
+    break;
+  case binding_kind::global:
+    emit(opcode::set_global, var.index, 0, name);
+    break;
+  default:
+    emit(opcode::set_global, interpreter_.global(name.lexeme), 0, name);
+  }
+}
+
+void compiler::declare(binding const& var, token const& name) {
+  if (var.kind == binding_kind::local) {
+    // The value is already sitting in the local's slot
+    assert(var.index == locals_);
+    ++locals_;
+    return;
+  }
+
+  auto const slot = var.kind == binding_kind::global
+                      ? var.index
+                      : interpreter_.global(name.lexeme);
+  emit(opcode::define_global, slot, -1, name);
+}
+
+void compiler::unwind(int locals) {
+  if (locals_ > locals) emit(opcode::unwind, locals, 0);
+}
+
+void compiler::call(box<call_expr> const& e, opcode op) {
+  std::visit(*this, e->callee);
+  for (auto const& arg : e->args) { std::visit(*this, arg); }
+
+  auto const argc = static_cast<int>(e->args.size());
+  emit(op, argc, -argc, e->paren);
+}
+
+void compiler::operator()(literal_expr const& e) {
+  if (std::holds_alternative<std::monostate>(e.literal)) {
+    emit(opcode::nil, 0, 1);
+  } else if (auto const* b = std::get_if<bool>(&e.literal)) {
+    emit(*b ? opcode::true_ : opcode::false_, 0, 1);
+  } else {
+    auto const constant =
+        e.constant >= 0 ? e.constant : interpreter_.constant(e.literal);
+    emit(opcode::constant, constant, 1);
+  }
+}
+
+void compiler::operator()(variable_expr const& e) { get(e.resolved, e.name); }
+
+void compiler::operator()(box<group_expr> const& e) {
+  std::visit(*this, e->ex);
+}
+
+void compiler::operator()(box<assign_expr> const& e) {
+  std::visit(*this, e->value);
+  set(e->resolved, e->name);
+}
+
+void compiler::operator()(box<unary_expr> const& e) {
+  std::visit(*this, e->right);
+
+  switch (e->op.type) {
+  case token_type::BANG:
+    emit(opcode::not_, 0, 0, e->op);
+    break;
+  case token_type::MINUS:
+    emit(opcode::negate, 0, 0, e->op);
+    break;
+  default:
+    __builtin_unreachable();
+  }
+}
+
+void compiler::operator()(box<logical_expr> const& e) {
+  std::visit(*this, e->left);
+
+  // Short-circuiting leaves the left operand as the result
+  auto const jump = emit(e->op.type == token_type::OR ? opcode::jump_if_true
+                                                      : opcode::jump_if_false,
+                         -1, 0);
+  emit(opcode::pop, 0, -1);
+  std::visit(*this, e->right);
+  patch(jump);
+}
+
+void compiler::operator()(box<binary_expr> const& e) {
+  std::visit(*this, e->left);
+
+  if (e->op.type == token_type::COMMA) {
+    emit(opcode::pop, 0, -1);
+    std::visit(*this, e->right);
+    return;
+  }
+
+  std::visit(*this, e->right);
+
+  switch (e->op.type) {
+  case token_type::BANG_EQUAL:
+    emit(opcode::not_equal, 0, -1, e->op);
+    break;
+  case token_type::EQUAL_EQUAL:
+    emit(opcode::equal, 0, -1, e->op);
+    break;
+  case token_type::GREATER:
+    emit(opcode::greater, 0, -1, e->op);
+    break;
+  case token_type::GREATER_EQUAL:
+    emit(opcode::greater_equal, 0, -1, e->op);
+    break;
+  case token_type::LESS:
+    emit(opcode::less, 0, -1, e->op);
+    break;
+  case token_type::LESS_EQUAL:
+    emit(opcode::less_equal, 0, -1, e->op);
+    break;
+  case token_type::PLUS:
+    emit(opcode::add, 0, -1, e->op);
+    break;
+  case token_type::MINUS:
+    emit(opcode::subtract, 0, -1, e->op);
+    break;
+  case token_type::STAR:
+    emit(opcode::multiply, 0, -1, e->op);
+    break;
+  case token_type::SLASH:
+    emit(opcode::divide, 0, -1, e->op);
+    break;
+  default:
+    throw runtime_error(e->op, "unhandled binary operator");
+  }
+}
+
+void compiler::operator()(box<call_expr> const& e) { call(e, opcode::call); }
+
+void compiler::operator()(box<conditional_expr> const& e) {
+  std::visit(*this, e->cond);
+
+  auto const alt = emit(opcode::jump_if_false, -1, 0);
+  emit(opcode::pop, 0, -1);
+  std::visit(*this, e->then);
+  auto const end = emit(opcode::jump, -1, 0);
+
+  // The condition is still on the stack in place of the result
+  patch(alt);
+  emit(opcode::pop, 0, -1);
+  std::visit(*this, e->alt);
+  patch(end);
+}
+
+void compiler::operator()(box<suspend_expr> const& e) {
+  std::visit(*this, e->value);
+  emit(e->keyword.type == token_type::YIELD ? opcode::yield : opcode::await, 0,
+       0, e->keyword);
+}
+
+void compiler::operator()(box<array_expr> const& e) {
+  for (auto const& element : e->elements) { std::visit(*this, element); }
+  auto const count = static_cast<int>(e->elements.size());
+  emit(opcode::array, count, 1 - count);
+}
+
+void compiler::operator()(box<index_expr> const& e) {
+  std::visit(*this, e->object);
+  std::visit(*this, e->index);
+  emit(opcode::get_index, 0, -1, e->bracket);
+}
+
+void compiler::operator()(box<set_index_expr> const& e) {
+  std::visit(*this, e->object);
+  std::visit(*this, e->index);
+  std::visit(*this, e->value);
+  emit(opcode::set_index, 0, -2, e->bracket);
+}
+
+void compiler::operator()(expression_stmt const& s) {
+  std::visit(*this, s.ex);
+  emit(opcode::pop, 0, -1);
+}
+
+void compiler::operator()(print_stmt const& s) {
+  std::visit(*this, s.ex);
+  emit(opcode::print, 0, -1);
+}
+
+void compiler::operator()(variable_stmt const& s) {
+  if (s.init) std::visit(*this, *s.init);
+  else emit(opcode::nil, 0, 1);
+
+  declare(s.resolved, s.name);
+}
+
+void compiler::operator()(break_stmt const& /*s*/) {
+  auto& loop = loops_.back();
+  unwind(loop.locals);
+  loop.breaks.push_back(emit(opcode::jump, -1, 0));
+}
+
+void compiler::operator()(return_stmt const& s) {
+  auto const* const tail =
+      s.value ? std::get_if<box<call_expr>>(&*s.value) : nullptr;
+  if (tail != nullptr) call(*tail, opcode::tail_call);
+  else if (s.value) std::visit(*this, *s.value);
+  else emit(opcode::nil, 0, 1);
+
+  emit(opcode::return_, 0, -1);
+}
+
+void compiler::operator()(box<block_stmt> const& s) {
+  auto const locals = locals_;
+  for (auto const& ss : s->stmts) { std::visit(*this, ss); }
+
+  unwind(locals);
+  height_ -= locals_ - locals;
+  locals_  = locals;
+}
+
+void compiler::operator()(box<function_stmt> const& s) {
+  auto proto       = std::make_shared<prototype>();
+  proto->name      = s->name.lexeme;
+  proto->arity     = static_cast<int>(s->params.size());
+  proto->kind      = s->kind;
+  proto->max_stack = proto->arity;
+  proto->captures  = s->captures;
+  if (ir_) {
+    proto->ir = ir::lower(*s, interpreter_);
+    if (proto->ir) {
+      ir::optimize(*proto->ir);
+      ir::generate(*proto->ir);
+    }
+  }
+
+  auto* const enclosing = std::exchange(proto_, proto.get());
+  auto const  locals    = std::exchange(locals_, proto->arity);
+  auto const  height    = std::exchange(height_, proto->arity);
+  auto        loops     = std::exchange(loops_, {});
+
+  body(s->body);
+  emit(opcode::nil, 0, 1);
+  emit(opcode::return_, 0, -1);
+
+  proto_  = enclosing;
+  locals_ = locals;
+  height_ = height;
+  loops_  = std::move(loops);
+
+  proto_->functions.push_back(std::move(proto));
+  emit(opcode::closure, static_cast<int>(proto_->functions.size()) - 1, 1);
+  declare(s->resolved, s->name);
+}
+
+void compiler::operator()(box<if_stmt> const& s) {
+  std::visit(*this, s->cond);
+
+  auto const alt = emit(opcode::jump_if_false, -1, 0);
+  emit(opcode::pop, 0, -1);
+  std::visit(*this, s->then);
+  auto const end = emit(opcode::jump, -1, 0);
+
+  patch(alt);
+  height_ += 1; // the condition is still there on this path
+  emit(opcode::pop, 0, -1);
+  if (s->alt) std::visit(*this, *s->alt);
+  patch(end);
+}
+
+void compiler::operator()(box<while_stmt> const& s) {
+  auto const start = here();
+  std::visit(*this, s->cond);
+
+  auto const exit = emit(opcode::jump_if_false, -1, 0);
+  emit(opcode::pop, 0, -1);
+
+  loops_.push_back({locals_, {}});
+  std::visit(*this, s->body);
+  emit(opcode::jump, start, 0);
+
+  patch(exit);
+  height_ += 1;
+  emit(opcode::pop, 0, -1);
+
+  // Breaks skip the condition's pop since it was popped going in
+  for (auto const jump : loops_.back().breaks) { patch(jump); }
+  loops_.pop_back();
+}
+
+} // namespace lox
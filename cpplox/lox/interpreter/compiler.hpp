@@ -0,0 +1,89 @@
+#pragma once
+
+#include <lox/ast/ast.hpp>
+#include <lox/interpreter/bytecode.hpp>
+#include <lox/token/token.hpp>
+
+#include <memory>
+#include <vector>
+
+namespace lox {
+
+class interpreter;
+
+// compiler turns a resolved AST into bytecode for the interpreter to run.
+// All the work of finding variables has already been done by the resolver, so
+// this is a single pass that mostly just flattens the tree.
+//
+// Locals are kept on the stack in the slots the resolver gave them. Since
+// every statement leaves the stack as it found it, a local's initialiser
+// always ends up in the right slot without having to be moved.
+class compiler {
+public:
+  // With `ir`, functions are also lowered to IR and optimised.
+  explicit compiler(interpreter& interpreter, bool ir = false)
+      : interpreter_(interpreter), ir_(ir) {}
+
+  // Compiles a program into a prototype that takes no arguments.
+  auto compile(std::vector<stmt> const& stmts) -> std::shared_ptr<prototype>;
+
+  void operator()(literal_expr const& e);
+  void operator()(variable_expr const& e);
+  void operator()(box<group_expr> const& e);
+  void operator()(box<assign_expr> const& e);
+  void operator()(box<unary_expr> const& e);
+  void operator()(box<logical_expr> const& e);
+  void operator()(box<binary_expr> const& e);
+  void operator()(box<call_expr> const& e);
+  void operator()(box<conditional_expr> const& e);
+  void operator()(box<suspend_expr> const& e);
+  void operator()(box<array_expr> const& e);
+  void operator()(box<index_expr> const& e);
+  void operator()(box<set_index_expr> const& e);
+
+  void operator()(expression_stmt const& s);
+  void operator()(print_stmt const& s);
+  void operator()(variable_stmt const& s);
+  void operator()(break_stmt const& s);
+  void operator()(return_stmt const& s);
+  void operator()(box<block_stmt> const& s);
+  void operator()(box<function_stmt> const& s);
+  void operator()(box<if_stmt> const& s);
+  void operator()(box<while_stmt> const& s);
+
+private:
+  struct loop {
+    int              locals; // live locals when the loop started
+    std::vector<int> breaks; // jumps to patch to the end of the loop
+  };
+
+  interpreter& interpreter_;
+  bool         ir_;
+
+  prototype*        proto_  = nullptr;
+  int               locals_ = 0;
+  int               height_ = 0;
+  std::vector<loop> loops_;
+
+  // Emits an instruction that changes the stack height by `effect`.
+  auto emit(opcode op, int arg, int effect) -> int;
+  auto emit(opcode op, int arg, int effect, token const& origin) -> int;
+  // Points a jump at the next instruction.
+  void patch(int jump);
+  [[nodiscard]] auto here() const -> int;
+
+  // Compiles the statements of a program or function body. Expression
+  // statements directly in the body, other than yields, echo their value.
+  void body(std::vector<stmt> const& stmts);
+
+  void get(binding const& var, token const& name);
+  void set(binding const& var, token const& name);
+  // Stores the value on top of the stack in a new variable.
+  void declare(binding const& var, token const& name);
+  // Pops locals down to `locals`.
+  void unwind(int locals);
+  // Compiles a call as `op` (call or tail_call).
+  void call(box<call_expr> const& e, opcode op);
+};
+
+} // namespace lox
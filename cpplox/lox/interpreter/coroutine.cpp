@@ -0,0 +1,213 @@
+#include <lox/errors.hpp>
+#include <lox/interpreter/channel.hpp>
+#include <lox/interpreter/coroutine.hpp>
+#include <lox/interpreter/interpreter.hpp>
+#include <lox/interpreter/tasks.hpp>
+#include <lox/profile/heap.hpp>
+
+#include <cstddef>
+#include <iterator>
+#include <mutex>
+#include <utility>
+
+namespace lox {
+
+auto resumable::resume(value in) -> value {
+  auto& promise = handle_.promise();
+  promise.in    = std::move(in);
+  handle_.resume();
+
+  if (promise.error) std::rethrow_exception(std::exchange(promise.error, {}));
+  return std::move(promise.out);
+}
+
+auto interpreter::activate(std::shared_ptr<function> const& fn,
+                           value const* args, int argc) -> value {
+  auto co = profile::as(profile::kind::coroutine, [&] {
+    // The callee goes first, as it does on the stack
+    std::vector<value> slots{fn};
+    slots.insert(slots.end(), args, args + argc);
+
+    return std::make_shared<coroutine>(fn->proto->kind, this,
+                                       frame(fn, std::move(slots)));
+  });
+  if (co->kind == function_kind::async) step(co, value{});
+  return co;
+}
+
+auto interpreter::frame(std::shared_ptr<function> fn, std::vector<value> slots)
+    -> resumable {
+  auto&        proto = *fn->proto;
+  instruction* ip    = proto.code.data();
+  value        in;
+
+  // While the call is suspended, the upvalues that were open on its slots
+  // are closed, and remembered here with their slots (counted from the
+  // base), highest first
+  std::vector<std::pair<std::ptrdiff_t, std::shared_ptr<upvalue>>> closed;
+
+  for (bool started = false;; started = true) {
+    if (depth() >= options_.max_depth or
+        sp_ + 1 + proto.max_stack > stack_end_) {
+      throw runtime_error(token{}, "stack overflow");
+    }
+
+    value* const base = sp_ + 1;
+    for (auto& slot : slots) { *sp_++ = std::move(slot); }
+    slots.clear();
+    for (auto it = closed.rbegin(); it != closed.rend(); ++it) {
+      auto& [slot, uv] = *it;
+      base[slot]       = std::move(uv->closed);
+      uv->location     = base + slot;
+      open_upvalues_.push_back(std::move(uv));
+    }
+    closed.clear();
+    // The suspending instruction's result
+    if (started) *sp_++ = std::move(in);
+
+    auto const bottom = frames_.size();
+    frames_.push_back({fn.get(), ip, base});
+    dispatch();
+
+    if (frames_.size() == bottom) {
+      value result = std::move(*--sp_);
+      *sp_         = value{};
+      co_return result;
+    }
+
+    // Suspended, on the value on top of the stack
+    ip = frames_.back().ip;
+    frames_.pop_back();
+    value out = std::move(*--sp_);
+    *sp_      = value{};
+
+    while (not open_upvalues_.empty() and
+           open_upvalues_.back()->location >= base) {
+      auto uv = std::move(open_upvalues_.back());
+      open_upvalues_.pop_back();
+
+      closed.emplace_back(uv->location - base, uv);
+      uv->closed   = std::move(*uv->location);
+      uv->location = &uv->closed;
+    }
+    slots.assign(std::make_move_iterator(base - 1),
+                 std::make_move_iterator(sp_));
+    while (sp_ >= base) { *--sp_ = value{}; }
+
+    in = co_yield std::move(out);
+  }
+}
+
+auto interpreter::resume(coroutine& co, value in) -> value {
+  if (co.owner != this) {
+    throw runtime_error(token{},
+                        "can't resume a coroutine from another task");
+  }
+  if (co.running) {
+    throw runtime_error(token{}, "can't resume a coroutine that's running");
+  }
+
+  co.running = true;
+  try {
+    value out  = co.body.resume(std::move(in));
+    co.running = false;
+    return out;
+  } catch (...) {
+    co.running = false;
+    throw;
+  }
+}
+
+auto interpreter::advance(coroutine& gen) -> std::optional<value> {
+  if (gen.body.done()) return std::nullopt;
+
+  value next = resume(gen, value{});
+  if (gen.body.done()) return std::nullopt;
+  return next;
+}
+
+void interpreter::step(std::shared_ptr<coroutine> const& co, value in) {
+  value out = resume(*co, std::move(in));
+
+  if (co->body.done()) {
+    for (auto& waiter : std::exchange(co->waiters, {})) {
+      ready_.emplace_back(std::move(waiter), out);
+    }
+    co->result = std::move(out);
+    return;
+  }
+
+  // It only suspends on what it has to wait for (see await)
+  if (auto const* ch = std::get_if<std::shared_ptr<channel>>(&out)) {
+    wait_for(**ch, co);
+  } else {
+    std::get<std::shared_ptr<coroutine>>(out)->waiters.push_back(co);
+  }
+}
+
+void interpreter::wait_for(channel& ch, std::shared_ptr<coroutine> const& co) {
+  if (inbox_ == nullptr) inbox_ = std::make_shared<inbox>();
+  ++inbox_->waiting;
+
+  // This interpreter might be long gone (or on to another run) by the time
+  // something's sent, so the inbox looks after itself
+  ch.receive([to = inbox_, co](value value) {
+    std::scoped_lock const lock(to->mutex);
+    to->received.emplace_back(co, std::move(value));
+    if (std::exchange(to->parked, false)) to->idle.unpark();
+  });
+}
+
+auto interpreter::block_on(value const& awaited) -> value {
+  std::shared_ptr<coroutine> until;
+  if (auto const* ch = std::get_if<std::shared_ptr<channel>>(&awaited)) {
+    // Stands in for the code waiting here, which isn't a coroutine
+    until = std::make_shared<coroutine>(function_kind::async, this,
+                                        resumable{});
+    wait_for(**ch, until);
+  } else {
+    until = std::get<std::shared_ptr<coroutine>>(awaited);
+  }
+
+  run_async(until.get());
+  return *until->result;
+}
+
+void interpreter::run_async(coroutine const* until) {
+  while (until == nullptr or not until->result) {
+    if (ready_.empty()) {
+      if (inbox_ == nullptr or inbox_->waiting == 0) {
+        if (until == nullptr) return;
+        // Whatever it's waiting for is waiting for it, one way or another
+        throw runtime_error(token{}, "await would wait forever");
+      }
+
+      if (tasks_ != nullptr and tasks_->spawner == this) {
+        std::scoped_lock const lock(tasks_->mutex);
+        tasks_->waiting = inbox_;
+      }
+
+      std::unique_lock lock(inbox_->mutex);
+      while (inbox_->received.empty()) {
+        // Nor can a channel get anything once there's no task to send it
+        if (alone()) throw runtime_error(token{}, "await would wait forever");
+        inbox_->parked = true;
+        inbox_->idle.park(lock);
+      }
+      current_meter = meter_;
+      inbox_->waiting -= static_cast<int>(inbox_->received.size());
+      for (auto& delivery : inbox_->received) {
+        ready_.push_back(std::move(delivery));
+      }
+      inbox_->received.clear();
+      continue;
+    }
+
+    auto [co, in] = std::move(ready_.front());
+    ready_.pop_front();
+    if (co->body.empty()) co->result = std::move(in);
+    else step(co, std::move(in));
+  }
+}
+
+} // namespace lox
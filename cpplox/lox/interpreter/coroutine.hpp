@@ -0,0 +1,125 @@
+#pragma once
+
+#include <lox/ast/ast.hpp>
+#include <lox/interpreter/value.hpp>
+#include <lox/pool/scheduler.hpp>
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace lox {
+
+class interpreter;
+
+// resumable is a C++20 coroutine that gives back a value each time it
+// suspends (co_yield) or finishes (co_return), and is resumed with one,
+// which is what its co_yield evaluates to.
+//
+// The interpreter runs each call to a generator or async function in one
+// (see interpreter::frame): while the call is suspended, its stack frame
+// lives in the coroutine's frame instead of on the interpreter's stack, so
+// a suspended call costs that one allocation and nothing else (no thread,
+// no stack).
+class resumable {
+public:
+  struct promise_type {
+    value              out; // yielded or returned
+    value              in;  // what it was last resumed with
+    std::exception_ptr error;
+
+    auto get_return_object() -> resumable {
+      return resumable{handle::from_promise(*this)};
+    }
+    static auto initial_suspend() noexcept -> std::suspend_always {
+      return {};
+    }
+    static auto final_suspend() noexcept -> std::suspend_always { return {}; }
+
+    auto yield_value(value v) noexcept {
+      struct resumption : std::suspend_always {
+        promise_type& promise;
+
+        auto await_resume() const noexcept -> value {
+          return std::move(promise.in);
+        }
+      };
+
+      out = std::move(v);
+      return resumption{{}, *this};
+    }
+    void return_value(value v) noexcept { out = std::move(v); }
+    void unhandled_exception() noexcept { error = std::current_exception(); }
+  };
+
+  using handle = std::coroutine_handle<promise_type>;
+
+  resumable() = default;
+  explicit resumable(handle h) : handle_(h) {}
+  resumable(resumable&& other) noexcept
+      : handle_(std::exchange(other.handle_, nullptr)) {}
+  auto operator=(resumable&& other) noexcept -> resumable& {
+    std::swap(handle_, other.handle_);
+    return *this;
+  }
+  ~resumable() {
+    if (handle_) handle_.destroy();
+  }
+
+  // Carries on until it next suspends or finishes, and returns what it gave
+  // back, or rethrows what it threw. It mustn't be done.
+  auto resume(value in) -> value;
+
+  [[nodiscard]] auto done() const -> bool {
+    return not handle_ or handle_.done();
+  }
+  [[nodiscard]] auto empty() const -> bool { return not handle_; }
+
+private:
+  handle handle_;
+};
+
+// A call to a generator or async function, as a value. It runs on the
+// interpreter that made the call, and only there, and only that one can ask
+// it for values or await it.
+//
+// - A generator runs a step at a time, up to each `yield`, as its values are
+//   asked for (see the next and done builtins). Whatever it returns is
+//   ignored.
+// - An async call starts straight away and runs until it has to wait: for
+//   another async call, or for a channel to receive something. The
+//   interpreter carries it on once that's ready (see interpreter::run_async),
+//   so any number can be waiting at once on a single thread.
+struct coroutine {
+  coroutine(function_kind kind, interpreter* owner, resumable body)
+      : kind(kind), owner(owner), body(std::move(body)) {}
+
+  function_kind kind;
+  interpreter*  owner;
+  resumable     body; // empty for plain code waiting on a channel
+  bool          running = false;
+
+  // A generator's next value, once done() has looked ahead for it
+  std::optional<value> peeked;
+
+  // What an async call returned, once it has, and the calls awaiting it
+  std::optional<value>                    result;
+  std::vector<std::shared_ptr<coroutine>> waiters;
+};
+
+// Where channels hand over what async calls (or other code) waiting on them
+// receive, from the senders' threads, for the interpreter to pick up.
+struct inbox {
+  std::mutex mutex;
+  parker     idle; // the interpreter, once there's nothing else to do
+  bool       parked = false;
+
+  std::vector<std::pair<std::shared_ptr<coroutine>, value>> received;
+  int waiting = 0; // receives not picked up yet (the interpreter's own count)
+};
+
+} // namespace lox
@@ -0,0 +1,313 @@
+#include <lox/errors.hpp>
+#include <lox/interpreter/interpreter.hpp>
+#include <lox/ir/ir.hpp>
+#include <lox/jit/jit.hpp>
+#include <lox/profile/heap.hpp>
+
+#include <fmt/core.h>
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <utility>
+
+namespace lox {
+
+namespace {
+
+// Unchecked, only for once the type is known
+auto number(value const& value) -> double {
+  return *std::get_if<double>(&value);
+}
+
+auto origin(ir::function const& fn, ir::operation const& op) -> token const& {
+  static token const none{};
+  return op.origin >= 0 ? fn.tokens[static_cast<std::size_t>(op.origin)]
+                        : none;
+}
+
+// The IR of a function value that takes `argc` arguments, if it has any.
+auto tail_callee(value const& callee, int argc) -> ir::function* {
+  auto const* fn = std::get_if<std::shared_ptr<function>>(&callee);
+  if (fn == nullptr) return nullptr;
+
+  auto const& proto = *(*fn)->proto;
+  return proto.arity == argc ? proto.ir.get() : nullptr;
+}
+
+} // namespace
+
+// Runs a function's register code (see ir::generate). Registers live on the
+// value stack, above the arguments.
+auto interpreter::execute(ir::function& fn, value* regs) -> value {
+  value* const saved = std::exchange(sp_, regs + fn.registers);
+  ++ir_depth_;
+
+  // After a tail call, the function running in these registers (and the
+  // callee value that keeps it alive: it might have been in a register)
+  ir::function* current = &fn;
+  value         callee;
+
+  ir::operation const* pc = fn.code.data() + run_native(fn, regs, 0);
+  for (;;) {
+    while (pc->op != ir::opcode::return_ and
+           pc->op != ir::opcode::tail_call) {
+      pc = step(*current, regs, pc);
+    }
+    if (pc->op == ir::opcode::return_) break;
+
+    // Another IR function replaces this one in its registers, so tail
+    // recursion doesn't nest. Anything else is an ordinary call, then the
+    // return after it.
+    ir::function* const next = tail_callee(regs[pc->a], pc->c);
+    if (next == nullptr or regs + next->registers > stack_end_ or
+        sp_ + pc->c > stack_end_) {
+      pc = step(*current, regs, pc);
+      continue;
+    }
+
+    // The arguments can come from any register, so they're gathered above
+    // them before moving down. The old callee has to last until then.
+    value        target = regs[pc->a];
+    value* const args   = sp_;
+    for (int i = 0; i < pc->c; ++i) {
+      args[i] = regs[current->arguments[static_cast<std::size_t>(pc->b + i)]];
+    }
+    for (int i = 0; i < pc->c; ++i) { regs[i] = std::move(args[i]); }
+    while (sp_ > regs + pc->c) { *--sp_ = value{}; }
+
+    tick();
+    callee  = std::move(target);
+    current = next;
+    sp_     = regs + next->registers;
+    pc      = next->code.data() + run_native(*next, regs, 0);
+  }
+
+  value result = regs[pc->a];
+  for (auto* reg = regs + current->arity; reg < sp_; ++reg) { *reg = value{}; }
+  sp_ = saved;
+  --ir_depth_;
+  return result;
+}
+
+[[gnu::always_inline]] inline auto
+interpreter::step(ir::function& fn, value* regs, ir::operation const* pc)
+    -> ir::operation const* {
+  ir::operation const* const code = fn.code.data();
+  auto const&                op   = *pc++;
+
+  // Not every operand is a register, but they're only used when they are
+  value&       dst     = regs[op.dst];
+  value const& a       = regs[op.a];
+  value const& b       = regs[op.b];
+  auto const   numbers = [&] {
+    return std::holds_alternative<double>(a) and
+           std::holds_alternative<double>(b);
+  };
+  auto const here = [&]() -> token const& { return origin(fn, op); };
+#ifdef LOX_HEAP_PROFILE
+  profile::near(here().line);
+#endif
+
+  switch (op.op) {
+  case ir::opcode::constant:
+    dst = fn.constants[static_cast<std::size_t>(op.a)];
+    break;
+  case ir::opcode::move:
+    dst = a;
+    break;
+
+  case ir::opcode::equal:
+    dst = a == b;
+    break;
+  case ir::opcode::not_equal:
+    dst = a != b;
+    break;
+  case ir::opcode::greater:
+    dst = numbers() ? number(a) > number(b)
+                    : values::greater_than(here(), a, b);
+    break;
+  case ir::opcode::greater_equal:
+    dst = numbers() ? number(a) >= number(b)
+                    : values::greater_equal(here(), a, b);
+    break;
+  case ir::opcode::less:
+    dst = numbers() ? number(a) < number(b) : values::less_than(here(), a, b);
+    break;
+  case ir::opcode::less_equal:
+    dst = numbers() ? number(a) <= number(b)
+                    : values::less_equal(here(), a, b);
+    break;
+  case ir::opcode::add:
+    if (numbers()) dst = number(a) + number(b);
+    else dst = values::plus(here(), a, b);
+    break;
+  case ir::opcode::subtract:
+    dst = numbers() ? number(a) - number(b) : values::minus(here(), a, b);
+    break;
+  case ir::opcode::multiply:
+    if (numbers()) dst = number(a) * number(b);
+    else dst = values::multiply(here(), a, b);
+    break;
+  case ir::opcode::divide:
+    dst = values::divide(here(), a, b);
+    break;
+  case ir::opcode::negate:
+    dst = values::negate(here(), a);
+    break;
+  case ir::opcode::not_:
+    dst = not values::is_truthy(a);
+    break;
+
+  case ir::opcode::get_global: {
+    value const* global = globals_.find(op.a);
+    if (global == nullptr) {
+      throw runtime_error(here(), fmt::format("undefined variable '{}'",
+                                              here().lexeme));
+    }
+    dst = *global;
+    break;
+  }
+  case ir::opcode::set_global: {
+    value* global = globals_.find(op.b);
+    if (global == nullptr) {
+      throw runtime_error(here(), fmt::format("undefined variable '{}'",
+                                              here().lexeme));
+    }
+    *global = a;
+    break;
+  }
+  case ir::opcode::call:
+  case ir::opcode::tail_call: {
+    // The arguments go on top of the stack, where they become the callee's
+    // first registers if it's IR too
+    value* const args = sp_;
+    if (args + op.c > stack_end_) {
+      throw runtime_error(here(), "stack overflow");
+    }
+    for (int i = 0; i < op.c; ++i) {
+      *sp_++ = regs[fn.arguments[static_cast<std::size_t>(op.b + i)]];
+    }
+
+    dst = invoke(a, args, op.c, here());
+    while (sp_ > args) { *--sp_ = value{}; }
+    break;
+  }
+  case ir::opcode::print:
+  case ir::opcode::echo:
+    print(a);
+    break;
+
+  case ir::opcode::jump:
+    // Loops count towards compiling too, and can carry on as machine code
+    if (op.a >= pc - code) return code + op.a;
+    tick();
+    return code + run_native(fn, regs, op.a);
+  case ir::opcode::branch:
+    if (not values::is_truthy(a)) return code + op.b;
+    break;
+
+  default:
+    // Parameters and phis don't generate any code, and returns are left to
+    // whoever's running the function
+    __builtin_unreachable();
+  }
+  return pc;
+}
+
+auto interpreter::run_native(ir::function& fn, value* regs, int at) -> int {
+  if (not options_.jit or fn.jit_off.load(std::memory_order_relaxed)) {
+    return at;
+  }
+
+  auto const* native = fn.native.load(std::memory_order_acquire);
+  if (native == nullptr) {
+    auto const hotness = fn.hotness.load(std::memory_order_relaxed) + 1;
+    fn.hotness.store(hotness, std::memory_order_relaxed);
+    if (hotness < options_.jit_threshold) return at;
+
+    // Whoever gets here first compiles it
+    std::scoped_lock const lock(fn.jit_mutex);
+    if (fn.jit_off.load(std::memory_order_relaxed)) return at;
+    if (fn.jit_code == nullptr) {
+      fn.jit_code = profile::as(profile::kind::code,
+                                [&] { return jit::compile(fn, &jit_step); });
+      if (fn.jit_code == nullptr) {
+        fn.jit_off.store(true, std::memory_order_relaxed);
+        return at;
+      }
+      fn.native.store(fn.jit_code.get(), std::memory_order_release);
+    }
+    native = fn.jit_code.get();
+  }
+
+  auto const resume = native->run(regs, *this, fn, at);
+  if (resume < 0) std::rethrow_exception(std::exchange(jit_error_, nullptr));
+
+  // Bailing out again and again means the guesses in the code are wrong for
+  // this function, so it's better off interpreted. The code stays (another
+  // thread might be in it) but is never run again.
+  auto const stop = fn.code[static_cast<std::size_t>(resume)].op;
+  if (stop != ir::opcode::return_ and stop != ir::opcode::tail_call and
+      resume != at) {
+    auto const bailouts = fn.bailouts.load(std::memory_order_relaxed) + 1;
+    fn.bailouts.store(bailouts, std::memory_order_relaxed);
+    if (bailouts > JIT_BAILOUTS_MAX) {
+      fn.jit_off.store(true, std::memory_order_relaxed);
+    }
+  }
+  return resume;
+}
+
+auto interpreter::jit_step(interpreter* self, ir::function* fn, value* regs,
+                           int pc) noexcept -> int {
+  try {
+    self->step(*fn, regs, &fn->code[static_cast<std::size_t>(pc)]);
+    return 0;
+  } catch (...) {
+    self->jit_error_ = std::current_exception();
+    return -1;
+  }
+}
+
+auto interpreter::invoke(value const& callee, value* args, int argc,
+                         token const& paren) -> value {
+  tick();
+  if (auto const* fn = std::get_if<std::shared_ptr<function>>(&callee)) {
+    auto const& target = *(*fn)->proto;
+    if (argc != target.arity) {
+      throw runtime_error(paren,
+                          fmt::format("expected {} arguments but got {}",
+                                      target.arity, argc));
+    }
+    if (target.kind != function_kind::plain) return activate(*fn, args, argc);
+    if (target.ir != nullptr and options_.ir) {
+      if (not fits(*target.ir, args)) {
+        throw runtime_error(paren, "stack overflow");
+      }
+      return execute(*target.ir, args);
+    }
+    return call(**fn, arguments(args, args + argc));
+  }
+
+  if (auto const* fn = std::get_if<std::shared_ptr<builtin>>(&callee)) {
+    if (argc != (*fn)->arity) {
+      throw runtime_error(paren,
+                          fmt::format("expected {} arguments but got {}",
+                                      (*fn)->arity, argc));
+    }
+    value result  = call_builtin(**fn, args, args + argc, paren);
+    current_meter = meter_;
+    return result;
+  }
+
+  throw runtime_error(paren, "can only call functions and classes");
+}
+
+auto interpreter::fits(ir::function const& fn, value const* regs) const
+    -> bool {
+  return ir_depth_ < IR_DEPTH_MAX and depth() < options_.max_depth and
+         regs + fn.registers <= stack_end_;
+}
+
+} // namespace lox
@@ -0,0 +1,60 @@
+#include <lox/errors.hpp>
+#include <lox/interpreter/globals.hpp>
+
+#include <fmt/format.h>
+
+#include <cassert>
+#include <utility>
+
+namespace lox {
+
+auto globals::slot(std::string const& name) -> int {
+  auto [it, inserted] =
+      slots_.try_emplace(name, static_cast<int>(values_.size()));
+  if (inserted) {
+    names_.push_back(name);
+    values_.emplace_back();
+  }
+
+  return it->second;
+}
+
+void globals::clear(std::vector<std::string> const& names) {
+  if (names != names_) {
+    slots_.clear();
+    names_.clear();
+    values_.clear();
+    for (auto const& name : names) { slot(name); }
+  }
+
+  for (auto& global : values_) { global.reset(); }
+}
+
+void globals::load(std::vector<std::string> const& names,
+                   std::vector<std::optional<value>> values) {
+  assert(values.size() == names.size());
+  clear(names);
+  values_ = std::move(values);
+}
+
+void globals::assign(int slot, token const& name, value value) {
+  auto& global = values_[slot];
+  if (not global) {
+    throw runtime_error(name,
+                        fmt::format("undefined variable '{}'", name.lexeme));
+  }
+
+  *global = std::move(value);
+}
+
+auto globals::get(int slot, token const& name) const -> value const& {
+  auto const& global = values_[slot];
+  if (not global) {
+    throw runtime_error(name,
+                        fmt::format("undefined variable '{}'", name.lexeme));
+  }
+
+  return *global;
+}
+
+} // namespace lox
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <lox/interpreter/value.hpp>
+#include <lox/token/token.hpp>
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace lox {
+
+// globals is a flat table of global variables. The resolver hands out a slot
+// per name, so at runtime a global is just an index into a vector.
+//
+// Slots are handed out on first mention, which might be before the variable
+// is defined (e.g. a function referring to a global declared further down).
+// Whether a slot has been defined yet is checked when it is used. Redefining
+// a global (e.g. in the REPL) reuses its slot.
+class globals {
+public:
+  // Returns the slot for `name`, creating an undefined one if needed.
+  auto slot(std::string const& name) -> int;
+
+  void define(int slot, value value) { values_[slot] = std::move(value); }
+  void define(std::string const& name, value value) {
+    define(slot(name), std::move(value));
+  }
+
+  void assign(int slot, token const& name, value value);
+  auto get(int slot, token const& name) const -> value const&;
+
+  // Returns the global in `slot`, or null if it hasn't been defined yet.
+  auto find(int slot) -> value* {
+    auto& global = values_[slot];
+    return global ? &*global : nullptr;
+  }
+
+  // The name of each slot, in order.
+  [[nodiscard]] auto names() const -> std::vector<std::string> const& {
+    return names_;
+  }
+  // Undefines everything, and hands out slots as in `names` from now on.
+  // With the same names as before, nothing is reallocated.
+  void clear(std::vector<std::string> const& names);
+
+  // Every slot's value, or nothing where it's undefined.
+  [[nodiscard]] auto values() const
+      -> std::vector<std::optional<value>> const& {
+    return values_;
+  }
+  // Like clear, but then sets every slot from `values`, one per name.
+  void load(std::vector<std::string> const& names,
+            std::vector<std::optional<value>> values);
+
+private:
+  std::unordered_map<std::string, int> slots_;
+  std::vector<std::string>             names_;
+  std::vector<std::optional<value>>    values_;
+};
+
+} // namespace lox
@@ -1,285 +1,1070 @@
-#include <lox/ast/ast_printer.hpp>
 #include <lox/errors.hpp>
+#include <lox/interpreter/channel.hpp>
+#include <lox/interpreter/compiler.hpp>
+#include <lox/interpreter/coroutine.hpp>
 #include <lox/interpreter/interpreter.hpp>
+#include <lox/interpreter/map.hpp>
+#include <lox/interpreter/snapshot.hpp>
+#include <lox/interpreter/tasks.hpp>
+#include <lox/ir/ir.hpp>
+#include <lox/profile/heap.hpp>
+#include <lox/simd/simd.hpp>
 
 #include <fmt/core.h>
-#include <fmt/ranges.h>
+#include <fmt/ostream.h>
 #include <fmt/std.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
-#include <exception>
+#include <cstdint>
+#include <iterator>
+#include <limits>
 #include <memory>
-#include <ranges>
+#include <new>
+#include <sstream>
+#include <stdexcept>
 #include <utility>
 
+// The dispatch loop uses labels as values (a GNU extension) unless
+// LOX_COMPUTED_GOTO is turned off in CMake.
+#if defined(__clang__)
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#endif
+
 namespace lox {
 
-interpreter::interpreter(std::ostream& output)
-    : globals_{std::make_shared<environment>()}, env_{globals_},
-      output_(output) {
-  globals_->define("pi", 3.14);
-  globals_->define("min", builtin{"min", 2, [](std::vector<value> args) {
-                                    return values::less_equal(token{}, args[0],
-                                                              args[1])
-                                             ? args[0]
-                                             : args[1];
-                                  }});
+interpreter::interpreter(std::ostream& output, options config)
+    : output_(output), options_(config),
+      stack_(std::make_unique<value[]>(config.stack_size)), sp_(stack_.get()),
+      stack_end_(sp_ + config.stack_size) {
+  if (budgeted()) options_.jit = false;
+  if (options_.heap_limit > 0) meter_ = std::make_shared<heap_meter>();
+  define_builtins();
 }
 
-struct break_exception final : public std::exception {
-  [[nodiscard]] auto what() const noexcept -> char const* override {
-    return "break: jumping out of loop";
-  }
-};
-
-struct return_exception final : public std::exception {
-  explicit return_exception(value result) : value(std::move(result)) {}
+namespace {
 
-  value value;
+auto to_channel(value const& value) -> channel& {
+  auto const* ch = std::get_if<std::shared_ptr<channel>>(&value);
+  if (ch == nullptr) throw runtime_error(token{}, "expected a channel");
+  return **ch;
+}
 
-  [[nodiscard]] auto what() const noexcept -> char const* override {
-    return "return: jumping out of callable";
+// Only the interpreter that made a generator can resume it
+auto to_generator(value const& value, interpreter const& self) -> coroutine& {
+  auto const* co = std::get_if<std::shared_ptr<coroutine>>(&value);
+  if (co == nullptr or (*co)->kind != function_kind::generator) {
+    throw runtime_error(token{}, "expected a generator");
   }
-};
-
-static auto hash_expr(expr ex) -> std::string {
-  // TODO: Fix me
-  auto hash = std::visit(ast_printer{}, ex);
-  return hash;
+  if ((*co)->owner != &self) {
+    throw runtime_error(token{}, "can't resume a coroutine from another task");
+  }
+  return **co;
 }
 
-auto interpreter::lookup_var(token name, expr ex) -> value {
-  auto hash = hash_expr(std::move(ex));
-  if (locals.contains(hash)) {
-    return env_->get(locals[hash], name);
-  } else {
-    return globals_->get(name);
-  }
+auto to_array(value const& value) -> array& {
+  auto const* arr = std::get_if<std::shared_ptr<array>>(&value);
+  if (arr == nullptr) throw runtime_error(token{}, "expected an array");
+  return **arr;
 }
 
-void interpreter::assign_var(token name, expr ex, value value) {
-  auto hash = hash_expr(std::move(ex));
-  if (locals.contains(hash)) env_->assign(locals[hash], name, value);
-  else globals_->assign(name, value);
+auto to_floats(value const& value) -> float_array& {
+  auto const* floats = std::get_if<std::shared_ptr<float_array>>(&value);
+  if (floats == nullptr) throw runtime_error(token{}, "expected a float array");
+  return **floats;
 }
 
-auto interpreter::operator()(literal_expr const& e) -> value {
-  return values::to_value(e.literal);
+auto to_number(value const& value) -> double {
+  auto const* number = std::get_if<double>(&value);
+  if (number == nullptr) throw runtime_error(token{}, "expected a number");
+  return *number;
 }
 
-auto interpreter::operator()(variable_expr const& e) -> value {
-  return lookup_var(e.name, e);
+auto to_map(value const& value) -> map& {
+  auto const* m = std::get_if<std::shared_ptr<map>>(&value);
+  if (m == nullptr) throw runtime_error(token{}, "expected a map");
+  return **m;
 }
 
-auto interpreter::operator()(box<group_expr> const& e) -> value {
-  return std::visit(*this, e->ex);
+} // namespace
+
+void interpreter::define_builtins() {
+  // Builtins are values like any other, which can end up in other tasks'
+  // interpreters (see isolation), so they act for whichever one calls them
+  // rather than capturing the one that defined them.
+  auto const define = [this](std::string const& name, int arity,
+                             builtin_fn fn) {
+    globals_.define(name,
+                    std::make_shared<builtin>(name, arity, std::move(fn)));
+  };
+
+  globals_.define("pi", 3.14);
+  define("min", 2, [](interpreter&, std::vector<value> const& args) {
+    return values::less_equal(token{}, args[0], args[1]) ? args[0] : args[1];
+  });
+  define("clock", 0, [](interpreter&, std::vector<value> const&) {
+    using namespace std::chrono;
+    duration<double> now = steady_clock::now().time_since_epoch();
+    return value{now.count()};
+  });
+  // Writes out what's been printed so far, rather than when the buffer
+  // fills up or the run finishes (see print)
+  define("flush", 0, [](interpreter& self, std::vector<value> const&) {
+    self.flush(true);
+    return value{};
+  });
+  // Prints what the heap has gone on so far (see profile::report)
+  define("heap_profile", 0, [](interpreter& self, std::vector<value> const&) {
+    std::ostringstream report;
+    profile::report(report);
+    self.printed_ += std::move(report).str();
+    self.flush();
+    return value{};
+  });
+
+  // Arrays: len also takes maps and strings, push appends (growing the array
+  // geometrically) and pop removes the last element and returns it
+  define("len", 1, [](interpreter&, std::vector<value> const& args) {
+    return value{values::length(token{}, args[0])};
+  });
+  define("push", 2, [](interpreter&, std::vector<value> const& args) {
+    profile::scope const charged{profile::kind::array};
+    auto& arr = to_array(args[0]);
+    if (arr.elements.size() == arr.elements.capacity()) {
+      arr.reserve(std::max<std::size_t>(2 * arr.elements.capacity(), 1));
+    }
+    arr.elements.push_back(args[1]);
+    return value{};
+  });
+  define("pop", 1, [](interpreter&, std::vector<value> const& args) {
+    auto& elements = to_array(args[0]).elements;
+    if (elements.empty()) {
+      throw runtime_error(token{}, "pop from an empty array");
+    }
+    value last = std::move(elements.back());
+    elements.pop_back();
+    return last;
+  });
+
+  // Float arrays, for numbers in bulk: floats makes one, of zeros or from an
+  // array of numbers, and the rest run vectorised (see simd.hpp)
+  define("floats", 1, [](interpreter&, std::vector<value> const& args) {
+    profile::scope const charged{profile::kind::floats};
+    auto                 floats = std::make_shared<float_array>();
+    if (auto const* n = std::get_if<double>(&args[0])) {
+      if (*n < 0 or std::trunc(*n) != *n) {
+        throw runtime_error(token{}, "expected a whole number");
+      }
+      // Their size in bytes has to fit the meter's count, too
+      auto const most = std::min<std::size_t>(
+          floats->elements.max_size(),
+          std::numeric_limits<std::int64_t>::max() / sizeof(double));
+      if (*n > static_cast<double>(most) or
+          static_cast<std::size_t>(*n) > most) {
+        throw runtime_error(token{}, "too many elements");
+      }
+      auto const size = static_cast<std::size_t>(*n);
+      // Charged for before they're allocated
+      floats->charged.resize(size * sizeof(double));
+      try {
+        floats->elements.resize(size);
+      } catch (std::bad_alloc const&) {
+        throw runtime_error(token{}, "out of memory");
+      }
+      return value{std::move(floats)};
+    }
+
+    auto const& elements = to_array(args[0]).elements;
+    floats->reserve(elements.size());
+    for (auto const& element : elements) {
+      floats->elements.push_back(to_number(element));
+    }
+    return value{std::move(floats)};
+  });
+  define("sum", 1, [](interpreter&, std::vector<value> const& args) {
+    return value{simd::sum(to_floats(args[0]).elements)};
+  });
+  define("minimum", 1, [](interpreter&, std::vector<value> const& args) {
+    auto const& elements = to_floats(args[0]).elements;
+    if (elements.empty()) throw runtime_error(token{}, "expected elements");
+    return value{simd::min(elements)};
+  });
+  define("maximum", 1, [](interpreter&, std::vector<value> const& args) {
+    auto const& elements = to_floats(args[0]).elements;
+    if (elements.empty()) throw runtime_error(token{}, "expected elements");
+    return value{simd::max(elements)};
+  });
+  define("dot", 2, [](interpreter&, std::vector<value> const& args) {
+    auto const& xs = to_floats(args[0]).elements;
+    auto const& ys = to_floats(args[1]).elements;
+    if (xs.size() != ys.size()) {
+      throw runtime_error(token{}, "expected arrays of the same length");
+    }
+    return value{simd::dot(xs, ys)};
+  });
+  define("scale", 2, [](interpreter&, std::vector<value> const& args) {
+    simd::scale(to_floats(args[0]).elements, to_number(args[1]));
+    return value{};
+  });
+
+  // Maps (see map.hpp), which are indexed like arrays: map makes an empty
+  // one, has and remove look up keys, and keys lists them in an array
+  define("map", 0, [](interpreter&, std::vector<value> const&) {
+    profile::scope const charged{profile::kind::map};
+    return value{std::make_shared<map>()};
+  });
+  define("has", 2, [](interpreter&, std::vector<value> const& args) {
+    auto const& key = args[1];
+    return value{to_map(args[0]).find(key, values::hash(token{}, key)) !=
+                 nullptr};
+  });
+  define("remove", 2, [](interpreter&, std::vector<value> const& args) {
+    auto const& key = args[1];
+    return value{to_map(args[0]).erase(key, values::hash(token{}, key))};
+  });
+  define("keys", 1, [](interpreter&, std::vector<value> const& args) {
+    profile::scope const charged{profile::kind::array};
+    auto const&          m    = to_map(args[0]);
+    auto                 keys = std::make_shared<array>();
+    keys->reserve(m.size());
+    m.each([&](value const& key, value const&) {
+      keys->elements.push_back(key);
+    });
+    return value{std::move(keys)};
+  });
+
+  // Tasks and channels (see spawn and channel.hpp)
+  define("spawn", 2, [](interpreter& self, std::vector<value> const& args) {
+    return self.spawn(args[0], args[1]);
+  });
+  define("channel", 0, [](interpreter&, std::vector<value> const&) {
+    profile::scope const charged{profile::kind::channel};
+    return value{std::make_shared<channel>()};
+  });
+  define("send", 2, [](interpreter&, std::vector<value> const& args) {
+    to_channel(args[0]).send(isolation{}(args[1]));
+    return value{};
+  });
+  define("receive", 1, [](interpreter& self, std::vector<value> const& args) {
+    return self.receive(to_channel(args[0]));
+  });
+
+  // Data parallelism (see parallel_map)
+  define("parallel_map", 2,
+         [](interpreter& self, std::vector<value> const& args) {
+           return value{
+               self.parallel_map(args[1], to_array(args[0]).elements)};
+         });
+  define("parallel_reduce", 3,
+         [](interpreter& self, std::vector<value> const& args) {
+           return self.parallel_reduce(args[1], to_array(args[0]).elements,
+                                       args[2]);
+         });
+
+  // Generators (see coroutine.hpp): next gives the next value a generator
+  // yields, or nil once it's finished, which done tells apart by looking
+  // ahead
+  define("next", 1, [](interpreter& self, std::vector<value> const& args) {
+    auto& gen = to_generator(args[0], self);
+    if (gen.peeked) return *std::exchange(gen.peeked, {});
+    return self.advance(gen).value_or(value{});
+  });
+  define("done", 1, [](interpreter& self, std::vector<value> const& args) {
+    auto& gen = to_generator(args[0], self);
+    if (not gen.peeked) gen.peeked = self.advance(gen);
+    return value{not gen.peeked};
+  });
 }
 
-auto interpreter::operator()(box<assign_expr> const& e) -> value {
-  value value = std::visit(*this, e->value);
-  assign_var(e->name, e, value);
-  return value;
+void interpreter::interpret(std::vector<stmt> const& stmts) {
+  start(*compile(stmts));
 }
 
-auto interpreter::operator()(box<unary_expr> const& e) -> value {
-  value right = std::visit(*this, e->right);
+auto interpreter::compile(std::vector<stmt> const& stmts)
+    -> std::shared_ptr<program> {
+  profile::scope const charged{profile::kind::code};
+  compiler             compiler{*this, options_.ir or options_.dump_ir};
+  auto const script = compiler.compile(stmts);
 
-  switch (e->op.type) {
-  case token_type::BANG:
-    return !values::is_truthy(right);
-  case token_type::MINUS:
-    return values::negate(e->op, right);
-  default:
-    __builtin_unreachable();
+  if (options_.dump_ir) {
+    auto const dump = [this](auto const& self,
+                             prototype const& proto) -> void {
+      for (auto const& fn : proto.functions) {
+        if (fn->ir) {
+          fmt::print(output_, "{}", ir::to_string(*fn->ir));
+        } else {
+          fmt::print(output_, "fun {}/{} (not lowered)\n", fn->name,
+                     fn->arity);
+        }
+        self(self, *fn);
+      }
+    };
+    dump(dump, *script);
   }
+
+  return std::make_shared<program>(
+      program{script, constants_, globals_.names()});
 }
 
-auto interpreter::operator()(box<logical_expr> const& e) -> value {
-  value left = std::visit(*this, e->left);
+void interpreter::run(program const& program) {
+  globals_.clear(program.globals);
+  define_builtins();
 
-  // Short-circuiting
-  // Note that we return a 'truthy' value instead of a bool (lossy)
-  if (e->op.type == token_type::OR) {
-    if (values::is_truthy(left)) return left;
-  } else {
-    if (!values::is_truthy(left)) return left;
+  // Anything compiled here later (in the REPL, say) might call the program's
+  // functions, so it has to share the constant pool they use
+  if (adopted_ != program.script) {
+    adopted_   = program.script;
+    constants_ = program.constants;
+    constant_ids_.clear();
   }
 
-  return std::visit(*this, e->right);
+  start(program);
 }
 
-auto interpreter::operator()(box<binary_expr> const& e) -> value {
-  // Note, we evaluate the LHS before the RHS.
-  // Also, we evaluate both operands before checking their types are valid.
-  value left  = std::visit(*this, e->left);
-  value right = std::visit(*this, e->right);
-
-  switch (e->op.type) {
-  case token_type::COMMA:
-    return right;
-  case token_type::BANG_EQUAL:
-    return left != right;
-  case token_type::EQUAL_EQUAL:
-    return left == right;
-  case token_type::GREATER:
-    return values::greater_than(e->op, left, right);
-  case token_type::GREATER_EQUAL:
-    return values::greater_equal(e->op, left, right);
-  case token_type::LESS:
-    return values::less_than(e->op, left, right);
-  case token_type::LESS_EQUAL:
-    return values::less_equal(e->op, left, right);
-  case token_type::PLUS:
-    return values::to_value(values::plus(e->op, left, right));
-  case token_type::MINUS:
-    return values::minus(e->op, left, right);
-  case token_type::STAR:
-    return values::to_value(values::multiply(e->op, left, right));
-  case token_type::SLASH:
-    return values::divide(e->op, left, right);
-  default:
-    throw runtime_error(e->op, "unhandled binary operator");
-  }
+auto interpreter::load_snapshot(std::span<char const> bytes)
+    -> std::shared_ptr<program> {
+  // Builtins are saved by name, and looked up among fresh ones
+  define_builtins();
+  auto snap = read_snapshot(bytes, [this](std::string const& name) {
+    auto const* found = globals_.find(globals_.slot(name));
+    if (found == nullptr or
+        not std::holds_alternative<std::shared_ptr<builtin>>(*found)) {
+      throw std::runtime_error(fmt::format("no builtin called '{}'", name));
+    }
+    return *found;
+  });
+
+  globals_.load(snap.program->globals, std::move(snap.globals));
+  adopted_   = snap.program->script;
+  constants_ = snap.program->constants;
+  constant_ids_.clear();
+  return snap.program;
 }
 
-auto interpreter::operator()(box<call_expr> const& e) -> value {
-  value callee = std::visit(*this, e->callee);
+void interpreter::save_snapshot(std::ostream& out) const {
+  if (adopted_ == nullptr) {
+    throw std::runtime_error("no program has run to take a snapshot of");
+  }
+  write_snapshot(out, {std::make_shared<program>(program{
+                           adopted_, constants_, globals_.names()}),
+                       globals_.values()});
+}
 
-  std::vector<value> args;
-  for (auto const& arg : e->args) { args.push_back(std::visit(*this, arg)); }
+void interpreter::run_main(program const& program) {
+  auto const& names = globals_.names();
+  auto const  it    = std::ranges::find(names, "main");
+  if (it == names.end()) return;
 
-  if (std::ssize(args) != values::arity(e->paren, callee)) {
-    throw runtime_error(e->paren,
-                        fmt::format("expected {} arguments but got {}",
-                                    values::arity(e->paren, callee),
-                                    std::ssize(args)));
-  }
+  auto const* main = globals_.find(static_cast<int>(it - names.begin()));
+  auto const* fn =
+      main == nullptr ? nullptr : std::get_if<std::shared_ptr<function>>(main);
+  if (fn != nullptr) start(program, **fn);
+}
 
-  return values::call(
-      e->paren, callee, args,
-      [this](callable callable, env_ptr const& env_ptr) -> value {
-        return interpret(callable, env_ptr);
-      });
+void interpreter::start(program const& program) {
+  start(program, function{program.script, {}});
 }
 
-auto interpreter::operator()(box<conditional_expr> const& e) -> value {
-  value cond = std::visit(*this, e->cond);
+void interpreter::start(program const& program, function const& entry) {
+  program_ = &program;
+  metering const metered{meter_};
+  start_budgets();
 
-  // This implicitly converts any expression into a bool (may be unexpected)
-  if (values::is_truthy(cond)) {
-    return std::visit(*this, e->then);
-  } else {
-    return std::visit(*this, e->alt);
+  try {
+    call(entry, {});
+    run_async(nullptr);
+    check_heap();
+  } catch (runtime_error const& err) {
+    report(err);
+    reset();
+  } catch (budget_exceeded const&) {
+    flush();
+    reset();
+    program_ = nullptr;
+    join_tasks();
+    throw;
   }
-}
+  flush();
+  program_ = nullptr;
+  profile::at(0);
 
-void interpreter::operator()(expression_stmt const& s) {
-  std::visit(*this, s.ex);
+  join_tasks();
 }
 
-void interpreter::operator()(print_stmt const& s) {
-  value value = std::visit(*this, s.ex);
-  output_ << fmt::format("{}\n", values::to_string(value));
-}
+auto interpreter::call(function const& fn, std::vector<value> const& args)
+    -> value {
+  auto& proto = *fn.proto;
+  if (std::ssize(args) != proto.arity) {
+    throw runtime_error(token{},
+                        fmt::format("expected {} arguments but got {}",
+                                    proto.arity, std::ssize(args)));
+  }
+  if (depth() >= options_.max_depth or
+      sp_ + 1 + proto.max_stack > stack_end_) {
+    throw runtime_error(token{}, "stack overflow");
+  }
 
-void interpreter::operator()(variable_stmt const& s) {
-  value value;
-  if (s.init) value = std::visit(*this, *s.init);
+  // There's no callee value here, the caller keeps `fn` alive
+  *sp_++ = value{};
+  for (auto const& arg : args) { *sp_++ = arg; }
+  frames_.push_back({&fn, proto.code.data(), sp_ - args.size()});
+  dispatch();
 
-  env_->define(s.name.lexeme, value);
+  value result = std::move(*--sp_);
+  *sp_         = value{};
+  return result;
 }
 
-void interpreter::operator()(box<block_stmt> const& s) {
-  env_ptr prev = env_; // points to the same thing as env_
-  fmt::print("making new scope\n");
-  fmt::print("prev env: {}\n", prev->values_);
-  if (prev->parent_)
-    fmt::print("prev parent hmmm {}\n", prev->parent_->values_);
-  if (env_->parent_)
-    fmt::print("env: {}, parent: {}\n", env_->values_, env_->parent_->values_);
-  else fmt::print("env: {}\n", env_->values_);
-  env_ = std::make_shared<environment>(prev);
-  for (auto const& ss : s->stmts) { std::visit(*this, ss); }
-  // TODO: This isn't exception-safe
-  fmt::print("resetting scope\n");
-  fmt::print("prev env: {}\n", prev->values_);
-  fmt::print("env: {}\n", env_->values_);
-  fmt::print("env: {}, parent: {}\n", env_->values_, env_->parent_->values_);
-  env_ = prev;
-}
+// The dispatch loop keeps everything it touches on every instruction (the
+// instruction pointer, stack top, current frame) in locals so that they can
+// live in registers. They are written back to the interpreter whenever
+// something else might need them.
+//
+// With computed gotos, each instruction jumps straight to the next one's
+// handler through a table, so the branch predictor gets a separate indirect
+// jump per handler to learn from instead of one shared one. The switch is
+// the portable fallback.
+//
+// With the heap profiler built in, each instruction first says which line
+// it's on, for what it allocates to be charged to.
+#ifdef LOX_HEAP_PROFILE
+#define PROFILE_LINE() profile::near(here().line)
+#else
+#define PROFILE_LINE() static_cast<void>(0)
+#endif
+
+#if LOX_COMPUTED_GOTO
+#define TARGET(name) \
+  case opcode::name: \
+  target_##name
+#define DISPATCH()                                      \
+  do {                                                  \
+    PROFILE_LINE();                                     \
+    goto* targets[static_cast<std::size_t>(op_at(ip))]; \
+  } while (false)
+#else
+#define TARGET(name) case opcode::name
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() \
+  do {         \
+    ++ip;      \
+    DISPATCH(); \
+  } while (false)
+
+#define POP() (*--sp = value{})
+// For when the top of the stack is known not to own anything
+#define DROP() (--sp)
 
-void interpreter::operator()(box<function_stmt> const& s) {
-  function fn{*s, env_};
-  env_->define(s->name.lexeme, fn);
-  fmt::print("defined new fn: {}\n", s->name.lexeme);
+// Swaps the current instruction for another version of it and runs that.
+#define REWRITE(to)      \
+  do {                   \
+    rewrite(ip, opcode::to); \
+    DISPATCH();          \
+  } while (false)
+
+namespace {
+
+// Bytecode is shared by every interpreter running it, on whatever thread (see
+// spawn), and quickening rewrites it as it runs. Every version of an
+// instruction does the same thing, so all that matters is that reads and
+// writes don't tear; relaxed atomics are plain moves on x86-64 and ARM.
+auto op_at(instruction* ip) -> opcode { return load_op(*ip); }
+void rewrite(instruction* ip, opcode to) {
+  std::atomic_ref(ip->op).store(to, std::memory_order_relaxed);
 }
 
-[[noreturn]] void interpreter::operator()(break_stmt const& /*s*/) {
-  throw break_exception();
+// Whether the top two values on the stack are both numbers/strings
+auto numbers(value const* sp) -> bool {
+  return std::holds_alternative<double>(sp[-2]) and
+         std::holds_alternative<double>(sp[-1]);
+}
+auto strings(value const* sp) -> bool {
+  return std::holds_alternative<string>(sp[-2]) and
+         std::holds_alternative<string>(sp[-1]);
 }
 
-[[noreturn]] void interpreter::operator()(return_stmt const& s) {
-  value value{};
-  if (s.value) { value = std::visit(*this, *s.value); }
+// Unchecked, only for once the type is known
+auto number(value& value) -> double& { return *std::get_if<double>(&value); }
 
-  throw return_exception{value};
-}
+} // namespace
+
+void interpreter::dispatch() {
+#if LOX_COMPUTED_GOTO
+  // clang-format off
+  static void* const targets[] = {
+    &&target_constant, &&target_nil, &&target_true_, &&target_false_,
+    &&target_pop, &&target_unwind,
+    &&target_get_local, &&target_set_local,
+    &&target_get_upvalue, &&target_set_upvalue,
+    &&target_get_global, &&target_set_global, &&target_define_global,
+    &&target_equal, &&target_not_equal, &&target_greater,
+    &&target_greater_equal, &&target_less, &&target_less_equal,
+    &&target_add, &&target_subtract, &&target_multiply, &&target_divide,
+    &&target_negate, &&target_not_,
+    &&target_array, &&target_get_index, &&target_set_index,
+    &&target_jump, &&target_jump_if_false, &&target_jump_if_true,
+    &&target_call, &&target_tail_call, &&target_closure, &&target_return_,
+    &&target_yield, &&target_await,
+    &&target_print, &&target_echo,
+    &&target_equal_num, &&target_not_equal_num, &&target_greater_num,
+    &&target_greater_equal_num, &&target_less_num, &&target_less_equal_num,
+    &&target_add_num, &&target_add_str, &&target_subtract_num,
+    &&target_multiply_num, &&target_negate_num,
+  };
+  // clang-format on
+  static_assert(std::size(targets) ==
+                static_cast<std::size_t>(opcode::NUM_OPCODES));
+#endif
 
-void interpreter::operator()(box<if_stmt> const& s) {
-  if (values::is_truthy(std::visit(*this, s->cond))) {
-    std::visit(*this, s->then);
-  } else if (s->alt) {
-    std::visit(*this, *s->alt);
+  auto const bottom = frames_.size() - 1; // frames below ours
+
+  function const*    closure{};
+  prototype*         proto{};
+  instruction*       ip{};
+  value*             base{};
+  value*             sp        = sp_;
+  value const* const constants = program_->constants.data();
+
+  auto const load_frame = [&] {
+    auto const& frame = frames_.back();
+    closure           = frame.closure;
+    proto             = closure->proto.get();
+    ip                = frame.ip;
+    base              = frame.base;
+  };
+  auto const here = [&]() -> token const& { return proto->token_at(ip); };
+
+  load_frame();
+
+#if !LOX_COMPUTED_GOTO
+dispatch:
+#endif
+  PROFILE_LINE();
+  switch (op_at(ip)) {
+  TARGET(constant) : {
+    *sp++ = constants[ip->arg];
+    NEXT();
+  }
+  TARGET(nil) : {
+    *sp++ = value{};
+    NEXT();
+  }
+  TARGET(true_) : {
+    *sp++ = true;
+    NEXT();
+  }
+  TARGET(false_) : {
+    *sp++ = false;
+    NEXT();
   }
-}
 
-void interpreter::operator()(box<while_stmt> const& s) {
-  try {
-    while (values::is_truthy(std::visit(*this, s->cond))) {
-      std::visit(*this, s->body);
+  TARGET(pop) : {
+    POP();
+    NEXT();
+  }
+  TARGET(unwind) : {
+    value* const last = base + ip->arg;
+    close_upvalues(last);
+    while (sp > last) { POP(); }
+    NEXT();
+  }
+
+  TARGET(get_local) : {
+    *sp++ = base[ip->arg];
+    NEXT();
+  }
+  TARGET(set_local) : {
+    base[ip->arg] = sp[-1];
+    NEXT();
+  }
+  TARGET(get_upvalue) : {
+    *sp++ = *closure->upvalues[ip->arg]->location;
+    NEXT();
+  }
+  TARGET(set_upvalue) : {
+    *closure->upvalues[ip->arg]->location = sp[-1];
+    NEXT();
+  }
+  TARGET(get_global) : {
+    value const* global = globals_.find(ip->arg);
+    if (global == nullptr) {
+      throw runtime_error(here(), fmt::format("undefined variable '{}'",
+                                              here().lexeme));
     }
-  } catch (break_exception&) {
-    // Break to end of loop
+    *sp++ = *global;
+    NEXT();
+  }
+  TARGET(set_global) : {
+    value* global = globals_.find(ip->arg);
+    if (global == nullptr) {
+      throw runtime_error(here(), fmt::format("undefined variable '{}'",
+                                              here().lexeme));
+    }
+    *global = sp[-1];
+    NEXT();
+  }
+  TARGET(define_global) : {
+    globals_.define(ip->arg, std::move(sp[-1]));
+    POP();
+    NEXT();
   }
-}
 
-void interpreter::interpret(std::vector<stmt> const& stmts) {
-  try {
-    for (auto const& s : stmts) {
-      if (std::holds_alternative<expression_stmt>(s)) {
-        auto  expr  = std::get<expression_stmt>(s);
-        value value = std::visit(*this, expr.ex);
-        output_ << fmt::format("{}\n", values::to_string(value));
-      } else {
-        std::visit(*this, s);
+  // Generic operators work on anything. The first time one sees two numbers
+  // (or two strings, for +) it rewrites itself into the specialised version
+  // and runs that instead. A specialised operator checks its guess each time
+  // and hands back to the generic one if it's wrong.
+  TARGET(equal) : {
+    if (numbers(sp)) REWRITE(equal_num);
+    sp[-2] = sp[-2] == sp[-1];
+    POP();
+    NEXT();
+  }
+  TARGET(not_equal) : {
+    if (numbers(sp)) REWRITE(not_equal_num);
+    sp[-2] = sp[-2] != sp[-1];
+    POP();
+    NEXT();
+  }
+  TARGET(greater) : {
+    if (numbers(sp)) REWRITE(greater_num);
+    sp[-2] = values::greater_than(here(), sp[-2], sp[-1]);
+    POP();
+    NEXT();
+  }
+  TARGET(greater_equal) : {
+    if (numbers(sp)) REWRITE(greater_equal_num);
+    sp[-2] = values::greater_equal(here(), sp[-2], sp[-1]);
+    POP();
+    NEXT();
+  }
+  TARGET(less) : {
+    if (numbers(sp)) REWRITE(less_num);
+    sp[-2] = values::less_than(here(), sp[-2], sp[-1]);
+    POP();
+    NEXT();
+  }
+  TARGET(less_equal) : {
+    if (numbers(sp)) REWRITE(less_equal_num);
+    sp[-2] = values::less_equal(here(), sp[-2], sp[-1]);
+    POP();
+    NEXT();
+  }
+  TARGET(add) : {
+    if (numbers(sp)) REWRITE(add_num);
+    if (strings(sp)) REWRITE(add_str);
+    sp[-2] = values::plus(here(), sp[-2], sp[-1]);
+    POP();
+    NEXT();
+  }
+  TARGET(subtract) : {
+    if (numbers(sp)) REWRITE(subtract_num);
+    sp[-2] = values::minus(here(), sp[-2], sp[-1]);
+    POP();
+    NEXT();
+  }
+  TARGET(multiply) : {
+    if (numbers(sp)) REWRITE(multiply_num);
+    sp[-2] = values::multiply(here(), sp[-2], sp[-1]);
+    POP();
+    NEXT();
+  }
+  TARGET(divide) : {
+    // Not worth specialising, it has to check for zero anyway
+    sp[-2] = values::divide(here(), sp[-2], sp[-1]);
+    POP();
+    NEXT();
+  }
+  TARGET(negate) : {
+    if (std::holds_alternative<double>(sp[-1])) REWRITE(negate_num);
+    sp[-1] = values::negate(here(), sp[-1]);
+    NEXT();
+  }
+  TARGET(not_) : {
+    sp[-1] = not values::is_truthy(sp[-1]);
+    NEXT();
+  }
+
+  TARGET(equal_num) : {
+    if (not numbers(sp)) [[unlikely]] REWRITE(equal);
+    sp[-2] = number(sp[-2]) == number(sp[-1]);
+    DROP();
+    NEXT();
+  }
+  TARGET(not_equal_num) : {
+    if (not numbers(sp)) [[unlikely]] REWRITE(not_equal);
+    sp[-2] = number(sp[-2]) != number(sp[-1]);
+    DROP();
+    NEXT();
+  }
+  TARGET(greater_num) : {
+    if (not numbers(sp)) [[unlikely]] REWRITE(greater);
+    sp[-2] = number(sp[-2]) > number(sp[-1]);
+    DROP();
+    NEXT();
+  }
+  TARGET(greater_equal_num) : {
+    if (not numbers(sp)) [[unlikely]] REWRITE(greater_equal);
+    sp[-2] = number(sp[-2]) >= number(sp[-1]);
+    DROP();
+    NEXT();
+  }
+  TARGET(less_num) : {
+    if (not numbers(sp)) [[unlikely]] REWRITE(less);
+    sp[-2] = number(sp[-2]) < number(sp[-1]);
+    DROP();
+    NEXT();
+  }
+  TARGET(less_equal_num) : {
+    if (not numbers(sp)) [[unlikely]] REWRITE(less_equal);
+    sp[-2] = number(sp[-2]) <= number(sp[-1]);
+    DROP();
+    NEXT();
+  }
+  TARGET(add_num) : {
+    if (not numbers(sp)) [[unlikely]] REWRITE(add);
+    number(sp[-2]) += number(sp[-1]);
+    DROP();
+    NEXT();
+  }
+  TARGET(add_str) : {
+    if (not strings(sp)) [[unlikely]] REWRITE(add);
+    sp[-2] = string::concat(std::get<string>(sp[-2]),
+                            std::get<string>(sp[-1]).view());
+    POP();
+    NEXT();
+  }
+  TARGET(subtract_num) : {
+    if (not numbers(sp)) [[unlikely]] REWRITE(subtract);
+    number(sp[-2]) -= number(sp[-1]);
+    DROP();
+    NEXT();
+  }
+  TARGET(multiply_num) : {
+    if (not numbers(sp)) [[unlikely]] REWRITE(multiply);
+    number(sp[-2]) *= number(sp[-1]);
+    DROP();
+    NEXT();
+  }
+  TARGET(negate_num) : {
+    if (not std::holds_alternative<double>(sp[-1])) [[unlikely]] {
+      REWRITE(negate);
+    }
+    number(sp[-1]) = -number(sp[-1]);
+    NEXT();
+  }
+
+  TARGET(array) : {
+    value* const first = sp - ip->arg;
+    auto         arr   = profile::as(profile::kind::array, [&] {
+      auto made = std::make_shared<array>();
+      made->reserve(static_cast<std::size_t>(ip->arg));
+      made->elements.assign(std::make_move_iterator(first),
+                            std::make_move_iterator(sp));
+      return made;
+    });
+    while (sp > first) { POP(); }
+    *sp++ = std::move(arr);
+    NEXT();
+  }
+  TARGET(get_index) : {
+    // Copied out first: sp[-2] might be all that owns the element
+    value element = values::index(here(), sp[-2], sp[-1]);
+    POP();
+    sp[-1] = std::move(element);
+    NEXT();
+  }
+  TARGET(set_index) : {
+    values::set_index(here(), sp[-3], sp[-2], sp[-1]);
+    sp[-3] = std::move(sp[-1]);
+    POP();
+    POP();
+    NEXT();
+  }
+
+  TARGET(jump) : {
+    // Jumping back is going round a loop
+    instruction* const to = proto->code.data() + ip->arg;
+    if (to < ip) tick();
+    ip = to;
+    DISPATCH();
+  }
+  TARGET(jump_if_false) : {
+    if (values::is_truthy(sp[-1])) NEXT();
+    ip = proto->code.data() + ip->arg;
+    DISPATCH();
+  }
+  TARGET(jump_if_true) : {
+    if (not values::is_truthy(sp[-1])) NEXT();
+    ip = proto->code.data() + ip->arg;
+    DISPATCH();
+  }
+
+  TARGET(tail_call) : {
+    auto const   argc   = ip->arg;
+    value* const callee = sp - argc - 1;
+    auto const*  fn     = std::get_if<std::shared_ptr<function>>(callee);
+
+    // Anything that can't run in this frame is an ordinary call, then the
+    // return after it
+    if (fn != nullptr and (*fn)->proto->arity == argc and
+        (*fn)->proto->kind == function_kind::plain and
+        not((*fn)->proto->ir != nullptr and options_.ir)) {
+      auto& target = *(*fn)->proto;
+      if (base + target.max_stack > stack_end_) {
+        throw runtime_error(here(), "stack overflow");
+      }
+
+      // The callee and its arguments replace ours, callee slot included, so
+      // the frame's closure stays alive
+      tick();
+      function const* const next = fn->get();
+      close_upvalues(base);
+      std::move(callee, sp, base - 1);
+      while (sp > base + argc) { POP(); }
+
+      frames_.back() = {next, target.code.data(), base};
+      load_frame();
+      DISPATCH();
+    }
+  }
+    [[fallthrough]];
+  TARGET(call) : {
+    auto const   argc   = ip->arg;
+    value* const callee = sp - argc - 1;
+    tick();
+
+    if (auto const* fn = std::get_if<std::shared_ptr<function>>(callee)) {
+      auto& target = *(*fn)->proto;
+      if (argc != target.arity) {
+        throw runtime_error(here(),
+                            fmt::format("expected {} arguments but got {}",
+                                        target.arity, argc));
+      }
+      if (depth() >= options_.max_depth or
+          sp - argc + target.max_stack > stack_end_) {
+        throw runtime_error(here(), "stack overflow");
+      }
+
+      if (target.kind != function_kind::plain) {
+        sp_          = sp;
+        value result = activate(*fn, sp - argc, argc);
+
+        while (sp > callee) { POP(); }
+        *sp++ = std::move(result);
+        NEXT();
+      }
+
+      if (target.ir != nullptr and options_.ir) {
+        if (not fits(*target.ir, sp - argc)) {
+          throw runtime_error(here(), "stack overflow");
+        }
+        sp_          = sp;
+        value result = execute(*target.ir, sp - argc);
+
+        while (sp > callee) { POP(); }
+        *sp++ = std::move(result);
+        NEXT();
+      }
+
+      frames_.back().ip = ip + 1;
+      frames_.push_back({fn->get(), target.code.data(), sp - argc});
+      load_frame();
+      DISPATCH();
+    }
+
+    if (auto const* fn = std::get_if<std::shared_ptr<builtin>>(callee)) {
+      if (argc != (*fn)->arity) {
+        throw runtime_error(here(),
+                            fmt::format("expected {} arguments but got {}",
+                                        (*fn)->arity, argc));
+      }
+
+      // The builtin might call back into the interpreter. Its arguments
+      // mustn't outlive the call: a computed goto out of this block wouldn't
+      // destroy them.
+      sp_          = sp;
+      value result = call_builtin(**fn, sp - argc, sp, here());
+      // It might have waited, and carried on on another thread
+      current_meter = meter_;
+
+      while (sp > callee) { POP(); }
+      *sp++ = std::move(result);
+      NEXT();
+    }
+
+    throw runtime_error(here(), "can only call functions and classes");
+  }
+  TARGET(closure) : {
+    auto const& target = proto->functions[ip->arg];
+    auto        fn     = profile::as(profile::kind::function, [&] {
+      auto made = std::make_shared<function>(function{target, {}});
+      made->upvalues.reserve(target->captures.size());
+      return made;
+    });
+
+    for (capture const& c : target->captures) {
+      fn->upvalues.push_back(c.local ? capture_upvalue(base + c.index)
+                                     : closure->upvalues[c.index]);
+    }
+
+    *sp++ = std::move(fn);
+    NEXT();
+  }
+  TARGET(return_) : {
+    value result = std::move(sp[-1]);
+    close_upvalues(base);
+
+    // Pop the frame and the callee
+    while (sp >= base) { POP(); }
+    *sp++ = std::move(result);
+
+    frames_.pop_back();
+    if (frames_.size() == bottom) {
+      sp_ = sp;
+      return;
+    }
+
+    load_frame();
+    DISPATCH();
+  }
+  // Only a generator's or async function's own frame suspends, and it's
+  // always the bottom one: the coroutine running it takes it from here (see
+  // frame)
+  TARGET(yield) : {
+    frames_.back().ip = ip + 1;
+    sp_               = sp;
+    return;
+  }
+  TARGET(await) : {
+    // Async calls that have already returned, and anything that isn't an
+    // async call or a channel, don't need waiting for
+    if (auto const* co = std::get_if<std::shared_ptr<coroutine>>(&sp[-1]);
+        co != nullptr and (*co)->kind == function_kind::async) {
+      // Another task's would finish on its thread, under our feet
+      if ((*co)->owner != this) {
+        throw runtime_error(here(),
+                            "can't await a coroutine from another task");
+      }
+      if ((*co)->result) {
+        value result = *(*co)->result; // sp[-1] might be all that owns it
+        sp[-1]       = std::move(result);
+        NEXT();
       }
+    } else if (not std::holds_alternative<std::shared_ptr<channel>>(sp[-1])) {
+      NEXT();
     }
-  } catch (runtime_error const& err) { errors::report_runtime_error(err); }
+
+    if (proto->kind == function_kind::async) {
+      frames_.back().ip = ip + 1;
+      sp_               = sp;
+      return;
+    }
+
+    // Anywhere else, it waits right here
+    sp_    = sp;
+    sp[-1] = block_on(sp[-1]);
+    NEXT();
+  }
+
+  TARGET(print) : {
+    print(sp[-1]);
+    POP();
+    NEXT();
+  }
+  TARGET(echo) : {
+    print(sp[-1]);
+    POP();
+    NEXT();
+  }
+
+  default:
+    __builtin_unreachable();
+  }
 }
 
-// Implements interpret_func
-auto interpreter::interpret(callable callable, env_ptr const& closure)
+#undef REWRITE
+#undef DROP
+#undef POP
+#undef NEXT
+#undef DISPATCH
+#undef PROFILE_LINE
+#undef TARGET
+
+auto interpreter::arguments(value const* first, value const* last)
+    -> std::vector<value> {
+  profile::scope const charged{profile::kind::arguments};
+  return {first, last};
+}
+
+auto interpreter::call_builtin(builtin const& fn, value const* first,
+                               value const* last, token const& paren)
     -> value {
-  env_ptr prev = env_;
   try {
-    env_ = std::make_shared<environment>(closure);
+    return fn.fn(*this, arguments(first, last));
+  } catch (runtime_error const& err) {
+    // What went wrong in Lox code it called back into already says where
+    if (err.token_.line != 0 or not err.token_.lexeme.empty()) throw;
+    throw runtime_error(paren, err.what());
+  }
+}
 
-    for (int i = 0; i < std::ssize(callable.params); ++i) {
-      env_->define(callable.params[i].lexeme, callable.args[i]);
-    }
+auto interpreter::capture_upvalue(value* slot) -> std::shared_ptr<upvalue> {
+  profile::scope const charged{profile::kind::upvalue};
+  auto it = std::ranges::lower_bound(
+      open_upvalues_, slot, {},
+      [](std::shared_ptr<upvalue> const& uv) { return uv->location; });
+  if (it != open_upvalues_.end() and (*it)->location == slot) return *it;
 
-    interpret(callable.body);
-  } catch (return_exception const& e) {
-    env_ = prev;
-    return e.value;
+  return *open_upvalues_.insert(it, std::make_shared<upvalue>(slot));
+}
+
+void interpreter::close_upvalues(value* last) {
+  while (not open_upvalues_.empty() and
+         open_upvalues_.back()->location >= last) {
+    upvalue& uv = *open_upvalues_.back();
+    uv.closed   = std::move(*uv.location);
+    uv.location = &uv.closed;
+    open_upvalues_.pop_back();
   }
+}
+
+void interpreter::reset() {
+  close_upvalues(stack_.get());
+  frames_.clear();
+  ir_depth_ = 0;
+
+  // Async calls that were waiting are abandoned, along with anything that
+  // arrives for them
+  ready_.clear();
+  inbox_.reset();
 
-  return {};
+  // An error can leave values anywhere up to where it was thrown
+  std::fill(stack_.get(), stack_end_, value{});
+  sp_ = stack_.get();
 }
 
-void interpreter::resolve(expr ex, int depth) {
-  auto hash    = hash_expr(std::move(ex));
-  locals[hash] = depth;
+auto interpreter::global(std::string const& name) -> int {
+  return globals_.slot(name);
+}
+
+auto interpreter::constant(literal const& literal) -> int {
+  // -0 compares equal to 0, and NaN to nothing, so they can't share entries
+  if (auto const* number = std::get_if<double>(&literal);
+      number != nullptr and
+      ((*number == 0 and std::signbit(*number)) or std::isnan(*number))) {
+    constants_.push_back(*number);
+    return static_cast<int>(constants_.size()) - 1;
+  }
+
+  auto [it, inserted] =
+      constant_ids_.try_emplace(literal, static_cast<int>(constants_.size()));
+  if (inserted) constants_.push_back(values::to_value(literal));
+
+  return it->second;
 }
 
 } // namespace lox
@@ -1,59 +1,360 @@
 #pragma once
 
 #include <lox/ast/ast.hpp>
-#include <lox/interpreter/environment.hpp>
+#include <lox/errors.hpp>
+#include <lox/interpreter/bytecode.hpp>
+#include <lox/interpreter/globals.hpp>
+#include <lox/interpreter/meter.hpp>
+#include <lox/interpreter/program.hpp>
 #include <lox/interpreter/value.hpp>
 #include <lox/token/token.hpp>
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
-#include <unordered_map>
-#include <utility>
-#include <variant>
 #include <vector>
 
 namespace lox {
 
+namespace ir {
+struct function;
+struct operation;
+} // namespace ir
+
+struct task_group;
+struct channel;
+class isolation;
+struct coroutine;
+struct inbox;
+class resumable;
+
+// How programs are run, for trying out different ways of running them.
+struct options {
+  // Run functions with their optimised IR (see ir.hpp) instead of their
+  // bytecode, where they have it.
+  bool ir = false;
+  // Print the IR of each function when it's compiled.
+  bool dump_ir = false;
+  // Compile IR functions to machine code once they've been called (or gone
+  // round a loop) jit_threshold times, where there's a JIT for the platform.
+  bool jit           = true;
+  int  jit_threshold = 1000;
+
+  // Limits on a program's calls: how deep they can nest, and the slots (of
+  // 32 bytes each) on the value stack for their locals and temporaries,
+  // allocated up front. Going past either is a "stack overflow" error.
+  std::size_t max_depth  = 1 << 14;
+  std::size_t stack_size = 1 << 16;
+  // The same for each task (see spawn), which has a stack of its own for as
+  // long as it runs, so that fanning out to thousands of tasks stays cheap.
+  // It's never more than stack_size.
+  std::size_t task_stack_size = 1 << 10;
+
+  // Budgets for each run, for capping scripts that run away: fuel, counted
+  // in steps (calls and trips round loops), seconds on the clock, and bytes
+  // of heap held by the strings, arrays and maps the run has made (see
+  // heap_meter), however many other runs there are at the same time. 0
+  // means no limit. Going over one throws budget_exceeded out of the run.
+  // Each task (see spawn) gets budgets of its own, and a task that goes over
+  // one fails.
+  //
+  // Machine code isn't metered, so with a budget, there's no JIT. Nor is
+  // time spent blocked in a builtin, waiting on a channel say.
+  std::uint64_t fuel       = 0;
+  double        time_limit = 0;
+  std::size_t   heap_limit = 0;
+};
+
+// What a run has used of its budgets (see options::fuel).
+struct usage {
+  std::uint64_t fuel    = 0;
+  double        seconds = 0;
+  std::size_t   heap    = 0; // bytes, more than when it started
+};
+
+// Thrown out of a run that goes over one of its budgets, for whoever is
+// running it to catch. It isn't a Lox error: it isn't reported to the
+// interpreter's diagnostics, and the script can't do anything about it.
+struct budget_exceeded final : public std::runtime_error {
+  budget_exceeded(std::string const& limit, usage used);
+
+  usage used;
+};
+
+// interpreter runs Lox programs. Each call to interpret compiles the program
+// to bytecode (see compiler) and runs it on a stack-based virtual machine.
+// With options::ir, functions that can be lowered to IR run as register code
+// instead (see execute).
+//
+// To run the same script many times, compile it once and run the program:
+// each run starts from fresh globals but reuses the interpreter's stack and
+// tables, so an interpreter is a cheap, resettable execution context.
+//
+// Programs can spawn tasks, which run on the shared scheduler's threads, each
+// in an interpreter of its own (see spawn). A run doesn't finish until every
+// task it spawned has.
+//
+// Calls to generators and async functions run in coroutines (see
+// coroutine.hpp), which keep their frames off the stack while they're
+// suspended. Async calls take turns on the interpreter's thread: whenever
+// one waits, the next that's ready carries on. A run doesn't finish until
+// every async call it made has, either.
 class interpreter {
 public:
-  explicit interpreter(std::ostream& output = std::cout);
+  explicit interpreter(std::ostream& output = std::cout,
+                       options config = {});
 
+  // Compiles and runs statements, keeping the globals from earlier calls
+  // (as the REPL needs).
   void interpret(std::vector<stmt> const& stmts);
-  void resolve(expr ex, int depth);
-
-  auto operator()(literal_expr const& e) -> value;
-  auto operator()(variable_expr const& e) -> value;
-  auto operator()(box<group_expr> const& e) -> value;
-  auto operator()(box<assign_expr> const& e) -> value;
-  auto operator()(box<unary_expr> const& e) -> value;
-  auto operator()(box<logical_expr> const& e) -> value;
-  auto operator()(box<binary_expr> const& e) -> value;
-  auto operator()(box<call_expr> const& e) -> value;
-  auto operator()(box<conditional_expr> const& e) -> value;
-
-  void operator()(expression_stmt const& s);
-  void operator()(print_stmt const& s);
-  void operator()(variable_stmt const& s);
-  void operator()(box<block_stmt> const& s);
-  void operator()(box<function_stmt> const& s);
-  void operator()(box<if_stmt> const& s);
-  void operator()(box<while_stmt> const& s);
-
-  [[noreturn]] void operator()(break_stmt const& s);
-  [[noreturn]] void operator()(return_stmt const& s);
-
-  auto lookup_var(token name, expr ex) -> value;
-  void assign_var(token name, expr ex, value value);
+  // Compiles resolved statements into a program that any interpreter can
+  // run.
+  auto compile(std::vector<stmt> const& stmts) -> std::shared_ptr<program>;
+  // Runs a program with only the builtins defined, whatever earlier runs
+  // left behind. It must outlive the run.
+  void run(program const& program);
+  // Saves the program last run here, with the globals as that run left
+  // them, for later runs to start from (see snapshot.hpp).
+  void save_snapshot(std::ostream& out) const;
+  // Loads a snapshot saved by save_snapshot, as if its program had just run
+  // here, and returns the program. Builtins in it are this interpreter's.
+  auto load_snapshot(std::span<char const> bytes) -> std::shared_ptr<program>;
+  // Carries on from a snapshot by calling the global function `main`, if
+  // there is one, with no arguments. `program` must outlive the run.
+  void run_main(program const& program);
+  // Returns the global slot for `name`.
+  auto global(std::string const& name) -> int;
+  // Interns a literal in the constant pool and returns its index.
+  auto constant(literal const& literal) -> int;
+  // Where errors from running programs, and compiling them for this
+  // interpreter, are reported.
+  auto diagnostics() -> errors& { return errors_; }
+  // What the last run (or the one running) has used of its budgets so far.
+  [[nodiscard]] auto used() const -> usage;
 
 private:
-  env_ptr       globals_;
-  env_ptr       env_;
+  // Nested calls to IR functions, which run on the C++ stack whatever
+  // options::max_depth says
+  static constexpr int IR_DEPTH_MAX = 1 << 11;
+  // Bailouts from a function's machine code before it's thrown away
+  static constexpr int JIT_BAILOUTS_MAX = 16;
+  // Bytes of output held back before they're written out
+  static constexpr std::size_t PRINTED_MAX = 1 << 16;
+
+  struct call_frame {
+    function const* closure;
+    instruction*    ip;   // where to carry on once the callee returns
+    value*          base; // the first argument, just above the callee
+  };
+
+  globals       globals_;
   std::ostream& output_;
+  std::string   printed_; // not yet written to output_ (see print)
+  errors        errors_;
+  options       options_;
+  int           ir_depth_ = 0;
+  // Thrown inside machine code, waiting to be rethrown outside it
+  std::exception_ptr jit_error_;
+
+  // Locals live in their frame's slots on the value stack and temporaries are
+  // pushed above them. Only variables captured by closures ever leave the
+  // stack (see upvalue). Slots above sp_ never own anything.
+  std::unique_ptr<value[]>              stack_;
+  value*                                sp_;
+  value*                                stack_end_;
+  std::vector<call_frame>               frames_{};
+  std::vector<std::shared_ptr<upvalue>> open_upvalues_{}; // sorted by slot
+
+  // Literals are converted to values once, and identical literals share an
+  // entry (and so a string buffer). The running program has a copy.
+  std::vector<value>     constants_{};
+  std::map<literal, int> constant_ids_{};
+  program const*         program_ = nullptr;
+  // The script of the last program run, whose constants we've taken on
+  std::shared_ptr<prototype> adopted_;
+
+  // Runs until the frame on top of the stack when it was called returns.
+  void dispatch();
+  // Runs a program's script, or `entry`, against the current globals.
+  void start(program const& program);
+  void start(program const& program, function const& entry);
+  void define_builtins();
+  // Implements interpret_func, for calls made from outside the interpreter.
+  auto call(function const& fn, std::vector<value> const& args) -> value;
+  // Runs a function's IR with its registers starting at `regs`, where the
+  // arguments already are. They must fit on the stack.
+  auto execute(ir::function& fn, value* regs) -> value;
+  // Runs any operation but a return, and returns the next one.
+  auto step(ir::function& fn, value* regs, ir::operation const* pc)
+      -> ir::operation const*;
+  // Runs `fn` from operation `at` as machine code if it's hot enough, and
+  // returns where to carry on interpreting.
+  auto run_native(ir::function& fn, value* regs, int at) -> int;
+  // step for machine code (see jit::step_fn)
+  static auto jit_step(interpreter* self, ir::function* fn, value* regs,
+                       int pc) noexcept -> int;
+  // Calls anything callable from IR, with the arguments on top of the stack.
+  auto invoke(value const& callee, value* args, int argc, token const& paren)
+      -> value;
+  [[nodiscard]] auto fits(ir::function const& fn, value const* regs) const
+      -> bool;
+  // Copies the arguments to a call from outside bytecode and IR, such as a
+  // builtin, off the stack.
+  static auto arguments(value const* first, value const* last)
+      -> std::vector<value>;
+  // Calls a builtin with the arguments from `first` to `last`. Builtins
+  // report errors without a location of their own, so those point at
+  // `paren`, the call's.
+  auto call_builtin(builtin const& fn, value const* first, value const* last,
+                    token const& paren) -> value;
+  // Calls in progress, bytecode and IR
+  [[nodiscard]] auto depth() const -> std::size_t {
+    return frames_.size() + static_cast<std::size_t>(ir_depth_);
+  }
+
+  auto capture_upvalue(value* slot) -> std::shared_ptr<upvalue>;
+  // Closes every upvalue pointing at `last` or above.
+  void close_upvalues(value* last);
+  // Throws away everything on the stack, e.g. after an error.
+  void reset();
+
+  // Budgets (see options::fuel) are counted down in ticks, one per call or
+  // loop back-edge, and only checked each time a slice of them runs out.
+  // Without budgets, that never happens. With a heap budget, what runs make
+  // is charged to meter_, which is current on this thread while one runs
+  // (and set again whenever it might have moved to another thread, after a
+  // builtin or a wait), and which throws as soon as the run asks for more
+  // than it may have.
+  std::int64_t                          ticks_     = 0;
+  std::int64_t                          slice_     = 0;
+  std::uint64_t                         fuel_used_ = 0; // in slices before
+  std::chrono::steady_clock::time_point started_{};
+  std::shared_ptr<heap_meter>           meter_;
+  std::int64_t                          heap_base_ = 0;
+
+  [[nodiscard]] auto budgeted() const -> bool;
+  [[nodiscard]] auto fuel_left() const -> std::int64_t;
+  void               start_budgets();
+  void               tick() {
+    if (--ticks_ <= 0) [[unlikely]] check_budgets();
+  }
+  // Throws budget_exceeded if anything's run out, or starts another slice.
+  void check_budgets();
+  // Throws budget_exceeded if the run holds more heap than it may, for once
+  // it's finished. While it runs, the meter checks as the heap grows.
+  void check_heap() const;
+
+  // Tasks spawned by the running program and by those tasks, shared with the
+  // interpreters running them; null until something's spawned
+  std::shared_ptr<task_group> tasks_;
+
+  // Runs `callee(arg)` as a task in an interpreter of its own, starting from
+  // a copy of the globals as they are now (see isolation). Returns a channel
+  // that receives what it returns (nil if it fails).
+  //
+  // Only the globals the task could use are copied (see isolate_globals).
+  auto spawn(value const& callee, value const& arg) -> value;
+  // Runs a spawned task here, against the group's program, taking on the
+  // charges for the copies it was handed.
+  auto run_task(isolation& copies, value const& callee, value const& arg,
+                std::vector<std::optional<value>> globals) -> value;
+
+  // Calls `callee` on each item, and returns an array of the results in the
+  // same order. The items are split into a few chunks per thread, and each
+  // chunk runs as a task, so `callee` sees copies of the items and globals,
+  // as with spawn.
+  auto parallel_map(value const& callee, std::vector<value> const& items)
+      -> std::shared_ptr<array>;
+  // Folds the items with `callee` (which should be associative), starting
+  // from `init`: each chunk is folded as a task, then the chunks' results
+  // are folded here, in order.
+  auto parallel_reduce(value const& callee, std::vector<value> const& items,
+                       value init) -> value;
+  // Runs the chunks of `items` as tasks, mapping `callee` over each (into an
+  // array) or folding each with it, and returns their results in order. The
+  // first chunk (in order) to fail rethrows its error here.
+  auto fan_out(value const& callee, std::vector<value> const& items,
+               bool fold) -> std::vector<value>;
+  // Maps or folds a chunk here, against the group's program, as run_task.
+  auto run_chunk(isolation& copies, value const& callee,
+                 std::vector<value> chunk, bool fold,
+                 std::vector<std::optional<value>> globals) -> value;
+
+  // Counts a task about to start in the group, setting it up if need be.
+  void start_task();
+  // Copies the globals for a task to start from, once `isolate` has copied
+  // what it's handed. Globals that can't change are all handed over; the
+  // rest only if a function it's come across uses them, or one it comes
+  // across copying those, and so on. Any other is left undefined, unless
+  // there's a channel among them: what comes over it could use anything.
+  auto isolate_globals(isolation& isolate) const
+      -> std::vector<std::optional<value>>;
+  // An idle interpreter from the group to run a task on, or a new one, and
+  // back again once the task has finished.
+  static auto borrow(std::shared_ptr<task_group> const& group)
+      -> std::unique_ptr<interpreter>;
+  static void finish_task(std::shared_ptr<task_group> const& group,
+                          std::unique_ptr<interpreter> self);
+  // Waits for everything the program that just ran spawned.
+  void join_tasks();
+  // Whether there's no task running that could send on a channel this
+  // interpreter waits on. A task is never alone: the program that spawned it
+  // might send it something.
+  [[nodiscard]] auto alone() const -> bool;
+  // Receives from a channel, waiting until something's sent, unless nothing
+  // ever could be.
+  auto receive(channel& ch) -> value;
+  // Prints a value on a line of its own, or reports an error, from whichever
+  // thread. What's printed is formatted straight into printed_, which is
+  // written out once it's big, when the run finishes, before an error is
+  // reported and when the script calls flush. While there are tasks, which
+  // print from other threads, it's written out line by line instead, so
+  // lines come out in the order they were printed. With `stream`, flush
+  // flushes the output stream too.
+  void print(value const& value);
+  void flush(bool stream = false);
+  void report(runtime_error const& err);
 
-  std::unordered_map<std::string, int> locals{};
+  // Async calls that can carry on, with what their await gives them, in the
+  // order they became ready
+  std::deque<std::pair<std::shared_ptr<coroutine>, value>> ready_;
+  // Where channels deliver to awaits; null until something awaits one
+  std::shared_ptr<inbox> inbox_;
 
-  // TODO: This feels hacky
-  auto interpret(callable callable, env_ptr const& closure) -> value;
+  // Calls a generator or async function, whose arguments have been checked:
+  // makes the coroutine to run it in and, if it's async, starts it.
+  auto activate(std::shared_ptr<function> const& fn, value const* args,
+                int argc) -> value;
+  // The coroutine's body. Each time it's resumed, it moves the call's frame
+  // back onto the stack and runs it, until it suspends again and moves it
+  // back off.
+  auto frame(std::shared_ptr<function> fn, std::vector<value> slots)
+      -> resumable;
+  // Carries a coroutine on until it next suspends or returns, and returns
+  // the value it did so with.
+  auto resume(coroutine& co, value in) -> value;
+  // A generator's next value, or nothing once it's finished.
+  auto advance(coroutine& gen) -> std::optional<value>;
+  // Carries an async call on, then sets it up to wait for what it awaits or
+  // hands what it returned to the calls waiting for it.
+  void step(std::shared_ptr<coroutine> const& co, value in);
+  // Has `co` carry on with what `ch` receives next.
+  void wait_for(channel& ch, std::shared_ptr<coroutine> const& co);
+  // Awaits outside an async function: runs other async calls until `awaited`
+  // (an async call or a channel) is ready, and returns what it gave.
+  auto block_on(value const& awaited) -> value;
+  // Runs async calls until `until` has returned, or until none are left to
+  // run if it's null.
+  void run_async(coroutine const* until);
 };
 
 } // namespace lox
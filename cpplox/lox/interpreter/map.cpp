@@ -0,0 +1,181 @@
+#include <lox/interpreter/map.hpp>
+#include <lox/profile/heap.hpp>
+
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <string_view>
+#include <utility>
+
+namespace lox {
+
+namespace {
+
+std::size_t const GROUP = 8; // control bytes probed at once
+
+// The final mix from MurmurHash3, so that every bit of the input affects
+// the low 7 bits kept in the control bytes
+auto mix(std::uint64_t h) -> std::size_t {
+  h ^= h >> 33U;
+  h *= 0xff51afd7ed558ccdU;
+  h ^= h >> 33U;
+  h *= 0xc4ceb9fe1a85ec53U;
+  h ^= h >> 33U;
+  return static_cast<std::size_t>(h);
+}
+
+// A group of control bytes, as one word: the byte for the group's first
+// slot is the lowest. Matches come back as a mask with the top bit of each
+// matching byte set.
+struct group {
+  static constexpr std::uint64_t LSBS = 0x0101010101010101U;
+  static constexpr std::uint64_t MSBS = 0x8080808080808080U;
+
+  explicit group(std::int8_t const* ctrl) {
+    std::memcpy(&word, ctrl, sizeof(word));
+    if constexpr (std::endian::native == std::endian::big) {
+      word = __builtin_bswap64(word);
+    }
+  }
+
+  // Full slots whose hash bits are `h2`. The byte after a real match can
+  // match falsely too, which comparing keys weeds out.
+  [[nodiscard]] auto match(std::uint64_t h2) const -> std::uint64_t {
+    auto const x = word ^ (LSBS * h2);
+    return (x - LSBS) & ~x & MSBS;
+  }
+  // Only EMPTY has the top bit set and bit 1 clear
+  [[nodiscard]] auto match_empty() const -> std::uint64_t {
+    return word & (~word << 6U) & MSBS;
+  }
+  // EMPTY and DELETED both have the top bit set and bit 0 clear
+  [[nodiscard]] auto match_empty_or_deleted() const -> std::uint64_t {
+    return word & (~word << 7U) & MSBS;
+  }
+
+  std::uint64_t word = 0;
+};
+
+// The slot within its group of a mask's first match
+auto first(std::uint64_t mask) -> std::size_t {
+  return static_cast<std::size_t>(std::countr_zero(mask)) / 8;
+}
+
+// The hash bits kept in the control bytes, and the rest, which picks the
+// group probing starts from
+auto h2(std::size_t hash) -> std::uint64_t { return hash & 0x7FU; }
+auto h1(std::size_t hash) -> std::size_t { return hash >> 7U; }
+
+} // namespace
+
+auto hash_key(value const& key) -> std::optional<std::size_t> {
+  if (std::holds_alternative<std::monostate>(key)) return mix(0);
+  if (auto const* b = std::get_if<bool>(&key)) return mix(*b ? 2 : 1);
+  if (auto const* number = std::get_if<double>(&key)) {
+    if (std::isnan(*number)) return std::nullopt;
+    // -0 == 0, so they have to hash the same
+    double const d = *number == 0 ? 0.0 : *number;
+    return mix(std::bit_cast<std::uint64_t>(d));
+  }
+  if (auto const* str = std::get_if<string>(&key)) {
+    return mix(std::hash<std::string_view>{}(str->view()));
+  }
+  return std::nullopt;
+}
+
+auto map::locate(value const& key, std::size_t hash) const -> std::ptrdiff_t {
+  if (ctrl_.empty()) return -1;
+
+  // Probes groups triangularly, which visits every one of a power of two
+  auto const groups = ctrl_.size() / GROUP - 1;
+  auto       g      = h1(hash) & groups;
+  for (std::size_t step = 1;; ++step) {
+    group const grp{&ctrl_[g * GROUP]};
+    for (auto mask = grp.match(h2(hash)); mask != 0; mask &= mask - 1) {
+      auto const i = g * GROUP + first(mask);
+      if (slots_[i].hash == hash and slots_[i].key == key) {
+        return static_cast<std::ptrdiff_t>(i);
+      }
+    }
+    // It would have gone in the first empty slot
+    if (grp.match_empty() != 0) return -1;
+    g = (g + step) & groups;
+  }
+}
+
+auto map::vacancy(std::size_t hash) const -> std::size_t {
+  auto const groups = ctrl_.size() / GROUP - 1;
+  auto       g      = h1(hash) & groups;
+  for (std::size_t step = 1;; ++step) {
+    group const grp{&ctrl_[g * GROUP]};
+    if (auto const mask = grp.match_empty_or_deleted(); mask != 0) {
+      return g * GROUP + first(mask);
+    }
+    g = (g + step) & groups;
+  }
+}
+
+auto map::find(value const& key, std::size_t hash) const -> value const* {
+  auto const i = locate(key, hash);
+  return i < 0 ? nullptr : &slots_[static_cast<std::size_t>(i)].value;
+}
+
+auto map::insert(value const& key, std::size_t hash) -> value& {
+  if (auto const i = locate(key, hash); i >= 0) {
+    return slots_[static_cast<std::size_t>(i)].value;
+  }
+
+  if (ctrl_.empty()) rehash(GROUP);
+  auto i = vacancy(hash);
+  if (growth_left_ == 0 and ctrl_[i] == EMPTY) {
+    // Grows once it's 7/8 full, counting deleted slots, which rehashing
+    // drops: if they're most of it, it only needs tidying up
+    rehash(size_ > ctrl_.size() * 7 / 16 ? ctrl_.size() * 2 : ctrl_.size());
+    i = vacancy(hash);
+  }
+
+  if (ctrl_[i] == EMPTY) --growth_left_;
+  ctrl_[i]  = static_cast<std::int8_t>(h2(hash));
+  slots_[i] = {key, value{}, hash};
+  ++size_;
+  return slots_[i].value;
+}
+
+auto map::erase(value const& key, std::size_t hash) -> bool {
+  auto const found = locate(key, hash);
+  if (found < 0) return false;
+
+  auto const i = static_cast<std::size_t>(found);
+  slots_[i]    = {};
+  --size_;
+
+  // Nothing else empties a slot, so if the group still has an empty one, it
+  // always has had and no probe has ever gone past it: this slot can be
+  // empty again. Otherwise it's marked deleted, for probes to carry on past.
+  if (group{&ctrl_[i - i % GROUP]}.match_empty() != 0) {
+    ctrl_[i] = EMPTY;
+    ++growth_left_;
+  } else {
+    ctrl_[i] = DELETED;
+  }
+  return true;
+}
+
+void map::rehash(std::size_t capacity) {
+  profile::scope const charged{profile::kind::map};
+  charged_.resize(capacity * (sizeof(slot) + sizeof(std::int8_t)));
+  auto old_ctrl  = std::exchange(ctrl_, std::vector<std::int8_t>(capacity,
+                                                                 EMPTY));
+  auto old_slots = std::exchange(slots_, std::vector<slot>(capacity));
+
+  for (std::size_t i = 0; i < old_ctrl.size(); ++i) {
+    if (not full(old_ctrl[i])) continue;
+    auto const j = vacancy(old_slots[i].hash);
+    ctrl_[j]     = old_ctrl[i];
+    slots_[j]    = std::move(old_slots[i]);
+  }
+  growth_left_ = capacity * 7 / 8 - size_;
+}
+
+} // namespace lox
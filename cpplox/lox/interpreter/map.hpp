@@ -0,0 +1,80 @@
+#pragma once
+
+#include <lox/interpreter/meter.hpp>
+#include <lox/interpreter/value.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace lox {
+
+// Hashes a map key: nil, a boolean, a number or a string. Anything else (or
+// NaN, which isn't equal to itself) can't be a key.
+auto hash_key(value const& key) -> std::optional<std::size_t>;
+
+// map is Lox's hash map, an open-addressing table in the style of Abseil's
+// Swiss tables:
+//
+// - Entries live in one flat array of slots, so inserting never allocates a
+//   node and probing walks contiguous memory.
+// - Alongside the slots is an array of control bytes, one per slot, saying
+//   whether it's empty, deleted or full. A full slot's byte holds 7 bits of
+//   its key's hash, so a probe compares a group of 8 bytes at once (as one
+//   64-bit word) and only looks at the keys whose bits match.
+// - Each slot keeps its key's full hash, so strings are hashed once, when
+//   they're inserted, and never again when the table grows.
+//
+// Lookups take the key's hash (see hash_key) as well as the key.
+class map {
+public:
+  // Returns the value for `key`, or null if there isn't one.
+  [[nodiscard]] auto find(value const& key, std::size_t hash) const
+      -> value const*;
+  // Returns the value for `key`, adding it as nil first if it isn't there.
+  auto insert(value const& key, std::size_t hash) -> value&;
+  // Removes `key`, and returns whether it was there.
+  auto erase(value const& key, std::size_t hash) -> bool;
+
+  [[nodiscard]] auto size() const -> std::size_t { return size_; }
+
+  // Charges its slots to the current meter instead (see heap_charge::adopt).
+  void adopt() { charged_.adopt(); }
+
+  // Calls `f` with each key and value, in no particular order.
+  template <typename F>
+  void each(F&& f) const {
+    for (std::size_t i = 0; i < ctrl_.size(); ++i) {
+      if (full(ctrl_[i])) f(slots_[i].key, slots_[i].value);
+    }
+  }
+
+private:
+  struct slot {
+    lox::value  key;
+    lox::value  value;
+    std::size_t hash = 0;
+  };
+
+  // Control bytes. Full slots hold the low 7 bits of their hash.
+  static constexpr std::int8_t EMPTY   = -128; // 0b1000'0000
+  static constexpr std::int8_t DELETED = -2;   // 0b1111'1110
+
+  static auto full(std::int8_t ctrl) -> bool { return ctrl >= 0; }
+
+  // Returns the slot holding `key`, or -1.
+  [[nodiscard]] auto locate(value const& key, std::size_t hash) const
+      -> std::ptrdiff_t;
+  // Returns an empty or deleted slot for a key with `hash`.
+  [[nodiscard]] auto vacancy(std::size_t hash) const -> std::size_t;
+  void               rehash(std::size_t capacity);
+
+  std::vector<std::int8_t> ctrl_; // a whole number of groups
+  std::vector<slot>        slots_;
+  std::size_t              size_        = 0;
+  std::size_t              growth_left_ = 0; // empty slots it can fill
+  heap_charge              charged_;         // see heap_meter
+};
+
+} // namespace lox
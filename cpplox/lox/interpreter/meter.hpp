@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <utility>
+
+namespace lox {
+
+// A heap meter counts the bytes held by what one interpreter's runs have
+// made, for its heap budget (see options::heap_limit). Only what a script can
+// make any amount of is counted: the characters of strings, the elements of
+// arrays and float arrays, and the slots of maps.
+//
+// Each is charged (see heap_charge) to the meter of the interpreter running
+// on the thread that made it, and pays the same meter back when it's freed,
+// on whichever thread. So what other interpreters make, on this thread or
+// any other, never counts, and nor does anything the host allocates. The
+// exception is what's copied for a task to start with, which the task takes
+// on (see heap_charge::adopt).
+//
+// Charges are checked against the limit as they grow, while the meter is
+// current, so a run goes over its budget as soon as it asks for too much
+// instead of the next time it checks (see interpreter::check_budgets).
+struct heap_meter {
+  static constexpr auto NO_LIMIT = std::numeric_limits<std::int64_t>::max();
+
+  std::atomic<std::int64_t> bytes{0};
+  // What bytes may grow to, and what's called with what it would have grown
+  // to instead, which throws budget_exceeded
+  std::atomic<std::int64_t>         limit{NO_LIMIT};
+  std::function<void(std::int64_t)> exceeded;
+};
+
+// The meter of the interpreter running on this thread, if it has a heap
+// budget. Interpreters set it whenever they start or carry on running here.
+inline thread_local std::shared_ptr<heap_meter> current_meter;
+
+// heap_charge is what something holding heap owes the meter that was current
+// when it was made, kept up to date by whatever changes how much it holds.
+// Without a meter it only keeps count, in case one adopts it.
+class heap_charge {
+public:
+  heap_charge() : meter_(current_meter) {}
+  explicit heap_charge(std::size_t bytes) : heap_charge() { resize(bytes); }
+  // A copy is charged for the same again, to the current meter
+  heap_charge(heap_charge const& other) : heap_charge() {
+    resize(other.bytes_);
+  }
+  auto operator=(heap_charge const& other) -> heap_charge& {
+    resize(other.bytes_);
+    return *this;
+  }
+  ~heap_charge() { resize(0); }
+
+  // Moves the charge to the current meter, paying back the one it was owed
+  // to, for something handed over to another interpreter (see isolation).
+  // Throws budget_exceeded, as resize does, with nothing charged, if it
+  // takes the current meter over its limit.
+  void adopt() {
+    if (meter_ == current_meter) return;
+
+    auto const bytes = std::exchange(bytes_, 0);
+    if (meter_ != nullptr) {
+      meter_->bytes.fetch_sub(static_cast<std::int64_t>(bytes),
+                              std::memory_order_relaxed);
+    }
+    meter_ = current_meter;
+    resize(bytes);
+  }
+
+  // Throws budget_exceeded, charging nothing more, if growing takes the meter
+  // over its limit. Charge before allocating, so that it's never made.
+  void resize(std::size_t bytes) {
+    if (bytes == bytes_) return;
+    if (meter_ == nullptr) {
+      bytes_ = bytes;
+      return;
+    }
+
+    auto const delta =
+        static_cast<std::int64_t>(bytes) - static_cast<std::int64_t>(bytes_);
+    auto const total =
+        meter_->bytes.fetch_add(delta, std::memory_order_relaxed) + delta;
+    if (delta > 0 and total > meter_->limit.load(std::memory_order_relaxed) and
+        meter_ == current_meter) [[unlikely]] {
+      meter_->bytes.fetch_sub(delta, std::memory_order_relaxed);
+      meter_->exceeded(total);
+    }
+    bytes_ = bytes;
+  }
+
+private:
+  std::shared_ptr<heap_meter> meter_;
+  std::size_t                 bytes_ = 0;
+};
+
+// metering makes a meter current on this thread for as long as it lives.
+class metering {
+public:
+  explicit metering(std::shared_ptr<heap_meter> meter)
+      : outer_(std::exchange(current_meter, std::move(meter))) {}
+  ~metering() { current_meter = std::move(outer_); }
+
+  metering(metering const&)                    = delete;
+  auto operator=(metering const&) -> metering& = delete;
+
+private:
+  std::shared_ptr<heap_meter> outer_;
+};
+
+} // namespace lox
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <lox/interpreter/bytecode.hpp>
+#include <lox/interpreter/value.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace lox {
+
+// A compiled script, for running any number of times, in any interpreter
+// (see interpreter::run). Running it doesn't change it, apart from quickening
+// its instructions, so one program can be shared by many runs.
+struct program {
+  std::shared_ptr<prototype> script;
+  // The constant pool and global slots it was compiled against
+  std::vector<value>       constants;
+  std::vector<std::string> globals; // names, by slot
+};
+
+} // namespace lox
@@ -0,0 +1,650 @@
+#include <lox/interpreter/map.hpp>
+#include <lox/interpreter/snapshot.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace lox {
+
+namespace {
+
+// The first bytes of every snapshot, then a version, which changes whenever
+// the format (or the bytecode) does
+constexpr std::string_view MAGIC   = "LOXSNAP";
+constexpr std::uint64_t    VERSION = 1;
+
+// What a value (or a literal) is, in the byte before it
+enum class tag : std::uint8_t {
+  nil,
+  false_,
+  true_,
+  number,
+  string,
+  function,
+  builtin,
+  array,
+  map,
+  floats,
+};
+
+// Numbers and counts are written as unsigned LEB128, and signed ones
+// zigzagged first, so that small ones take a byte. Doubles are written as
+// their 8 bytes, little end first. Text is written once, the first time it
+// comes up, and by number after that.
+//
+// Objects that can be shared (prototypes, functions, captured variables,
+// arrays, maps and float arrays) are numbered in the order they're first
+// written. Each one starts with 0 the first time, followed by what's in it,
+// and is only its number after that.
+class writer {
+public:
+  auto operator()(snapshot const& snap) -> std::string {
+    for (char const c : MAGIC) { byte(static_cast<std::uint8_t>(c)); }
+    unsigned_(VERSION);
+
+    auto const& program = *snap.program;
+    unsigned_(program.globals.size());
+    for (auto const& name : program.globals) { text(name); }
+    unsigned_(program.constants.size());
+    for (auto const& constant : program.constants) { write(constant); }
+    write(program.script);
+
+    unsigned_(snap.globals.size());
+    for (auto const& global : snap.globals) {
+      byte(global ? 1 : 0);
+      if (global) write(*global);
+    }
+    return std::move(out_);
+  }
+
+private:
+  std::string                                    out_;
+  std::unordered_map<std::string, std::uint64_t> texts_;
+  std::unordered_map<void const*, std::uint64_t> objects_;
+
+  void byte(std::uint8_t b) { out_.push_back(static_cast<char>(b)); }
+
+  void unsigned_(std::uint64_t n) {
+    for (; n >= 0x80; n >>= 7U) { byte(static_cast<std::uint8_t>(n | 0x80)); }
+    byte(static_cast<std::uint8_t>(n));
+  }
+  void signed_(std::int64_t n) {
+    unsigned_((static_cast<std::uint64_t>(n) << 1U) ^
+              static_cast<std::uint64_t>(n >> 63));
+  }
+  void number(double d) {
+    auto bits = std::bit_cast<std::uint64_t>(d);
+    for (int i = 0; i < 8; ++i, bits >>= 8U) {
+      byte(static_cast<std::uint8_t>(bits));
+    }
+  }
+
+  void text(std::string_view str) {
+    auto const [it, inserted] = texts_.try_emplace(std::string{str},
+                                                   texts_.size());
+    unsigned_(it->second);
+    if (inserted) {
+      unsigned_(str.size());
+      out_.append(str);
+    }
+  }
+
+  // Writes the object's number and returns false if it's been written
+  // before, or numbers it and returns true for its contents to follow.
+  auto first_time(void const* object) -> bool {
+    auto const [it, inserted] = objects_.try_emplace(object,
+                                                     objects_.size() + 1);
+    unsigned_(inserted ? 0 : it->second);
+    return inserted;
+  }
+
+  void write(literal const& literal) {
+    if (auto const* b = std::get_if<bool>(&literal)) {
+      byte(static_cast<std::uint8_t>(*b ? tag::true_ : tag::false_));
+    } else if (auto const* d = std::get_if<double>(&literal)) {
+      byte(static_cast<std::uint8_t>(tag::number));
+      number(*d);
+    } else if (auto const* str = std::get_if<std::string>(&literal)) {
+      byte(static_cast<std::uint8_t>(tag::string));
+      text(*str);
+    } else {
+      byte(static_cast<std::uint8_t>(tag::nil));
+    }
+  }
+
+  void write(std::shared_ptr<prototype> const& proto) {
+    if (not first_time(proto.get())) return;
+
+    text(proto->name);
+    unsigned_(static_cast<std::uint64_t>(proto->arity));
+    byte(static_cast<std::uint8_t>(proto->kind));
+    unsigned_(static_cast<std::uint64_t>(proto->max_stack));
+
+    unsigned_(proto->captures.size());
+    for (auto const& capture : proto->captures) {
+      byte(capture.local ? 1 : 0);
+      unsigned_(static_cast<std::uint64_t>(capture.index));
+    }
+    unsigned_(proto->code.size());
+    for (auto const& instr : proto->code) {
+      byte(static_cast<std::uint8_t>(instr.op));
+      signed_(instr.arg);
+    }
+    unsigned_(proto->functions.size());
+    for (auto const& fn : proto->functions) { write(fn); }
+
+    unsigned_(proto->origins.size());
+    for (auto const origin : proto->origins) { signed_(origin); }
+    unsigned_(proto->tokens.size());
+    for (auto const& token : proto->tokens) {
+      unsigned_(static_cast<std::uint64_t>(token.type));
+      text(token.lexeme);
+      signed_(token.line);
+      write(token.literal);
+    }
+  }
+
+  void write(value const& value) {
+    auto const kind = [this](tag t) { byte(static_cast<std::uint8_t>(t)); };
+
+    if (std::holds_alternative<std::monostate>(value)) {
+      kind(tag::nil);
+    } else if (auto const* b = std::get_if<bool>(&value)) {
+      kind(*b ? tag::true_ : tag::false_);
+    } else if (auto const* d = std::get_if<double>(&value)) {
+      kind(tag::number);
+      number(*d);
+    } else if (auto const* str = std::get_if<string>(&value)) {
+      kind(tag::string);
+      text(str->view());
+    } else if (auto const* fn =
+                   std::get_if<std::shared_ptr<function>>(&value)) {
+      kind(tag::function);
+      if (not first_time(fn->get())) return;
+
+      write((*fn)->proto);
+      unsigned_((*fn)->upvalues.size());
+      for (auto const& captured : (*fn)->upvalues) {
+        if (not first_time(captured.get())) continue;
+        if (captured->location != &captured->closed) {
+          throw std::runtime_error(
+              "can't snapshot a function whose variables are still in scope");
+        }
+        write(captured->closed);
+      }
+    } else if (auto const* b = std::get_if<std::shared_ptr<builtin>>(&value)) {
+      kind(tag::builtin);
+      text((*b)->name);
+    } else if (auto const* arr = std::get_if<std::shared_ptr<array>>(&value)) {
+      kind(tag::array);
+      if (not first_time(arr->get())) return;
+
+      unsigned_((*arr)->elements.size());
+      for (auto const& element : (*arr)->elements) { write(element); }
+    } else if (auto const* m = std::get_if<std::shared_ptr<map>>(&value)) {
+      kind(tag::map);
+      if (not first_time(m->get())) return;
+
+      unsigned_((*m)->size());
+      (*m)->each([this](lox::value const& key, lox::value const& v) {
+        write(key);
+        write(v);
+      });
+    } else if (auto const* floats =
+                   std::get_if<std::shared_ptr<float_array>>(&value)) {
+      kind(tag::floats);
+      if (not first_time(floats->get())) return;
+
+      unsigned_((*floats)->elements.size());
+      for (auto const d : (*floats)->elements) { number(d); }
+    } else {
+      throw std::runtime_error(fmt::format("can't snapshot {}", value));
+    }
+  }
+};
+
+class reader {
+public:
+  reader(std::span<char const>                            bytes,
+         std::function<value(std::string const&)> const& builtin)
+      : bytes_(bytes), builtin_(builtin) {}
+
+  auto operator()() -> snapshot {
+    for (char const c : MAGIC) {
+      if (pos_ == bytes_.size() or bytes_[pos_++] != c) {
+        throw std::runtime_error("not a snapshot");
+      }
+    }
+    if (unsigned_() != VERSION) {
+      throw std::runtime_error("snapshot is from another version of lox");
+    }
+
+    snapshot snap;
+    snap.program = std::make_shared<program>();
+    auto& program = *snap.program;
+
+    program.globals.resize(count());
+    for (auto& name : program.globals) { name = text(); }
+    globals_ = program.globals.size();
+    program.constants.resize(count());
+    constants_ = program.constants.size();
+    for (auto& constant : program.constants) { constant = read_value(); }
+    program.script = read_prototype();
+    if (not program.script->captures.empty()) corrupt();
+
+    snap.globals.resize(count());
+    if (snap.globals.size() != program.globals.size()) corrupt();
+    for (auto& global : snap.globals) {
+      if (byte() != 0) global = read_value();
+    }
+
+    if (pos_ != bytes_.size()) corrupt();
+    return snap;
+  }
+
+private:
+  struct object {
+    std::type_info const* type;
+    std::shared_ptr<void> ptr;
+  };
+
+  std::span<char const>                            bytes_;
+  std::function<value(std::string const&)> const& builtin_;
+  std::size_t                                      pos_ = 0;
+  // Views into bytes_, by number
+  std::vector<std::string_view> texts_;
+  std::vector<object>           objects_;
+  // What the bytecode's operands index into (see check)
+  std::size_t globals_   = 0;
+  std::size_t constants_ = 0;
+
+  [[noreturn]] static void corrupt() {
+    throw std::runtime_error("snapshot is corrupt or cut short");
+  }
+
+  auto byte() -> std::uint8_t {
+    if (pos_ == bytes_.size()) corrupt();
+    return static_cast<std::uint8_t>(bytes_[pos_++]);
+  }
+
+  auto unsigned_() -> std::uint64_t {
+    std::uint64_t n = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      auto const b = byte();
+      n |= static_cast<std::uint64_t>(b & 0x7FU) << shift;
+      if ((b & 0x80U) == 0) return n;
+    }
+    corrupt();
+  }
+  auto signed_() -> std::int64_t {
+    auto const n = unsigned_();
+    return static_cast<std::int64_t>(n >> 1U) ^
+           -static_cast<std::int64_t>(n & 1U);
+  }
+  // A count of things to come, each of which takes at least a byte
+  auto count() -> std::size_t {
+    auto const n = unsigned_();
+    if (n > bytes_.size() - pos_) corrupt();
+    return static_cast<std::size_t>(n);
+  }
+  auto number() -> double {
+    if (bytes_.size() - pos_ < 8) corrupt();
+    std::uint64_t bits = 0;
+    for (unsigned i = 0; i < 8; ++i) {
+      bits |= static_cast<std::uint64_t>(byte()) << (8 * i);
+    }
+    return std::bit_cast<double>(bits);
+  }
+
+  auto text() -> std::string_view {
+    auto const id = unsigned_();
+    if (id < texts_.size()) return texts_[id];
+    if (id > texts_.size()) corrupt();
+
+    auto const size = count();
+    texts_.emplace_back(bytes_.data() + pos_, size);
+    pos_ += size;
+    return texts_.back();
+  }
+
+  // Returns an object read before, or null if this is its first time (and
+  // the caller reads it and remembers it).
+  template <typename T>
+  auto seen() -> std::shared_ptr<T> {
+    auto const id = unsigned_();
+    if (id == 0) return nullptr;
+    if (id > objects_.size() or *objects_[id - 1].type != typeid(T)) {
+      corrupt();
+    }
+    return std::static_pointer_cast<T>(objects_[id - 1].ptr);
+  }
+  // Remembered before what's in it is read, which might lead back to it
+  template <typename T>
+  auto remember(std::shared_ptr<T> ptr) -> std::shared_ptr<T> {
+    objects_.push_back({&typeid(T), ptr});
+    return ptr;
+  }
+
+  auto read_literal() -> literal {
+    switch (static_cast<tag>(byte())) {
+    case tag::nil: return {};
+    case tag::false_: return false;
+    case tag::true_: return true;
+    case tag::number: return number();
+    case tag::string: return std::string{text()};
+    default: corrupt();
+    }
+  }
+
+  auto read_prototype() -> std::shared_ptr<prototype> {
+    if (auto proto = seen<prototype>()) return proto;
+    auto const proto = remember(std::make_shared<prototype>());
+
+    proto->name      = text();
+    proto->arity     = static_cast<int>(unsigned_());
+    proto->kind      = static_cast<function_kind>(byte());
+    proto->max_stack = static_cast<int>(unsigned_());
+
+    proto->captures.resize(count());
+    for (auto& capture : proto->captures) {
+      capture.local = byte() != 0;
+      capture.index = static_cast<int>(unsigned_());
+    }
+    proto->code.resize(count());
+    for (auto& instr : proto->code) {
+      auto const op = byte();
+      if (op >= static_cast<std::uint8_t>(opcode::NUM_OPCODES)) corrupt();
+      instr.op  = static_cast<opcode>(op);
+      instr.arg = static_cast<std::int32_t>(signed_());
+    }
+    proto->functions.resize(count());
+    for (auto& fn : proto->functions) { fn = read_prototype(); }
+
+    proto->origins.resize(count());
+    for (auto& origin : proto->origins) {
+      origin = static_cast<int>(signed_());
+    }
+    proto->tokens.resize(count());
+    for (auto& token : proto->tokens) {
+      auto const type = unsigned_();
+      if (type >= static_cast<std::uint64_t>(token_type::NUM_TYPES)) corrupt();
+      token.type    = static_cast<token_type>(type);
+      token.lexeme  = text();
+      token.line    = static_cast<int>(signed_());
+      token.literal = read_literal();
+    }
+
+    check(*proto);
+    return proto;
+  }
+
+  // Checks everything a prototype refers to by number against what it
+  // indexes, as the VM doesn't: it trusts the compiler to have got them
+  // right, and a snapshot mustn't be able to make it read or write out of
+  // bounds.
+  void check(prototype const& proto) const {
+    auto const within = [](std::int64_t i, std::size_t size) {
+      return i >= 0 and static_cast<std::uint64_t>(i) < size;
+    };
+    auto const slots = static_cast<std::size_t>(proto.max_stack);
+
+    if (proto.kind > function_kind::async or proto.arity < 0 or
+        proto.max_stack < proto.arity) {
+      corrupt();
+    }
+
+    // The captures of the functions it makes are its own locals and upvalues
+    for (auto const& fn : proto.functions) {
+      for (auto const& capture : fn->captures) {
+        if (not within(capture.index,
+                       capture.local ? slots : proto.captures.size())) {
+          corrupt();
+        }
+      }
+    }
+
+    // It mustn't run off the end either
+    if (proto.code.empty() or proto.code.back().op != opcode::return_) {
+      corrupt();
+    }
+    for (auto const& instr : proto.code) {
+      auto const ok = [&] {
+        switch (instr.op) {
+        case opcode::constant: return within(instr.arg, constants_);
+        case opcode::unwind:
+        case opcode::array:
+        case opcode::call:
+        case opcode::tail_call: return within(instr.arg, slots + 1);
+        case opcode::get_local:
+        case opcode::set_local: return within(instr.arg, slots);
+        case opcode::get_upvalue:
+        case opcode::set_upvalue:
+          return within(instr.arg, proto.captures.size());
+        case opcode::get_global:
+        case opcode::set_global:
+        case opcode::define_global: return within(instr.arg, globals_);
+        case opcode::jump:
+        case opcode::jump_if_false:
+        case opcode::jump_if_true:
+          return within(instr.arg, proto.code.size());
+        case opcode::closure: return within(instr.arg, proto.functions.size());
+        default: return true;
+        }
+      }();
+      if (not ok) corrupt();
+    }
+
+    check_stack(proto);
+
+    if (proto.origins.size() != proto.code.size()) corrupt();
+    for (auto const origin : proto.origins) {
+      if (origin != -1 and not within(origin, proto.tokens.size())) corrupt();
+    }
+  }
+
+  // Follows every path through the code (whose operands have been checked),
+  // working out how many values are on the frame before each instruction.
+  // The VM pushes and pops without checking, trusting the frame never to
+  // hold more than max_stack (which is checked on each call) and every pop
+  // to have something to pop, so a path that breaks either is corrupt. So is
+  // one that reaches an instruction with a different number of values than
+  // another path did, as the compiler never emits that.
+  static void check_stack(prototype const& proto) {
+    std::vector<int>         heights(proto.code.size(), -1);
+    std::vector<std::size_t> todo;
+
+    auto const reach = [&](std::size_t at, int height) {
+      if (heights[at] == -1) {
+        heights[at] = height;
+        todo.push_back(at);
+      } else if (heights[at] != height) {
+        corrupt();
+      }
+    };
+    reach(0, proto.arity);
+
+    while (not todo.empty()) {
+      auto const  at     = todo.back();
+      auto const& instr  = proto.code[at];
+      auto        height = heights[at];
+      todo.pop_back();
+
+      // What it pops, then what it pushes
+      auto const [pops, pushes] = [&]() -> std::pair<int, int> {
+        switch (instr.op) {
+        case opcode::constant:
+        case opcode::nil:
+        case opcode::true_:
+        case opcode::false_:
+        case opcode::get_local:
+        case opcode::get_upvalue:
+        case opcode::get_global:
+        case opcode::closure: return {0, 1};
+        case opcode::pop:
+        case opcode::define_global:
+        case opcode::return_:
+        case opcode::print:
+        case opcode::echo: return {1, 0};
+        case opcode::unwind: return {std::max(height - instr.arg, 0), 0};
+        case opcode::set_local:
+        case opcode::set_upvalue:
+        case opcode::set_global:
+        case opcode::negate:
+        case opcode::not_:
+        case opcode::negate_num:
+        case opcode::jump_if_false:
+        case opcode::jump_if_true:
+        case opcode::yield:
+        case opcode::await: return {1, 1};
+        case opcode::array: return {instr.arg, 1};
+        case opcode::get_index: return {2, 1};
+        case opcode::set_index: return {3, 1};
+        case opcode::call:
+        case opcode::tail_call: return {instr.arg + 1, 1};
+        case opcode::jump: return {0, 0};
+        default: return {2, 1}; // the binary operators
+        }
+      }();
+      if (height < pops) corrupt();
+      height += pushes - pops;
+      if (height > proto.max_stack) corrupt();
+
+      auto const target = static_cast<std::size_t>(instr.arg);
+      switch (instr.op) {
+      case opcode::return_: break;
+      case opcode::jump: reach(target, height); break;
+      case opcode::jump_if_false:
+      case opcode::jump_if_true:
+        reach(target, height);
+        reach(at + 1, height);
+        break;
+      // The code ends in a return, so there's always a next instruction
+      default: reach(at + 1, height);
+      }
+    }
+  }
+
+  auto read_value() -> value {
+    switch (static_cast<tag>(byte())) {
+    case tag::nil: return {};
+    case tag::false_: return false;
+    case tag::true_: return true;
+    case tag::number: return number();
+    case tag::string: return string{text()};
+    case tag::builtin: return builtin_(std::string{text()});
+
+    case tag::function: {
+      if (auto fn = seen<function>()) return fn;
+      auto const fn = remember(std::make_shared<function>());
+
+      fn->proto = read_prototype();
+      fn->upvalues.resize(count());
+      for (auto& captured : fn->upvalues) {
+        captured = seen<upvalue>();
+        if (captured != nullptr) continue;
+
+        captured           = remember(std::make_shared<upvalue>(nullptr));
+        captured->location = &captured->closed;
+        captured->closed   = read_value();
+      }
+      if (fn->upvalues.size() != fn->proto->captures.size()) corrupt();
+      return fn;
+    }
+
+    case tag::array: {
+      if (auto arr = seen<array>()) return arr;
+      auto const arr = remember(std::make_shared<array>());
+
+      arr->elements.resize(count());
+      for (auto& element : arr->elements) { element = read_value(); }
+      return arr;
+    }
+
+    case tag::map: {
+      if (auto m = seen<map>()) return m;
+      auto const m = remember(std::make_shared<map>());
+
+      for (auto n = count(); n > 0; --n) {
+        auto       key  = read_value();
+        auto const hash = hash_key(key);
+        if (not hash) corrupt();
+        m->insert(key, *hash) = read_value();
+      }
+      return m;
+    }
+
+    case tag::floats: {
+      if (auto floats = seen<float_array>()) return floats;
+      auto const floats = remember(std::make_shared<float_array>());
+
+      floats->elements.resize(count());
+      for (auto& d : floats->elements) { d = number(); }
+      return floats;
+    }
+    }
+    corrupt();
+  }
+};
+
+} // namespace
+
+void write_snapshot(std::ostream& out, snapshot const& snap) {
+  auto const bytes = writer{}(snap);
+  out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+auto read_snapshot(std::span<char const>                            bytes,
+                   std::function<value(std::string const&)> const& builtin)
+    -> snapshot {
+  return reader{bytes, builtin}();
+}
+
+mapped_file::mapped_file(std::string const& path) {
+  auto const fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) throw std::system_error(errno, std::generic_category(), path);
+
+  struct stat info {};
+  if (fstat(fd, &info) != 0) {
+    auto const error = errno;
+    close(fd);
+    throw std::system_error(error, std::generic_category(), path);
+  }
+
+  // Mapping nothing fails, and there's nothing to map
+  size_ = static_cast<std::size_t>(info.st_size);
+  if (size_ > 0) {
+    void* const memory = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    auto const  error  = errno;
+    close(fd);
+    if (memory == MAP_FAILED) {
+      throw std::system_error(error, std::generic_category(), path);
+    }
+    data_ = static_cast<char const*>(memory);
+  } else {
+    close(fd);
+  }
+}
+
+mapped_file::~mapped_file() {
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), size_); // NOLINT
+  }
+}
+
+} // namespace lox
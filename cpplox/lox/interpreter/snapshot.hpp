@@ -0,0 +1,67 @@
+#pragma once
+
+#include <lox/interpreter/program.hpp>
+#include <lox/interpreter/value.hpp>
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace lox {
+
+// A snapshot is a program together with its globals as running it left
+// them, for later runs to start from instead of running it all again (see
+// interpreter::save_snapshot).
+struct snapshot {
+  std::shared_ptr<program>          program;
+  std::vector<std::optional<value>> globals; // by slot, as program->globals
+};
+
+// Writes a snapshot out in a compact binary form:
+//
+// - Prototypes are saved with their bytecode, as it has been quickened so
+//   far, but not their IR, so runs from a snapshot only ever run bytecode.
+// - Functions, the variables they captured, arrays, maps and float arrays
+//   are saved once each, however many places refer to them, so what was
+//   shared (or cyclic) still is once it's read back.
+// - Builtins are saved by name.
+//
+// Channels and coroutines, and functions that captured variables still on
+// the stack, can't be saved: they throw std::runtime_error.
+void write_snapshot(std::ostream& out, snapshot const& snap);
+
+// Reads a snapshot written by write_snapshot, looking builtins up by name
+// with `builtin`. Throws std::runtime_error if it isn't one, or has been cut
+// short or corrupted: everything its bytecode refers to by number (constants,
+// globals, locals, upvalues, jump targets and functions) is checked to be
+// there as it's read, and its code never to overflow its frame or pop from
+// an empty one.
+auto read_snapshot(std::span<char const>                            bytes,
+                   std::function<value(std::string const&)> const& builtin)
+    -> snapshot;
+
+// A file mapped into memory, read-only, for as long as this lives. Throws
+// std::system_error if it can't be opened or mapped.
+class mapped_file {
+public:
+  explicit mapped_file(std::string const& path);
+  ~mapped_file();
+
+  mapped_file(mapped_file const&)                    = delete;
+  auto operator=(mapped_file const&) -> mapped_file& = delete;
+
+  [[nodiscard]] auto bytes() const -> std::span<char const> {
+    return {data_, size_};
+  }
+
+private:
+  char const* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+} // namespace lox
@@ -0,0 +1,69 @@
+#include <lox/interpreter/string.hpp>
+#include <lox/profile/heap.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+namespace lox {
+
+static std::size_t const MIN_CAPACITY = 16;
+
+string::string(std::string_view str) {
+  if (str.empty()) return;
+  profile::scope const charged{profile::kind::string};
+
+  // Literals and one-off strings are sized exactly; they only get slack once
+  // something is appended to them.
+  buf_ = std::make_shared<buffer>(str.size());
+  std::memcpy(buf_->data.get(), str.data(), str.size());
+  buf_->used = str.size();
+  size_      = str.size();
+}
+
+auto string::try_extend(std::string_view right) const -> bool {
+  if (buf_ == nullptr or buf_->capacity - size_ < right.size()) return false;
+
+  std::size_t expected = size_;
+  if (not buf_->used.compare_exchange_strong(expected, size_ + right.size())) {
+    return false;
+  }
+
+  // We own [size_, size_ + right.size()) now and nobody can see it yet.
+  std::memcpy(buf_->data.get() + size_, right.data(), right.size());
+  return true;
+}
+
+auto string::concat(string const& left, std::string_view right) -> string {
+  if (right.empty()) return left;
+  if (left.try_extend(right)) return {left.buf_, left.size_ + right.size()};
+  profile::scope const charged{profile::kind::string};
+
+  // Leave room to grow so that repeatedly appending stays linear.
+  std::size_t const size = left.size_ + right.size();
+  auto              buf =
+      std::make_shared<buffer>(std::max(std::bit_ceil(size), MIN_CAPACITY));
+  if (left.size_ > 0) {
+    std::memcpy(buf->data.get(), left.view().data(), left.size_);
+  }
+  std::memcpy(buf->data.get() + left.size_, right.data(), right.size());
+  buf->used = size;
+
+  return {std::move(buf), size};
+}
+
+auto string::repeat(std::string_view str, int count) -> string {
+  if (count <= 0 or str.empty()) return {};
+  profile::scope const charged{profile::kind::string};
+
+  std::size_t const size = str.size() * static_cast<std::size_t>(count);
+  auto              buf  = std::make_shared<buffer>(size);
+  for (std::size_t offset = 0; offset < size; offset += str.size()) {
+    std::memcpy(buf->data.get() + offset, str.data(), str.size());
+  }
+  buf->used = size;
+
+  return {std::move(buf), size};
+}
+
+} // namespace lox
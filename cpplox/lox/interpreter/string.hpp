@@ -0,0 +1,86 @@
+#pragma once
+
+#include <lox/interpreter/meter.hpp>
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <compare>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace lox {
+
+// string is Lox's immutable string. It is a view of a prefix of a shared,
+// append-only buffer (builder semantics):
+//
+// - Copying a string just bumps a reference count.
+// - `a + b` writes `b` straight after `a` when `a` ends where its buffer's
+//   contents end and there is spare capacity, so building a string in a loop
+//   is amortised linear instead of quadratic.
+// - Otherwise it copies into a new buffer with room to grow.
+//
+// Bytes are never written before the end of a buffer's contents, so every
+// existing string keeps seeing the same characters. Claiming the end of a
+// buffer is a compare-and-swap, which keeps this safe across threads.
+class string {
+public:
+  string() = default;
+  string(std::string_view str); // NOLINT(google-explicit-constructor)
+  string(char const* str) : string(std::string_view{str}) {} // NOLINT
+
+  [[nodiscard]] auto view() const -> std::string_view {
+    if (buf_ == nullptr) return {};
+    return {buf_->data.get(), size_};
+  }
+  [[nodiscard]] auto size() const -> std::size_t { return size_; }
+  [[nodiscard]] auto empty() const -> bool { return size_ == 0; }
+  [[nodiscard]] auto str() const -> std::string { return std::string{view()}; }
+
+  // Returns `left` followed by `right`, reusing `left`'s buffer if possible.
+  static auto concat(string const& left, std::string_view right) -> string;
+  // Returns `str` repeated `count` times in a buffer sized up front.
+  static auto repeat(std::string_view str, int count) -> string;
+
+  friend auto operator==(string const& a, string const& b) -> bool {
+    return a.view() == b.view();
+  }
+  friend auto operator<=>(string const& a, string const& b)
+      -> std::strong_ordering {
+    return a.view() <=> b.view();
+  }
+
+private:
+  struct buffer {
+    // Charged for before it's allocated (see heap_charge)
+    explicit buffer(std::size_t capacity)
+        : capacity(capacity), charged(capacity), data(new char[capacity]) {}
+
+    std::atomic<std::size_t> used{0};
+    std::size_t              capacity;
+    heap_charge              charged; // see heap_meter
+    std::unique_ptr<char[]>  data;
+  };
+
+  string(std::shared_ptr<buffer> buf, std::size_t size)
+      : buf_(std::move(buf)), size_(size) {}
+
+  // Tries to append `right` in place. Returns false if someone else has
+  // already written past our end or the buffer is full.
+  [[nodiscard]] auto try_extend(std::string_view right) const -> bool;
+
+  std::shared_ptr<buffer> buf_;
+  std::size_t             size_ = 0;
+};
+
+} // namespace lox
+
+template <>
+struct fmt::formatter<lox::string> : formatter<std::string_view> {
+  template <typename FormatContext>
+  auto format(lox::string const& str, FormatContext& ctx) const {
+    return formatter<std::string_view>::format(str.view(), ctx);
+  }
+};
@@ -0,0 +1,544 @@
+#include <lox/errors.hpp>
+#include <lox/interpreter/bytecode.hpp>
+#include <lox/interpreter/channel.hpp>
+#include <lox/interpreter/coroutine.hpp>
+#include <lox/interpreter/interpreter.hpp>
+#include <lox/interpreter/map.hpp>
+#include <lox/interpreter/tasks.hpp>
+#include <lox/pool/scheduler.hpp>
+#include <lox/profile/heap.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_set>
+#include <utility>
+
+namespace lox {
+
+auto isolation::operator()(value const& value) -> lox::value {
+  if (auto const* arr = std::get_if<std::shared_ptr<array>>(&value)) {
+    auto& copy = arrays_[arr->get()];
+    if (copy != nullptr) return copy;
+
+    // Remembered before copying the elements, which might lead back to it
+    copy              = std::make_shared<array>();
+    auto const result = copy;
+
+    result->reserve((*arr)->elements.size());
+    for (auto const& element : (*arr)->elements) {
+      result->elements.push_back((*this)(element));
+    }
+    return result;
+  }
+
+  if (auto const* floats = std::get_if<std::shared_ptr<float_array>>(&value)) {
+    auto& copy = floats_[floats->get()];
+    if (copy == nullptr) copy = std::make_shared<float_array>(**floats);
+    return copy;
+  }
+
+  if (auto const* m = std::get_if<std::shared_ptr<map>>(&value)) {
+    auto& copy = maps_[m->get()];
+    if (copy != nullptr) return copy;
+
+    copy              = std::make_shared<map>();
+    auto const result = copy;
+
+    (*m)->each([&](lox::value const& key, lox::value const& v) {
+      // Keys are immutable, so only the values need copying
+      result->insert(key, *hash_key(key)) = (*this)(v);
+    });
+    return result;
+  }
+
+  if (std::holds_alternative<std::shared_ptr<channel>>(value)) {
+    met_channel_ = true;
+    return value;
+  }
+
+  auto const* fn = std::get_if<std::shared_ptr<function>>(&value);
+  if (fn == nullptr) return value;
+  if ((*fn)->upvalues.empty()) {
+    reached_.push_back((*fn)->proto.get());
+    return value;
+  }
+
+  auto& copy = functions_[fn->get()];
+  if (copy != nullptr) return copy;
+  reached_.push_back((*fn)->proto.get());
+
+  // Remembered before copying what it captured, which might lead back to it
+  copy = std::make_shared<function>(function{(*fn)->proto, {}});
+  auto const result = copy;
+
+  result->upvalues.reserve((*fn)->upvalues.size());
+  for (auto const& captured : (*fn)->upvalues) {
+    auto& variable = upvalues_[captured.get()];
+    if (variable == nullptr) {
+      variable           = std::make_shared<upvalue>(nullptr);
+      variable->location = &variable->closed;
+      variable->closed   = (*this)(*captured->location);
+    }
+    result->upvalues.push_back(variable);
+  }
+  return result;
+}
+
+auto isolation::shares(value const& value) -> bool {
+  if (auto const* fn = std::get_if<std::shared_ptr<function>>(&value)) {
+    return (*fn)->upvalues.empty();
+  }
+  return not std::holds_alternative<std::shared_ptr<array>>(value) and
+         not std::holds_alternative<std::shared_ptr<float_array>>(value) and
+         not std::holds_alternative<std::shared_ptr<map>>(value);
+}
+
+void isolation::adopt() {
+  for (auto const& [_, copy] : arrays_) copy->charged.adopt();
+  for (auto const& [_, copy] : floats_) copy->charged.adopt();
+  for (auto const& [_, copy] : maps_) copy->adopt();
+}
+
+void interpreter::start_task() {
+  profile::scope const charged{profile::kind::task};
+  // What's been printed so far comes before anything the task prints
+  flush();
+  if (tasks_ == nullptr) {
+    auto config       = options_;
+    config.stack_size = std::min(config.stack_size, config.task_stack_size);
+    tasks_ = std::make_shared<task_group>(output_, errors_.output, config);
+    tasks_->spawner = this;
+  }
+
+  std::scoped_lock const lock(tasks_->mutex);
+  // Tasks only start once the program has, so this is the one that started
+  // them
+  if (tasks_->program == nullptr) {
+    tasks_->program = std::make_shared<program const>(*program_);
+  }
+  ++tasks_->running;
+}
+
+auto interpreter::isolate_globals(isolation& isolate) const
+    -> std::vector<std::optional<value>> {
+  auto const& values = globals_.values();
+
+  // What can't change is handed over whether it's used or not, as that costs
+  // nothing
+  std::vector<std::optional<value>> globals;
+  globals.reserve(values.size());
+  for (auto const& global : values) {
+    globals.push_back(global and isolation::shares(*global) ? global
+                                                            : std::nullopt);
+  }
+
+  // The rest is only copied if the functions the task has (and the functions
+  // they define, and those in the globals they use, and so on) use it
+  std::vector<bool>                    used(values.size());
+  std::unordered_set<prototype const*> seen;
+  auto const                           use = [&](std::int32_t arg) {
+    auto const slot = static_cast<std::size_t>(arg);
+    if (slot >= values.size() or used[slot]) return;
+    used[slot] = true;
+    if (values[slot]) globals[slot] = isolate(*values[slot]);
+  };
+
+  for (auto reached = isolate.reached();
+       not reached.empty() and not isolate.met_channel();
+       reached = isolate.reached()) {
+    while (not reached.empty()) {
+      auto const* proto = reached.back();
+      reached.pop_back();
+      if (not seen.insert(proto).second) continue;
+
+      for (auto const& nested : proto->functions) {
+        reached.push_back(nested.get());
+      }
+      // Other tasks might be quickening this code as it's read
+      for (auto const& instr : proto->code) {
+        auto const op = load_op(instr);
+        if (op == opcode::get_global or op == opcode::set_global) {
+          use(instr.arg);
+        }
+      }
+    }
+  }
+
+  // Functions that come over a channel could use any of them
+  if (isolate.met_channel()) {
+    for (std::size_t slot = 0; slot < values.size(); ++slot) {
+      use(static_cast<std::int32_t>(slot));
+    }
+  }
+  return globals;
+}
+
+auto interpreter::borrow(std::shared_ptr<task_group> const& group)
+    -> std::unique_ptr<interpreter> {
+  profile::scope const         charged{profile::kind::task};
+  std::unique_ptr<interpreter> self;
+  {
+    std::scoped_lock const lock(group->mutex);
+    if (not group->idle.empty()) {
+      self = std::move(group->idle.back());
+      group->idle.pop_back();
+    }
+  }
+  if (self == nullptr) {
+    self = std::make_unique<interpreter>(group->output, group->config);
+    self->errors_.output = group->diagnostics;
+  }
+
+  self->tasks_ = group;
+  return self;
+}
+
+void interpreter::finish_task(std::shared_ptr<task_group> const& group,
+                              std::unique_ptr<interpreter> self) {
+  // Idle interpreters mustn't keep their group alive
+  self->tasks_.reset();
+
+  std::shared_ptr<inbox> spawner;
+  {
+    std::scoped_lock const lock(group->mutex);
+    group->idle.push_back(std::move(self));
+    if (--group->running == 0) {
+      group->done.notify_all();
+      spawner = group->waiting;
+    }
+  }
+  if (spawner != nullptr) {
+    std::scoped_lock const lock(spawner->mutex);
+    if (std::exchange(spawner->parked, false)) spawner->idle.unpark();
+  }
+}
+
+auto interpreter::spawn(value const& callee, value const& arg) -> value {
+  if (not std::holds_alternative<std::shared_ptr<function>>(callee) and
+      not std::holds_alternative<std::shared_ptr<builtin>>(callee)) {
+    throw runtime_error(token{}, "can only spawn functions");
+  }
+  profile::scope const charged{profile::kind::task};
+  // The copies are the task's, and charged to it once it runs (see
+  // isolation::adopt). The globals come last, as which of them are copied
+  // depends on what the callee and argument hold.
+  isolation                         isolate;
+  value                             copied;
+  value                             copy;
+  std::vector<std::optional<value>> globals;
+  {
+    metering const unmetered{nullptr};
+    copied  = isolate(callee);
+    copy    = isolate(arg);
+    globals = isolate_globals(isolate);
+  }
+  start_task();
+
+  auto result = std::make_shared<channel>();
+  scheduler::shared().spawn([group = tasks_, isolate = std::move(isolate),
+                             callee = std::move(copied), arg = std::move(copy),
+                             globals = std::move(globals), result]() mutable {
+    auto self = borrow(group);
+    result->send(isolation{}(
+        self->run_task(isolate, callee, arg, std::move(globals))));
+    finish_task(group, std::move(self));
+  });
+
+  return result;
+}
+
+auto interpreter::run_task(isolation& copies, value const& callee,
+                           value const& arg,
+                           std::vector<std::optional<value>> globals)
+    -> value {
+  // The builtins come with the globals: they act for whichever interpreter
+  // calls them, so the spawner's are ours too
+  globals_.load(tasks_->program->globals, std::move(globals));
+  program_ = tasks_->program.get();
+  metering const metered{meter_};
+  start_budgets();
+
+  value result;
+  try {
+    copies.adopt();
+    *sp_++ = arg;
+    result = invoke(callee, sp_ - 1, 1, token{});
+    *--sp_ = value{};
+
+    // Async calls the task made finish with it, and if it was one itself,
+    // what it returns is the task's result
+    run_async(nullptr);
+    check_heap();
+    if (auto const* co = std::get_if<std::shared_ptr<coroutine>>(&result);
+        co != nullptr and (*co)->owner == this and (*co)->result) {
+      result = value{*(*co)->result};
+    }
+  } catch (runtime_error const& err) {
+    report(err);
+    reset();
+
+    std::scoped_lock const lock(tasks_->mutex);
+    tasks_->failed = true;
+  } catch (budget_exceeded const& err) {
+    // Only the program's own run throws it on, to whoever's running it
+    report(runtime_error(token{}, err.what()));
+    reset();
+
+    std::scoped_lock const lock(tasks_->mutex);
+    tasks_->failed = true;
+  }
+
+  program_ = nullptr;
+  return result;
+}
+
+auto interpreter::fan_out(value const& callee, std::vector<value> const& items,
+                          bool fold) -> std::vector<value> {
+  if (not std::holds_alternative<std::shared_ptr<function>>(callee) and
+      not std::holds_alternative<std::shared_ptr<builtin>>(callee)) {
+    throw runtime_error(token{}, "can only run functions in parallel");
+  }
+
+  // A few chunks per thread, so that threads that finish theirs early can
+  // take on some of the others'
+  auto const threads = std::max<std::size_t>(scheduler::shared().size(), 1);
+  auto const chunks  = std::min(items.size(), threads * 4);
+  std::vector<std::shared_ptr<channel>> results(chunks);
+  // A chunk's error is only rethrown here, once the chunks before it have
+  // finished, so which one is reported doesn't depend on timing
+  auto errors = std::make_shared<std::vector<std::exception_ptr>>(chunks);
+
+  // Which globals the callee could use is only worked out for the first
+  // chunk (see isolate_globals). The others share the globals that can't
+  // change with it, and copy just the ones it copied, unless their items
+  // hold functions or channels, which could use more.
+  auto const&                       values = globals_.values();
+  std::vector<std::optional<value>> shared;
+  std::vector<std::size_t>          used;
+
+  for (std::size_t i = 0; i < chunks; ++i) {
+    // Chunks differ in size by one at most
+    auto const first = items.begin() + static_cast<std::ptrdiff_t>(
+                                           i * items.size() / chunks);
+    auto const last  = items.begin() + static_cast<std::ptrdiff_t>(
+                                          (i + 1) * items.size() / chunks);
+    isolation                         isolate;
+    std::vector<value>                chunk;
+    value                             copied;
+    std::vector<std::optional<value>> globals;
+    {
+      // Charged to the chunk's task (see spawn)
+      metering const unmetered{nullptr};
+      chunk.reserve(static_cast<std::size_t>(last - first));
+      for (auto it = first; it != last; ++it) {
+        chunk.push_back(isolate(*it));
+      }
+
+      auto const own =
+          i == 0 or isolate.has_reached() or isolate.met_channel();
+      copied  = isolate(callee);
+      globals = own ? isolate_globals(isolate) : shared;
+      if (i == 0) {
+        shared = globals;
+        for (std::size_t slot = 0; slot < values.size(); ++slot) {
+          if (globals[slot] and not isolation::shares(*values[slot])) {
+            used.push_back(slot);
+            shared[slot].reset();
+          }
+        }
+      } else if (not own) {
+        for (auto const slot : used) globals[slot] = isolate(*values[slot]);
+      }
+    }
+    // Only once it's all copied (see spawn)
+    start_task();
+
+    results[i] = std::make_shared<channel>();
+    scheduler::shared().spawn([group = tasks_, isolate = std::move(isolate),
+                               callee = std::move(copied),
+                               chunk = std::move(chunk), fold,
+                               globals = std::move(globals),
+                               result = results[i], errors, i]() mutable {
+      auto  self = borrow(group);
+      value out;
+      try {
+        out = isolation{}(self->run_chunk(isolate, callee, std::move(chunk),
+                                          fold, std::move(globals)));
+      } catch (runtime_error const&) {
+        (*errors)[i] = std::current_exception();
+      }
+      result->send(std::move(out));
+      finish_task(group, std::move(self));
+    });
+  }
+
+  std::vector<value> out;
+  out.reserve(chunks);
+  for (std::size_t i = 0; i < chunks; ++i) {
+    out.push_back(results[i]->receive());
+    if ((*errors)[i]) std::rethrow_exception((*errors)[i]);
+  }
+  return out;
+}
+
+auto interpreter::run_chunk(isolation& copies, value const& callee,
+                            std::vector<value> chunk, bool fold,
+                            std::vector<std::optional<value>> globals)
+    -> value {
+  globals_.load(tasks_->program->globals, std::move(globals));
+  program_ = tasks_->program.get();
+  metering const metered{meter_};
+  start_budgets();
+
+  value result;
+  try {
+    copies.adopt();
+    if (fold) {
+      result = std::move(chunk.front());
+      for (std::size_t i = 1; i < chunk.size(); ++i) {
+        *sp_++ = std::move(result);
+        *sp_++ = std::move(chunk[i]);
+        result = invoke(callee, sp_ - 2, 2, token{});
+        *--sp_ = value{};
+        *--sp_ = value{};
+      }
+    } else {
+      auto mapped = std::make_shared<array>();
+      mapped->reserve(chunk.size());
+      for (auto& item : chunk) {
+        *sp_++ = std::move(item);
+        mapped->elements.push_back(invoke(callee, sp_ - 1, 1, token{}));
+        *--sp_ = value{};
+      }
+      result = std::move(mapped);
+    }
+    run_async(nullptr);
+    check_heap();
+  } catch (runtime_error const&) {
+    reset();
+    program_ = nullptr;
+    throw;
+  } catch (budget_exceeded const& err) {
+    reset();
+    program_ = nullptr;
+    throw runtime_error(token{}, err.what());
+  }
+
+  program_ = nullptr;
+  return result;
+}
+
+auto interpreter::parallel_map(value const& callee,
+                               std::vector<value> const& items)
+    -> std::shared_ptr<array> {
+  auto mapped = std::make_shared<array>();
+  mapped->reserve(items.size());
+  for (auto& chunk : fan_out(callee, items, false)) {
+    auto& elements = std::get<std::shared_ptr<array>>(chunk)->elements;
+    std::ranges::move(elements, std::back_inserter(mapped->elements));
+  }
+  return mapped;
+}
+
+auto interpreter::parallel_reduce(value const& callee,
+                                  std::vector<value> const& items, value init)
+    -> value {
+  value result = std::move(init);
+  for (auto& chunk : fan_out(callee, items, true)) {
+    *sp_++ = std::move(result);
+    *sp_++ = std::move(chunk);
+    result = invoke(callee, sp_ - 2, 2, token{});
+    *--sp_ = value{};
+    *--sp_ = value{};
+  }
+  return result;
+}
+
+void interpreter::join_tasks() {
+  if (tasks_ == nullptr) return;
+
+  std::unique_lock lock(tasks_->mutex);
+  tasks_->done.wait(lock, [this] { return tasks_->running == 0; });
+
+  if (std::exchange(tasks_->failed, false)) errors_.runtime_errored = true;
+  tasks_->program.reset();
+}
+
+auto interpreter::alone() const -> bool {
+  if (tasks_ == nullptr) return true;
+
+  // A task sends everything it's going to before it stops counting as
+  // running, so once none are, what's been sent is all there'll be
+  std::scoped_lock const lock(tasks_->mutex);
+  return tasks_->running == 0;
+}
+
+auto interpreter::receive(channel& ch) -> value {
+  if (alone()) {
+    auto next = ch.try_receive();
+    if (not next) throw runtime_error(token{}, "receive would wait forever");
+    return std::move(*next);
+  }
+  if (tasks_->spawner != this) return ch.receive();
+
+  // The spawner waits for something to receive or for the last task to
+  // finish, whichever is first. If it gives up, whatever's sent later is
+  // dropped, as with an abandoned await.
+  auto const group    = tasks_;
+  auto const received = std::make_shared<std::optional<value>>();
+  ch.receive([group, received](value value) {
+    std::scoped_lock const lock(group->mutex);
+    *received = std::move(value);
+    group->done.notify_all();
+  });
+
+  std::unique_lock lock(group->mutex);
+  group->done.wait(lock,
+                   [&] { return received->has_value() or group->running == 0; });
+  if (not *received) {
+    throw runtime_error(token{}, "receive would wait forever");
+  }
+  return std::move(**received);
+}
+
+void interpreter::print(value const& value) {
+  values::format_to(printed_, value);
+  printed_ += '\n';
+  if (tasks_ != nullptr or printed_.size() >= PRINTED_MAX) flush();
+}
+
+void interpreter::flush(bool stream) {
+  if (printed_.empty() and not stream) return;
+
+  auto const write = [&] {
+    output_.write(printed_.data(), std::ssize(printed_));
+    if (stream) output_.flush();
+  };
+  if (tasks_ == nullptr) {
+    write();
+  } else {
+    std::scoped_lock const lock(tasks_->output_mutex);
+    write();
+  }
+  // Keeps its capacity, for the next lot
+  printed_.clear();
+}
+
+void interpreter::report(runtime_error const& err) {
+  flush();
+  if (tasks_ == nullptr) {
+    errors_.report_runtime_error(err);
+    return;
+  }
+
+  std::scoped_lock const lock(tasks_->output_mutex);
+  errors_.report_runtime_error(err);
+}
+
+} // namespace lox
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <lox/interpreter/interpreter.hpp>
+#include <lox/interpreter/program.hpp>
+#include <lox/interpreter/value.hpp>
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace lox {
+
+// Everything spawned (see interpreter::spawn) while an interpreter runs a
+// program, directly or by other tasks, and what they share with it: the
+// program, where to print and report errors, and idle interpreters to run
+// the next tasks on.
+struct task_group {
+  task_group(std::ostream& output, std::ostream* diagnostics, options config)
+      : output(output), diagnostics(diagnostics), config(config) {}
+
+  std::ostream&                  output;
+  std::ostream*                  diagnostics;
+  options                        config;
+  std::shared_ptr<program const> program; // a copy of the one running
+
+  // For printing and reporting errors, from any task
+  std::mutex output_mutex;
+
+  std::mutex                                mutex;
+  std::condition_variable                   done;
+  std::size_t                               running = 0;
+  bool                                      failed  = false;
+  std::vector<std::unique_ptr<interpreter>> idle;
+
+  // The interpreter that started the group, and where it last waited for an
+  // await (see run_async): once no task is running, nothing more can be sent
+  // to it, so the last task to finish wakes it to find that out
+  interpreter const*     spawner = nullptr;
+  std::shared_ptr<inbox> waiting;
+};
+
+// isolation copies values to hand to another task. Arrays (of either kind)
+// and maps are copied, as are functions that captured variables, which get
+// copies of the variables (holding copies of their values, and so on), so
+// tasks never share anything they can change. Everything else is immutable,
+// or a channel, and handed over as it is. Anything shared between values
+// copied by the same isolation stays shared between the copies.
+//
+// It also keeps track of the functions it comes across, copied or not, and
+// of whether it came across a channel, for finding which globals a task
+// could use (see interpreter::isolate_globals).
+class isolation {
+public:
+  auto operator()(value const& value) -> lox::value;
+
+  // Whether values like this one are handed over as they are.
+  [[nodiscard]] static auto shares(value const& value) -> bool;
+
+  // Charges the copies to the current meter (see heap_charge::adopt), for
+  // the task they're handed to, once it's running. They're made with no
+  // meter current, so that they never count against the spawner's budget.
+  void adopt();
+
+  // The prototypes of the functions come across since last asked.
+  auto reached() -> std::vector<prototype const*> {
+    return std::exchange(reached_, {});
+  }
+  [[nodiscard]] auto has_reached() const -> bool {
+    return not reached_.empty();
+  }
+  // Whether a channel has been come across, through which anything might
+  // come later.
+  [[nodiscard]] auto met_channel() const -> bool { return met_channel_; }
+
+private:
+  std::vector<prototype const*> reached_;
+  bool                          met_channel_ = false;
+
+
+  std::unordered_map<array const*, std::shared_ptr<array>>       arrays_;
+  std::unordered_map<map const*, std::shared_ptr<map>>           maps_;
+  std::unordered_map<function const*, std::shared_ptr<function>> functions_;
+  std::unordered_map<upvalue const*, std::shared_ptr<upvalue>>   upvalues_;
+
+  std::unordered_map<float_array const*, std::shared_ptr<float_array>> floats_;
+};
+
+} // namespace lox
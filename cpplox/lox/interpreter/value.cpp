@@ -1,8 +1,15 @@
 #include <lox/errors.hpp>
+#include <lox/interpreter/coroutine.hpp>
+#include <lox/interpreter/map.hpp>
 #include <lox/interpreter/value.hpp>
 
 #include <fmt/core.h>
+#include <fmt/ranges.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iterator>
 #include <optional>
 #include <utility>
 
@@ -16,206 +23,362 @@ template <class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
 template <class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 // clang-format on
 
-auto to_string(value value) -> std::string {
-  using namespace std::string_literals;
-  return std::visit(
-      overloaded{[](std::monostate const&) { return "nil"s; },
-                 [](bool arg) { return arg ? "true"s : "false"s; },
-                 [](double arg) { return fmt::format("{}", arg); },
-                 [](std::string const& arg) { return arg; },
-                 [](box<function> const& f) {
-                   return fmt::format("<fn {}>", f->decl.name.lexeme);
+namespace {
+
+// Arrays and maps can contain themselves. One that's already being printed
+// (on this thread) prints as `cycle` instead the second time round.
+template <typename F>
+void print_once(std::string& out, void const* aggregate, char const* cycle,
+                F const& contents) {
+  thread_local std::vector<void const*> printing;
+  if (std::ranges::find(printing, aggregate) != printing.end()) {
+    out += cycle;
+    return;
+  }
+
+  printing.push_back(aggregate);
+  try {
+    contents();
+    printing.pop_back();
+  } catch (...) {
+    printing.pop_back();
+    throw;
+  }
+}
+
+} // namespace
+
+auto to_string(value const& value) -> std::string {
+  std::string str;
+  format_to(str, value);
+  return str;
+}
+
+void format_to(std::string& out, value const& value) {
+  auto const append = std::back_inserter(out);
+  std::visit(
+      overloaded{[&](std::monostate const&) { out += "nil"; },
+                 [&](bool arg) { out += arg ? "true" : "false"; },
+                 [&](double arg) { fmt::format_to(append, "{}", arg); },
+                 [&](string const& arg) { out += arg.view(); },
+                 [&](std::shared_ptr<function> const& f) {
+                   fmt::format_to(append, "<fn {}>", f->proto->name);
+                 },
+                 [&](std::shared_ptr<builtin> const& b) {
+                   fmt::format_to(append, "<native {}>", b->name);
+                 },
+                 [&](std::shared_ptr<channel> const&) { out += "<channel>"; },
+                 [&](std::shared_ptr<coroutine> const& c) {
+                   out += c->kind == function_kind::async ? "<async>"
+                                                          : "<generator>";
                  },
-                 [](box<builtin> const& b) {
-                   return fmt::format("<native {}>", b->name);
+                 [&](std::shared_ptr<array> const& a) {
+                   print_once(out, a.get(), "[...]", [&] {
+                     out += '[';
+                     bool first = true;
+                     for (auto const& element : a->elements) {
+                       if (not std::exchange(first, false)) out += ", ";
+                       format_to(out, element);
+                     }
+                     out += ']';
+                   });
+                 },
+                 [&](std::shared_ptr<float_array> const& a) {
+                   fmt::format_to(append, "[{}]", fmt::join(a->elements, ", "));
+                 },
+                 [&](std::shared_ptr<map> const& m) {
+                   print_once(out, m.get(), "{...}", [&] {
+                     out += '{';
+                     bool first = true;
+                     m->each([&](auto const& key, auto const& v) {
+                       if (not std::exchange(first, false)) out += ", ";
+                       format_to(out, key);
+                       out += ": ";
+                       format_to(out, v);
+                     });
+                     out += '}';
+                   });
                  }},
       value);
 }
 
-auto to_value(literal literal) -> value {
-  return std::visit(overloaded{[](auto arg) { return value{arg}; }}, literal);
-}
-
-auto to_value(number_or_string result) -> value {
-  return std::visit(overloaded{[](auto arg) { return value{arg}; }}, result);
+auto to_value(literal const& literal) -> value {
+  return std::visit(
+      overloaded{[](std::string const& arg) { return value{string{arg}}; },
+                 [](auto const& arg) { return value{arg}; }},
+      literal);
 }
 
-auto is_truthy(value value) -> bool {
+auto is_truthy(value const& value) -> bool {
   return std::visit(overloaded{
                         [](std::monostate const&) { return false; },
                         [](bool arg) { return arg; },
-                        [](auto&) { return true; },
+                        [](auto const&) { return true; },
                     },
                     value);
 }
 
 // Can't throw exceptions using overloaded trick.
+// The visitors only live for the duration of a std::visit, so they borrow
+// the operator token instead of copying it.
 struct negate_visitor {
-  token token;
+  token const& token;
 
   auto operator()(double arg) const -> double { return -arg; }
-  auto operator()(auto&) const -> double {
+  auto operator()(auto const&) const -> double {
     throw runtime_error(token, "operand must be a number");
   }
 };
 
-auto negate(token token, value value) -> double {
-  return std::visit(negate_visitor{std::move(token)}, value);
+auto negate(token const& token, value const& value) -> double {
+  return std::visit(negate_visitor{token}, value);
+}
+
+auto equal(token const& /*token*/, value const& left, value const& right)
+    -> bool {
+  return left == right;
 }
 
-// TODO: Should these functions actually be const??
-// Is it worth changing them to allow for moving?
 struct less_than_visitor {
-  token token;
+  token const& token;
 
   auto operator()(double left, double right) const -> bool {
     return left < right;
   }
-  auto operator()(std::string left, std::string right) const -> bool {
+  auto operator()(string const& left, string const& right) const -> bool {
     return left < right;
   }
-  auto operator()(auto&, auto&) const -> bool {
+  auto operator()(auto const&, auto const&) const -> bool {
     throw runtime_error(token, "operands must be two numbers or two strings");
   }
 };
 
-auto less_than(token token, value left, value right) -> bool {
-  return std::visit(less_than_visitor{std::move(token)}, left, right);
+auto less_than(token const& token, value const& left, value const& right)
+    -> bool {
+  return std::visit(less_than_visitor{token}, left, right);
 }
 
-auto greater_than(token token, value left, value right) -> bool {
-  return less_than(std::move(token), std::move(right), std::move(left));
+auto greater_than(token const& token, value const& left, value const& right)
+    -> bool {
+  return less_than(token, right, left);
 }
 
-auto less_equal(token token, value left, value right) -> bool {
-  return !(greater_than(std::move(token), std::move(left), std::move(right)));
+auto less_equal(token const& token, value const& left, value const& right)
+    -> bool {
+  return !(greater_than(token, left, right));
 }
 
-auto greater_equal(token token, value left, value right) -> bool {
-  return !(less_than(std::move(token), std::move(left), std::move(right)));
+auto greater_equal(token const& token, value const& left, value const& right)
+    -> bool {
+  return !(less_than(token, left, right));
 }
 
 struct plus_visitor {
-  token token;
+  token const& token;
 
-  auto operator()(double left, double right) -> number_or_string {
+  auto operator()(double left, double right) const -> value {
     return left + right;
   }
-  auto operator()(std::string left, std::string right) -> number_or_string {
-    return left + right;
+  auto operator()(string const& left, string const& right) const -> value {
+    return string::concat(left, right.view());
   }
-  auto operator()(double left, std::string right) -> number_or_string {
-    return fmt::format("{}{}", left, right);
+  auto operator()(double left, string const& right) const -> value {
+    return string{fmt::format("{}{}", left, right)};
   }
-  auto operator()(std::string left, double right) -> number_or_string {
-    return fmt::format("{}{}", left, right);
+  auto operator()(string const& left, double right) const -> value {
+    return string::concat(left, fmt::format("{}", right));
   }
-  auto operator()(auto&, auto&) -> number_or_string {
+  auto operator()(auto const&, auto const&) const -> value {
     throw runtime_error(token, "operands must be numbers or strings");
   }
 };
 
-auto plus(token token, value left, value right) -> number_or_string {
-  return std::visit(plus_visitor{std::move(token)}, left, right);
+auto plus(token const& token, value const& left, value const& right) -> value {
+  return std::visit(plus_visitor{token}, left, right);
 }
 
 struct minus_visitor {
-  token token;
+  token const& token;
 
-  auto operator()(double left, double right) -> double { return left - right; }
-  auto operator()(auto&, auto&) -> double {
-    throw runtime_error(std::move(token), "operands must be two numbers");
+  auto operator()(double left, double right) const -> double {
+    return left - right;
+  }
+  auto operator()(auto const&, auto const&) const -> double {
+    throw runtime_error(token, "operands must be two numbers");
   }
 };
 
-auto minus(token token, value left, value right) -> double {
-  return std::visit(minus_visitor{std::move(token)}, left, right);
+auto minus(token const& token, value const& left, value const& right)
+    -> double {
+  return std::visit(minus_visitor{token}, left, right);
 }
 
 struct multiply_visitor {
-  token token;
+  token const& token;
 
-  auto operator()(double left, double right) const -> number_or_string {
+  auto operator()(double left, double right) const -> value {
     return left * right;
   }
-  auto operator()(double left, std::string right) const -> number_or_string {
-    int length = static_cast<int>(left);
-
-    std::string result;
-    while (--length >= 0) result += right;
-
-    return result;
+  auto operator()(double left, string const& right) const -> value {
+    return string::repeat(right.view(), static_cast<int>(left));
   }
-  auto operator()(std::string left, double right) const -> number_or_string {
-    int length = static_cast<int>(right);
-
-    std::string result;
-    while (--length >= 0) result += left;
-
-    return result;
+  auto operator()(string const& left, double right) const -> value {
+    return string::repeat(left.view(), static_cast<int>(right));
   }
-  auto operator()(auto&, auto&) const -> number_or_string {
+  auto operator()(auto const&, auto const&) const -> value {
     throw runtime_error(
         token, "operands must be two numbers or a number and a string");
   }
 };
 
-auto multiply(token token, value left, value right) -> number_or_string {
-  return std::visit(multiply_visitor{std::move(token)}, left, right);
+auto multiply(token const& token, value const& left, value const& right)
+    -> value {
+  return std::visit(multiply_visitor{token}, left, right);
 }
 
 struct divide_visitor {
-  token token;
+  token const& token;
 
   auto operator()(double left, double right) const -> double {
     if (right <= EPSILON) throw runtime_error(token, "division by zero");
     return left / right;
   }
-  auto operator()(auto&, auto&) const -> double {
+  auto operator()(auto const&, auto const&) const -> double {
     throw runtime_error(token, "operands must be two numbers");
   }
 };
 
-auto divide(token token, value left, value right) -> double {
-  return std::visit(divide_visitor{std::move(token)}, left, right);
+auto divide(token const& token, value const& left, value const& right)
+    -> double {
+  return std::visit(divide_visitor{token}, left, right);
+}
+
+namespace {
+
+// Checks that `index` is a valid index into `elements`, and returns it as
+// one.
+template <typename T>
+auto to_index(token const& token, std::vector<T> const& elements,
+              value const& index) -> std::size_t {
+  auto const* number = std::get_if<double>(&index);
+  if (number == nullptr or std::trunc(*number) != *number) {
+    throw runtime_error(token, "index must be a whole number");
+  }
+  if (*number < 0 or *number >= static_cast<double>(elements.size())) {
+    throw runtime_error(token, "index out of range");
+  }
+  return static_cast<std::size_t>(*number);
+}
+
+} // namespace
+
+auto index(token const& token, value const& object, value const& index)
+    -> value {
+  if (auto const* arr = std::get_if<std::shared_ptr<array>>(&object)) {
+    auto const& elements = (*arr)->elements;
+    return elements[to_index(token, elements, index)];
+  }
+  if (auto const* floats = std::get_if<std::shared_ptr<float_array>>(&object)) {
+    auto const& elements = (*floats)->elements;
+    return elements[to_index(token, elements, index)];
+  }
+  if (auto const* m = std::get_if<std::shared_ptr<map>>(&object)) {
+    value const* found = (*m)->find(index, hash(token, index));
+    return found != nullptr ? *found : lox::value{};
+  }
+  throw runtime_error(token, "can only index arrays and maps");
+}
+
+void set_index(token const& token, value const& object, value const& index,
+               value value) {
+  if (auto const* arr = std::get_if<std::shared_ptr<array>>(&object)) {
+    auto& elements = (*arr)->elements;
+    elements[to_index(token, elements, index)] = std::move(value);
+    return;
+  }
+  if (auto const* m = std::get_if<std::shared_ptr<map>>(&object)) {
+    (*m)->insert(index, hash(token, index)) = std::move(value);
+    return;
+  }
+  if (auto const* floats = std::get_if<std::shared_ptr<float_array>>(&object)) {
+    auto&       elements = (*floats)->elements;
+    auto const* number   = std::get_if<double>(&value);
+    if (number == nullptr) {
+      throw runtime_error(token, "float arrays can only hold numbers");
+    }
+    elements[to_index(token, elements, index)] = *number;
+    return;
+  }
+  throw runtime_error(token, "can only index arrays and maps");
+}
+
+auto length(token const& token, value const& value) -> double {
+  if (auto const* arr = std::get_if<std::shared_ptr<array>>(&value)) {
+    return static_cast<double>((*arr)->elements.size());
+  }
+  if (auto const* floats = std::get_if<std::shared_ptr<float_array>>(&value)) {
+    return static_cast<double>((*floats)->elements.size());
+  }
+  if (auto const* m = std::get_if<std::shared_ptr<map>>(&value)) {
+    return static_cast<double>((*m)->size());
+  }
+  if (auto const* str = std::get_if<string>(&value)) {
+    return static_cast<double>(str->size());
+  }
+  throw runtime_error(token,
+                      "can only take the length of arrays, maps and strings");
+}
+
+auto hash(token const& token, value const& key) -> std::size_t {
+  auto const hashed = hash_key(key);
+  if (not hashed) {
+    throw runtime_error(
+        token, "map keys must be nil, booleans, numbers or strings");
+  }
+  return *hashed;
 }
 
 struct call_visitor {
-  token                     paren;
+  token const&              paren;
   std::vector<value> const& args;
-  interpret_func            interpret;
+  interpreter&              self;
+  interpret_func const&     interpret;
 
-  auto operator()(box<function> const& fn) const -> value {
+  auto operator()(std::shared_ptr<function> const& fn) const -> value {
     return fn->call(interpret, args);
   }
-  auto operator()(box<builtin> const& b) const -> value { return b->fn(args); }
+  auto operator()(std::shared_ptr<builtin> const& b) const -> value {
+    return b->fn(self, args);
+  }
   auto operator()(auto const&) const -> value {
     throw runtime_error(paren,
                         "call visitor: can only call functions and classes");
   }
 };
 
-auto call(token paren, value callee, std::vector<value> const& args,
-          interpret_func fn) -> value {
-  return std::visit(call_visitor{std::move(paren), args, std::move(fn)},
-                    callee);
+auto call(token const& paren, value const& callee,
+          std::vector<value> const& args, interpreter& self,
+          interpret_func const& fn) -> value {
+  return std::visit(call_visitor{paren, args, self, fn}, callee);
 }
 
 struct arity_visitor {
-  token paren;
+  token const& paren;
 
-  auto operator()(box<function> const& fn) const -> int {
-    return static_cast<int>(std::ssize(fn->decl.params));
+  auto operator()(std::shared_ptr<function> const& fn) const -> int {
+    return fn->proto->arity;
+  }
+  auto operator()(std::shared_ptr<builtin> const& b) const -> int {
+    return b->arity;
   }
-  auto operator()(box<builtin> const& b) const -> int { return b->arity; }
   auto operator()(auto const&) const -> int {
     throw runtime_error(paren,
                         "arity visitor: can only call functions and classes");
   }
 };
 
-auto arity(token paren, value callee) -> int {
-  return std::visit(arity_visitor{std::move(paren)}, callee);
+auto arity(token const& paren, value const& callee) -> int {
+  return std::visit(arity_visitor{paren}, callee);
 }
 
 } // namespace lox::values
@@ -1,10 +1,12 @@
 #pragma once
 
-#include <lox/ast/ast.hpp>
-#include <lox/box.hpp>
 #include <lox/errors.hpp>
+#include <lox/interpreter/bytecode.hpp>
+#include <lox/interpreter/meter.hpp>
+#include <lox/interpreter/string.hpp>
 #include <lox/token/token.hpp>
 
+#include <cstddef>
 #include <functional>
 #include <memory>
 #include <string>
@@ -13,78 +15,142 @@
 
 namespace lox {
 
-// A value is either a literal or a callable. Instead of nesting variants,
-// literal has been flattened out here.
-// TODO: Simplify this into just one literal variant
-using value = std::variant<std::monostate, bool, double, std::string,
-                           box<struct function>, box<struct builtin>>;
+class interpreter;
 
-struct callable {
-  std::vector<token> const& params;
-  std::vector<value> const& args;
-  std::vector<stmt> const&  body;
+// A value is either a literal, a callable, a channel or a coroutine. Instead
+// of nesting variants, literal has been flattened out here. Strings are
+// immutable and shared (see string.hpp), so copying a value never copies
+// characters. Functions are immutable once created, so they are shared too.
+// Arrays, float arrays, maps (see map.hpp), channels (see channel.hpp) and
+// coroutines (see coroutine.hpp) are shared by reference.
+// TODO: Simplify this into just one literal variant
+using value = std::variant<std::monostate, bool, double, string,
+                           std::shared_ptr<struct function>,
+                           std::shared_ptr<struct builtin>,
+                           std::shared_ptr<struct channel>,
+                           std::shared_ptr<struct coroutine>,
+                           std::shared_ptr<struct array>,
+                           std::shared_ptr<class map>,
+                           std::shared_ptr<struct float_array>>;
+
+// An upvalue is a variable captured by a closure. While the variable is still
+// in scope it is open and points at a slot on the interpreter's stack; when
+// the scope ends it is closed and the value moves into the upvalue.
+struct upvalue {
+  explicit upvalue(value* slot) : location(slot) {}
+
+  value* location; // points at `closed` once closed
+  value  closed;
 };
 
-using env_ptr = std::shared_ptr<class environment>;
-
-using interpret_func = std::function<value(callable, env_ptr)>;
+using interpret_func =
+    std::function<value(function const&, std::vector<value> const&)>;
 
 struct function {
-  function_stmt decl;
-  env_ptr       enclosing;
+  std::shared_ptr<prototype>            proto;
+  std::vector<std::shared_ptr<upvalue>> upvalues;
 
   [[nodiscard]] auto call(interpret_func const&     fn,
                           std::vector<value> const& args) const -> value {
-    return fn(callable{decl.params, args, decl.body}, enclosing);
-  }
-
-  friend auto operator==(function const& a, function const& b) -> bool {
-    return a.decl.name.lexeme == b.decl.name.lexeme;
+    return fn(*this, args);
   }
 };
 
+// A builtin is called with the interpreter calling it, which needn't be the
+// one that defined it.
+using builtin_fn =
+    std::function<value(interpreter&, std::vector<value> const&)>;
+
 struct builtin {
-  std::string                              name;
-  int                                      arity;
-  std::function<value(std::vector<value>)> fn;
+  std::string name;
+  int         arity;
+  builtin_fn  fn;
+};
 
-  friend auto operator==(builtin const& a, builtin const& b) -> bool {
-    return a.name == b.name;
+// An array is a growable list of values, stored contiguously so that
+// indexing is a bounds check and a load. Whatever grows it makes room with
+// reserve, which charges for the room before it's allocated (see
+// heap_meter), or recharges it afterwards.
+struct array {
+  std::vector<value> elements;
+  heap_charge        charged;
+
+  void reserve(std::size_t capacity) {
+    if (capacity <= elements.capacity()) return;
+    charged.resize(capacity * sizeof(value));
+    elements.reserve(capacity);
   }
+  void recharge() { charged.resize(elements.capacity() * sizeof(value)); }
 };
 
-using number_or_string = std::variant<double, std::string>;
+// A float array only holds numbers, as plain doubles, for the numeric
+// builtins (see simd.hpp) to work on in bulk.
+struct float_array {
+  std::vector<double> elements;
+  heap_charge         charged;
+
+  void reserve(std::size_t capacity) {
+    if (capacity <= elements.capacity()) return;
+    charged.resize(capacity * sizeof(double));
+    elements.reserve(capacity);
+  }
+  void recharge() { charged.resize(elements.capacity() * sizeof(double)); }
+};
 
 namespace values {
 
 // *** Operations ***
+// Operands are taken by reference so that reading a string never copies it.
 
-auto to_string(value value) -> std::string;
-auto to_value(literal literal) -> value;
-auto to_value(number_or_string result) -> value;
+auto to_string(value const& value) -> std::string;
+// Appends what to_string would return, without making a string of it first.
+void format_to(std::string& out, value const& value);
+auto to_value(literal const& literal) -> value;
 
 // Unary operations
-auto is_truthy(value value) -> bool;
-auto negate(token token, value value) -> double;
+auto is_truthy(value const& value) -> bool;
+auto negate(token const& token, value const& value) -> double;
 
 // Binary operations
 // - Comparison operations
-auto equal(token token, value left, value right) -> bool;
-auto less_than(token token, value left, value right) -> bool;
-auto greater_than(token token, value left, value right) -> bool;
-auto less_equal(token token, value left, value right) -> bool;
-auto greater_equal(token token, value left, value right) -> bool;
+auto equal(token const& token, value const& left, value const& right) -> bool;
+auto less_than(token const& token, value const& left, value const& right)
+    -> bool;
+auto greater_than(token const& token, value const& left, value const& right)
+    -> bool;
+auto less_equal(token const& token, value const& left, value const& right)
+    -> bool;
+auto greater_equal(token const& token, value const& left, value const& right)
+    -> bool;
 
 // - Maths operations
-auto plus(token token, value left, value right) -> number_or_string;
-auto minus(token token, value left, value right) -> double;
-auto multiply(token token, value left, value right) -> number_or_string;
-auto divide(token token, value left, value right) -> double;
+auto plus(token const& token, value const& left, value const& right) -> value;
+auto minus(token const& token, value const& left, value const& right)
+    -> double;
+auto multiply(token const& token, value const& left, value const& right)
+    -> value;
+auto divide(token const& token, value const& left, value const& right)
+    -> double;
+
+// Arrays, float arrays and maps
+// - Array indices must be whole numbers in [0, len). Maps give nil for keys
+//   they don't have. Float arrays can only be set to numbers.
+auto index(token const& token, value const& object, value const& index)
+    -> value;
+void set_index(token const& token, value const& object, value const& index,
+               value value);
+// - The number of elements in an array, entries in a map or bytes in a
+//   string.
+auto length(token const& token, value const& value) -> double;
+// - Map keys are nil, booleans, numbers (but not NaN) or strings.
+auto hash(token const& token, value const& key) -> std::size_t;
 
 // Function call
-auto call(token paren, value callee, std::vector<value> const& args,
-          interpret_func fn) -> value;
-auto arity(token paren, value callee) -> int;
+// - Builtins are called for `self`.
+auto call(token const& paren, value const& callee,
+          std::vector<value> const& args, interpreter& self,
+          interpret_func const& fn) -> value;
+auto arity(token const& paren, value const& callee) -> int;
 
 } // namespace values
 
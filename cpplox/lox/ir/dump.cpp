@@ -0,0 +1,97 @@
+#include <lox/ir/ir.hpp>
+
+#include <fmt/format.h>
+#include <fmt/ranges.h>
+
+#include <array>
+#include <iterator>
+
+namespace lox::ir {
+
+namespace {
+
+// clang-format off
+constexpr std::array names{
+  "param", "const", "phi",
+  "equal", "not_equal", "greater", "greater_equal", "less", "less_equal",
+  "add", "subtract", "multiply", "divide",
+  "negate", "not",
+  "get_global", "set_global", "call", "print", "echo",
+  "jump", "branch", "return",
+  "move", "tail_call",
+};
+// clang-format on
+static_assert(names.size() == static_cast<std::size_t>(opcode::tail_call) + 1);
+
+} // namespace
+
+// Prints e.g.
+//   b1: <- b0, b2
+//     v3 = phi v0 (b0), v5 (b2)
+//     v4 = less v3, v1
+//     branch v4 -> b2, b3
+auto to_string(function const& fn) -> std::string {
+  std::string out;
+  auto        it = std::back_inserter(out);
+
+  fmt::format_to(it, "fun {}/{}\n", fn.name, fn.arity);
+  for (std::size_t b = 0; b < fn.blocks.size(); ++b) {
+    auto const& block = fn.blocks[b];
+    fmt::format_to(it, "b{}:", b);
+    if (not block.preds.empty()) {
+      fmt::format_to(it, " <- b{}", fmt::join(block.preds, ", b"));
+    }
+    fmt::format_to(it, "\n");
+
+    for (auto const id : block.code) {
+      auto const& in = fn.instrs[id];
+      fmt::format_to(it, "  ");
+      if (in.op < opcode::set_global or in.op == opcode::call) {
+        fmt::format_to(it, "v{} = ", id);
+      }
+      fmt::format_to(it, "{}", names[static_cast<std::size_t>(in.op)]);
+
+      switch (in.op) {
+      case opcode::param:
+        fmt::format_to(it, " {}", in.imm);
+        break;
+      case opcode::constant: {
+        auto const& constant = fn.constants[in.imm];
+        if (std::holds_alternative<string>(constant)) {
+          fmt::format_to(it, " \"{}\"", constant);
+        } else {
+          fmt::format_to(it, " {}", constant);
+        }
+        break;
+      }
+      case opcode::phi:
+        for (std::size_t i = 0; i < in.args.size(); ++i) {
+          fmt::format_to(it, "{} v{} (b{})", i == 0 ? "" : ",", in.args[i],
+                         block.preds[i]);
+        }
+        break;
+      case opcode::get_global:
+      case opcode::set_global:
+        fmt::format_to(it, " {}", fn.tokens[in.origin].lexeme);
+        if (not in.args.empty()) fmt::format_to(it, ", v{}", in.args[0]);
+        break;
+      case opcode::jump:
+        fmt::format_to(it, " -> b{}", in.targets[0]);
+        break;
+      case opcode::branch:
+        fmt::format_to(it, " v{} -> b{}, b{}", in.args[0], in.targets[0],
+                       in.targets[1]);
+        break;
+      default:
+        if (not in.args.empty()) {
+          fmt::format_to(it, " v{}", fmt::join(in.args, ", v"));
+        }
+      }
+      fmt::format_to(it, "\n");
+    }
+  }
+
+  return out;
+}
+
+} // namespace lox::ir
@@ -0,0 +1,170 @@
+#include <lox/ir/ir.hpp>
+
+#include <algorithm>
+#include <utility>
+
+namespace lox::ir {
+
+namespace {
+
+class generator {
+public:
+  explicit generator(function& fn) : fn_(fn) {}
+
+  void run();
+
+private:
+  function& fn_;
+
+  std::vector<int>                 starts_;  // where each block's code begins
+  std::vector<std::pair<int, int>> patches_; // (operation, block) targets
+
+  auto emit(operation op) -> int {
+    fn_.code.push_back(op);
+    return static_cast<int>(fn_.code.size()) - 1;
+  }
+
+  // Assigns the phis at the start of `target` for coming in along `edge`.
+  void moves(int target, int edge);
+  // Goes to a block, unless it's next anyway.
+  void go(int from, int target, int edge);
+};
+
+void generator::run() {
+  fn_.code.clear();
+  fn_.arguments.clear();
+  fn_.registers = static_cast<int>(fn_.instrs.size());
+
+  starts_.assign(fn_.blocks.size(), -1);
+  for (std::size_t b = 0; b < fn_.blocks.size(); ++b) {
+    starts_[b] = static_cast<int>(fn_.code.size());
+
+    auto const& code = fn_.blocks[b].code;
+    for (std::size_t i = 0; i < code.size(); ++i) {
+      auto const  id  = code[i];
+      auto const& in  = fn_.instrs[id];
+      auto const  arg = [&](std::size_t n) { return in.args[n]; };
+
+      switch (in.op) {
+      case opcode::param:
+      case opcode::phi:
+        break;
+      case opcode::constant:
+        emit({.op = in.op, .dst = id, .a = in.imm});
+        break;
+      case opcode::get_global:
+        emit({.op = in.op, .dst = id, .a = in.imm, .origin = in.origin});
+        break;
+      case opcode::set_global:
+        emit({.op = in.op, .a = arg(0), .b = in.imm, .origin = in.origin});
+        break;
+      case opcode::call: {
+        auto const* const next =
+            i + 1 < code.size() ? &fn_.instrs[code[i + 1]] : nullptr;
+        bool const tail = next != nullptr and next->op == opcode::return_ and
+                          next->args[0] == id;
+        emit({.op     = tail ? opcode::tail_call : in.op,
+              .dst    = id,
+              .a      = arg(0),
+              .b      = static_cast<int>(fn_.arguments.size()),
+              .c      = static_cast<int>(in.args.size()) - 1,
+              .origin = in.origin});
+        fn_.arguments.insert(fn_.arguments.end(), in.args.begin() + 1,
+                             in.args.end());
+        break;
+      }
+      case opcode::print:
+      case opcode::echo:
+      case opcode::return_:
+        emit({.op = in.op, .a = arg(0)});
+        break;
+      case opcode::negate:
+      case opcode::not_:
+        emit({.op = in.op, .dst = id, .a = arg(0), .origin = in.origin});
+        break;
+
+      case opcode::jump:
+        go(static_cast<int>(b), in.targets[0], in.edges[0]);
+        break;
+      case opcode::branch: {
+        auto const alt = in.targets[1];
+        auto const at  = emit({.op = in.op, .a = arg(0)});
+
+        // Moves for the false edge need somewhere to go
+        bool const stub =
+            fn_.instrs[fn_.blocks[alt].code[0]].op == opcode::phi;
+        if (not stub) patches_.emplace_back(at, alt);
+
+        go(stub ? -1 : static_cast<int>(b), in.targets[0], in.edges[0]);
+        if (stub) {
+          fn_.code[at].b = static_cast<int>(fn_.code.size());
+          go(static_cast<int>(b), alt, in.edges[1]);
+        }
+        break;
+      }
+
+      default: // binary operators
+        emit({.op     = in.op,
+              .dst    = id,
+              .a      = arg(0),
+              .b      = arg(1),
+              .origin = in.origin});
+      }
+    }
+  }
+
+  for (auto const& [at, block] : patches_) {
+    auto& op = fn_.code[at];
+    (op.op == opcode::jump ? op.a : op.b) = starts_[block];
+  }
+}
+
+void generator::moves(int target, int edge) {
+  std::vector<std::pair<int, int>> copies; // (to, from)
+  for (auto const id : fn_.blocks[target].code) {
+    auto const& in = fn_.instrs[id];
+    if (in.op != opcode::phi) break;
+    if (in.args[edge] != id) copies.emplace_back(id, in.args[edge]);
+  }
+
+  // The phis are assigned all at once, so if one reads another (a swap, say)
+  // everything goes through spare registers first
+  bool const overlap = std::ranges::any_of(copies, [&](auto const& copy) {
+    return std::ranges::any_of(copies, [&](auto const& other) {
+      return other.first == copy.second;
+    });
+  });
+  if (not overlap) {
+    for (auto const& [to, from] : copies) {
+      emit({.op = opcode::move, .dst = to, .a = from});
+    }
+    return;
+  }
+
+  auto const spare = static_cast<int>(fn_.instrs.size());
+  for (std::size_t i = 0; i < copies.size(); ++i) {
+    emit({.op  = opcode::move,
+          .dst = spare + static_cast<int>(i),
+          .a   = copies[i].second});
+  }
+  for (std::size_t i = 0; i < copies.size(); ++i) {
+    emit({.op  = opcode::move,
+          .dst = copies[i].first,
+          .a   = spare + static_cast<int>(i)});
+  }
+  fn_.registers =
+      std::max(fn_.registers, spare + static_cast<int>(copies.size()));
+}
+
+void generator::go(int from, int target, int edge) {
+  moves(target, edge);
+  if (from >= 0 and target == from + 1) return;
+
+  patches_.emplace_back(emit({.op = opcode::jump}), target);
+}
+
+} // namespace
+
+void generate(function& fn) { generator{fn}.run(); }
+
+} // namespace lox::ir
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <lox/ast/ast.hpp>
+#include <lox/interpreter/value.hpp>
+#include <lox/token/token.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace lox {
+
+class interpreter;
+
+namespace jit {
+class code;
+} // namespace jit
+
+// An SSA intermediate representation of a function, for optimisations that
+// need to see more than one expression at a time.
+//
+// Each instruction defines (at most) one value, named by the instruction's
+// index, so values are registers that are only ever written once. Locals
+// disappear: every assignment defines a new value, and where control flow
+// merges a phi picks between them depending on which predecessor we came
+// from. Instructions are grouped into basic blocks, each ending in a jump,
+// branch or return.
+namespace ir {
+
+// clang-format off
+// Immediates are in brackets and arguments (values) in parentheses.
+enum class opcode : std::uint8_t {
+  param,         // [index]
+  constant,      // [index into the function's constants]
+  phi,           // (one per predecessor, in the same order)
+
+  equal, not_equal, greater, greater_equal, less, less_equal,
+  add, subtract, multiply, divide,
+  negate, not_,
+
+  get_global,    // [slot]
+  set_global,    // [slot] (value)
+  call,          // (callee, args...)
+  print, echo,   // (value)
+
+  // Terminators. A branch goes to its first target if the condition is
+  // truthy.
+  jump,          // -> target
+  branch,        // (cond) -> target, alt
+  return_,       // (value)
+
+  // Only in generated code (see operation). A tail call is a call whose
+  // result the return after it returns, so the callee can take over the
+  // caller's registers.
+  move, tail_call,
+};
+// clang-format on
+
+struct instr {
+  opcode           op;
+  std::vector<int> args;
+  int              imm    = -1;
+  int              origin = -1; // index into tokens, for errors
+  int              block  = -1;
+
+  // Successors of a terminator, and the index of this block in each one's
+  // predecessors (to pick phi arguments with).
+  std::array<int, 2> targets{-1, -1};
+  std::array<int, 2> edges{-1, -1};
+};
+
+struct block {
+  std::vector<int> code; // indices into instrs, phis first
+  std::vector<int> preds;
+};
+
+// An instruction of the register code that IR is run as. Every value keeps
+// the register it's numbered with and phis turn into moves on the way into
+// their block, so the code is a flat list, run in order.
+//
+// Operands are registers except for immediates (as in the IR) and targets,
+// which are indices into the code. A branch falls through if the condition
+// is truthy and goes to `b` if not. A call's arguments are `c` registers
+// listed from `b` in the function's arguments.
+struct operation {
+  opcode       op;
+  std::int32_t dst    = -1;
+  std::int32_t a      = -1;
+  std::int32_t b      = -1;
+  std::int32_t c      = -1;
+  std::int32_t origin = -1;
+};
+
+// Instructions that aren't in any block's code are dead; they keep their
+// index until the function is compacted.
+struct function {
+  std::string        name;
+  int                arity = 0;
+  std::vector<instr> instrs;
+  std::vector<block> blocks; // the entry is blocks[0]
+  std::vector<value> constants;
+  std::vector<token> tokens;
+
+  // Filled in by generate
+  std::vector<operation> code;
+  std::vector<int>       arguments;
+  int                    registers = 0;
+
+  // Kept by the interpreter for the JIT (see jit.hpp). Interpreters on
+  // different threads can share a function (see interpreter::spawn), so the
+  // counts are atomic (increments racing might be lost, which is fine) and
+  // the machine code is made once, under jit_mutex, and kept until the
+  // function goes.
+  std::atomic<int>              hotness{0}; // calls and loop iterations
+  std::atomic<int>              bailouts{0};
+  std::atomic<bool>             jit_off{false}; // can't or shouldn't compile
+  std::atomic<jit::code const*> native{nullptr};
+  std::mutex                    jit_mutex;
+  std::shared_ptr<jit::code>    jit_code; // owns native
+};
+
+// Lowers a resolved function to IR, or returns null if it uses something the
+// IR can't express yet (closures: nested functions and upvalues).
+auto lower(function_stmt const& decl, interpreter& interpreter)
+    -> std::shared_ptr<function>;
+
+// Runs common-subexpression elimination, loop-invariant code motion and
+// dead-code elimination, then renumbers what's left.
+void optimize(function& fn);
+
+// Generates the register code for a (compacted) function.
+void generate(function& fn);
+
+auto to_string(function const& fn) -> std::string;
+
+} // namespace ir
+
+} // namespace lox
@@ -0,0 +1,540 @@
+#include <lox/interpreter/interpreter.hpp>
+#include <lox/ir/ir.hpp>
+
+#include <cmath>
+#include <map>
+#include <utility>
+
+// SSA is built directly from the AST as in Braun et al., "Simple and
+// Efficient Construction of Static Single Assignment Form" (2013). Each block
+// remembers the value each local slot was last given in it. Reading a slot
+// that a block hasn't written looks it up in the predecessors, adding a phi
+// where they might disagree. A block is sealed once all its predecessors are
+// known; until then, reads in it make placeholder phis that are filled in
+// when it's sealed. Phis that turn out to only ever have one value are
+// replaced by it.
+
+namespace lox::ir {
+
+namespace {
+
+// Thrown on anything the IR can't express
+struct unsupported {};
+
+class lowering {
+public:
+  lowering(function& fn, interpreter& interpreter)
+      : fn_(fn), interpreter_(interpreter) {}
+
+  void lower(function_stmt const& decl);
+
+  auto operator()(literal_expr const& e) -> int;
+  auto operator()(variable_expr const& e) -> int;
+  auto operator()(box<group_expr> const& e) -> int;
+  auto operator()(box<assign_expr> const& e) -> int;
+  auto operator()(box<unary_expr> const& e) -> int;
+  auto operator()(box<logical_expr> const& e) -> int;
+  auto operator()(box<binary_expr> const& e) -> int;
+  auto operator()(box<call_expr> const& e) -> int;
+  auto operator()(box<conditional_expr> const& e) -> int;
+  auto operator()(box<suspend_expr> const& e) -> int;
+  auto operator()(box<array_expr> const& e) -> int;
+  auto operator()(box<index_expr> const& e) -> int;
+  auto operator()(box<set_index_expr> const& e) -> int;
+
+  void operator()(expression_stmt const& s);
+  void operator()(print_stmt const& s);
+  void operator()(variable_stmt const& s);
+  void operator()(break_stmt const& s);
+  void operator()(return_stmt const& s);
+  void operator()(box<block_stmt> const& s);
+  void operator()(box<function_stmt> const& s);
+  void operator()(box<if_stmt> const& s);
+  void operator()(box<while_stmt> const& s);
+
+private:
+  function&    fn_;
+  interpreter& interpreter_;
+
+  int              current_ = 0;
+  std::vector<int> loops_; // the exit block of each enclosing loop
+
+  // Per block: the value of each slot written in it, whether it's sealed and
+  // the placeholder phis (by slot) waiting for it to be.
+  std::vector<std::map<int, int>>              defs_;
+  std::vector<bool>                            sealed_;
+  std::vector<std::vector<std::pair<int, int>>> incomplete_;
+
+  // What each removed phi was replaced with, or -1
+  std::vector<int>       replaced_;
+  std::map<literal, int> constant_ids_;
+
+  auto eval(expr const& e) -> int { return std::visit(*this, e); }
+  void exec(stmt const& s) { std::visit(*this, s); }
+
+  auto new_block() -> int;
+  auto emit(opcode op, std::vector<int> args, int imm = -1) -> int;
+  auto emit(opcode op, std::vector<int> args, int imm, token const& origin)
+      -> int;
+  auto constant(literal const& literal) -> int;
+  auto nil() -> int { return constant(std::monostate{}); }
+
+  void jump(int target);
+  void branch(int cond, int target, int alt);
+  // Carries on in a new block that nothing jumps to, after a return or break.
+  void unreachable();
+
+  void write(int slot, int block, int value);
+  auto read(int slot, int block) -> int;
+  auto read_recursive(int slot, int block) -> int;
+  auto add_phi(int block, std::vector<int> args) -> int;
+  auto add_phi_operands(int slot, int phi) -> int;
+  auto remove_trivial_phi(int phi) -> int;
+  void seal(int block);
+  auto resolve(int value) const -> int;
+
+  // Points every argument at what it ended up being replaced with.
+  void finish();
+};
+
+void lowering::lower(function_stmt const& decl) {
+  // Coroutines keep their frames in the bytecode's form (see coroutine.hpp)
+  if (decl.kind != function_kind::plain) throw unsupported{};
+
+  fn_.name  = decl.name.lexeme;
+  fn_.arity = static_cast<int>(decl.params.size());
+
+  current_ = new_block();
+  seal(current_);
+  for (int i = 0; i < fn_.arity; ++i) {
+    write(i, current_, emit(opcode::param, {}, i));
+  }
+
+  // Expression statements directly in the body echo, as they do in bytecode
+  for (auto const& s : decl.body) {
+    if (auto const* e = std::get_if<expression_stmt>(&s)) {
+      emit(opcode::echo, {eval(e->ex)});
+    } else {
+      exec(s);
+    }
+  }
+  emit(opcode::return_, {nil()});
+
+  finish();
+}
+
+auto lowering::new_block() -> int {
+  fn_.blocks.emplace_back();
+  defs_.emplace_back();
+  sealed_.push_back(false);
+  incomplete_.emplace_back();
+  return static_cast<int>(fn_.blocks.size()) - 1;
+}
+
+auto lowering::emit(opcode op, std::vector<int> args, int imm) -> int {
+  auto const id = static_cast<int>(fn_.instrs.size());
+  fn_.instrs.push_back({.op = op, .args = std::move(args), .imm = imm,
+                        .block = current_});
+  fn_.blocks[current_].code.push_back(id);
+  replaced_.push_back(-1);
+  return id;
+}
+
+auto lowering::emit(opcode op, std::vector<int> args, int imm,
+                    token const& origin) -> int {
+  auto const id = emit(op, std::move(args), imm);
+  fn_.tokens.push_back(origin);
+  fn_.instrs[id].origin = static_cast<int>(fn_.tokens.size()) - 1;
+  return id;
+}
+
+auto lowering::constant(literal const& literal) -> int {
+  // -0 compares equal to 0, and NaN to nothing, so they can't share entries
+  auto const* number = std::get_if<double>(&literal);
+  bool const  unique =
+      number != nullptr and
+      ((*number == 0 and std::signbit(*number)) or std::isnan(*number));
+
+  auto const next = static_cast<int>(fn_.constants.size());
+  auto const [it, inserted] =
+      unique ? std::pair{constant_ids_.end(), true}
+             : constant_ids_.try_emplace(literal, next);
+  if (inserted) fn_.constants.push_back(values::to_value(literal));
+
+  return emit(opcode::constant, {}, inserted ? next : it->second);
+}
+
+void lowering::jump(int target) {
+  auto const id = emit(opcode::jump, {});
+  auto&      in = fn_.instrs[id];
+
+  fn_.blocks[target].preds.push_back(current_);
+  in.targets[0] = target;
+  in.edges[0]   = static_cast<int>(fn_.blocks[target].preds.size()) - 1;
+}
+
+void lowering::branch(int cond, int target, int alt) {
+  auto const id = emit(opcode::branch, {cond});
+  auto&      in = fn_.instrs[id];
+
+  fn_.blocks[target].preds.push_back(current_);
+  fn_.blocks[alt].preds.push_back(current_);
+  in.targets = {target, alt};
+  in.edges   = {static_cast<int>(fn_.blocks[target].preds.size()) - 1,
+                static_cast<int>(fn_.blocks[alt].preds.size()) - 1};
+}
+
+void lowering::unreachable() {
+  current_ = new_block();
+  seal(current_);
+}
+
+void lowering::write(int slot, int block, int value) {
+  defs_[block][slot] = value;
+}
+
+auto lowering::read(int slot, int block) -> int {
+  auto const& defs = defs_[block];
+  if (auto it = defs.find(slot); it != defs.end()) return resolve(it->second);
+  return read_recursive(slot, block);
+}
+
+auto lowering::read_recursive(int slot, int block) -> int {
+  auto const& preds = fn_.blocks[block].preds;
+
+  int value = -1;
+  if (not sealed_[block]) {
+    value = add_phi(block, {});
+    incomplete_[block].emplace_back(slot, value);
+  } else if (preds.size() == 1) {
+    value = read(slot, preds[0]);
+  } else if (preds.empty()) {
+    // Only in unreachable code, where the value doesn't matter. It goes first
+    // in case the block has already ended.
+    auto const saved = std::exchange(current_, block);
+    value            = nil();
+    current_         = saved;
+
+    auto& code = fn_.blocks[block].code;
+    code.pop_back();
+    code.insert(code.begin(), value);
+  } else {
+    // Breaks cycles through loops
+    value = add_phi(block, {});
+    write(slot, block, value);
+    value = add_phi_operands(slot, value);
+  }
+
+  write(slot, block, value);
+  return value;
+}
+
+auto lowering::add_phi(int block, std::vector<int> args) -> int {
+  auto const id = static_cast<int>(fn_.instrs.size());
+  fn_.instrs.push_back(
+      {.op = opcode::phi, .args = std::move(args), .block = block});
+  auto& code = fn_.blocks[block].code;
+  code.insert(code.begin(), id);
+  replaced_.push_back(-1);
+  return id;
+}
+
+auto lowering::add_phi_operands(int slot, int phi) -> int {
+  for (auto const pred : fn_.blocks[fn_.instrs[phi].block].preds) {
+    auto const value = read(slot, pred);
+    fn_.instrs[phi].args.push_back(value);
+  }
+  return remove_trivial_phi(phi);
+}
+
+auto lowering::remove_trivial_phi(int phi) -> int {
+  int same = -1;
+  for (auto arg : fn_.instrs[phi].args) {
+    arg = resolve(arg);
+    if (arg == same or arg == phi) continue;
+    if (same >= 0) return phi; // merges at least two values
+    same = arg;
+  }
+  if (same < 0) return phi; // only reachable from itself; left for DCE
+
+  auto& code = fn_.blocks[fn_.instrs[phi].block].code;
+  std::erase(code, phi);
+  replaced_[phi] = same;
+  return same;
+}
+
+void lowering::seal(int block) {
+  for (auto const& [slot, phi] : std::exchange(incomplete_[block], {})) {
+    add_phi_operands(slot, phi);
+  }
+  sealed_[block] = true;
+}
+
+auto lowering::resolve(int value) const -> int {
+  while (replaced_[value] >= 0) { value = replaced_[value]; }
+  return value;
+}
+
+void lowering::finish() {
+  // Removing a phi can make the phis that use it trivial too
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto& in : fn_.instrs) {
+      for (auto& arg : in.args) { arg = resolve(arg); }
+    }
+    for (auto& block : fn_.blocks) {
+      for (auto const id : std::vector<int>(block.code)) {
+        if (fn_.instrs[id].op != opcode::phi) continue;
+        changed |= remove_trivial_phi(id) != id;
+      }
+    }
+  }
+}
+
+auto lowering::operator()(literal_expr const& e) -> int {
+  return constant(e.literal);
+}
+
+auto lowering::operator()(variable_expr const& e) -> int {
+  switch (e.resolved.kind) {
+  case binding_kind::local:
+    return read(e.resolved.index, current_);
+  case binding_kind::upvalue:
+    throw unsupported{};
+  case binding_kind::global:
+    return emit(opcode::get_global, {}, e.resolved.index, e.name);
+  default:
+    return emit(opcode::get_global, {}, interpreter_.global(e.name.lexeme),
+                e.name);
+  }
+}
+
+auto lowering::operator()(box<group_expr> const& e) -> int {
+  return eval(e->ex);
+}
+
+auto lowering::operator()(box<assign_expr> const& e) -> int {
+  auto const value = eval(e->value);
+
+  switch (e->resolved.kind) {
+  case binding_kind::local:
+    write(e->resolved.index, current_, value);
+    break;
+  case binding_kind::upvalue:
+    throw unsupported{};
+  case binding_kind::global:
+    emit(opcode::set_global, {value}, e->resolved.index, e->name);
+    break;
+  default:
+    emit(opcode::set_global, {value}, interpreter_.global(e->name.lexeme),
+         e->name);
+  }
+  return value;
+}
+
+auto lowering::operator()(box<unary_expr> const& e) -> int {
+  auto const right = eval(e->right);
+  return emit(e->op.type == token_type::BANG ? opcode::not_ : opcode::negate,
+              {right}, -1, e->op);
+}
+
+auto lowering::operator()(box<logical_expr> const& e) -> int {
+  auto const left  = eval(e->left);
+  auto const right = new_block();
+  auto const end   = new_block();
+
+  // Short-circuiting makes the left operand the result
+  if (e->op.type == token_type::OR) branch(left, end, right);
+  else branch(left, right, end);
+
+  seal(right);
+  current_         = right;
+  auto const value = eval(e->right);
+  jump(end);
+
+  // The branch was added to end's predecessors before the jump
+  seal(end);
+  current_ = end;
+  return remove_trivial_phi(add_phi(end, {left, value}));
+}
+
+auto lowering::operator()(box<binary_expr> const& e) -> int {
+  auto const left = eval(e->left);
+  if (e->op.type == token_type::COMMA) return eval(e->right);
+  auto const right = eval(e->right);
+
+  opcode op{};
+  switch (e->op.type) {
+  case token_type::BANG_EQUAL:
+    op = opcode::not_equal;
+    break;
+  case token_type::EQUAL_EQUAL:
+    op = opcode::equal;
+    break;
+  case token_type::GREATER:
+    op = opcode::greater;
+    break;
+  case token_type::GREATER_EQUAL:
+    op = opcode::greater_equal;
+    break;
+  case token_type::LESS:
+    op = opcode::less;
+    break;
+  case token_type::LESS_EQUAL:
+    op = opcode::less_equal;
+    break;
+  case token_type::PLUS:
+    op = opcode::add;
+    break;
+  case token_type::MINUS:
+    op = opcode::subtract;
+    break;
+  case token_type::STAR:
+    op = opcode::multiply;
+    break;
+  case token_type::SLASH:
+    op = opcode::divide;
+    break;
+  default:
+    throw runtime_error(e->op, "unhandled binary operator");
+  }
+  return emit(op, {left, right}, -1, e->op);
+}
+
+auto lowering::operator()(box<call_expr> const& e) -> int {
+  std::vector<int> args{eval(e->callee)};
+  for (auto const& arg : e->args) { args.push_back(eval(arg)); }
+  return emit(opcode::call, std::move(args), -1, e->paren);
+}
+
+auto lowering::operator()(box<conditional_expr> const& e) -> int {
+  auto const cond = eval(e->cond);
+  auto const then = new_block();
+  auto const alt  = new_block();
+  auto const end  = new_block();
+  branch(cond, then, alt);
+
+  seal(then);
+  current_         = then;
+  auto const first = eval(e->then);
+  jump(end);
+
+  seal(alt);
+  current_          = alt;
+  auto const second = eval(e->alt);
+  jump(end);
+
+  seal(end);
+  current_ = end;
+  return remove_trivial_phi(add_phi(end, {first, second}));
+}
+
+auto lowering::operator()(box<suspend_expr> const& /*e*/) -> int {
+  throw unsupported{};
+}
+
+// Arrays are left to the bytecode
+auto lowering::operator()(box<array_expr> const& /*e*/) -> int {
+  throw unsupported{};
+}
+
+auto lowering::operator()(box<index_expr> const& /*e*/) -> int {
+  throw unsupported{};
+}
+
+auto lowering::operator()(box<set_index_expr> const& /*e*/) -> int {
+  throw unsupported{};
+}
+
+void lowering::operator()(expression_stmt const& s) { eval(s.ex); }
+
+void lowering::operator()(print_stmt const& s) {
+  emit(opcode::print, {eval(s.ex)});
+}
+
+void lowering::operator()(variable_stmt const& s) {
+  // Only the top level has globals, and it isn't lowered
+  if (s.resolved.kind != binding_kind::local) throw unsupported{};
+
+  auto const value = s.init ? eval(*s.init) : nil();
+  write(s.resolved.index, current_, value);
+}
+
+void lowering::operator()(break_stmt const& /*s*/) {
+  jump(loops_.back());
+  unreachable();
+}
+
+void lowering::operator()(return_stmt const& s) {
+  emit(opcode::return_, {s.value ? eval(*s.value) : nil()});
+  unreachable();
+}
+
+void lowering::operator()(box<block_stmt> const& s) {
+  for (auto const& ss : s->stmts) { exec(ss); }
+}
+
+void lowering::operator()(box<function_stmt> const& /*s*/) {
+  throw unsupported{};
+}
+
+void lowering::operator()(box<if_stmt> const& s) {
+  auto const cond = eval(s->cond);
+  auto const then = new_block();
+  auto const alt  = s->alt ? new_block() : -1;
+  auto const end  = new_block();
+  branch(cond, then, s->alt ? alt : end);
+
+  seal(then);
+  current_ = then;
+  exec(s->then);
+  jump(end);
+
+  if (s->alt) {
+    seal(alt);
+    current_ = alt;
+    exec(*s->alt);
+    jump(end);
+  }
+
+  seal(end);
+  current_ = end;
+}
+
+void lowering::operator()(box<while_stmt> const& s) {
+  // The header can't be sealed until the body has jumped back to it
+  auto const header = new_block();
+  jump(header);
+  current_ = header;
+
+  auto const cond = eval(s->cond);
+  auto const body = new_block();
+  auto const exit = new_block();
+  branch(cond, body, exit);
+
+  seal(body);
+  current_ = body;
+  loops_.push_back(exit);
+  exec(s->body);
+  loops_.pop_back();
+  jump(header);
+
+  seal(header);
+  seal(exit);
+  current_ = exit;
+}
+
+} // namespace
+
+auto lower(function_stmt const& decl, interpreter& interpreter)
+    -> std::shared_ptr<function> {
+  auto fn = std::make_shared<function>();
+  try {
+    lowering{*fn, interpreter}.lower(decl);
+  } catch (unsupported const&) {
+    return nullptr;
+  }
+  return fn;
+}
+
+} // namespace lox::ir
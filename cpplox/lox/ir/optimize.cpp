@@ -0,0 +1,499 @@
+#include <lox/ir/ir.hpp>
+
+#include <algorithm>
+#include <map>
+#include <ranges>
+#include <tuple>
+#include <utility>
+
+namespace lox::ir {
+
+namespace {
+
+// What's known about the type of a value. `unknown` is for phis in loops
+// that haven't been worked out yet; `any` means it could be anything.
+enum class type { unknown, nil, boolean, number, string, any };
+
+auto join(type a, type b) -> type {
+  if (a == type::unknown) return b;
+  if (b == type::unknown or a == b) return a;
+  return type::any;
+}
+
+auto type_of(value const& constant) -> type {
+  if (std::holds_alternative<std::monostate>(constant)) return type::nil;
+  if (std::holds_alternative<bool>(constant)) return type::boolean;
+  if (std::holds_alternative<double>(constant)) return type::number;
+  if (std::holds_alternative<string>(constant)) return type::string;
+  return type::any;
+}
+
+auto is_terminator(opcode op) -> bool {
+  return op == opcode::jump or op == opcode::branch or op == opcode::return_;
+}
+
+// Whether an instruction's value only depends on its operands
+auto is_pure(opcode op) -> bool {
+  switch (op) {
+  case opcode::constant:
+  case opcode::equal:
+  case opcode::not_equal:
+  case opcode::greater:
+  case opcode::greater_equal:
+  case opcode::less:
+  case opcode::less_equal:
+  case opcode::add:
+  case opcode::subtract:
+  case opcode::multiply:
+  case opcode::divide:
+  case opcode::negate:
+  case opcode::not_:
+    return true;
+  default:
+    return false;
+  }
+}
+
+class optimizer {
+public:
+  explicit optimizer(function& fn) : fn_(fn) {}
+
+  void run() {
+    analyse();
+    eliminate_common_subexpressions();
+    infer_types();
+    hoist_loop_invariants();
+    eliminate_dead_code();
+    compact();
+  }
+
+private:
+  function& fn_;
+
+  std::vector<int>              order_;   // reachable blocks, reverse postorder
+  std::vector<int>              rpo_;     // position in order_, or -1
+  std::vector<int>              idom_;    // immediate dominator
+  std::vector<std::vector<int>> children_; // in the dominator tree
+  std::vector<type>             types_;
+
+  [[nodiscard]] auto terminator(int block) const -> instr const& {
+    return fn_.instrs[fn_.blocks[block].code.back()];
+  }
+  [[nodiscard]] auto successors(int block) const -> std::vector<int> {
+    auto const& in = terminator(block);
+    std::vector<int> succs;
+    for (auto const target : in.targets) {
+      if (target >= 0) succs.push_back(target);
+    }
+    return succs;
+  }
+  [[nodiscard]] auto dominates(int a, int b) const -> bool {
+    while (b != a and b != 0) { b = idom_[b]; }
+    return b == a;
+  }
+
+  // Whether running the instruction can't fail or affect anything else, so
+  // it can be moved or removed freely.
+  [[nodiscard]] auto is_safe(instr const& in) const -> bool;
+
+  void analyse();
+  void eliminate_common_subexpressions();
+  void infer_types();
+  void hoist_loop_invariants();
+  void eliminate_dead_code();
+  void compact();
+
+  // Rewrites every argument through `replaced` (-1 for unchanged).
+  void replace(std::vector<int> const& replaced);
+};
+
+void optimizer::analyse() {
+  auto const n = fn_.blocks.size();
+
+  // Postorder by depth-first search from the entry
+  order_.clear();
+  std::vector<bool> seen(n);
+  std::vector<std::pair<int, std::size_t>> stack{{0, 0}};
+  seen[0] = true;
+  while (not stack.empty()) {
+    auto& [block, next] = stack.back();
+    auto const succs    = successors(block);
+    if (next < succs.size()) {
+      auto const succ = succs[next++];
+      if (not seen[succ]) {
+        seen[succ] = true;
+        stack.emplace_back(succ, 0);
+      }
+    } else {
+      order_.push_back(block);
+      stack.pop_back();
+    }
+  }
+  std::ranges::reverse(order_);
+
+  rpo_.assign(n, -1);
+  for (std::size_t i = 0; i < order_.size(); ++i) {
+    rpo_[order_[i]] = static_cast<int>(i);
+  }
+
+  // Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+  idom_.assign(n, -1);
+  idom_[0] = 0;
+  auto const intersect = [&](int a, int b) {
+    while (a != b) {
+      while (rpo_[a] > rpo_[b]) { a = idom_[a]; }
+      while (rpo_[b] > rpo_[a]) { b = idom_[b]; }
+    }
+    return a;
+  };
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto const block : order_ | std::views::drop(1)) {
+      int idom = -1;
+      for (auto const pred : fn_.blocks[block].preds) {
+        if (rpo_[pred] < 0 or idom_[pred] < 0) continue;
+        idom = idom < 0 ? pred : intersect(pred, idom);
+      }
+      if (idom_[block] != idom) {
+        idom_[block] = idom;
+        changed      = true;
+      }
+    }
+  }
+
+  children_.assign(n, {});
+  for (auto const block : order_ | std::views::drop(1)) {
+    children_[idom_[block]].push_back(block);
+  }
+}
+
+void optimizer::replace(std::vector<int> const& replaced) {
+  auto const resolve = [&](int value) {
+    while (replaced[value] >= 0) { value = replaced[value]; }
+    return value;
+  };
+  for (auto& in : fn_.instrs) {
+    for (auto& arg : in.args) { arg = resolve(arg); }
+  }
+}
+
+// Global value numbering over the dominator tree: a pure instruction that
+// does the same thing to the same values as one that dominates it is
+// replaced by that one. This is safe even for instructions that can fail,
+// since if the first one failed we'd never have got to the second.
+void optimizer::eliminate_common_subexpressions() {
+  using key = std::tuple<opcode, std::vector<int>, int>;
+
+  std::map<key, int> available;
+  std::vector<int>   replaced(fn_.instrs.size(), -1);
+  auto const         resolve = [&](int value) {
+    while (replaced[value] >= 0) { value = replaced[value]; }
+    return value;
+  };
+
+  auto const visit = [&](auto const& self, int block) -> void {
+    std::vector<key> added;
+
+    auto& code = fn_.blocks[block].code;
+    std::erase_if(code, [&](int id) {
+      auto& in = fn_.instrs[id];
+      for (auto& arg : in.args) { arg = resolve(arg); }
+      if (not is_pure(in.op)) return false;
+
+      // Equal constants already share an index
+      key k{in.op, in.args, in.imm};
+      auto [it, inserted] = available.try_emplace(k, id);
+      if (inserted) {
+        added.push_back(std::move(k));
+        return false;
+      }
+      replaced[id] = it->second;
+      return true;
+    });
+
+    for (auto const child : children_[block]) { self(self, child); }
+    for (auto const& k : added) { available.erase(k); }
+  };
+  visit(visit, 0);
+
+  replace(replaced);
+}
+
+void optimizer::infer_types() {
+  types_.assign(fn_.instrs.size(), type::unknown);
+
+  // Phis in loops depend on themselves, so start from unknown and go until
+  // nothing changes.
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto const block : order_) {
+      for (auto const id : fn_.blocks[block].code) {
+        auto const& in = fn_.instrs[id];
+        auto const  arg = [&](std::size_t i) { return types_[in.args[i]]; };
+        auto const  numbers = [&] {
+          return arg(0) == type::number and arg(1) == type::number;
+        };
+
+        type t = type::any;
+        switch (in.op) {
+        case opcode::constant:
+          t = type_of(fn_.constants[in.imm]);
+          break;
+        case opcode::phi:
+          t = type::unknown;
+          for (auto const a : in.args) { t = join(t, types_[a]); }
+          break;
+        case opcode::equal:
+        case opcode::not_equal:
+        case opcode::greater:
+        case opcode::greater_equal:
+        case opcode::less:
+        case opcode::less_equal:
+        case opcode::not_:
+          t = type::boolean;
+          break;
+        case opcode::add:
+          if (arg(0) == type::unknown or arg(1) == type::unknown) {
+            t = type::unknown;
+          } else if (numbers()) {
+            t = type::number;
+          } else if (arg(0) == type::string or arg(1) == type::string) {
+            t = type::string;
+          }
+          break;
+        case opcode::subtract:
+        case opcode::divide:
+        case opcode::negate:
+          t = type::number;
+          break;
+        case opcode::multiply:
+          if (arg(0) == type::unknown or arg(1) == type::unknown) {
+            t = type::unknown;
+          } else if (numbers()) {
+            t = type::number;
+          }
+          break;
+        default:
+          break;
+        }
+
+        if (types_[id] != t) {
+          types_[id] = t;
+          changed    = true;
+        }
+      }
+    }
+  }
+}
+
+auto optimizer::is_safe(instr const& in) const -> bool {
+  auto const arg = [&](std::size_t i) { return types_[in.args[i]]; };
+  auto const numbers = [&] {
+    return arg(0) == type::number and arg(1) == type::number;
+  };
+  auto const strings = [&] {
+    return arg(0) == type::string and arg(1) == type::string;
+  };
+  auto const addable = [&](type t) {
+    return t == type::number or t == type::string;
+  };
+
+  switch (in.op) {
+  case opcode::param:
+  case opcode::constant:
+  case opcode::phi:
+  case opcode::equal:
+  case opcode::not_equal:
+  case opcode::not_:
+    return true;
+  case opcode::greater:
+  case opcode::greater_equal:
+  case opcode::less:
+  case opcode::less_equal:
+    return numbers() or strings();
+  case opcode::add:
+    return addable(arg(0)) and addable(arg(1));
+  case opcode::subtract:
+  case opcode::multiply:
+    return numbers();
+  case opcode::negate:
+    return arg(0) == type::number;
+  default:
+    // Division can always fail, by zero
+    return false;
+  }
+}
+
+// Moves instructions whose operands don't change in a loop out in front of
+// it, so they run once instead of on every iteration. Only safe instructions
+// can move in general, since the loop body might never run. The exception is
+// the loop's header, which always runs at least once: anything there that
+// would have been the first thing to run (or fail) can move too.
+void optimizer::hoist_loop_invariants() {
+  struct loop {
+    int               header;
+    std::vector<bool> body; // by block
+    int               size = 0;
+  };
+
+  // Natural loops, from the back edges to their headers
+  std::vector<loop> loops;
+  for (auto const block : order_) {
+    for (auto const succ : successors(block)) {
+      if (not dominates(succ, block)) continue;
+
+      loop l{succ, std::vector<bool>(fn_.blocks.size()), 0};
+      std::vector<int> work{block};
+      l.body[succ] = true;
+      while (not work.empty()) {
+        auto const b = work.back();
+        work.pop_back();
+        if (l.body[b]) continue;
+        l.body[b] = true;
+        for (auto const pred : fn_.blocks[b].preds) {
+          if (rpo_[pred] >= 0) work.push_back(pred);
+        }
+      }
+      l.size = static_cast<int>(std::ranges::count(l.body, true));
+      loops.push_back(std::move(l));
+    }
+  }
+
+  // Inner loops first, so that what they hoist can carry on outwards
+  std::ranges::sort(loops, {}, &loop::size);
+
+  for (auto const& l : loops) {
+    // The one way in, which must lead nowhere else
+    int  preheader = -1;
+    bool single    = true;
+    for (auto const pred : fn_.blocks[l.header].preds) {
+      if (rpo_[pred] < 0 or l.body[pred]) continue;
+      single    = preheader < 0;
+      preheader = pred;
+    }
+    if (preheader < 0 or not single or
+        terminator(preheader).op != opcode::jump) {
+      continue;
+    }
+
+    auto&      into = fn_.blocks[preheader].code;
+    auto const end  = [&] { return into.end() - 1; }; // before the jump
+
+    for (auto const block : order_) {
+      if (not l.body[block]) continue;
+
+      // Whether everything so far in the header has been hoisted or is safe
+      bool first = block == l.header;
+
+      std::erase_if(fn_.blocks[block].code, [&](int id) {
+        auto& in = fn_.instrs[id];
+        bool const invariant =
+            is_pure(in.op) and std::ranges::none_of(in.args, [&](int arg) {
+              return l.body[fn_.instrs[arg].block];
+            });
+        bool const safe = is_safe(in);
+
+        if (invariant and (safe or first)) {
+          into.insert(end(), id);
+          in.block = preheader;
+          return true;
+        }
+        if (not safe) first = false;
+        return false;
+      });
+    }
+  }
+}
+
+void optimizer::eliminate_dead_code() {
+  std::vector<bool> live(fn_.instrs.size());
+  std::vector<int>  work;
+
+  for (auto const block : order_) {
+    for (auto const id : fn_.blocks[block].code) {
+      auto const& in = fn_.instrs[id];
+      // Parameters stay so that they keep their registers (see compact)
+      if (not is_safe(in) or is_terminator(in.op) or
+          in.op == opcode::param) {
+        work.push_back(id);
+      }
+    }
+  }
+  while (not work.empty()) {
+    auto const id = work.back();
+    work.pop_back();
+    if (live[id]) continue;
+    live[id] = true;
+    for (auto const arg : fn_.instrs[id].args) { work.push_back(arg); }
+  }
+
+  for (auto& block : fn_.blocks) {
+    std::erase_if(block.code, [&](int id) { return not live[id]; });
+  }
+}
+
+// Drops unreachable blocks and renumbers the instructions that are left in
+// order, so they're easier to read. Parameters come first in the entry block,
+// so they end up numbered (and in registers) 0 to arity - 1.
+void optimizer::compact() {
+  std::vector<int> block_ids(fn_.blocks.size(), -1);
+  for (std::size_t i = 0; i < order_.size(); ++i) {
+    block_ids[order_[i]] = static_cast<int>(i);
+  }
+
+  std::vector<int>   ids(fn_.instrs.size(), -1);
+  std::vector<instr> instrs;
+  std::vector<block> blocks;
+  for (auto const old : order_) {
+    auto& b = fn_.blocks[old];
+
+    // Forget edges from unreachable blocks, and their phi arguments
+    std::vector<int> keep;
+    block            nb;
+    for (std::size_t i = 0; i < b.preds.size(); ++i) {
+      if (block_ids[b.preds[i]] < 0) continue;
+      keep.push_back(static_cast<int>(i));
+      nb.preds.push_back(block_ids[b.preds[i]]);
+    }
+
+    for (auto const id : b.code) {
+      ids[id]  = static_cast<int>(instrs.size());
+      auto& in = instrs.emplace_back(std::move(fn_.instrs[id]));
+      in.block = static_cast<int>(blocks.size());
+      if (in.op == opcode::phi) {
+        std::vector<int> args;
+        for (auto const i : keep) { args.push_back(in.args[i]); }
+        in.args = std::move(args);
+      }
+      nb.code.push_back(ids[id]);
+    }
+    blocks.push_back(std::move(nb));
+  }
+
+  for (auto& in : instrs) {
+    for (auto& arg : in.args) { arg = ids[arg]; }
+    for (auto& target : in.targets) {
+      if (target >= 0) target = block_ids[target];
+    }
+  }
+
+  // Predecessors have moved around, so find each edge again
+  for (std::size_t b = 0; b < blocks.size(); ++b) {
+    auto& in = instrs[blocks[b].code.back()];
+    for (std::size_t i = 0; i < 2; ++i) {
+      if (in.targets[i] < 0) continue;
+      auto const& preds = blocks[in.targets[i]].preds;
+      in.edges[i]       = static_cast<int>(
+          std::ranges::find(preds, static_cast<int>(b)) - preds.begin());
+    }
+  }
+
+  fn_.instrs = std::move(instrs);
+  fn_.blocks = std::move(blocks);
+}
+
+} // namespace
+
+void optimize(function& fn) { optimizer{fn}.run(); }
+
+} // namespace lox::ir
@@ -0,0 +1,461 @@
+#include <lox/jit/jit.hpp>
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#if defined(__x86_64__) && __has_include(<sys/mman.h>)
+#define LOX_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace lox::jit {
+
+namespace {
+
+// Where the templates expect things to be in a value (libstdc++'s layout):
+// the alternative's bytes first, then its index in a byte.
+constexpr int VALUE_SIZE   = 32;
+constexpr int INDEX_OFFSET = 24;
+
+// Alternatives that don't own anything, so copying or overwriting them is
+// just copying bytes
+constexpr std::uint8_t NIL     = 0;
+constexpr std::uint8_t BOOLEAN = 1;
+constexpr std::uint8_t NUMBER  = 2;
+static_assert(std::is_same_v<std::variant_alternative_t<NIL, value>,
+                             std::monostate>);
+static_assert(std::is_same_v<std::variant_alternative_t<BOOLEAN, value>, bool>);
+static_assert(std::is_same_v<std::variant_alternative_t<NUMBER, value>, double>);
+
+auto index_byte(value const& v) -> std::uint8_t {
+  std::uint8_t byte = 0;
+  std::memcpy(&byte, reinterpret_cast<char const*>(&v) + INDEX_OFFSET, 1);
+  return byte;
+}
+
+auto layout_matches() -> bool {
+  if (sizeof(value) != VALUE_SIZE) return false;
+
+  value const nil{};
+  value const yes{true};
+  value const pi{3.25};
+  value const text{string{"x"}};
+
+  double d = 0;
+  std::memcpy(&d, &pi, sizeof d);
+  bool b = false;
+  std::memcpy(&b, &yes, sizeof b);
+  return index_byte(nil) == NIL and index_byte(yes) == BOOLEAN and
+         index_byte(pi) == NUMBER and index_byte(text) > NUMBER and
+         d == 3.25 and b;
+}
+
+#ifdef LOX_JIT
+
+// Registers the generated code keeps things in (all callee-saved)
+//   rbx  the function's registers (value*)
+//   r12  the interpreter
+//   r13  the ir::function
+// rax, rcx, rdx and xmm0 are scratch.
+
+enum class cond : std::uint8_t {
+  b = 0x2, ae = 0x3, e = 0x4, ne = 0x5, be = 0x6, a = 0x7, s = 0x8,
+  p = 0xa, np = 0xb,
+};
+
+// Just enough of an x86-64 assembler for the templates. Memory operands are
+// always [rbx + disp32].
+class assembler {
+public:
+  std::vector<std::uint8_t> bytes;
+
+  [[nodiscard]] auto here() const -> int {
+    return static_cast<int>(bytes.size());
+  }
+
+  void raw(std::initializer_list<std::uint8_t> code) {
+    bytes.insert(bytes.end(), code);
+  }
+  void imm32(std::int32_t imm) {
+    auto const word = static_cast<std::uint32_t>(imm);
+    for (int i = 0; i < 4; ++i) bytes.push_back((word >> (8 * i)) & 0xff);
+  }
+  void imm64(std::uint64_t imm) {
+    for (int i = 0; i < 8; ++i) bytes.push_back((imm >> (8 * i)) & 0xff);
+  }
+
+  // op reg, [rbx + disp]; `reg` is the ModRM reg field (register or /digit)
+  void mem(std::initializer_list<std::uint8_t> op, int reg, int disp) {
+    raw(op);
+    bytes.push_back(static_cast<std::uint8_t>(0x80 | (reg << 3) | 3));
+    imm32(disp);
+  }
+
+  // Jumps; they return where the rel32 is for patching
+  auto jcc(cond c) -> int {
+    raw({0x0f, static_cast<std::uint8_t>(0x80 | static_cast<int>(c))});
+    imm32(0);
+    return here() - 4;
+  }
+  auto jmp() -> int {
+    raw({0xe9});
+    imm32(0);
+    return here() - 4;
+  }
+  void patch(int at, int target) {
+    auto const rel = static_cast<std::uint32_t>(target - (at + 4));
+    for (int i = 0; i < 4; ++i) bytes[at + i] = (rel >> (8 * i)) & 0xff;
+  }
+
+  void setcc(cond c, int reg8) {
+    raw({0x0f, static_cast<std::uint8_t>(0x90 | static_cast<int>(c)),
+         static_cast<std::uint8_t>(0xc0 | reg8)});
+  }
+};
+
+constexpr int RAX = 0;
+constexpr int RCX = 1;
+constexpr int XMM0 = 0;
+
+auto slot(int reg) -> int { return reg * VALUE_SIZE; }
+auto tag(int reg) -> int { return slot(reg) + INDEX_OFFSET; }
+
+class compiler {
+public:
+  compiler(ir::function const& fn, step_fn step) : fn_(fn), step_(step) {}
+
+  auto run() -> std::vector<std::uint8_t>;
+
+private:
+  ir::function const& fn_;
+  step_fn             step_;
+  assembler           as_;
+
+  std::vector<int> starts_; // where each operation's code begins
+
+  // Jumps to patch once everything's emitted: to an operation, or to the
+  // slow path of one.
+  std::vector<std::pair<int, int>> to_ops_;
+  std::vector<std::pair<int, int>> to_steps_;
+  std::vector<std::pair<int, int>> to_bails_;
+  std::vector<int>                 to_exit_; // with the result in eax
+  std::vector<int>                 to_failed_;
+
+  // Operation `pc`'s slow paths: let the interpreter run it and carry on
+  // here, or go back to the interpreter for good.
+  void slow(cond c, int pc) { to_steps_.emplace_back(as_.jcc(c), pc); }
+  void bail(cond c, int pc) { to_bails_.emplace_back(as_.jcc(c), pc); }
+
+  void guard_number(int reg, int pc) {
+    as_.mem({0x80}, 7, tag(reg)); // cmp byte [reg.index], NUMBER
+    as_.raw({NUMBER});
+    bail(cond::ne, pc);
+  }
+  // Overwriting a string or a function has to release it
+  void guard_trivial(int reg, int pc) {
+    as_.mem({0x80}, 7, tag(reg));
+    as_.raw({NUMBER});
+    slow(cond::a, pc);
+  }
+  void set_tag(int reg, std::uint8_t index) {
+    as_.mem({0xc6}, 0, tag(reg)); // mov byte [reg.index], index
+    as_.raw({index});
+  }
+
+  void call_step(int pc);
+  void arithmetic(ir::operation const& op, int pc);
+  void comparison(ir::operation const& op, int pc);
+  void truthiness_branch(ir::operation const& op, int pc);
+  void constant(ir::operation const& op, int pc);
+  void move(ir::operation const& op, int pc);
+};
+
+auto compiler::run() -> std::vector<std::uint8_t> {
+  auto const count = static_cast<int>(fn_.code.size());
+
+  // Prologue: keep the callee-saved registers and pick up the arguments
+  // (regs, interpreter, function, start)
+  as_.raw({0x53});             // push rbx
+  as_.raw({0x41, 0x54});       // push r12
+  as_.raw({0x41, 0x55});       // push r13
+  as_.raw({0x48, 0x89, 0xfb}); // mov rbx, rdi
+  as_.raw({0x49, 0x89, 0xf4}); // mov r12, rsi
+  as_.raw({0x49, 0x89, 0xd5}); // mov r13, rdx
+
+  // Entry points: the start, and the top of every loop so that a loop that's
+  // got hot in the interpreter can carry on here
+  std::vector<bool> entries(static_cast<std::size_t>(count), false);
+  entries[0] = true;
+  for (int pc = 0; pc < count; ++pc) {
+    auto const& op = fn_.code[static_cast<std::size_t>(pc)];
+    if (op.op == ir::opcode::jump and op.a <= pc) {
+      entries[static_cast<std::size_t>(op.a)] = true;
+    }
+  }
+  for (int pc = 0; pc < count; ++pc) {
+    if (not entries[static_cast<std::size_t>(pc)]) continue;
+    as_.raw({0x81, 0xf9}); // cmp ecx, pc
+    as_.imm32(pc);
+    to_ops_.emplace_back(as_.jcc(cond::e), pc);
+  }
+  as_.raw({0x89, 0xc8}); // mov eax, ecx: not an entry, so carry on there
+  to_exit_.push_back(as_.jmp());
+
+  starts_.assign(static_cast<std::size_t>(count) + 1, 0);
+  for (int pc = 0; pc < count; ++pc) {
+    starts_[static_cast<std::size_t>(pc)] = as_.here();
+    auto const& op = fn_.code[static_cast<std::size_t>(pc)];
+
+    switch (op.op) {
+    case ir::opcode::constant:
+      constant(op, pc);
+      break;
+    case ir::opcode::move:
+      move(op, pc);
+      break;
+
+    case ir::opcode::add:
+    case ir::opcode::subtract:
+    case ir::opcode::multiply:
+      arithmetic(op, pc);
+      break;
+    case ir::opcode::negate:
+      guard_number(op.a, pc);
+      guard_trivial(op.dst, pc);
+      as_.mem({0x48, 0x8b}, RAX, slot(op.a)); // mov rax, [a]
+      as_.raw({0x48, 0x0f, 0xba, 0xf8, 63});  // btc rax, 63
+      as_.mem({0x48, 0x89}, RAX, slot(op.dst));
+      set_tag(op.dst, NUMBER);
+      break;
+
+    case ir::opcode::equal:
+    case ir::opcode::not_equal:
+    case ir::opcode::greater:
+    case ir::opcode::greater_equal:
+    case ir::opcode::less:
+    case ir::opcode::less_equal:
+      comparison(op, pc);
+      break;
+
+    case ir::opcode::jump:
+      to_ops_.emplace_back(as_.jmp(), op.a);
+      break;
+    case ir::opcode::branch:
+      truthiness_branch(op, pc);
+      break;
+    case ir::opcode::return_:
+    case ir::opcode::tail_call:
+      // The interpreter does returns itself
+      as_.raw({0xb8}); // mov eax, pc
+      as_.imm32(pc);
+      to_exit_.push_back(as_.jmp());
+      break;
+
+    default:
+      call_step(pc);
+    }
+  }
+  starts_[static_cast<std::size_t>(count)] = as_.here();
+
+  // Slow paths, out of the way of the fast ones
+  for (auto const& [at, pc] : to_steps_) {
+    as_.patch(at, as_.here());
+    call_step(pc);
+    to_ops_.emplace_back(as_.jmp(), pc + 1);
+  }
+  for (auto const& [at, pc] : to_bails_) {
+    as_.patch(at, as_.here());
+    as_.raw({0xb8});
+    as_.imm32(pc);
+    to_exit_.push_back(as_.jmp());
+  }
+
+  // Failing: the interpreter has the exception
+  auto const failed = as_.here();
+  as_.raw({0xb8});
+  as_.imm32(-1);
+
+  // Epilogue
+  auto const exit = as_.here();
+  as_.raw({0x41, 0x5d}); // pop r13
+  as_.raw({0x41, 0x5c}); // pop r12
+  as_.raw({0x5b});       // pop rbx
+  as_.raw({0xc3});       // ret
+
+  for (auto const& [at, pc] : to_ops_) {
+    as_.patch(at, starts_[static_cast<std::size_t>(pc)]);
+  }
+  for (auto const at : to_exit_) as_.patch(at, exit);
+  for (auto const at : to_failed_) as_.patch(at, failed);
+
+  return std::move(as_.bytes);
+}
+
+void compiler::call_step(int pc) {
+  // The three pushes in the prologue leave the stack 16-byte aligned
+  as_.raw({0x4c, 0x89, 0xe7}); // mov rdi, r12
+  as_.raw({0x4c, 0x89, 0xee}); // mov rsi, r13
+  as_.raw({0x48, 0x89, 0xda}); // mov rdx, rbx
+  as_.raw({0xb9});             // mov ecx, pc
+  as_.imm32(pc);
+  as_.raw({0x48, 0xb8}); // mov rax, step
+  as_.imm64(std::bit_cast<std::uint64_t>(step_));
+  as_.raw({0xff, 0xd0}); // call rax
+  as_.raw({0x85, 0xc0}); // test eax, eax
+  to_failed_.push_back(as_.jcc(cond::s));
+}
+
+void compiler::arithmetic(ir::operation const& op, int pc) {
+  guard_number(op.a, pc);
+  guard_number(op.b, pc);
+  guard_trivial(op.dst, pc);
+
+  std::uint8_t const code = op.op == ir::opcode::add        ? 0x58
+                            : op.op == ir::opcode::subtract ? 0x5c
+                                                            : 0x59;
+  as_.mem({0xf2, 0x0f, 0x10}, XMM0, slot(op.a)); // movsd xmm0, [a]
+  as_.mem({0xf2, 0x0f, code}, XMM0, slot(op.b)); // addsd etc. xmm0, [b]
+  as_.mem({0xf2, 0x0f, 0x11}, XMM0, slot(op.dst));
+  set_tag(op.dst, NUMBER);
+}
+
+void compiler::comparison(ir::operation const& op, int pc) {
+  // Equality works on anything, so other types are just slow, not wrong
+  bool const equality =
+      op.op == ir::opcode::equal or op.op == ir::opcode::not_equal;
+  for (auto const reg : {op.a, op.b}) {
+    as_.mem({0x80}, 7, tag(reg));
+    as_.raw({NUMBER});
+    if (equality) slow(cond::ne, pc);
+    else bail(cond::ne, pc);
+  }
+  guard_trivial(op.dst, pc);
+
+  // Unordered (NaN) comparisons set CF, ZF and PF, which makes a and ae
+  // false, as they should be; a < b is b > a
+  bool const swap =
+      op.op == ir::opcode::less or op.op == ir::opcode::less_equal;
+  as_.mem({0xf2, 0x0f, 0x10}, XMM0, slot(swap ? op.b : op.a));
+  as_.mem({0x66, 0x0f, 0x2e}, XMM0, slot(swap ? op.a : op.b)); // ucomisd
+
+  switch (op.op) {
+  case ir::opcode::equal:
+    as_.setcc(cond::e, RAX);
+    as_.setcc(cond::np, RCX);
+    as_.raw({0x20, 0xc8}); // and al, cl
+    break;
+  case ir::opcode::not_equal:
+    as_.setcc(cond::ne, RAX);
+    as_.setcc(cond::p, RCX);
+    as_.raw({0x08, 0xc8}); // or al, cl
+    break;
+  case ir::opcode::greater:
+  case ir::opcode::less:
+    as_.setcc(cond::a, RAX);
+    break;
+  default:
+    as_.setcc(cond::ae, RAX);
+  }
+  as_.mem({0x88}, RAX, slot(op.dst)); // mov [dst], al
+  set_tag(op.dst, BOOLEAN);
+}
+
+void compiler::truthiness_branch(ir::operation const& op, int pc) {
+  // nil and false are falsey, everything else is truthy (and falls through)
+  as_.mem({0x0f, 0xb6}, RAX, tag(op.a)); // movzx eax, byte [a.index]
+  as_.raw({0x83, 0xf8, BOOLEAN});        // cmp eax, BOOLEAN
+  to_ops_.emplace_back(as_.jcc(cond::b), op.b);
+  to_ops_.emplace_back(as_.jcc(cond::ne), pc + 1);
+  as_.mem({0x80}, 7, slot(op.a)); // cmp byte [a], false
+  as_.raw({0});
+  to_ops_.emplace_back(as_.jcc(cond::e), op.b);
+}
+
+void compiler::constant(ir::operation const& op, int pc) {
+  auto const& constant = fn_.constants[static_cast<std::size_t>(op.a)];
+  if (constant.index() > NUMBER) {
+    call_step(pc);
+    return;
+  }
+
+  guard_trivial(op.dst, pc);
+  if (auto const* number = std::get_if<double>(&constant)) {
+    as_.raw({0x48, 0xb8}); // mov rax, number
+    as_.imm64(std::bit_cast<std::uint64_t>(*number));
+    as_.mem({0x48, 0x89}, RAX, slot(op.dst));
+  } else if (auto const* boolean = std::get_if<bool>(&constant)) {
+    as_.mem({0xc6}, 0, slot(op.dst));
+    as_.raw({static_cast<std::uint8_t>(*boolean)});
+  }
+  set_tag(op.dst, static_cast<std::uint8_t>(constant.index()));
+}
+
+void compiler::move(ir::operation const& op, int pc) {
+  as_.mem({0x80}, 7, tag(op.a));
+  as_.raw({NUMBER});
+  slow(cond::a, pc);
+  guard_trivial(op.dst, pc);
+
+  as_.mem({0x48, 0x8b}, RAX, slot(op.a));
+  as_.mem({0x48, 0x89}, RAX, slot(op.dst));
+  as_.mem({0x0f, 0xb6}, RAX, tag(op.a));
+  as_.mem({0x88}, RAX, tag(op.dst));
+}
+
+#endif
+
+} // namespace
+
+code::~code() {
+#ifdef LOX_JIT
+  munmap(memory_, size_);
+#endif
+}
+
+auto code::run(value* regs, interpreter& self, ir::function& fn, int at) const
+    -> int {
+  using entry = int (*)(value*, interpreter*, ir::function*, int);
+  return reinterpret_cast<entry>(memory_)(regs, &self, &fn, at);
+}
+
+auto supported() -> bool {
+#ifdef LOX_JIT
+  static bool const matches = layout_matches();
+  return matches;
+#else
+  return false;
+#endif
+}
+
+auto compile(ir::function const& fn, step_fn step) -> std::shared_ptr<code> {
+#ifdef LOX_JIT
+  if (not supported() or fn.code.empty()) return nullptr;
+
+  auto const bytes = compiler{fn, step}.run();
+
+  // Written while it's writable, then made executable instead
+  auto const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  auto const size = (bytes.size() + page - 1) / page * page;
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) return nullptr;
+
+  std::memcpy(memory, bytes.data(), bytes.size());
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return nullptr;
+  }
+  return std::make_shared<code>(memory, size);
+#else
+  static_cast<void>(fn);
+  static_cast<void>(step);
+  return nullptr;
+#endif
+}
+
+} // namespace lox::jit
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <lox/interpreter/value.hpp>
+#include <lox/ir/ir.hpp>
+
+#include <cstddef>
+#include <memory>
+
+namespace lox {
+
+class interpreter;
+
+// A baseline JIT: it turns a function's register code (see ir::generate)
+// into x86-64 machine code one operation at a time, from templates.
+//
+// The machine code works on the same registers as the interpreter, so
+// control can pass between them at any operation. Numbers are done inline:
+// arithmetic and comparisons check (guard) that their operands are numbers
+// and, if they aren't, bail out back to the interpreter, which carries on
+// from that operation. Anything else (calls, globals, strings...) calls back
+// into the interpreter to run just that operation.
+namespace jit {
+
+// Runs operation `pc` of `fn` in the interpreter. Returns 0, or -1 if it
+// threw, in which case the interpreter keeps the exception to rethrow once
+// it's out of generated code (which can't be unwound through).
+using step_fn = int (*)(interpreter* self, ir::function* fn, value* regs,
+                        int pc) noexcept;
+
+class code {
+public:
+  code(void* memory, std::size_t size) : memory_(memory), size_(size) {}
+  ~code();
+
+  code(code const&)                    = delete;
+  auto operator=(code const&) -> code& = delete;
+
+  // Runs from operation `at`, which must be the start of the function or of
+  // a loop (otherwise it returns straight away), until it returns, bails out
+  // or fails. Returns the operation for the interpreter to carry on from
+  // (the return itself, if it got that far), or -1 if it failed.
+  auto run(value* regs, interpreter& self, ir::function& fn, int at) const
+      -> int;
+
+private:
+  void*       memory_;
+  std::size_t size_;
+};
+
+// Whether generated code can run here: on x86-64, with values laid out the
+// way the templates expect.
+auto supported() -> bool;
+
+// Generates machine code for a function, or returns null if it can't.
+auto compile(ir::function const& fn, step_fn step) -> std::shared_ptr<code>;
+
+} // namespace jit
+
+} // namespace lox
@@ -0,0 +1,31 @@
+#include <lox/errors.hpp>
+#include <lox/lox.hpp>
+#include <lox/optimizer/optimizer.hpp>
+#include <lox/parser/parser.hpp>
+#include <lox/resolver/resolver.hpp>
+#include <lox/scanner/scanner.hpp>
+
+#include <string>
+
+namespace lox {
+
+auto compile(std::string_view source, interpreter& interpreter)
+    -> std::shared_ptr<program> {
+  auto& errors   = interpreter.diagnostics();
+  errors.errored = false;
+
+  scanner scanner{std::string{source}, errors};
+  parser  parser{scanner.scan(), errors};
+  auto    stmts = parser.parse();
+  if (errors.errored) return nullptr;
+
+  resolver resolver{interpreter};
+  resolver.resolve(stmts);
+  if (errors.errored) return nullptr;
+
+  optimizer optimizer;
+  optimizer.optimize(stmts);
+  return interpreter.compile(stmts);
+}
+
+} // namespace lox
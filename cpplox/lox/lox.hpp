@@ -0,0 +1,18 @@
+#pragma once
+
+#include <lox/interpreter/interpreter.hpp>
+#include <lox/interpreter/program.hpp>
+
+#include <memory>
+#include <string_view>
+
+namespace lox {
+
+// Scans, parses, resolves, optimises and compiles a script into a program
+// that `interpreter`, or any other interpreter, can run over and over.
+// Returns null if there were errors, which go to the interpreter's
+// diagnostics (forgetting any from before).
+auto compile(std::string_view source, interpreter& interpreter)
+    -> std::shared_ptr<program>;
+
+} // namespace lox
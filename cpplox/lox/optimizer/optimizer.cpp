@@ -0,0 +1,447 @@
+#include <lox/errors.hpp>
+#include <lox/interpreter/value.hpp>
+#include <lox/optimizer/optimizer.hpp>
+
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace lox {
+
+namespace {
+
+// Folding `"x" * 1000000` would just move the work to compile time
+std::size_t const MAX_FOLDED_STRING = 256;
+
+// Counts the nodes in a tree, for the stats.
+struct node_counter {
+  auto count(expr const& e) -> int { return std::visit(*this, e); }
+  auto count(stmt const& s) -> int { return std::visit(*this, s); }
+  auto count(std::vector<stmt> const& stmts) -> int {
+    int n = 0;
+    for (auto const& s : stmts) { n += count(s); }
+    return n;
+  }
+
+  auto operator()(literal_expr const&) -> int { return 1; }
+  auto operator()(variable_expr const&) -> int { return 1; }
+  auto operator()(box<group_expr> const& e) -> int { return 1 + count(e->ex); }
+  auto operator()(box<assign_expr> const& e) -> int {
+    return 1 + count(e->value);
+  }
+  auto operator()(box<unary_expr> const& e) -> int {
+    return 1 + count(e->right);
+  }
+  auto operator()(box<logical_expr> const& e) -> int {
+    return 1 + count(e->left) + count(e->right);
+  }
+  auto operator()(box<binary_expr> const& e) -> int {
+    return 1 + count(e->left) + count(e->right);
+  }
+  auto operator()(box<call_expr> const& e) -> int {
+    int n = 1 + count(e->callee);
+    for (auto const& arg : e->args) { n += count(arg); }
+    return n;
+  }
+  auto operator()(box<conditional_expr> const& e) -> int {
+    return 1 + count(e->cond) + count(e->then) + count(e->alt);
+  }
+  auto operator()(box<suspend_expr> const& e) -> int {
+    return 1 + count(e->value);
+  }
+  auto operator()(box<array_expr> const& e) -> int {
+    int n = 1;
+    for (auto const& element : e->elements) { n += count(element); }
+    return n;
+  }
+  auto operator()(box<index_expr> const& e) -> int {
+    return 1 + count(e->object) + count(e->index);
+  }
+  auto operator()(box<set_index_expr> const& e) -> int {
+    return 1 + count(e->object) + count(e->index) + count(e->value);
+  }
+
+  auto operator()(expression_stmt const& s) -> int { return 1 + count(s.ex); }
+  auto operator()(print_stmt const& s) -> int { return 1 + count(s.ex); }
+  auto operator()(variable_stmt const& s) -> int {
+    return 1 + (s.init ? count(*s.init) : 0);
+  }
+  auto operator()(break_stmt const&) -> int { return 1; }
+  auto operator()(return_stmt const& s) -> int {
+    return 1 + (s.value ? count(*s.value) : 0);
+  }
+  auto operator()(box<block_stmt> const& s) -> int {
+    return 1 + count(s->stmts);
+  }
+  auto operator()(box<function_stmt> const& s) -> int {
+    return 1 + count(s->body);
+  }
+  auto operator()(box<if_stmt> const& s) -> int {
+    return 1 + count(s->cond) + count(s->then) + (s->alt ? count(*s->alt) : 0);
+  }
+  auto operator()(box<while_stmt> const& s) -> int {
+    return 1 + count(s->cond) + count(s->body);
+  }
+};
+
+auto literal_of(expr const& e) -> literal const* {
+  auto const* lit = std::get_if<literal_expr>(&e);
+  return lit != nullptr ? &lit->literal : nullptr;
+}
+
+auto is_truthy(literal const& literal) -> bool {
+  return values::is_truthy(values::to_value(literal));
+}
+
+auto to_literal(value const& value) -> std::optional<literal> {
+  if (std::holds_alternative<std::monostate>(value)) return literal{};
+  if (auto const* b = std::get_if<bool>(&value)) return literal{*b};
+  if (auto const* d = std::get_if<double>(&value)) return literal{*d};
+  if (auto const* s = std::get_if<string>(&value)) return literal{s->str()};
+  return std::nullopt;
+}
+
+// Whether evaluating `e` can't do anything besides produce a value.
+// Globals are out since reading an undefined one is an error.
+auto is_pure(expr const& e) -> bool {
+  if (std::holds_alternative<literal_expr>(e)) return true;
+  if (auto const* var = std::get_if<variable_expr>(&e)) {
+    return var->resolved.kind == binding_kind::local or
+           var->resolved.kind == binding_kind::upvalue;
+  }
+  return false;
+}
+
+// Whether a statement never carries on to the next one.
+auto exits(stmt const& s) -> bool {
+  if (std::holds_alternative<return_stmt>(s)) return true;
+  if (std::holds_alternative<break_stmt>(s)) return true;
+  if (auto const* block = std::get_if<box<block_stmt>>(&s)) {
+    return not(*block)->stmts.empty() and exits((*block)->stmts.back());
+  }
+  return false;
+}
+
+auto is_empty_block(stmt const& s) -> bool {
+  auto const* block = std::get_if<box<block_stmt>>(&s);
+  return block != nullptr and (*block)->stmts.empty();
+}
+
+// Wraps a branch that's replacing an if statement in a block, so that it
+// isn't mistaken for an expression statement directly in a function body
+// (which would echo its value).
+auto as_block(stmt s) -> stmt {
+  if (std::holds_alternative<box<block_stmt>>(s)) return s;
+
+  block_stmt block;
+  block.stmts.push_back(std::move(s));
+  return block;
+}
+
+auto evaluate(token const& op, literal const& l, literal const& r)
+    -> std::optional<literal> {
+  value const left  = values::to_value(l);
+  value const right = values::to_value(r);
+
+  if (op.type == token_type::STAR) {
+    auto const* str   = std::get_if<std::string>(&l);
+    auto const* count = std::get_if<double>(&r);
+    if (str == nullptr) {
+      str   = std::get_if<std::string>(&r);
+      count = std::get_if<double>(&l);
+    }
+    if (str != nullptr and count != nullptr and
+        static_cast<double>(str->size()) * *count > MAX_FOLDED_STRING) {
+      return std::nullopt;
+    }
+  }
+
+  try {
+    switch (op.type) {
+    case token_type::BANG_EQUAL:
+      return literal{left != right};
+    case token_type::EQUAL_EQUAL:
+      return literal{left == right};
+    case token_type::GREATER:
+      return literal{values::greater_than(op, left, right)};
+    case token_type::GREATER_EQUAL:
+      return literal{values::greater_equal(op, left, right)};
+    case token_type::LESS:
+      return literal{values::less_than(op, left, right)};
+    case token_type::LESS_EQUAL:
+      return literal{values::less_equal(op, left, right)};
+    case token_type::PLUS:
+      return to_literal(values::plus(op, left, right));
+    case token_type::MINUS:
+      return literal{values::minus(op, left, right)};
+    case token_type::STAR:
+      return to_literal(values::multiply(op, left, right));
+    case token_type::SLASH:
+      return literal{values::divide(op, left, right)};
+    default:
+      return std::nullopt;
+    }
+  } catch (runtime_error const&) {
+    // Leave it to fail at runtime
+    return std::nullopt;
+  }
+}
+
+auto fold(token const& op, literal const& l, literal const& r)
+    -> std::optional<literal> {
+  auto result = evaluate(op, l, r);
+
+  // NaN can't be pooled as a constant (it isn't equal to itself), so it's
+  // left to be worked out at runtime
+  if (auto const* number = result ? std::get_if<double>(&*result) : nullptr;
+      number != nullptr and std::isnan(*number)) {
+    return std::nullopt;
+  }
+
+  return result;
+}
+
+} // namespace
+
+void optimizer::optimize(std::vector<stmt>& stmts) {
+  node_counter counter;
+  stats_.before += counter.count(stmts);
+  simplify(stmts);
+  stats_.after += counter.count(stmts);
+}
+
+void optimizer::simplify(expr& e) {
+  if (auto replacement = std::visit(*this, e)) e = std::move(*replacement);
+}
+
+void optimizer::simplify(stmt& s) {
+  if (auto replacement = std::visit(*this, s)) s = std::move(*replacement);
+}
+
+void optimizer::simplify(std::vector<stmt>& stmts) {
+  for (std::size_t i = 0; i < stmts.size(); ++i) {
+    simplify(stmts[i]);
+
+    if (exits(stmts[i])) {
+      stmts.erase(stmts.begin() + static_cast<std::ptrdiff_t>(i) + 1,
+                  stmts.end());
+    }
+  }
+
+  // Only once we're done, since frames_ points into stmts
+  std::erase_if(stmts, is_empty_block);
+}
+
+auto optimizer::known(binding const& var) const -> literal const* {
+  static literal const nil{};
+
+  auto const& frame = frames_.back();
+  auto const  index = static_cast<std::size_t>(var.index);
+
+  variable_stmt const* decl = nullptr;
+  if (var.kind == binding_kind::local and index < frame.slots.size()) {
+    decl = frame.slots[index];
+  } else if (var.kind == binding_kind::upvalue and
+             index < frame.captures.size()) {
+    decl = frame.captures[index];
+  }
+
+  if (decl == nullptr or decl->assigned) return nullptr;
+  if (not decl->init) return &nil;
+  return literal_of(*decl->init);
+}
+
+auto optimizer::operator()(literal_expr& /*e*/) -> std::optional<expr> {
+  return std::nullopt;
+}
+
+auto optimizer::operator()(variable_expr& e) -> std::optional<expr> {
+  if (auto const* lit = known(e.resolved)) return literal_expr{*lit};
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<group_expr>& e) -> std::optional<expr> {
+  // Grouping only matters to the parser
+  simplify(e->ex);
+  return std::move(e->ex);
+}
+
+auto optimizer::operator()(box<assign_expr>& e) -> std::optional<expr> {
+  simplify(e->value);
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<unary_expr>& e) -> std::optional<expr> {
+  simplify(e->right);
+
+  auto const* right = literal_of(e->right);
+  if (right == nullptr) return std::nullopt;
+
+  if (e->op.type == token_type::BANG) return literal_expr{not is_truthy(*right)};
+  if (auto const* number = std::get_if<double>(right)) {
+    return literal_expr{-*number};
+  }
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<logical_expr>& e) -> std::optional<expr> {
+  simplify(e->left);
+  simplify(e->right);
+
+  auto const* left = literal_of(e->left);
+  if (left == nullptr) return std::nullopt;
+
+  // Like the interpreter, the result is whichever operand decided it
+  bool const decided =
+      (e->op.type == token_type::OR) == is_truthy(*left);
+  return decided ? std::move(e->left) : std::move(e->right);
+}
+
+auto optimizer::operator()(box<binary_expr>& e) -> std::optional<expr> {
+  simplify(e->left);
+  simplify(e->right);
+
+  if (e->op.type == token_type::COMMA) {
+    if (is_pure(e->left)) return std::move(e->right);
+    return std::nullopt;
+  }
+
+  auto const* left  = literal_of(e->left);
+  auto const* right = literal_of(e->right);
+  if (left == nullptr or right == nullptr) return std::nullopt;
+
+  if (auto result = fold(e->op, *left, *right)) {
+    return literal_expr{std::move(*result)};
+  }
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<call_expr>& e) -> std::optional<expr> {
+  simplify(e->callee);
+  for (auto& arg : e->args) { simplify(arg); }
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<conditional_expr>& e) -> std::optional<expr> {
+  simplify(e->cond);
+  simplify(e->then);
+  simplify(e->alt);
+
+  auto const* cond = literal_of(e->cond);
+  if (cond == nullptr) return std::nullopt;
+
+  return is_truthy(*cond) ? std::move(e->then) : std::move(e->alt);
+}
+
+auto optimizer::operator()(box<suspend_expr>& e) -> std::optional<expr> {
+  simplify(e->value);
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<array_expr>& e) -> std::optional<expr> {
+  for (auto& element : e->elements) { simplify(element); }
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<index_expr>& e) -> std::optional<expr> {
+  simplify(e->object);
+  simplify(e->index);
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<set_index_expr>& e) -> std::optional<expr> {
+  simplify(e->object);
+  simplify(e->index);
+  simplify(e->value);
+  return std::nullopt;
+}
+
+auto optimizer::operator()(expression_stmt& s) -> std::optional<stmt> {
+  simplify(s.ex);
+  return std::nullopt;
+}
+
+auto optimizer::operator()(print_stmt& s) -> std::optional<stmt> {
+  simplify(s.ex);
+  return std::nullopt;
+}
+
+auto optimizer::operator()(variable_stmt& s) -> std::optional<stmt> {
+  if (s.init) simplify(*s.init);
+
+  if (s.resolved.kind == binding_kind::local) {
+    auto& slots = frames_.back().slots;
+    auto  slot  = static_cast<std::size_t>(s.resolved.index);
+    if (slots.size() <= slot) slots.resize(slot + 1);
+    slots[slot] = &s;
+  }
+
+  return std::nullopt;
+}
+
+auto optimizer::operator()(break_stmt& /*s*/) -> std::optional<stmt> {
+  return std::nullopt;
+}
+
+auto optimizer::operator()(return_stmt& s) -> std::optional<stmt> {
+  if (s.value) simplify(*s.value);
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<block_stmt>& s) -> std::optional<stmt> {
+  auto const locals = frames_.back().slots.size();
+  simplify(s->stmts);
+
+  frames_.back().slots.resize(locals);
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<function_stmt>& s) -> std::optional<stmt> {
+  if (s->resolved.kind == binding_kind::local) {
+    auto& slots = frames_.back().slots;
+    auto  slot  = static_cast<std::size_t>(s->resolved.index);
+    if (slots.size() <= slot) slots.resize(slot + 1);
+    slots[slot] = nullptr;
+  }
+
+  // Work out what each capture refers to before entering the function
+  frame inner{std::vector<variable_stmt const*>(s->params.size()), {}};
+  auto const& enclosing = frames_.back();
+  for (capture const& c : s->captures) {
+    auto const  index = static_cast<std::size_t>(c.index);
+    auto const& from  = c.local ? enclosing.slots : enclosing.captures;
+    inner.captures.push_back(index < from.size() ? from[index] : nullptr);
+  }
+
+  frames_.push_back(std::move(inner));
+  simplify(s->body);
+  frames_.pop_back();
+
+  return std::nullopt;
+}
+
+auto optimizer::operator()(box<if_stmt>& s) -> std::optional<stmt> {
+  simplify(s->cond);
+  simplify(s->then);
+  if (s->alt) simplify(*s->alt);
+
+  auto const* cond = literal_of(s->cond);
+  if (cond == nullptr) return std::nullopt;
+
+  if (is_truthy(*cond)) return as_block(std::move(s->then));
+  if (s->alt) return as_block(std::move(*s->alt));
+  return block_stmt{};
+}
+
+auto optimizer::operator()(box<while_stmt>& s) -> std::optional<stmt> {
+  simplify(s->cond);
+  simplify(s->body);
+
+  auto const* cond = literal_of(s->cond);
+  if (cond != nullptr and not is_truthy(*cond)) return block_stmt{};
+  return std::nullopt;
+}
+
+} // namespace lox
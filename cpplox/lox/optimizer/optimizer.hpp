@@ -0,0 +1,95 @@
+#pragma once
+
+#include <lox/ast/ast.hpp>
+#include <lox/token/token.hpp>
+
+#include <fmt/format.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace lox {
+
+// optimizer simplifies a resolved AST before it's compiled:
+// - operators whose operands are literals are folded, e.g. `1 + 2` or
+//   `"a" + "b"`, as are `and`/`or`/`?:`/`,` with a literal on the left
+// - locals that are initialised with a literal and never assigned to are
+//   replaced by the literal
+// - branches and loops whose condition is a literal are dropped, as is code
+//   after a `return` or `break`
+//
+// It only makes changes that can't be observed, so anything that would fail
+// at runtime (e.g. `-"a"` or `1 / 0`) is left for the interpreter to report.
+class optimizer {
+public:
+  struct stats {
+    int before = 0; // nodes
+    int after  = 0;
+
+    [[nodiscard]] auto removed() const -> int { return before - after; }
+  };
+
+  void optimize(std::vector<stmt>& stmts);
+
+  [[nodiscard]] auto statistics() const -> stats const& { return stats_; }
+
+  // Expression visitors return what to replace the expression with, if
+  // anything.
+  auto operator()(literal_expr& e) -> std::optional<expr>;
+  auto operator()(variable_expr& e) -> std::optional<expr>;
+  auto operator()(box<group_expr>& e) -> std::optional<expr>;
+  auto operator()(box<assign_expr>& e) -> std::optional<expr>;
+  auto operator()(box<unary_expr>& e) -> std::optional<expr>;
+  auto operator()(box<logical_expr>& e) -> std::optional<expr>;
+  auto operator()(box<binary_expr>& e) -> std::optional<expr>;
+  auto operator()(box<call_expr>& e) -> std::optional<expr>;
+  auto operator()(box<conditional_expr>& e) -> std::optional<expr>;
+  auto operator()(box<suspend_expr>& e) -> std::optional<expr>;
+  auto operator()(box<array_expr>& e) -> std::optional<expr>;
+  auto operator()(box<index_expr>& e) -> std::optional<expr>;
+  auto operator()(box<set_index_expr>& e) -> std::optional<expr>;
+
+  // Likewise for statements. An empty block means remove it.
+  auto operator()(expression_stmt& s) -> std::optional<stmt>;
+  auto operator()(print_stmt& s) -> std::optional<stmt>;
+  auto operator()(variable_stmt& s) -> std::optional<stmt>;
+  auto operator()(break_stmt& s) -> std::optional<stmt>;
+  auto operator()(return_stmt& s) -> std::optional<stmt>;
+  auto operator()(box<block_stmt>& s) -> std::optional<stmt>;
+  auto operator()(box<function_stmt>& s) -> std::optional<stmt>;
+  auto operator()(box<if_stmt>& s) -> std::optional<stmt>;
+  auto operator()(box<while_stmt>& s) -> std::optional<stmt>;
+
+private:
+  // The declarations of the locals in scope in the function being optimised,
+  // by slot, and of the variables it captures, by upvalue index. Parameters
+  // and functions are null.
+  struct frame {
+    std::vector<variable_stmt const*> slots;
+    std::vector<variable_stmt const*> captures;
+  };
+
+  std::vector<frame> frames_{frame{}};
+  stats              stats_;
+
+  void simplify(expr& e);
+  void simplify(stmt& s);
+  void simplify(std::vector<stmt>& stmts);
+
+  // Returns the literal that the variable always holds, if there is one.
+  [[nodiscard]] auto known(binding const& var) const -> literal const*;
+};
+
+} // namespace lox
+
+template <>
+struct fmt::formatter<lox::optimizer::stats> : formatter<std::string> {
+  template <typename FormatContext>
+  auto format(lox::optimizer::stats const& stats, FormatContext& ctx) const {
+    return formatter<std::string>::format(
+        fmt::format("{} nodes removed ({} -> {})", stats.removed(),
+                    stats.before, stats.after),
+        ctx);
+  }
+};
@@ -1,5 +1,6 @@
 #include <lox/errors.hpp>
 #include <lox/parser/parser.hpp>
+#include <lox/profile/heap.hpp>
 
 #include <algorithm>
 #include <exception>
@@ -14,19 +15,28 @@ using enum token_type;
 
 // === Parse grammar ===
 auto parser::parse() -> std::vector<stmt> {
+  profile::scope const charged{profile::kind::syntax};
+
   std::vector<stmt> stmts;
   while (!done()) { stmts.push_back(declaration()); }
 
+  profile::at(0);
   return stmts;
 }
 
 auto parser::declaration() -> stmt {
   try {
     if (match({FUN})) return function("function");
+    if (match({ASYNC})) {
+      consume(FUN, "expect 'fun' after 'async'");
+      stmt decl = function("function");
+      std::get<box<function_stmt>>(decl)->kind = function_kind::async;
+      return decl;
+    }
     if (match({VAR})) return var_declaration();
     return statement();
   } catch (parser_error& err) {
-    errors::report_parser_error(err);
+    errors_.report_parser_error(err);
     synchronise();
     return expression_stmt{};
   }
@@ -40,7 +50,7 @@ auto parser::function(std::string kind) -> stmt {
   if (!check(RIGHT_PAREN)) {
     do {
       if (std::ssize(params) >= 255) {
-        errors::report(peek().line, "can't have more than 255 parameters");
+        errors_.report(peek().line, "can't have more than 255 parameters");
       }
 
       params.push_back(consume(IDENTIFIER, "expect parameter name"));
@@ -186,6 +196,14 @@ auto parser::expression_statement() -> stmt {
 auto parser::expression() -> expr { return assignment(); }
 
 auto parser::assignment() -> expr {
+  // Like return, yield takes a whole expression, or nothing (nil)
+  if (match({YIELD})) {
+    token keyword = prev();
+    expr  value   = literal_expr{};
+    if (!check(SEMICOLON) && !check(RIGHT_PAREN)) value = assignment();
+    return suspend_expr{keyword, value};
+  }
+
   expr lhs = logic_or();
 
   if (match({EQUAL})) {
@@ -197,9 +215,13 @@ auto parser::assignment() -> expr {
       token name   = var_ex.name;
       return assign_expr{name, rhs};
     }
+    if (auto* index = std::get_if<box<index_expr>>(&lhs)) {
+      auto& get = **index;
+      return set_index_expr{get.object, get.bracket, get.index, rhs};
+    }
 
     // Report but don't throw an error because we don't want to synchronise
-    errors::report(equals.line, "Invalid assignment target");
+    errors_.report(equals.line, "Invalid assignment target");
   }
 
   return lhs;
@@ -260,6 +282,12 @@ auto parser::unary() -> expr {
     return unary_expr{op, right};
   }
 
+  if (match({AWAIT})) {
+    token keyword = prev();
+    expr  value   = unary();
+    return suspend_expr{keyword, value};
+  }
+
   return call();
 }
 
@@ -267,8 +295,16 @@ auto parser::call() -> expr {
   expr ex = primary();
 
   while (true) {
-    if (match({LEFT_PAREN})) ex = finish_call(ex);
-    else break;
+    if (match({LEFT_PAREN})) {
+      ex = finish_call(ex);
+    } else if (match({LEFT_BRACKET})) {
+      token bracket = prev();
+      expr  index   = expression();
+      consume(RIGHT_BRACKET, "expected ']' after index");
+      ex = index_expr{ex, bracket, index};
+    } else {
+      break;
+    }
   }
 
   return ex;
@@ -279,7 +315,7 @@ auto parser::finish_call(expr callee) -> expr {
   if (!check(RIGHT_PAREN)) {
     do {
       if (std::ssize(args) >= MAX_ARGS) {
-        errors::report(peek().line, "can't have more than 255 arguments");
+        errors_.report(peek().line, "can't have more than 255 arguments");
       }
       args.push_back(conditional());
     } while (match({COMMA}));
@@ -297,6 +333,18 @@ auto parser::primary() -> expr {
 
   if (match({IDENTIFIER})) return variable_expr{prev()};
 
+  if (match({LEFT_BRACKET})) {
+    token             bracket = prev();
+    std::vector<expr> elements;
+    if (!check(RIGHT_BRACKET)) {
+      do {
+        elements.push_back(conditional());
+      } while (match({COMMA}));
+    }
+    consume(RIGHT_BRACKET, "expected ']' after array elements");
+    return array_expr{bracket, elements};
+  }
+
   if (match({LEFT_PAREN})) {
     expr ex = expression();
     consume(RIGHT_PAREN, "expected ')' after expression");
@@ -381,6 +429,7 @@ void parser::synchronise() {
     switch (peek().type) {
     case CLASS:
     case FUN:
+    case ASYNC:
     case VAR:
     case FOR:
     case IF:
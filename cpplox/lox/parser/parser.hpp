@@ -1,6 +1,8 @@
 #pragma once
 
 #include <lox/ast/ast.hpp>
+#include <lox/errors.hpp>
+#include <lox/profile/heap.hpp>
 #include <lox/token/token.hpp>
 
 #include <string_view>
@@ -11,7 +13,8 @@ namespace lox {
 
 class parser {
 public:
-  explicit parser(std::vector<token> tokens) : tokens_(std::move(tokens)) {}
+  parser(std::vector<token> tokens, errors& errors)
+      : tokens_(std::move(tokens)), errors_(errors) {}
 
   auto parse() -> std::vector<stmt>;
 
@@ -57,6 +60,7 @@ private:
   inline auto done() -> bool { return peek().type == token_type::EOF; }
   inline auto next() -> token {
     if (!done()) ++curr_;
+    profile::at(tokens_[curr_ - 1].line);
     return prev();
   }
   inline auto check(token_type type) -> bool {
@@ -65,6 +69,7 @@ private:
   }
 
   const std::vector<token> tokens_;
+  errors&                  errors_;
 
   int curr_       = 0;
   int loop_depth_ = 0;
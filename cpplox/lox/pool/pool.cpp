@@ -0,0 +1,118 @@
+#include <lox/pool/pool.hpp>
+
+#include <algorithm>
+#include <utility>
+
+namespace lox {
+
+namespace {
+
+// Which pool (if any) the calling thread works for, and as which worker
+thread_local void const* current_pool = nullptr;
+thread_local std::size_t current_worker = 0;
+
+} // namespace
+
+pool::pool(std::size_t threads) {
+  if (threads == 0) {
+    threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+
+  workers_.reserve(threads);
+  for (std::size_t i = 0; i < threads; ++i) {
+    workers_.push_back(std::make_unique<worker>());
+  }
+
+  threads_.reserve(threads);
+  for (std::size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back([this, i] { loop(i); });
+  }
+}
+
+pool::~pool() {
+  wait();
+
+  {
+    std::scoped_lock const lock(mutex_);
+    stopping_ = true;
+  }
+  work_.notify_all();
+
+  for (auto& thread : threads_) { thread.join(); }
+}
+
+void pool::submit(task fn) {
+  auto const at = self().value_or(next_++ % workers_.size());
+
+  pending_.fetch_add(1);
+  {
+    auto&                  w = *workers_[at];
+    std::scoped_lock const lock(w.mutex);
+    w.tasks.push_back(std::move(fn));
+  }
+  queued_.fetch_add(1);
+
+  // Taking the lock means a worker that just found nothing to do is either
+  // already asleep (and gets woken) or will see queued_ before it sleeps
+  { std::scoped_lock const lock(mutex_); }
+  work_.notify_one();
+}
+
+void pool::wait() {
+  std::unique_lock lock(mutex_);
+  done_.wait(lock, [this] { return pending_.load() == 0; });
+}
+
+void pool::loop(std::size_t self) {
+  current_pool   = this;
+  current_worker = self;
+
+  while (true) {
+    if (auto t = find(self)) {
+      run(*t);
+      continue;
+    }
+
+    std::unique_lock lock(mutex_);
+    work_.wait(lock, [this] { return stopping_ or queued_.load() > 0; });
+    if (stopping_ and queued_.load() == 0) return;
+  }
+}
+
+auto pool::find(std::size_t self) -> std::optional<task> {
+  auto take = [this](std::size_t at, bool own) -> std::optional<task> {
+    auto&                  w = *workers_[at];
+    std::scoped_lock const lock(w.mutex);
+    if (w.tasks.empty()) return std::nullopt;
+
+    auto t = std::move(own ? w.tasks.back() : w.tasks.front());
+    if (own) w.tasks.pop_back();
+    else w.tasks.pop_front();
+    queued_.fetch_sub(1);
+    return t;
+  };
+
+  if (auto t = take(self, true)) return t;
+
+  // Start from our neighbour so thieves spread out
+  for (std::size_t i = 1; i < workers_.size(); ++i) {
+    if (auto t = take((self + i) % workers_.size(), false)) return t;
+  }
+  return std::nullopt;
+}
+
+void pool::run(task& fn) {
+  fn();
+
+  if (pending_.fetch_sub(1) == 1) {
+    { std::scoped_lock const lock(mutex_); }
+    done_.notify_all();
+  }
+}
+
+auto pool::self() const -> std::optional<std::size_t> {
+  if (current_pool != this) return std::nullopt;
+  return current_worker;
+}
+
+} // namespace lox
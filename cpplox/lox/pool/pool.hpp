@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace lox {
+
+// pool is a work-stealing thread pool. Each worker has its own deque of
+// tasks: tasks submitted by a worker go on the back of its own deque, where
+// it takes them from too (so the most recent, cache-warm work runs first),
+// and idle workers steal from the front of everyone else's. Tasks submitted
+// from outside are dealt out round-robin.
+class pool {
+public:
+  using task = std::function<void()>;
+
+  // With no threads given, one per core.
+  explicit pool(std::size_t threads = 0);
+  // Finishes every task already submitted first.
+  ~pool();
+
+  pool(pool const&)                    = delete;
+  auto operator=(pool const&) -> pool& = delete;
+
+  // Tasks mustn't throw.
+  void submit(task fn);
+  // Blocks until every task submitted so far (and any they submit) has
+  // finished. Not for calling from a task, which would wait for itself.
+  void wait();
+
+  [[nodiscard]] auto size() const -> std::size_t { return workers_.size(); }
+
+private:
+  struct worker {
+    std::mutex       mutex;
+    std::deque<task> tasks;
+  };
+
+  std::vector<std::unique_ptr<worker>> workers_;
+  std::vector<std::thread>             threads_;
+
+  std::atomic<std::size_t> next_{0};    // for dealing out tasks
+  std::atomic<std::size_t> queued_{0};  // in any deque
+  std::atomic<std::size_t> pending_{0}; // submitted but not finished
+
+  // For sleeping when there's nothing to do
+  std::mutex              mutex_;
+  std::condition_variable work_;
+  std::condition_variable done_;
+  bool                    stopping_ = false;
+
+  void loop(std::size_t self);
+  // Takes a task from our own deque, or steals one.
+  auto find(std::size_t self) -> std::optional<task>;
+  void run(task& fn);
+  // The index of the calling thread's worker, if it's one of ours.
+  [[nodiscard]] auto self() const -> std::optional<std::size_t>;
+};
+
+} // namespace lox
@@ -0,0 +1,181 @@
+#include <lox/pool/scheduler.hpp>
+
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <utility>
+
+#if defined(__SANITIZE_THREAD__)
+#include <sanitizer/tsan_interface.h>
+#endif
+
+namespace lox {
+
+namespace {
+
+// Interpreters run IR functions on the C++ stack, to a fixed depth (see
+// interpreter::IR_DEPTH_MAX), so a task's stack needs room for that. Pages
+// are only backed once touched.
+constexpr std::size_t STACK_SIZE = std::size_t{2} << 20;
+// Stacks kept for reuse, since mapping them costs system calls
+constexpr std::size_t STACKS_KEPT = 64;
+
+} // namespace
+
+struct scheduler::fiber {
+  scheduler*            owner;
+  std::function<void()> fn;
+  void*                 stack;
+  ucontext_t            context{};
+  bool                  done = false;
+  // A parked fiber can't carry on until it has finished switching away and
+  // it has been woken, which happen in either order: each counts in here,
+  // and the second one resumes it
+  std::atomic<int> arrivals{0};
+#if defined(__SANITIZE_THREAD__)
+  void* tsan = __tsan_create_fiber(0);
+#endif
+};
+
+namespace {
+
+// Per thread: where a fiber goes back to when it parks or finishes, and the
+// fiber running. A fiber can move threads while it's parked, so these are
+// only read through functions the compiler can't cache them across.
+thread_local ucontext_t        home;
+thread_local scheduler::fiber* running = nullptr;
+#if defined(__SANITIZE_THREAD__)
+thread_local void* home_tsan = nullptr;
+#endif
+
+[[gnu::noinline]] auto home_context() -> ucontext_t* { return &home; }
+[[gnu::noinline]] auto running_fiber() -> scheduler::fiber* {
+  return running;
+}
+
+// Switches from the running fiber back to its thread.
+void switch_home(scheduler::fiber* f) {
+#if defined(__SANITIZE_THREAD__)
+  __tsan_switch_to_fiber(home_tsan, 0);
+#endif
+  if (f->done) setcontext(home_context());
+  else swapcontext(&f->context, home_context());
+}
+
+void enter() {
+  auto* const f = running_fiber();
+  f->fn();
+  f->done = true;
+  switch_home(f);
+}
+
+} // namespace
+
+scheduler::~scheduler() {
+  pool_.wait();
+  for (auto* const stack : stacks_) { munmap(stack, STACK_SIZE); }
+}
+
+void scheduler::spawn(std::function<void()> fn) {
+  auto* const f = new fiber{this, std::move(fn), allocate_stack()};
+
+  getcontext(&f->context);
+  f->context.uc_stack.ss_sp   = f->stack;
+  f->context.uc_stack.ss_size = STACK_SIZE;
+  f->context.uc_link          = nullptr;
+  makecontext(&f->context, &enter, 0);
+
+  pool_.submit([this, f] { resume(f); });
+}
+
+auto scheduler::shared() -> scheduler& {
+  static scheduler shared;
+  return shared;
+}
+
+void scheduler::resume(fiber* f) {
+  running = f;
+#if defined(__SANITIZE_THREAD__)
+  home_tsan = __tsan_get_current_fiber();
+  __tsan_switch_to_fiber(f->tsan, 0);
+#endif
+  swapcontext(&home, &f->context);
+  running = nullptr;
+
+  if (f->done) {
+#if defined(__SANITIZE_THREAD__)
+    __tsan_destroy_fiber(f->tsan);
+#endif
+    free_stack(f->stack);
+    delete f;
+    return;
+  }
+
+  // It parked
+  arrive(f);
+}
+
+void scheduler::arrive(fiber* f) {
+  if (f->arrivals.fetch_add(1, std::memory_order_acq_rel) == 0) return;
+
+  f->arrivals.store(0, std::memory_order_relaxed);
+  pool_.submit([this, f] { resume(f); });
+}
+
+auto scheduler::allocate_stack() -> void* {
+  {
+    std::scoped_lock const lock(stacks_mutex_);
+    if (not stacks_.empty()) {
+      auto* const stack = stacks_.back();
+      stacks_.pop_back();
+      return stack;
+    }
+  }
+
+  auto* const stack =
+      mmap(nullptr, STACK_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED) throw std::bad_alloc{};
+
+  // Overflowing into the lowest page faults instead of corrupting memory
+  mprotect(stack, static_cast<std::size_t>(sysconf(_SC_PAGESIZE)), PROT_NONE);
+  return stack;
+}
+
+void scheduler::free_stack(void* stack) {
+  std::scoped_lock const lock(stacks_mutex_);
+  if (stacks_.size() < STACKS_KEPT) stacks_.push_back(stack);
+  else munmap(stack, STACK_SIZE);
+}
+
+void parker::park(std::unique_lock<std::mutex>& lock) {
+  parked_ = true;
+
+  auto* const f = running_fiber();
+  if (f == nullptr) {
+    woken_.wait(lock, [this] { return not parked_; });
+    return;
+  }
+
+  // Whoever wakes us might do it before we've switched away (see fiber)
+  fiber_ = f;
+  lock.unlock();
+  switch_home(f);
+  lock.lock();
+}
+
+void parker::unpark() {
+  parked_ = false;
+
+  if (auto* const f = std::exchange(fiber_, nullptr)) {
+    f->owner->arrive(f);
+  } else {
+    woken_.notify_one();
+  }
+}
+
+} // namespace lox
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <lox/pool/pool.hpp>
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace lox {
+
+// scheduler runs tasks M:N: any number of them on a few threads (a pool).
+// Each task is a fiber, with a stack of its own, so a task that has to wait
+// for something (see parker) parks instead of blocking its thread, which
+// goes on to run other tasks. It carries on later, from where it was, on
+// whichever thread picks it up.
+class scheduler {
+public:
+  // With no threads given, one per core.
+  explicit scheduler(std::size_t threads = 0) : pool_(threads) {}
+  // Waits for the tasks that can still finish; any parked for good are
+  // leaked.
+  ~scheduler();
+
+  scheduler(scheduler const&)                    = delete;
+  auto operator=(scheduler const&) -> scheduler& = delete;
+
+  // Starts `fn` as a task. It mustn't throw.
+  void spawn(std::function<void()> fn);
+
+  [[nodiscard]] auto size() const -> std::size_t { return pool_.size(); }
+
+  // The scheduler everything shares, started on first use.
+  static auto shared() -> scheduler&;
+
+  struct fiber; // a task and its stack
+
+private:
+  friend class parker;
+
+  pool pool_;
+
+  // Stacks of finished fibers, for the next ones
+  std::mutex         stacks_mutex_;
+  std::vector<void*> stacks_;
+
+  // Runs a fiber on the calling thread until it finishes or parks.
+  void resume(fiber* f);
+  // Resumes a parked fiber once it's both switched away and been woken.
+  void arrive(fiber* f);
+  auto allocate_stack() -> void*;
+  void free_stack(void* stack);
+};
+
+// parker is how a task, or any other thread, waits for another to wake it.
+// A task parks (see scheduler); anything else sleeps.
+class parker {
+public:
+  // Waits for unpark, with `lock` released meanwhile.
+  void park(std::unique_lock<std::mutex>& lock);
+  // Wakes whoever's parked. The caller must hold the lock they parked with.
+  void unpark();
+
+private:
+  scheduler::fiber*       fiber_  = nullptr; // the task parked, if one is
+  bool                    parked_ = false;
+  std::condition_variable woken_;
+};
+
+} // namespace lox
@@ -0,0 +1,205 @@
+#include <lox/profile/heap.hpp>
+
+#include <fmt/ostream.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace lox::profile {
+
+namespace {
+
+constexpr std::array<char const*, static_cast<std::size_t>(kind::NUM_KINDS)>
+    NAMES = {"other",    "syntax",   "code",      "string",    "array",
+             "map",      "floats",   "function",  "upvalue",   "arguments",
+             "coroutine", "channel", "task"};
+
+} // namespace
+
+auto name(kind k) -> char const* { return NAMES[static_cast<std::size_t>(k)]; }
+
+#ifdef LOX_HEAP_PROFILE
+
+namespace {
+
+// Where each allocation's bytes were charged, in front of them. It keeps
+// what follows aligned for anything operator new has to allow for.
+struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) header {
+  usage*      site; // null if it wasn't counted
+  std::size_t size;
+};
+
+struct profiler {
+  std::mutex mutex;
+  usage      totals;
+  // By line then kind (see key); the nodes stay put as it grows, so headers
+  // can point at them
+  std::unordered_map<std::uint64_t, usage> sites;
+};
+
+auto key(kind k, int line) -> std::uint64_t {
+  return static_cast<std::uint64_t>(static_cast<std::uint32_t>(line)) << 8U |
+         static_cast<std::uint64_t>(k);
+}
+
+// Set while the profiler allocates for itself, which isn't counted
+thread_local bool inside = false;
+
+auto the_profiler() -> profiler& {
+  // Never destroyed: there's still freeing to do after exit
+  static profiler* const instance = [] {
+    bool const was_inside = std::exchange(inside, true);
+    auto*      made       = new profiler;
+    inside                = was_inside;
+    return made;
+  }();
+  return *instance;
+}
+
+void charge(usage& use, std::size_t size) {
+  ++use.allocations;
+  use.bytes += size;
+  use.live += size;
+  use.peak = std::max(use.peak, use.live);
+}
+
+auto allocate(std::size_t size) noexcept -> void* {
+  auto* const h = static_cast<header*>(std::malloc(sizeof(header) + size));
+  if (h == nullptr) return nullptr;
+
+  h->site = nullptr;
+  h->size = size;
+  if (not inside) {
+    inside     = true;
+    auto& prof = the_profiler();
+    {
+      std::scoped_lock const lock(prof.mutex);
+      h->site = &prof.sites[key(current, line)];
+      charge(*h->site, size);
+      charge(prof.totals, size);
+    }
+    inside = false;
+  }
+  return h + 1;
+}
+
+auto allocate_or_throw(std::size_t size) -> void* {
+  void* const p = allocate(size);
+  if (p == nullptr) throw std::bad_alloc{};
+  return p;
+}
+
+void release(void* p) noexcept {
+  if (p == nullptr) return;
+
+  auto* const h = static_cast<header*>(p) - 1;
+  if (h->site != nullptr) {
+    auto&                  prof = the_profiler();
+    std::scoped_lock const lock(prof.mutex);
+    h->site->live -= h->size;
+    prof.totals.live -= h->size;
+  }
+  std::free(h);
+}
+
+} // namespace
+
+auto totals() -> usage {
+  auto&                  prof = the_profiler();
+  std::scoped_lock const lock(prof.mutex);
+  return prof.totals;
+}
+
+void report(std::ostream& out, std::size_t rows) {
+  struct row {
+    kind  what;
+    int   line;
+    usage use;
+  };
+
+  // Nothing allocated for the report is counted in it
+  bool const       was_inside = std::exchange(inside, true);
+  auto&            prof       = the_profiler();
+  usage            all;
+  std::vector<row> found;
+  {
+    std::scoped_lock const lock(prof.mutex);
+    all = prof.totals;
+    found.reserve(prof.sites.size());
+    for (auto const& [k, use] : prof.sites) {
+      found.push_back({static_cast<kind>(k & 0xffU),
+                       static_cast<int>(k >> 8U), use});
+    }
+  }
+  std::ranges::sort(found, [](row const& a, row const& b) {
+    return a.use.peak != b.use.peak ? a.use.peak > b.use.peak
+                                    : a.use.bytes > b.use.bytes;
+  });
+  found.resize(std::min(found.size(), rows));
+
+  fmt::print(out,
+             "heap profile: {} allocations, {} bytes in all, {} live, {} at "
+             "peak\n",
+             all.allocations, all.bytes, all.live, all.peak);
+  fmt::print(out, "{:<10} {:>6} {:>12} {:>14} {:>14} {:>14}\n", "kind", "line",
+             "allocations", "bytes", "live", "peak");
+  for (auto const& [what, line, use] : found) {
+    fmt::print(out, "{:<10} {:>6} {:>12} {:>14} {:>14} {:>14}\n", name(what),
+               line > 0 ? fmt::to_string(line) : "-", use.allocations,
+               use.bytes, use.live, use.peak);
+  }
+  inside = was_inside;
+}
+
+#else
+
+auto totals() -> usage { return {}; }
+
+void report(std::ostream& out, std::size_t /*rows*/) {
+  fmt::print(out, "heap profile: not built in (see LOX_HEAP_PROFILE)\n");
+}
+
+#endif
+
+} // namespace lox::profile
+
+#ifdef LOX_HEAP_PROFILE
+
+// Over-aligned allocations keep the standard library's own operators, which
+// don't come through these.
+auto operator new(std::size_t size) -> void* {
+  return lox::profile::allocate_or_throw(size);
+}
+auto operator new[](std::size_t size) -> void* {
+  return lox::profile::allocate_or_throw(size);
+}
+auto operator new(std::size_t size, std::nothrow_t const&) noexcept -> void* {
+  return lox::profile::allocate(size);
+}
+auto operator new[](std::size_t size, std::nothrow_t const&) noexcept
+    -> void* {
+  return lox::profile::allocate(size);
+}
+
+void operator delete(void* p) noexcept { lox::profile::release(p); }
+void operator delete[](void* p) noexcept { lox::profile::release(p); }
+void operator delete(void* p, std::size_t /*size*/) noexcept {
+  lox::profile::release(p);
+}
+void operator delete[](void* p, std::size_t /*size*/) noexcept {
+  lox::profile::release(p);
+}
+void operator delete(void* p, std::nothrow_t const&) noexcept {
+  lox::profile::release(p);
+}
+void operator delete[](void* p, std::nothrow_t const&) noexcept {
+  lox::profile::release(p);
+}
+
+#endif
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <utility>
+
+// A heap profiler, for finding out what a script's memory goes on. It's only
+// built in with the LOX_HEAP_PROFILE CMake option, which replaces the global
+// operator new and delete with ones that charge every allocation to
+//
+// - what's being allocated, as far as the code allocating it has said (see
+//   scope), and
+// - the line of Lox source running at the time on that thread (see at),
+//
+// counting allocations, bytes allocated, and bytes live now and at their
+// peak for each. Without it, scope and at compile away to nothing.
+namespace lox::profile {
+
+#ifdef LOX_HEAP_PROFILE
+inline constexpr bool enabled = true;
+#else
+inline constexpr bool enabled = false;
+#endif
+
+enum class kind : std::uint8_t {
+  other, // whatever hasn't said
+  syntax,
+  code, // bytecode, IR and machine code
+  string,
+  array,
+  map,
+  floats,
+  function,
+  upvalue,   // a captured variable, once it's left the stack
+  arguments, // a builtin's, or a call's from one
+  coroutine,
+  channel,
+  task, // task groups, their interpreters and copies of globals
+  NUM_KINDS,
+};
+
+auto name(kind k) -> char const*;
+
+#ifdef LOX_HEAP_PROFILE
+// What this thread is allocating, and for which line
+inline thread_local kind current = kind::other;
+inline thread_local int  line    = 0;
+#endif
+
+// Charges allocations on this thread to `line` from now on (0 for none).
+inline void at([[maybe_unused]] int line) {
+#ifdef LOX_HEAP_PROFILE
+  profile::line = line;
+#endif
+}
+// The same, but for code that might not know its line (0), which carries on
+// with the last one.
+inline void near([[maybe_unused]] int line) {
+#ifdef LOX_HEAP_PROFILE
+  if (line > 0) profile::line = line;
+#endif
+}
+
+// Charges allocations on this thread to `k` for as long as it lives. The
+// bytecode loop can't have one alive when it jumps to the next instruction,
+// so it uses as instead.
+#ifdef LOX_HEAP_PROFILE
+class scope {
+public:
+  explicit scope(kind k) noexcept : outer_(std::exchange(current, k)) {}
+  ~scope() { current = outer_; }
+
+  scope(scope const&)                    = delete;
+  auto operator=(scope const&) -> scope& = delete;
+
+private:
+  kind outer_;
+};
+#else
+class scope {
+public:
+  explicit scope(kind /*k*/) noexcept {}
+};
+#endif
+
+// Returns what `make` does, with what it allocates charged to `k`.
+template <typename F>
+auto as(kind k, F const& make) -> decltype(make()) {
+  scope const charged{k};
+  return make();
+}
+
+struct usage {
+  std::uint64_t allocations = 0;
+  std::uint64_t bytes       = 0; // allocated, in all
+  std::uint64_t live        = 0;
+  std::uint64_t peak        = 0; // the most ever live at once
+};
+
+// Everything allocated since the process started (nothing without
+// LOX_HEAP_PROFILE).
+auto totals() -> usage;
+// Writes out the totals, then the `rows` kinds and lines with the highest
+// peaks, one per row.
+void report(std::ostream& out, std::size_t rows = 20);
+
+} // namespace lox::profile
@@ -7,108 +7,219 @@
 
 namespace lox {
 
-void resolver::resolve(std::vector<stmt> const& stmts) {
-  for (stmt const& s : stmts) { std::visit(*this, s); }
+void resolver::resolve(std::vector<stmt>& stmts) {
+  for (stmt& s : stmts) { std::visit(*this, s); }
 }
 
-void resolver::resolve_local(expr e, token name) {
-  for (auto it = scopes.crbegin(); it != scopes.crend(); ++it) {
-    if (it->contains(name.lexeme)) {
-      interpreter_.resolve(e, std::distance(it, scopes.crbegin()));
-      return;
+auto resolver::resolve_local(frame const& f, std::string const& name) -> int {
+  for (auto it = f.scopes.crbegin(); it != f.scopes.crend(); ++it) {
+    if (auto local = it->names.find(name); local != it->names.end()) {
+      return local->second.slot;
     }
   }
+
+  return -1;
 }
 
-void resolver::begin_scope() { scopes.emplace_back(); }
+// Looks for `name` in the functions enclosing frames_[depth], threading a
+// capture through each function in between (like clox's upvalues).
+auto resolver::resolve_upvalue(std::size_t depth, std::string const& name)
+    -> int {
+  if (depth == 0) return -1;
 
-void resolver::end_scope() { scopes.pop_back(); }
+  frame& enclosing = frames_[depth - 1];
+  if (int slot = resolve_local(enclosing, name); slot >= 0) {
+    return add_capture(frames_[depth], capture{true, slot});
+  }
+  if (int index = resolve_upvalue(depth - 1, name); index >= 0) {
+    return add_capture(frames_[depth], capture{false, index});
+  }
+
+  return -1;
+}
 
-void resolver::declare(token name) {
-  if (scopes.empty()) return;
+auto resolver::add_capture(frame& f, capture c) -> int {
+  auto& captures = *f.captures;
+  for (int i = 0; i < std::ssize(captures); ++i) {
+    if (captures[i].local == c.local and captures[i].index == c.index) return i;
+  }
 
-  scopes.back()[name.lexeme] = false;
+  captures.push_back(c);
+  return static_cast<int>(std::ssize(captures)) - 1;
 }
 
-void resolver::define(token name) {
-  if (scopes.empty()) return;
+auto resolver::resolve_name(token const& name) -> binding {
+  if (int slot = resolve_local(frames_.back(), name.lexeme); slot >= 0) {
+    return {binding_kind::local, slot};
+  }
+  if (int index = resolve_upvalue(frames_.size() - 1, name.lexeme);
+      index >= 0) {
+    return {binding_kind::upvalue, index};
+  }
 
-  scopes.back()[name.lexeme] = true;
+  return {binding_kind::global, interpreter_.global(name.lexeme)};
 }
 
-void resolver::operator()(literal_expr const&) {}
+void resolver::begin_scope() {
+  frame& f = frames_.back();
+  f.scopes.push_back(scope{{}, f.next_slot});
+}
 
-void resolver::operator()(variable_expr const& e) {
-  if (not scopes.empty() and scopes.back().contains(e.name.lexeme) and
-      not scopes.back()[e.name.lexeme]) {
-    errors::report(e.name.line,
-                   "can't read local variable in its own initialiser");
+void resolver::end_scope() {
+  frame& f = frames_.back();
+  // Slots are reused once a scope ends, like a stack
+  f.next_slot = f.scopes.back().base;
+  f.scopes.pop_back();
+}
+
+auto resolver::declare(token const& name, variable_stmt* decl) -> binding {
+  frame& f = frames_.back();
+  if (f.scopes.empty()) {
+    return {binding_kind::global, interpreter_.global(name.lexeme)};
   }
 
-  resolve_local(e, e.name);
+  int const slot                     = f.next_slot++;
+  f.scopes.back().names[name.lexeme] = local{slot, false, decl};
+  return {binding_kind::local, slot};
 }
 
-void resolver::operator()(box<group_expr> const& e) {
+void resolver::define(token const& name) {
+  frame& f = frames_.back();
+  if (f.scopes.empty()) return;
+
+  f.scopes.back().names[name.lexeme].defined = true;
+}
+
+void resolver::mark_assigned(std::string const& name) {
+  // Same search order as resolve_name
+  for (auto f = frames_.rbegin(); f != frames_.rend(); ++f) {
+    for (auto it = f->scopes.rbegin(); it != f->scopes.rend(); ++it) {
+      if (auto local = it->names.find(name); local != it->names.end()) {
+        if (local->second.decl != nullptr) local->second.decl->assigned = true;
+        return;
+      }
+    }
+  }
+}
+
+void resolver::operator()(literal_expr& e) {
+  e.constant = interpreter_.constant(e.literal);
+}
+
+void resolver::operator()(variable_expr& e) {
+  auto const& scopes = frames_.back().scopes;
+  if (not scopes.empty()) {
+    auto const& names = scopes.back().names;
+    if (auto it = names.find(e.name.lexeme);
+        it != names.end() and not it->second.defined) {
+      interpreter_.diagnostics().report(e.name.line,
+                     "can't read local variable in its own initialiser");
+    }
+  }
+
+  e.resolved = resolve_name(e.name);
+}
+
+void resolver::operator()(box<group_expr>& e) {
   std::visit(*this, e->ex);
 }
 
-void resolver::operator()(box<assign_expr> const& e) {
+void resolver::operator()(box<assign_expr>& e) {
   std::visit(*this, e->value);
-  resolve_local(e, e->name);
+
+  e->resolved = resolve_name(e->name);
+  mark_assigned(e->name.lexeme);
 }
 
-void resolver::operator()(box<unary_expr> const& e) {
+void resolver::operator()(box<unary_expr>& e) {
   std::visit(*this, e->right);
 }
 
-void resolver::operator()(box<logical_expr> const& e) {
+void resolver::operator()(box<logical_expr>& e) {
   std::visit(*this, e->left);
   std::visit(*this, e->right);
 }
 
-void resolver::operator()(box<binary_expr> const& e) {
+void resolver::operator()(box<binary_expr>& e) {
   std::visit(*this, e->left);
   std::visit(*this, e->right);
 }
 
-void resolver::operator()(box<call_expr> const& e) {
+void resolver::operator()(box<call_expr>& e) {
   std::visit(*this, e->callee);
 
-  for (expr arg : e->args) { std::visit(*this, arg); }
+  for (expr& arg : e->args) { std::visit(*this, arg); }
 }
 
-void resolver::operator()(box<conditional_expr> const& e) {
+void resolver::operator()(box<conditional_expr>& e) {
   std::visit(*this, e->cond);
   std::visit(*this, e->then);
   std::visit(*this, e->alt);
 }
 
-void resolver::operator()(expression_stmt const& s) { std::visit(*this, s.ex); }
+void resolver::operator()(box<suspend_expr>& e) {
+  std::visit(*this, e->value);
+  if (e->keyword.type != token_type::YIELD) return;
+
+  // Yielding is what makes a function a generator
+  function_stmt* const fn = frames_.back().function;
+  if (fn == nullptr) {
+    interpreter_.diagnostics().report(e->keyword.line,
+                                      "can't yield outside a function");
+  } else if (fn->kind == function_kind::async) {
+    interpreter_.diagnostics().report(e->keyword.line,
+                                      "can't yield in an async function");
+  } else {
+    fn->kind = function_kind::generator;
+  }
+}
+
+void resolver::operator()(box<array_expr>& e) {
+  for (expr& element : e->elements) { std::visit(*this, element); }
+}
+
+void resolver::operator()(box<index_expr>& e) {
+  std::visit(*this, e->object);
+  std::visit(*this, e->index);
+}
+
+void resolver::operator()(box<set_index_expr>& e) {
+  std::visit(*this, e->object);
+  std::visit(*this, e->index);
+  std::visit(*this, e->value);
+}
+
+void resolver::operator()(expression_stmt& s) { std::visit(*this, s.ex); }
 
-void resolver::operator()(print_stmt const& s) { std::visit(*this, s.ex); }
+void resolver::operator()(print_stmt& s) { std::visit(*this, s.ex); }
 
-void resolver::operator()(variable_stmt const& s) {
-  declare(s.name);
+void resolver::operator()(variable_stmt& s) {
+  s.resolved = declare(s.name, &s);
+  s.assigned = false;
   if (s.init) std::visit(*this, *s.init);
   define(s.name);
 }
 
-void resolver::operator()(return_stmt const& s) {
+void resolver::operator()(return_stmt& s) {
   if (s.value) std::visit(*this, *s.value);
 }
 
-void resolver::operator()(break_stmt const&) {}
+void resolver::operator()(break_stmt&) {}
 
-void resolver::operator()(box<block_stmt> const& s) {
+void resolver::operator()(box<block_stmt>& s) {
   begin_scope();
   resolve(s->stmts);
   end_scope();
 }
 
-void resolver::resolve_function(box<function_stmt> const& s) {
+void resolver::resolve_function(box<function_stmt>& s) {
+  // Each function gets a fresh stack frame, with its parameters in the first
+  // slots.
+  s->captures.clear();
+  frames_.push_back(frame{{}, &s->captures, 0, &*s});
   begin_scope();
 
-  for (token param : s->params) {
+  for (token const& param : s->params) {
     declare(param);
     define(param);
   }
@@ -116,22 +227,23 @@ void resolver::resolve_function(box<function_stmt> const& s) {
   resolve(s->body);
 
   end_scope();
+  frames_.pop_back();
 }
 
-void resolver::operator()(box<function_stmt> const& s) {
-  declare(s->name);
+void resolver::operator()(box<function_stmt>& s) {
+  s->resolved = declare(s->name);
   define(s->name);
 
   resolve_function(s);
 }
 
-void resolver::operator()(box<if_stmt> const& s) {
+void resolver::operator()(box<if_stmt>& s) {
   std::visit(*this, s->cond);
   std::visit(*this, s->then);
   if (s->alt) std::visit(*this, *s->alt);
 }
 
-void resolver::operator()(box<while_stmt> const& s) {
+void resolver::operator()(box<while_stmt>& s) {
   std::visit(*this, s->cond);
   std::visit(*this, s->body);
 }
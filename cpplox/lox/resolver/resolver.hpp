@@ -15,41 +15,74 @@ class resolver {
 public:
   explicit resolver(interpreter& interpreter) : interpreter_(interpreter) {}
 
-  void resolve(std::vector<stmt> const& stmts);
-
-  void operator()(literal_expr const& e);
-  void operator()(variable_expr const& e);
-  void operator()(box<group_expr> const& e);
-  void operator()(box<assign_expr> const& e);
-  void operator()(box<unary_expr> const& e);
-  void operator()(box<logical_expr> const& e);
-  void operator()(box<binary_expr> const& e);
-  void operator()(box<call_expr> const& e);
-  void operator()(box<conditional_expr> const& e);
-
-  void operator()(expression_stmt const& s);
-  void operator()(print_stmt const& s);
-  void operator()(variable_stmt const& s);
-  void operator()(break_stmt const& s);
-  void operator()(return_stmt const& s);
-  void operator()(box<block_stmt> const& s);
-  void operator()(box<function_stmt> const& s);
-  void operator()(box<if_stmt> const& s);
-  void operator()(box<while_stmt> const& s);
+  void resolve(std::vector<stmt>& stmts);
+
+  void operator()(literal_expr& e);
+  void operator()(variable_expr& e);
+  void operator()(box<group_expr>& e);
+  void operator()(box<assign_expr>& e);
+  void operator()(box<unary_expr>& e);
+  void operator()(box<logical_expr>& e);
+  void operator()(box<binary_expr>& e);
+  void operator()(box<call_expr>& e);
+  void operator()(box<conditional_expr>& e);
+  void operator()(box<suspend_expr>& e);
+  void operator()(box<array_expr>& e);
+  void operator()(box<index_expr>& e);
+  void operator()(box<set_index_expr>& e);
+
+  void operator()(expression_stmt& s);
+  void operator()(print_stmt& s);
+  void operator()(variable_stmt& s);
+  void operator()(break_stmt& s);
+  void operator()(return_stmt& s);
+  void operator()(box<block_stmt>& s);
+  void operator()(box<function_stmt>& s);
+  void operator()(box<if_stmt>& s);
+  void operator()(box<while_stmt>& s);
 
 private:
+  struct local {
+    int            slot;
+    bool           defined;
+    variable_stmt* decl; // null for functions and parameters
+  };
+
+  struct scope {
+    std::unordered_map<std::string, local> names;
+    int                                    base; // first slot of the scope
+  };
+
+  // Every function being resolved has its own frame of scopes, whose locals
+  // are numbered from the start of its stack frame. The outermost frame is
+  // the top level, where a name outside any scope is a global.
+  struct frame {
+    std::deque<scope>     scopes;
+    std::vector<capture>* captures; // null at the top level
+    int                   next_slot;
+    function_stmt*        function = nullptr; // likewise
+  };
+
   interpreter& interpreter_;
 
-  std::deque<std::unordered_map<std::string, bool>> scopes{};
+  std::vector<frame> frames_{frame{{}, nullptr, 0}};
 
-  void resolve_local(expr e, token name);
-  void resolve_function(box<function_stmt> const& s);
+  auto resolve_name(token const& name) -> binding;
+  // Returns the slot `name` is declared in within `f`, or -1.
+  static auto resolve_local(frame const& f, std::string const& name) -> int;
+  // Returns the capture index of `name` in frames_[depth], or -1.
+  auto resolve_upvalue(std::size_t depth, std::string const& name) -> int;
+  static auto add_capture(frame& f, capture c) -> int;
+  void        resolve_function(box<function_stmt>& s);
 
   void begin_scope();
   void end_scope();
 
-  void declare(token name);
-  void define(token name);
+  // Declares `name` in the current scope, or as a global at the top level.
+  auto declare(token const& name, variable_stmt* decl = nullptr) -> binding;
+  void define(token const& name);
+  // Notes that the local `name` resolves to is assigned to.
+  void mark_assigned(std::string const& name);
 };
 
 } // namespace lox
@@ -23,6 +23,9 @@ static auto get_token_type(std::string_view ident) -> token_type {
   if (ident == "var") return token_type::VAR;
   if (ident == "while") return token_type::WHILE;
   if (ident == "break") return token_type::BREAK;
+  if (ident == "yield") return token_type::YIELD;
+  if (ident == "async") return token_type::ASYNC;
+  if (ident == "await") return token_type::AWAIT;
 
   return token_type::IDENTIFIER;
 }
@@ -52,6 +55,8 @@ void scanner::scan_next() {
   case ')': add_token(RIGHT_PAREN); break;
   case '{': add_token(LEFT_BRACE); break;
   case '}': add_token(RIGHT_BRACE); break;
+  case '[': add_token(LEFT_BRACKET); break;
+  case ']': add_token(RIGHT_BRACKET); break;
   case ',': add_token(COMMA); break;
   case '.': add_token(DOT); break;
   case '-': add_token(MINUS); break;
@@ -107,7 +112,7 @@ void scanner::scan_next() {
     } else if (is_alpha(c)) {
       identifier();
     } else {
-      errors::report(line_, fmt::format("unexpected character: {}", c));
+      errors_.report(line_, fmt::format("unexpected character: {}", c));
     }
     break;
   }
@@ -120,7 +125,7 @@ void scanner::string() {
   }
 
   if (done()) {
-    errors::report(
+    errors_.report(
         line_, fmt::format("unterminated string: {}", substr(start_, curr_)));
     return;
   }
@@ -170,7 +175,7 @@ void scanner::block_comment() {
   // Idea: keep track of the levels of nesting.
   for (int depth = 1; depth > 0;) {
     if (done()) {
-      errors::report(line_, "unterminated block comment");
+      errors_.report(line_, "unterminated block comment");
       return;
     }
 
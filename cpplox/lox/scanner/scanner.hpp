@@ -1,5 +1,6 @@
 #pragma once
 
+#include <lox/errors.hpp>
 #include <lox/token/token.hpp>
 
 #include <string>
@@ -11,7 +12,8 @@ namespace lox {
 
 class scanner {
 public:
-  explicit scanner(std::string source) : source_(std::move(source)) {}
+  scanner(std::string source, errors& errors)
+      : source_(std::move(source)), errors_(errors) {}
 
   auto scan() -> std::vector<token>;
 
@@ -50,6 +52,7 @@ private:
 
   const std::string  source_;
   std::vector<token> tokens_;
+  errors&            errors_;
 
   int start_ = 0;
   int curr_  = 0;
@@ -0,0 +1,278 @@
+#include <lox/simd/simd.hpp>
+
+#include <cstddef>
+#include <limits>
+
+#if defined(__x86_64__)
+#define LOX_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace lox::simd {
+
+namespace {
+
+double const INF = std::numeric_limits<double>::infinity();
+
+// One version of every kernel
+struct kernels {
+  char const* name;
+  double (*sum)(double const* xs, std::size_t n);
+  double (*dot)(double const* xs, double const* ys, std::size_t n);
+  double (*min)(double const* xs, std::size_t n);
+  double (*max)(double const* xs, std::size_t n);
+  void (*scale)(double* xs, std::size_t n, double factor);
+};
+
+// Comparing this way round skips NaNs, the same as minpd and maxpd do
+auto lesser(double x, double acc) -> double { return x < acc ? x : acc; }
+auto greater(double x, double acc) -> double { return x > acc ? x : acc; }
+
+// The scalar versions still keep four accumulators, which compilers tend to
+// vectorise anyway
+namespace scalar {
+
+auto sum(double const* xs, std::size_t n) -> double {
+  double      acc[4] = {};
+  std::size_t i      = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (std::size_t j = 0; j < 4; ++j) { acc[j] += xs[i + j]; }
+  }
+  for (; i < n; ++i) { acc[0] += xs[i]; }
+  return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+auto dot(double const* xs, double const* ys, std::size_t n) -> double {
+  double      acc[4] = {};
+  std::size_t i      = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (std::size_t j = 0; j < 4; ++j) { acc[j] += xs[i + j] * ys[i + j]; }
+  }
+  for (; i < n; ++i) { acc[0] += xs[i] * ys[i]; }
+  return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+auto min(double const* xs, std::size_t n) -> double {
+  double acc = INF;
+  for (std::size_t i = 0; i < n; ++i) { acc = lesser(xs[i], acc); }
+  return acc;
+}
+
+auto max(double const* xs, std::size_t n) -> double {
+  double acc = -INF;
+  for (std::size_t i = 0; i < n; ++i) { acc = greater(xs[i], acc); }
+  return acc;
+}
+
+void scale(double* xs, std::size_t n, double factor) {
+  for (std::size_t i = 0; i < n; ++i) { xs[i] *= factor; }
+}
+
+kernels const versions{"scalar", sum, dot, min, max, scale};
+
+} // namespace scalar
+
+#ifdef LOX_SIMD
+
+// SSE2 is always there on x86-64. Four registers of two lanes each.
+namespace sse2 {
+
+auto horizontal_sum(__m128d v) -> double {
+  return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+auto horizontal_min(__m128d v) -> double {
+  return _mm_cvtsd_f64(_mm_min_sd(v, _mm_unpackhi_pd(v, v)));
+}
+auto horizontal_max(__m128d v) -> double {
+  return _mm_cvtsd_f64(_mm_max_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+auto sum(double const* xs, std::size_t n) -> double {
+  __m128d     a0 = _mm_setzero_pd(), a1 = a0, a2 = a0, a3 = a0;
+  std::size_t i  = 0;
+  for (; i + 8 <= n; i += 8) {
+    a0 = _mm_add_pd(a0, _mm_loadu_pd(xs + i));
+    a1 = _mm_add_pd(a1, _mm_loadu_pd(xs + i + 2));
+    a2 = _mm_add_pd(a2, _mm_loadu_pd(xs + i + 4));
+    a3 = _mm_add_pd(a3, _mm_loadu_pd(xs + i + 6));
+  }
+  return horizontal_sum(_mm_add_pd(_mm_add_pd(a0, a1), _mm_add_pd(a2, a3))) +
+         scalar::sum(xs + i, n - i);
+}
+
+auto dot(double const* xs, double const* ys, std::size_t n) -> double {
+  __m128d     a0 = _mm_setzero_pd(), a1 = a0, a2 = a0, a3 = a0;
+  std::size_t i  = 0;
+  for (; i + 8 <= n; i += 8) {
+    a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_loadu_pd(xs + i), _mm_loadu_pd(ys + i)));
+    a1 = _mm_add_pd(
+        a1, _mm_mul_pd(_mm_loadu_pd(xs + i + 2), _mm_loadu_pd(ys + i + 2)));
+    a2 = _mm_add_pd(
+        a2, _mm_mul_pd(_mm_loadu_pd(xs + i + 4), _mm_loadu_pd(ys + i + 4)));
+    a3 = _mm_add_pd(
+        a3, _mm_mul_pd(_mm_loadu_pd(xs + i + 6), _mm_loadu_pd(ys + i + 6)));
+  }
+  return horizontal_sum(_mm_add_pd(_mm_add_pd(a0, a1), _mm_add_pd(a2, a3))) +
+         scalar::dot(xs + i, ys + i, n - i);
+}
+
+auto min(double const* xs, std::size_t n) -> double {
+  __m128d     a0 = _mm_set1_pd(INF), a1 = a0;
+  std::size_t i  = 0;
+  for (; i + 4 <= n; i += 4) {
+    a0 = _mm_min_pd(_mm_loadu_pd(xs + i), a0);
+    a1 = _mm_min_pd(_mm_loadu_pd(xs + i + 2), a1);
+  }
+  return lesser(horizontal_min(_mm_min_pd(a0, a1)),
+                scalar::min(xs + i, n - i));
+}
+
+auto max(double const* xs, std::size_t n) -> double {
+  __m128d     a0 = _mm_set1_pd(-INF), a1 = a0;
+  std::size_t i  = 0;
+  for (; i + 4 <= n; i += 4) {
+    a0 = _mm_max_pd(_mm_loadu_pd(xs + i), a0);
+    a1 = _mm_max_pd(_mm_loadu_pd(xs + i + 2), a1);
+  }
+  return greater(horizontal_max(_mm_max_pd(a0, a1)),
+                 scalar::max(xs + i, n - i));
+}
+
+void scale(double* xs, std::size_t n, double factor) {
+  auto const  f = _mm_set1_pd(factor);
+  std::size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    _mm_storeu_pd(xs + i, _mm_mul_pd(_mm_loadu_pd(xs + i), f));
+  }
+  scalar::scale(xs + i, n - i, factor);
+}
+
+kernels const versions{"sse2", sum, dot, min, max, scale};
+
+} // namespace sse2
+
+// Compiled for AVX2 whatever the rest of the build targets, and only called
+// once the CPU says it has it. Four registers of four lanes each.
+namespace avx2 {
+
+#define LOX_AVX2 __attribute__((target("avx2")))
+
+LOX_AVX2 auto horizontal_sum(__m256d v) -> double {
+  return sse2::horizontal_sum(
+      _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1)));
+}
+
+LOX_AVX2 auto sum(double const* xs, std::size_t n) -> double {
+  __m256d     a0 = _mm256_setzero_pd(), a1 = a0, a2 = a0, a3 = a0;
+  std::size_t i  = 0;
+  for (; i + 16 <= n; i += 16) {
+    a0 = _mm256_add_pd(a0, _mm256_loadu_pd(xs + i));
+    a1 = _mm256_add_pd(a1, _mm256_loadu_pd(xs + i + 4));
+    a2 = _mm256_add_pd(a2, _mm256_loadu_pd(xs + i + 8));
+    a3 = _mm256_add_pd(a3, _mm256_loadu_pd(xs + i + 12));
+  }
+  return horizontal_sum(
+             _mm256_add_pd(_mm256_add_pd(a0, a1), _mm256_add_pd(a2, a3))) +
+         scalar::sum(xs + i, n - i);
+}
+
+LOX_AVX2 auto dot(double const* xs, double const* ys, std::size_t n)
+    -> double {
+  __m256d     a0 = _mm256_setzero_pd(), a1 = a0, a2 = a0, a3 = a0;
+  std::size_t i  = 0;
+  for (; i + 16 <= n; i += 16) {
+    a0 = _mm256_add_pd(
+        a0, _mm256_mul_pd(_mm256_loadu_pd(xs + i), _mm256_loadu_pd(ys + i)));
+    a1 = _mm256_add_pd(a1, _mm256_mul_pd(_mm256_loadu_pd(xs + i + 4),
+                                         _mm256_loadu_pd(ys + i + 4)));
+    a2 = _mm256_add_pd(a2, _mm256_mul_pd(_mm256_loadu_pd(xs + i + 8),
+                                         _mm256_loadu_pd(ys + i + 8)));
+    a3 = _mm256_add_pd(a3, _mm256_mul_pd(_mm256_loadu_pd(xs + i + 12),
+                                         _mm256_loadu_pd(ys + i + 12)));
+  }
+  return horizontal_sum(
+             _mm256_add_pd(_mm256_add_pd(a0, a1), _mm256_add_pd(a2, a3))) +
+         scalar::dot(xs + i, ys + i, n - i);
+}
+
+LOX_AVX2 auto min(double const* xs, std::size_t n) -> double {
+  __m256d     a0 = _mm256_set1_pd(INF), a1 = a0;
+  std::size_t i  = 0;
+  for (; i + 8 <= n; i += 8) {
+    a0 = _mm256_min_pd(_mm256_loadu_pd(xs + i), a0);
+    a1 = _mm256_min_pd(_mm256_loadu_pd(xs + i + 4), a1);
+  }
+  auto const v = _mm256_min_pd(a0, a1);
+  return lesser(sse2::horizontal_min(_mm_min_pd(
+                    _mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1))),
+                scalar::min(xs + i, n - i));
+}
+
+LOX_AVX2 auto max(double const* xs, std::size_t n) -> double {
+  __m256d     a0 = _mm256_set1_pd(-INF), a1 = a0;
+  std::size_t i  = 0;
+  for (; i + 8 <= n; i += 8) {
+    a0 = _mm256_max_pd(_mm256_loadu_pd(xs + i), a0);
+    a1 = _mm256_max_pd(_mm256_loadu_pd(xs + i + 4), a1);
+  }
+  auto const v = _mm256_max_pd(a0, a1);
+  return greater(sse2::horizontal_max(_mm_max_pd(
+                     _mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1))),
+                 scalar::max(xs + i, n - i));
+}
+
+LOX_AVX2 void scale(double* xs, std::size_t n, double factor) {
+  auto const  f = _mm256_set1_pd(factor);
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(xs + i, _mm256_mul_pd(_mm256_loadu_pd(xs + i), f));
+  }
+  scalar::scale(xs + i, n - i, factor);
+}
+
+#undef LOX_AVX2
+
+kernels const versions{"avx2", sum, dot, min, max, scale};
+
+} // namespace avx2
+
+#endif
+
+auto pick() -> kernels const& {
+  static kernels const& chosen = []() -> kernels const& {
+#ifdef LOX_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return avx2::versions;
+    return sse2::versions;
+#else
+    return scalar::versions;
+#endif
+  }();
+  return chosen;
+}
+
+} // namespace
+
+auto sum(std::span<double const> xs) -> double {
+  return pick().sum(xs.data(), xs.size());
+}
+
+auto dot(std::span<double const> xs, std::span<double const> ys) -> double {
+  return pick().dot(xs.data(), ys.data(), xs.size());
+}
+
+auto min(std::span<double const> xs) -> double {
+  return pick().min(xs.data(), xs.size());
+}
+
+auto max(std::span<double const> xs) -> double {
+  return pick().max(xs.data(), xs.size());
+}
+
+void scale(std::span<double> xs, double factor) {
+  pick().scale(xs.data(), xs.size(), factor);
+}
+
+auto instruction_set() -> char const* { return pick().name; }
+
+} // namespace lox::simd
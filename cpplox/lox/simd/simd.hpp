@@ -0,0 +1,29 @@
+#pragma once
+
+#include <span>
+
+// Numeric kernels over contiguous doubles, for the float array builtins
+// (see interpreter::define_builtins).
+//
+// Each has a scalar version and, on x86-64, SSE2 and AVX2 ones. Which one
+// runs is picked once, the first time any of them is called, from what the
+// CPU supports. They keep several accumulators going at once, so a
+// reduction is limited by memory bandwidth rather than by the latency of
+// each add. That also means sums are added up in a different order from a
+// simple loop (and from one version to another), which can change the last
+// bits of the result.
+namespace lox::simd {
+
+auto sum(std::span<double const> xs) -> double;
+// `ys` is the same length as `xs`.
+auto dot(std::span<double const> xs, std::span<double const> ys) -> double;
+// NaNs are skipped; with nothing else, these are +/- infinity.
+auto min(std::span<double const> xs) -> double;
+auto max(std::span<double const> xs) -> double;
+// Multiplies each element by `factor`, in place.
+void scale(std::span<double> xs, double factor);
+
+// The instruction set the kernels are using: "avx2", "sse2" or "scalar".
+auto instruction_set() -> char const*;
+
+} // namespace lox::simd
@@ -8,8 +8,9 @@ namespace lox {
 
 constexpr std::array token_type_names{
     // Single-character tokens
-    "LEFT_PAREN", "RIGHT_PAREN", "LEFT_BRACE", "RIGHT_BRACE", "COMMA", "DOT",
-    "MINUS", "PLUS", "SEMICOLON", "SLASH", "STAR", "QUESTION", "COLON",
+    "LEFT_PAREN", "RIGHT_PAREN", "LEFT_BRACE", "RIGHT_BRACE", "LEFT_BRACKET",
+    "RIGHT_BRACKET", "COMMA", "DOT", "MINUS", "PLUS", "SEMICOLON", "SLASH",
+    "STAR", "QUESTION", "COLON",
 
     // One or two character tokens
     "BANG", "BANG_EQUAL", "EQUAL", "EQUAL_EQUAL", "GREATER", "GREATER_EQUAL",
@@ -20,7 +21,8 @@ constexpr std::array token_type_names{
 
     // Keywords
     "AND", "CLASS", "ELSE", "FALSE", "FUN", "FOR", "IF", "NIL", "OR", "PRINT",
-    "RETURN", "SUPER", "THIS", "TRUE", "VAR", "WHILE", "BREAK",
+    "RETURN", "SUPER", "THIS", "TRUE", "VAR", "WHILE", "BREAK", "YIELD",
+    "ASYNC", "AWAIT",
 
     "EOF"};
 
@@ -14,7 +14,7 @@ namespace lox {
 // clang-format off
 enum class token_type {
   // Single-character tokens
-  LEFT_PAREN, RIGHT_PAREN, LEFT_BRACE, RIGHT_BRACE,
+  LEFT_PAREN, RIGHT_PAREN, LEFT_BRACE, RIGHT_BRACE, LEFT_BRACKET, RIGHT_BRACKET,
   COMMA, DOT, MINUS, PLUS, SEMICOLON, SLASH, STAR,
   QUESTION, COLON,
   
@@ -30,6 +30,7 @@ enum class token_type {
   // Keywords
   AND, CLASS, ELSE, FALSE, FUN, FOR, IF, NIL, OR,
   PRINT, RETURN, SUPER, THIS, TRUE, VAR, WHILE, BREAK,
+  YIELD, ASYNC, AWAIT,
   
   EOF,
   
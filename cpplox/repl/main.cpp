@@ -1,18 +1,30 @@
 #include <lox/ast/ast_printer.hpp>
 #include <lox/errors.hpp>
-#include <lox/interpreter/environment.hpp>
 #include <lox/interpreter/interpreter.hpp>
+#include <lox/interpreter/snapshot.hpp>
+#include <lox/lox.hpp>
+#include <lox/optimizer/optimizer.hpp>
 #include <lox/parser/parser.hpp>
+#include <lox/pool/pool.hpp>
+#include <lox/profile/heap.hpp>
 #include <lox/resolver/resolver.hpp>
 #include <lox/scanner/scanner.hpp>
 #include <lox/token/token.hpp>
 
 #include <fmt/ranges.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <cstdio>
+#include <cstdlib>
 #include <exception>
+#include <filesystem>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <span>
 #include <sstream>
 #include <string>
 #include <string_view>
@@ -22,31 +34,43 @@
 
 static auto run(lox::interpreter& interpreter, std::string const& source)
     -> int {
-  lox::scanner scanner(source);
+  auto& errors = interpreter.diagnostics();
+
+  lox::scanner scanner(source, errors);
   auto const   tokens = scanner.scan();
   fmt::print("=== Printing tokens ===\n[{}]\n", fmt::join(tokens, ", "));
 
   // Stop if there was an error
-  if (lox::errors::errored) return EX_DATAERR;
-  if (lox::errors::runtime_errored) return EX_SOFTWARE;
+  if (errors.errored) return EX_DATAERR;
+  if (errors.runtime_errored) return EX_SOFTWARE;
 
-  lox::parser parser(tokens);
-  auto const  stmts = parser.parse();
+  lox::parser parser(tokens, errors);
+  auto        stmts = parser.parse();
   fmt::print("=== Printing AST ===\n{}\n",
              fmt::join(lox::print(lox::ast_printer{}, stmts), "\n"));
 
   lox::resolver resolver{interpreter};
   resolver.resolve(stmts);
 
+  lox::optimizer optimizer;
+  optimizer.optimize(stmts);
+  fmt::print("=== Optimizing AST ===\n{}\n{}\n", optimizer.statistics(),
+             fmt::join(lox::print(lox::ast_printer{}, stmts), "\n"));
+
   fmt::print("=== Evaluating AST ===\n");
-  interpreter.interpret(stmts);
+  try {
+    interpreter.interpret(stmts);
+  } catch (lox::budget_exceeded const& err) {
+    fmt::print("Error: {}\n", err.what());
+    return EX_SOFTWARE;
+  }
 
   return EX_OK;
 }
 
 // Pass by const reference because we want a non-owning view
 // but need a null-terminated string.
-static auto run_file(std::string const& path) -> int {
+static auto run_file(std::string const& path, lox::options options) -> int {
   // Requires a null-terminated string (artifact of underlying C file API)
   std::ifstream file(path);
   if (!file.good()) {
@@ -57,21 +81,197 @@ static auto run_file(std::string const& path) -> int {
   const std::ostringstream ss;
   file >> ss.rdbuf();
 
-  lox::interpreter interpreter{};
+  lox::interpreter interpreter{std::cout, options};
 
   int err = run(interpreter, ss.str());
   if (err > 0) return err;
 
-  if (lox::errors::errored) EX_DATAERR;
+  if (interpreter.diagnostics().errored) EX_DATAERR;
+
+  return EX_OK;
+}
+
+// Runs a script, then saves a snapshot of the globals it left behind for
+// later runs to start from (see run_snapshot).
+static auto save_snapshot(std::string const& script, std::string const& path,
+                          lox::options options) -> int {
+  std::ifstream file(script);
+  if (!file.good()) {
+    fmt::print("Error opening file: {}\n", script);
+    return EX_NOINPUT;
+  }
+
+  std::ostringstream source;
+  source << file.rdbuf();
+
+  lox::interpreter interpreter{std::cout, options};
+  auto const       program = lox::compile(source.str(), interpreter);
+  if (program == nullptr) return EX_DATAERR;
+
+  try {
+    interpreter.run(*program);
+    if (interpreter.diagnostics().runtime_errored) return EX_SOFTWARE;
+
+    std::ofstream out(path, std::ios::binary);
+    interpreter.save_snapshot(out);
+    if (not out.good()) {
+      fmt::print("Error writing file: {}\n", path);
+      return EX_CANTCREAT;
+    }
+  } catch (std::exception const& err) {
+    fmt::print("Error: {}\n", err.what());
+    return EX_SOFTWARE;
+  }
+  return EX_OK;
+}
+
+// Starts from a snapshot instead of running the script it was taken of, and
+// carries on by calling its main function.
+static auto run_snapshot(std::string const& path, lox::options options)
+    -> int {
+  lox::interpreter              interpreter{std::cout, options};
+  std::shared_ptr<lox::program> program;
+  try {
+    lox::mapped_file const file{path};
+    program = interpreter.load_snapshot(file.bytes());
+  } catch (std::exception const& err) {
+    fmt::print("Error loading snapshot: {}\n", err.what());
+    return EX_NOINPUT;
+  }
 
+  try {
+    interpreter.run_main(*program);
+  } catch (lox::budget_exceeded const& err) {
+    fmt::print("Error: {}\n", err.what());
+    return EX_SOFTWARE;
+  }
+  if (interpreter.diagnostics().runtime_errored) return EX_SOFTWARE;
   return EX_OK;
 }
 
-static void run_prompt() {
+// What running one script in a batch came to
+struct outcome {
+  std::string output; // and errors
+  int         status  = EX_OK;
+  double      seconds = 0;
+};
+
+// Runs a script in an interpreter of its own, keeping whatever it prints.
+static auto run_isolated(std::string const& path, lox::options options)
+    -> outcome {
+  auto const start = std::chrono::steady_clock::now();
+  outcome    result;
+
+  std::ifstream file(path);
+  if (!file.good()) {
+    result.output = fmt::format("Error opening file: {}\n", path);
+    result.status = EX_NOINPUT;
+    return result;
+  }
+
+  std::ostringstream source;
+  source << file.rdbuf();
+
+  std::ostringstream output;
+  try {
+    lox::interpreter interpreter{output, options};
+    interpreter.diagnostics().output = &output;
+
+    if (auto const program = lox::compile(source.str(), interpreter)) {
+      interpreter.run(*program);
+      if (interpreter.diagnostics().runtime_errored) {
+        result.status = EX_SOFTWARE;
+      }
+    } else {
+      result.status = EX_DATAERR;
+    }
+  } catch (std::exception const& err) {
+    output << "Error: " << err.what() << "\n";
+    result.status = EX_SOFTWARE;
+  }
+
+  result.output  = std::move(output).str();
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  return result;
+}
+
+// Expands directories into the scripts under them, in order.
+static auto find_scripts(std::vector<std::string> const& paths)
+    -> std::vector<std::string> {
+  namespace fs = std::filesystem;
+
+  std::vector<std::string> scripts;
+  for (auto const& path : paths) {
+    std::error_code error;
+    if (not fs::is_directory(path, error)) {
+      scripts.push_back(path);
+      continue;
+    }
+
+    std::vector<std::string> found;
+    for (auto const& entry : fs::recursive_directory_iterator(path, error)) {
+      if (entry.is_regular_file() and entry.path().extension() == ".lox") {
+        found.push_back(entry.path().string());
+      }
+    }
+    std::ranges::sort(found);
+    scripts.insert(scripts.end(), found.begin(), found.end());
+  }
+  return scripts;
+}
+
+// Runs scripts `jobs` at a time. Each prints as a whole, in the order given,
+// as soon as it and all before it are done.
+static auto run_batch(std::vector<std::string> const& paths, std::size_t jobs,
+                      lox::options options) -> int {
+  auto const start   = std::chrono::steady_clock::now();
+  auto const scripts = find_scripts(paths);
+
+  std::vector<std::promise<outcome>> promises(scripts.size());
+  std::vector<std::future<outcome>>  outcomes;
+  outcomes.reserve(scripts.size());
+  for (auto& promise : promises) { outcomes.push_back(promise.get_future()); }
+
+  lox::pool pool{jobs};
+  for (std::size_t i = 0; i < scripts.size(); ++i) {
+    pool.submit([&, i] {
+      promises[i].set_value(run_isolated(scripts[i], options));
+    });
+  }
+
+  int         status = EX_OK;
+  std::size_t failed = 0;
+  double      busy   = 0;
+  for (std::size_t i = 0; i < scripts.size(); ++i) {
+    auto const result = outcomes[i].get();
+    fmt::print("=== {} ===\n{}", scripts[i], result.output);
+    std::fflush(stdout);
+
+    if (result.status != EX_OK) {
+      ++failed;
+      if (status == EX_OK) status = result.status;
+    }
+    busy += result.seconds;
+  }
+
+  auto const elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+  fmt::print(stderr,
+             "{} scripts, {} failed, in {:.3f}s ({:.3f}s of work on {} "
+             "threads)\n",
+             scripts.size(), failed, elapsed, busy, pool.size());
+
+  return status;
+}
+
+static void run_prompt(lox::options options) {
   fmt::print("Running prompt\n");
 
   std::string      line;
-  lox::interpreter interpreter{};
+  lox::interpreter interpreter{std::cout, options};
 
   while (true) {
     fmt::print("> ");
@@ -79,8 +279,8 @@ static void run_prompt() {
     if (std::getline(std::cin, line)) {
       run(interpreter, line);
 
-      lox::errors::errored         = false;
-      lox::errors::runtime_errored = false;
+      interpreter.diagnostics().errored         = false;
+      interpreter.diagnostics().runtime_errored = false;
     } else {
       fmt::print("\n");
       break;
@@ -89,14 +289,79 @@ static void run_prompt() {
 }
 
 auto main(int argc, char* argv[]) -> int {
-  if (argc > 2) {
-    fmt::print("Usage: lox [script]\n");
+  lox::options             options;
+  std::size_t              jobs = 0; // not running a batch
+  std::vector<std::string> paths;
+  std::string              save_to;   // a snapshot, after running the script
+  std::string              load_from; // a snapshot, instead of a script
+
+  auto const usage = [] {
+    fmt::print("Usage: lox [--ir] [--dump-ir] [--no-jit] [--fuel N] "
+               "[--time-limit SECONDS] [--heap-limit BYTES]\n"
+               "           [--heap-profile]\n"
+               "           [script | --jobs N scripts-or-dirs... |\n"
+               "           --save-snapshot FILE script | --snapshot FILE]\n");
     return EX_USAGE;
-  } else if (argc == 2) {
-    int err = run_file(argv[1]); // NOLINT
+  };
+
+  auto const args = std::span(argv, static_cast<std::size_t>(argc));
+  for (std::size_t i = 1; i < args.size(); ++i) {
+    std::string_view const arg = args[i];
+    if (arg == "--ir") {
+      options.ir = true;
+    } else if (arg == "--dump-ir") {
+      options.dump_ir = true;
+    } else if (arg == "--no-jit") {
+      options.jit = false;
+    } else if (arg == "--jobs" and i + 1 < args.size()) {
+      auto const n = std::atoi(args[++i]);
+      if (n <= 0) return usage();
+      jobs = static_cast<std::size_t>(n);
+    } else if (arg == "--fuel" and i + 1 < args.size()) {
+      options.fuel = std::strtoull(args[++i], nullptr, 10);
+    } else if (arg == "--time-limit" and i + 1 < args.size()) {
+      options.time_limit = std::strtod(args[++i], nullptr);
+    } else if (arg == "--heap-limit" and i + 1 < args.size()) {
+      options.heap_limit = std::strtoull(args[++i], nullptr, 10);
+    } else if (arg == "--heap-profile") {
+      if constexpr (not lox::profile::enabled) {
+        fmt::print("Error: --heap-profile needs lox built with "
+                   "LOX_HEAP_PROFILE\n");
+        return EX_USAGE;
+      }
+      // At exit, whichever way it comes
+      std::atexit([] { lox::profile::report(std::cerr); });
+    } else if (arg == "--save-snapshot" and i + 1 < args.size()) {
+      save_to = args[++i];
+    } else if (arg == "--snapshot" and i + 1 < args.size()) {
+      load_from = args[++i];
+    } else if (arg.starts_with("--")) {
+      return usage();
+    } else {
+      paths.emplace_back(arg);
+    }
+  }
+
+  if (not load_from.empty()) {
+    if (jobs > 0 or not save_to.empty() or not paths.empty()) return usage();
+    return run_snapshot(load_from, options);
+  }
+  if (not save_to.empty()) {
+    if (jobs > 0 or paths.size() != 1) return usage();
+    return save_snapshot(paths.front(), save_to, options);
+  }
+
+  if (jobs > 0) {
+    if (paths.empty()) return usage();
+    return run_batch(paths, jobs, options);
+  }
+  if (paths.size() > 1) return usage();
+
+  if (not paths.empty()) {
+    int err = run_file(paths.front(), options);
     if (err > 0) return err;
   } else {
-    run_prompt();
+    run_prompt(options);
   }
 
   return EX_OK;
@@ -1,10 +1,23 @@
-#include <lox/interpreter/environment.hpp>
 #include <lox/interpreter/interpreter.hpp>
+#include <lox/interpreter/snapshot.hpp>
+#include <lox/lox.hpp>
 #include <lox/parser/parser.hpp>
+#include <lox/profile/heap.hpp>
+#include <lox/resolver/resolver.hpp>
 #include <lox/scanner/scanner.hpp>
 #include <tests/util.hpp>
 
+#include <fmt/core.h>
+
+#include <array>
+#include <limits>
+#include <optional>
 #include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 TEST_CASE("interpreter") {
   std::string input;
@@ -34,10 +47,51 @@ TEST_CASE("interpreter") {
     input = read_file("interpreter/closure.lox");
     want  = "1\n1\nnil\n2\n2\nnil\n";
   }
+  SUBCASE("captured locals") {
+    input = R"(fun outer() { var x = "before"; fun mid() { fun inner() { print x; }
+               return inner; } var f = mid(); x = "after"; return f; }
+               var f = outer(); f();
+               { var a = 1; fun get() { print a; } a = 2; get(); })";
+    want  = "after\nafter\nnil\n2\n";
+  }
+  SUBCASE("break closes captured locals") {
+    input = R"(var f = nil;
+               for (var i = 0; i < 3; i = i + 1) {
+                 var j = i; fun get() { print j; }
+                 if (i == 1) { f = get; break; }
+               }
+               f();)";
+    want  = "1\nnil\n";
+  }
+  SUBCASE("operators change types") {
+    input = R"(fun add(a, b) { return a + b; }
+               fun lt(a, b) { return a < b; }
+               print add(1, 2); print add("a", "b"); print add(3, 4);
+               print add("x", 1);
+               print lt(1, 2); print lt("b", "a"); print lt(2, 1);)";
+    want  = "3\nab\n7\nx1\ntrue\nfalse\nfalse\n";
+  }
+  SUBCASE("tail calls") {
+    // Far deeper than the stack would go if each call kept its frame
+    input = R"(fun count(n, acc) { if (n == 0) return acc;
+                 return count(n - 1, acc + 1); }
+               fun even(n) { if (n == 0) return true; return uneven(n - 1); }
+               fun uneven(n) { if (n == 0) return false; return even(n - 1); }
+               print count(100000, 0); print even(100001);
+               fun capture(n) { fun get() { return n; }
+                 if (n == 0) return get; return capture(n - 1); }
+               print capture(3)();)";
+    want  = "100000\nfalse\n0\n";
+  }
   SUBCASE("native fn") {
     input = R"(min("a", "b");)";
     want  = "a\n";
   }
+  SUBCASE("shared string buffers") {
+    input = R"(var a = "ab"; var b = a + "c"; var c = a + "d";
+               print b; print c; print a; print b * 2; print b == "abc";)";
+    want  = "abc\nabd\nab\nabcabc\ntrue\n";
+  }
   SUBCASE("static scope") {
     input = read_file("interpreter/scopes.lox");
     want  = "global\nglobal\n";
@@ -51,16 +105,961 @@ TEST_CASE("interpreter") {
     want  = "error!\n";
   }
 
-  lox::scanner scanner{input};
-  lox::parser  parser{scanner.scan()};
-
   std::ostringstream buffer;
 
-  lox::interpreter       interpreter{buffer};
+  lox::interpreter interpreter{buffer};
+  lox::scanner     scanner{input, interpreter.diagnostics()};
+  lox::parser      parser{scanner.scan(), interpreter.diagnostics()};
+
   std::vector<lox::stmt> stmts = parser.parse();
+  lox::resolver          resolver{interpreter};
+  resolver.resolve(stmts);
   interpreter.interpret(stmts);
 
   REQUIRE(not buffer.str().empty());
   std::string got = buffer.str();
   REQUIRE(want == got);
 }
+
+TEST_CASE("stack limits") {
+  lox::options config;
+  SUBCASE("depth") { config.max_depth = 100; }
+  SUBCASE("stack size") { config.stack_size = 256; }
+
+  // Not a tail call, so every level keeps its frame
+  std::string const input = R"(fun deep(n) { if (n == 0) return 0;
+                                 return 1 + deep(n - 1); }
+                               print deep(20); print deep(500);)";
+
+  for (bool const ir : {false, true}) {
+    CAPTURE(ir);
+    config.ir = ir;
+
+    std::ostringstream buffer;
+
+    lox::interpreter interpreter{buffer, config};
+    lox::scanner     scanner{input, interpreter.diagnostics()};
+    lox::parser      parser{scanner.scan(), interpreter.diagnostics()};
+
+    std::vector<lox::stmt> stmts = parser.parse();
+    lox::resolver          resolver{interpreter};
+    resolver.resolve(stmts);
+    interpreter.interpret(stmts);
+
+    REQUIRE(interpreter.diagnostics().runtime_errored);
+    REQUIRE("20\n" == buffer.str());
+  }
+}
+
+TEST_CASE("programs") {
+  std::ostringstream buffer;
+  lox::interpreter   interpreter{buffer};
+
+  auto const program = lox::compile(
+      R"(var runs = 0; { runs = runs + 1; }
+         fun greet(name) { return "hi " + name; }
+         print greet("lox"); print runs;)",
+      interpreter);
+  REQUIRE(program != nullptr);
+
+  // Every run starts again, on any interpreter
+  std::ostringstream other_buffer;
+  lox::interpreter   other{other_buffer, {.ir = true}};
+  for (int i = 0; i < 3; ++i) {
+    interpreter.run(*program);
+    other.run(*program);
+  }
+  REQUIRE("hi lox\n1\nhi lox\n1\nhi lox\n1\n" == buffer.str());
+  REQUIRE(buffer.str() == other_buffer.str());
+
+  // Globals from a run are gone by the next one
+  auto const define = lox::compile("var left = 1;", interpreter);
+  auto const use    = lox::compile("print left;", interpreter);
+  interpreter.run(*define);
+  buffer.str("");
+  interpreter.run(*use);
+  REQUIRE(interpreter.diagnostics().runtime_errored);
+  REQUIRE(buffer.str().empty());
+}
+
+TEST_CASE("constants") {
+  // inf - inf folds to NaN, which isn't equal to itself, so it mustn't end
+  // up sharing a pool entry with another number
+  std::string const big = "1" + std::string(308, '0') + " * 10";
+
+  std::ostringstream buffer;
+  lox::interpreter   interpreter{buffer};
+
+  auto const program = lox::compile(
+      fmt::format("print 5; var nan = {0} - {0}; print nan != nan; print 7;",
+                  big),
+      interpreter);
+  REQUIRE(program != nullptr);
+  interpreter.run(*program);
+  REQUIRE("5\ntrue\n7\n" == buffer.str());
+
+  // However a NaN literal gets to the pool, it gets an entry of its own
+  lox::scanner scanner{"print 5; print 0; print 7; print 0;",
+                       interpreter.diagnostics()};
+  lox::parser  parser{scanner.scan(), interpreter.diagnostics()};
+
+  std::vector<lox::stmt> stmts = parser.parse();
+  lox::resolver          resolver{interpreter};
+  resolver.resolve(stmts);
+  for (int const i : {1, 3}) {
+    auto& print  = std::get<lox::print_stmt>(stmts[i]);
+    auto& lit    = std::get<lox::literal_expr>(print.ex);
+    lit.literal  = std::numeric_limits<double>::quiet_NaN();
+    lit.constant = -1;
+  }
+
+  buffer.str("");
+  interpreter.run(*interpreter.compile(stmts));
+  REQUIRE("5\nnan\n7\nnan\n" == buffer.str());
+}
+
+TEST_CASE("output") {
+  for (bool const ir : {false, true}) {
+    CAPTURE(ir);
+
+    // Errors go to the same stream, after everything printed before them
+    std::ostringstream buffer;
+    lox::interpreter   interpreter{buffer, {.ir = ir}};
+    interpreter.diagnostics().output = &buffer;
+
+    auto const program = lox::compile(
+        R"(var n = 0; while (n < 20000) { print n; n = n + 1; }
+           print [1, "a", nil]; print flush(); nil();)",
+        interpreter);
+    REQUIRE(program != nullptr);
+    interpreter.run(*program);
+    REQUIRE(interpreter.diagnostics().runtime_errored);
+
+    auto const out = buffer.str();
+    REQUIRE(out.starts_with("0\n1\n2\n"));
+    auto const tail = out.find("19999\n[1, a, nil]\nnil\n");
+    REQUIRE(tail != std::string::npos);
+    REQUIRE(out.find("19998\n") < tail);
+    REQUIRE(out.find("] Error:") > tail);
+    REQUIRE(out.find("] Error:") != std::string::npos);
+  }
+
+  // What a task prints comes after what was printed before it started
+  std::ostringstream buffer;
+  lox::interpreter   interpreter{buffer};
+  auto const         program = lox::compile(
+      R"(fun work(x) { print x; return x + 1; }
+         print "before"; print receive(spawn(work, 1)); print "after";)",
+      interpreter);
+  interpreter.run(*program);
+  REQUIRE(buffer.str() == "before\n1\n2\nafter\n");
+
+  // However a task reaches flush, it flushes what the task printed
+  buffer.str("");
+  auto const aliased = lox::compile(
+      R"(var fl = flush;
+         fun work(f) { print "task"; { f(); fl(); } return [fl][0](); }
+         print "before"; print receive(spawn(work, flush)); { fl(); }
+         print "after";)",
+      interpreter);
+  interpreter.run(*aliased);
+  REQUIRE(buffer.str() == "before\ntask\nnil\nafter\n");
+}
+
+TEST_CASE("builtin errors") {
+  // Point at the call, from bytecode or IR, unless they come from Lox code
+  // the builtin called back into
+  std::pair<std::string_view, std::string_view> const cases[] = {
+      {"fun empty(a) {\n  return pop(a);\n}\nempty([]);",
+       "[line 2] Error: ')' pop from an empty array\n"},
+      {"fun f() {\n  return len(nil);\n}\nf();",
+       "[line 2] Error: ')' can only take the length of arrays, maps and "
+       "strings\n"},
+      {"fun bad(x) {\n  return x - \"x\";\n}\nparallel_map([1], bad);",
+       "[line 2] Error: '-' operands must be two numbers\n"},
+  };
+  for (bool const ir : {false, true}) {
+    for (auto const& [input, want] : cases) {
+      CAPTURE(ir);
+      CAPTURE(input);
+
+      std::ostringstream buffer;
+      std::ostringstream errors;
+      lox::interpreter   interpreter{buffer, {.ir = ir}};
+      interpreter.diagnostics().output = &errors;
+
+      auto const program = lox::compile(input, interpreter);
+      REQUIRE(program != nullptr);
+      interpreter.run(*program);
+      REQUIRE(want == errors.str());
+    }
+  }
+}
+
+TEST_CASE("heap profile") {
+  std::ostringstream buffer;
+  lox::interpreter   interpreter{buffer};
+  auto const         before  = lox::profile::totals();
+  auto const         program = lox::compile(
+      R"(var s = "";
+         for (var i = 0; i < 100; i = i + 1) { s = s + "ab"; }
+         heap_profile();)",
+      interpreter);
+  REQUIRE(program != nullptr);
+  interpreter.run(*program);
+
+  REQUIRE(buffer.str().starts_with("heap profile: "));
+  if constexpr (lox::profile::enabled) {
+    REQUIRE(lox::profile::totals().allocations > before.allocations);
+
+    // The strings built on line 2 are charged to it, among everything else
+    // the tests have allocated
+    std::ostringstream report;
+    lox::profile::report(report, 1000);
+    REQUIRE(report.str().find(fmt::format("\n{:<10} {:>6} ", "string", 2)) !=
+            std::string::npos);
+  }
+}
+
+TEST_CASE("budgets") {
+  std::string const spin = R"(fun spin() { while (true) {} }
+                              print "start"; spin();)";
+
+  SUBCASE("fuel") {
+    for (bool const ir : {false, true}) {
+      CAPTURE(ir);
+
+      std::ostringstream buffer;
+      lox::interpreter   interpreter{buffer, {.ir = ir, .fuel = 10000}};
+      auto const         program = lox::compile(spin, interpreter);
+      REQUIRE(program != nullptr);
+
+      try {
+        interpreter.run(*program);
+        FAIL("should have run out of fuel");
+      } catch (lox::budget_exceeded const& err) {
+        REQUIRE(err.used.fuel == 10000);
+      }
+      REQUIRE(buffer.str() == "start\n");
+      REQUIRE(not interpreter.diagnostics().runtime_errored);
+
+      // Every run gets the whole budget, and calls count too
+      auto const fine = lox::compile(
+          R"(fun id(x) { return x; } var n = 0;
+             for (var i = 0; i < 100; i = i + 1) { n = id(n) + 1; }
+             print n;)",
+          interpreter);
+      interpreter.run(*fine);
+      REQUIRE(interpreter.used().fuel == 200);
+      REQUIRE(buffer.str() == "start\n100\n");
+
+      auto const deep =
+          lox::compile("fun r(n) { return r(n + 1); } r(0);", interpreter);
+      REQUIRE_THROWS(interpreter.run(*deep));
+    }
+  }
+  SUBCASE("time") {
+    for (bool const ir : {false, true}) {
+      CAPTURE(ir);
+
+      std::ostringstream buffer;
+      lox::interpreter   interpreter{buffer, {.ir = ir, .time_limit = 0.05}};
+      auto const         program = lox::compile(spin, interpreter);
+      REQUIRE(program != nullptr);
+
+      try {
+        interpreter.run(*program);
+        FAIL("should have run out of time");
+      } catch (lox::budget_exceeded const& err) {
+        REQUIRE(err.used.seconds >= 0.05);
+        REQUIRE(err.used.fuel > 0);
+      }
+    }
+  }
+  SUBCASE("tasks") {
+    // A task has a budget of its own, and fails if it runs out
+    std::ostringstream buffer;
+    std::ostringstream errors;
+    lox::interpreter   interpreter{buffer, {.fuel = 10000}};
+    interpreter.diagnostics().output = &errors;
+
+    auto const program = lox::compile(
+        R"(fun spin(x) { while (true) {} }
+           print receive(spawn(spin, 1)); print "after";)",
+        interpreter);
+    interpreter.run(*program);
+    REQUIRE(buffer.str() == "nil\nafter\n");
+    REQUIRE(interpreter.diagnostics().runtime_errored);
+    REQUIRE(errors.str().find("ran out of fuel") != std::string::npos);
+  }
+  SUBCASE("tasks only copy what they use") {
+    // A task is handed copies of the globals it could use, and no others,
+    // charged to it rather than the spawner, so a big one it doesn't use
+    // costs nothing however many are spawned (or however many chunks
+    // parallel work is split into), while one that uses it takes the task
+    // over its limit. Without the extra floats it stays under, and so does
+    // the spawner, however many it hands out.
+    constexpr std::size_t limit = 1 << 20;
+    auto const            run   = [&](std::string_view task) {
+      std::ostringstream buffer;
+      lox::interpreter   interpreter{buffer, {.heap_limit = limit}};
+      interpreter.diagnostics().output = &buffer;
+      auto const program = lox::compile(
+          fmt::format(R"(var big = floats(100000); var small = [1];
+                         fun add(x) {{ var more = floats(100000);
+                           return x + small[0]; }}
+                         fun use(x) {{ var more = floats(100000);
+                           return len(big); }}
+                         fun peek(x) {{ return len(big); }}
+                         var xs = [];
+                         for (var i = 0; i < 64; i = i + 1) push(xs, i);
+                         var total = 0;
+                         for (var i = 0; i < 10; i = i + 1)
+                           total = total + {};
+                         print total;)",
+                      task),
+          interpreter);
+      REQUIRE(program != nullptr);
+      interpreter.run(*program);
+      return buffer.str();
+    };
+
+    REQUIRE(run("receive(spawn(add, i))") == "55\n");
+    REQUIRE(run("len(parallel_map(xs, add))") == "640\n");
+    REQUIRE(run("receive(spawn(peek, i))") == "1000000\n");
+    REQUIRE(run("len(parallel_map(xs, peek))") == "640\n");
+    for (auto const* const use :
+         {"receive(spawn(use, i))", "len(parallel_map(xs, use))"}) {
+      CAPTURE(use);
+      auto const out = run(use);
+      REQUIRE(out.find("went over its heap limit") != std::string::npos);
+    }
+  }
+  SUBCASE("heap") {
+    // Each run is only charged for what it holds, whatever else is running:
+    // one runs over its limit while the other, alongside it, stays well
+    // under, though it makes far more than the limit in all
+    constexpr std::size_t limit = 1 << 20;
+
+    std::ostringstream hog_buffer;
+    lox::interpreter   hog{hog_buffer, {.heap_limit = limit}};
+    auto const         hoard = lox::compile(
+        R"(var xs = []; while (true) { push(xs, "x" * 100 + "y"); })", hog);
+    std::ostringstream buffer;
+    lox::interpreter   modest{buffer, {.heap_limit = limit}};
+    auto const         churn = lox::compile(
+        R"(var keep = []; for (var i = 0; i < 1000; i = i + 1) push(keep, i);
+           for (var i = 0; i < 100000; i = i + 1) { var s = "a" * 1000; }
+           print len(keep);)",
+        modest);
+    REQUIRE(hoard != nullptr);
+    REQUIRE(churn != nullptr);
+
+    std::optional<lox::usage> hogged;
+    std::thread               hogging([&] {
+      try {
+        hog.run(*hoard);
+      } catch (lox::budget_exceeded const& err) { hogged = err.used; }
+    });
+    modest.run(*churn);
+    hogging.join();
+
+    REQUIRE(hogged);
+    REQUIRE(hogged->heap > limit);
+    REQUIRE(buffer.str() == "1000\n");
+    REQUIRE(modest.used().heap < limit / 8);
+  }
+  SUBCASE("heap, all at once") {
+    // Going over in one go is caught there and then, before it's allocated,
+    // not at the end of a slice
+    constexpr std::size_t limit = 1 << 20;
+
+    for (auto const* const big :
+         {R"("x" * 100000000)", "floats(100000000)", R"("x" * 600000 + "y")"}) {
+      CAPTURE(big);
+
+      std::ostringstream buffer;
+      lox::interpreter   interpreter{buffer, {.heap_limit = limit}};
+      auto const         program = lox::compile(
+          fmt::format(R"(print "start"; var big = {}; print "end";)", big),
+          interpreter);
+      REQUIRE(program != nullptr);
+
+      try {
+        interpreter.run(*program);
+        FAIL("should have gone over its heap limit");
+      } catch (lox::budget_exceeded const& err) {
+        REQUIRE(err.used.heap > limit);
+        REQUIRE(err.used.fuel < 10);
+      }
+      REQUIRE(buffer.str() == "start\n");
+      REQUIRE(interpreter.used().heap < limit);
+    }
+  }
+}
+
+TEST_CASE("isolates") {
+  // Interpreters on different threads share nothing, errors included: every
+  // other one fails, and only it should know
+  constexpr std::size_t count = 8;
+
+  std::array<std::string, count> outputs;
+  std::array<std::string, count> diagnostics;
+  std::array<bool, count>        failed{};
+
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < count; ++i) {
+    threads.emplace_back([&, i] {
+      std::ostringstream buffer;
+      std::ostringstream errors;
+
+      lox::interpreter interpreter{buffer, {.ir = i % 4 < 2}};
+      interpreter.diagnostics().output = &errors;
+
+      auto const program = lox::compile(
+          fmt::format(R"(fun fib(n) {{ if (n < 2) return n;
+                           return fib(n - 1) + fib(n - 2); }}
+                         var s = "";
+                         for (var i = 0; i < 100; i = i + 1) s = s + "x";
+                         print fib(20) + {0}; if ({1}) print -s;)",
+                      i, i % 2 == 1),
+          interpreter);
+      for (int run = 0; run < 10; ++run) { interpreter.run(*program); }
+
+      outputs[i]     = buffer.str();
+      diagnostics[i] = errors.str();
+      failed[i]      = interpreter.diagnostics().runtime_errored;
+    });
+  }
+  for (auto& thread : threads) { thread.join(); }
+
+  for (std::size_t i = 0; i < count; ++i) {
+    CAPTURE(i);
+
+    std::string want;
+    for (int run = 0; run < 10; ++run) {
+      want += fmt::format("{}\n", 6765 + i);
+    }
+    REQUIRE(want == outputs[i]);
+    REQUIRE(failed[i] == (i % 2 == 1));
+    REQUIRE(diagnostics[i].empty() == (i % 2 == 0));
+  }
+}
+
+TEST_CASE("tasks") {
+  std::string input;
+  std::string want;
+
+  SUBCASE("fan out") {
+    input = R"(fun fib(n) { if (n < 2) return n;
+                 return fib(n - 1) + fib(n - 2); }
+               var results = channel();
+               for (var i = 0; i < 16; i = i + 1) send(results, spawn(fib, i));
+               var total = 0;
+               for (var i = 0; i < 16; i = i + 1)
+                 total = total + receive(receive(results));
+               print total;)";
+    want  = "1596\n";
+  }
+  SUBCASE("tasks wait on tasks") {
+    // More tasks are waiting at once than there are threads
+    input = R"(fun tree(depth) { if (depth == 0) return 1;
+                 var left = spawn(tree, depth - 1);
+                 var right = spawn(tree, depth - 1);
+                 return receive(left) + receive(right); }
+               print tree(6);)";
+    want  = "64\n";
+  }
+  SUBCASE("ping pong") {
+    input = R"(var ping = channel(); var pong = channel();
+               fun bounce(count) { for (var i = 0; i < count; i = i + 1)
+                 send(pong, receive(ping) + 1); }
+               var bouncing = spawn(bounce, 100);
+               var x = 0;
+               for (var i = 0; i < 100; i = i + 1) {
+                 send(ping, x); x = receive(pong); }
+               print x;)";
+    want  = "100\n";
+  }
+  SUBCASE("nothing is shared") {
+    // The task changes its own copies of the global and the captured variable
+    input = R"(var count = 0;
+               fun make() { var n = 10;
+                 fun add(by) { { n = n + by; count = count + by; } return n; }
+                 return add; }
+               var add = make();
+               print receive(spawn(add, 5)); print add(1); print count;)";
+    want  = "15\n11\n1\n";
+  }
+  SUBCASE("tasks get the globals they use") {
+    // Through the functions it's handed, those they define and those in the
+    // globals they use; and anything, with a channel to receive functions
+    input = R"(var data = [1, 2]; var log = []; var unused = [3];
+               fun helper() { return data[1]; }
+               fun work(x) { fun inner() { { push(log, x); } return helper(); }
+                 return inner() + len(log); }
+               print receive(spawn(work, 10)); print len(log);
+               fun late(x) { return data[0] + unused[0]; }
+               fun call(c) { return receive(c)(0); }
+               var pass = channel(); var got = spawn(call, pass);
+               { send(pass, late); } print receive(got);)";
+    want  = "3\n0\n4\n";
+  }
+  SUBCASE("builtins act for the task calling them") {
+    // However spawn reaches the task, it spawns from the task's globals
+    input = R"(var where = "parent"; var sp = spawn;
+               fun look(x) { return where; }
+               fun alias(x) { { where = "alias"; }
+                 return receive(sp(look, 0)); }
+               fun passed(s) { { where = "passed"; }
+                 return receive(s(look, 0)); }
+               fun stored(a) { { where = "stored"; }
+                 return receive(a[0](look, 0)); }
+               print receive(spawn(alias, 0));
+               print receive(spawn(passed, spawn));
+               print receive(spawn(stored, [sp]));
+               print parallel_map([1, 2], alias); print where;)";
+    want  = "alias\npassed\nstored\n[alias, alias]\nparent\n";
+  }
+  SUBCASE("parallel map and reduce") {
+    input = R"(fun square(x) { return x * x; }
+               fun add(a, b) { return a + b; }
+               fun join(a, b) { return a + "," + b; }
+               var xs = [];
+               for (var i = 1; i <= 1000; i = i + 1) { push(xs, i); }
+               var squares = parallel_map(xs, square);
+               print len(squares); print squares[0]; print squares[999];
+               print parallel_reduce(squares, add, 0);
+               print parallel_reduce(["a", "b", "c", "d", "e"], join, "z");
+               print parallel_map([], square);
+               print parallel_reduce([], add, 7);)";
+    want  = "1000\n1\n1000000\n333833500\nz,a,b,c,d,e\n[]\n7\n";
+  }
+  SUBCASE("parallel work sees copies") {
+    input = R"(var seen = [0];
+               fun count(x) { { seen[0] = seen[0] + 1; } return seen[0]; }
+               print len(parallel_map([1, 2, 3, 4, 5, 6, 7, 8], count));
+               print seen;)";
+    want  = "8\n[0]\n";
+  }
+  SUBCASE("parallel work gets the globals it uses") {
+    // The last chunk's item uses a global the callee doesn't
+    input = R"(var g = [5]; fun late(x) { return g[0]; }
+               fun apply(x) { if (x == 1) return x; return x(0); }
+               var xs = [];
+               for (var i = 0; i < 99; i = i + 1) push(xs, 1);
+               { push(xs, late); }
+               var ys = parallel_map(xs, apply); print ys[0]; print ys[99];)";
+    want  = "1\n5\n";
+  }
+  SUBCASE("failing parallel work") {
+    input = R"(fun check(x) { if (x == 3) return x - "x"; return x; }
+               print "before"; print parallel_map([1, 2, 3, 4], check);
+               print "never";)";
+    want  = "before\n";
+  }
+  SUBCASE("failing tasks") {
+    input = R"(fun fail(n) { return n - "x"; }
+               print receive(spawn(fail, 1)); print "after";)";
+    want  = "nil\nafter\n";
+  }
+  SUBCASE("tasks have smaller stacks") {
+    input = R"(fun deep(n) { if (n == 0) return 0; return 1 + deep(n - 1); }
+               print receive(spawn(deep, 50)); print receive(spawn(deep, 1000));
+               print deep(1000);)";
+    want  = "50\nnil\n1000\n";
+  }
+  SUBCASE("receiving what nothing can send") {
+    // Once the tasks have finished, what they sent can still be received
+    input = R"(var ch = channel(); fun put(x) { { send(ch, x); } }
+               var done = receive(spawn(put, 1));
+               print "before"; print receive(ch); print receive(ch);
+               print "never";)";
+    want  = "before\n1\n";
+  }
+
+  std::ostringstream buffer;
+  std::ostringstream errors;
+  lox::interpreter   interpreter{buffer};
+  interpreter.diagnostics().output = &errors;
+
+  auto const program = lox::compile(input, interpreter);
+  REQUIRE(program != nullptr);
+  interpreter.run(*program);
+
+  REQUIRE(want == buffer.str());
+  REQUIRE(interpreter.diagnostics().runtime_errored ==
+          not errors.str().empty());
+}
+
+TEST_CASE("coroutines") {
+  std::string input;
+  std::string want;
+
+  SUBCASE("generators") {
+    input = R"(fun count(n) { for (var i = 0; i < n; i = i + 1) yield i;
+                 return "ignored"; }
+               var g = count(3);
+               print g;
+               while (!done(g)) print next(g);
+               print next(g); print done(g);)";
+    want  = "<generator>\n0\n1\n2\nnil\ntrue\n";
+  }
+  SUBCASE("pipelines") {
+    // Each stage only ever holds one value, however long the stream
+    input = R"(fun naturals() { var n = 0;
+                 while (true) { n = n + 1; yield n; } }
+               fun squares(gen) { while (true) { var x = next(gen);
+                 yield x * x; } }
+               fun take(gen, k) { while (k > 0) { yield next(gen);
+                 k = k - 1; } }
+               var s = take(squares(naturals()), 10000);
+               var total = 0;
+               while (!done(s)) total = total + next(s);
+               print total;)";
+    want  = "333383335000\n";
+  }
+  SUBCASE("frames survive suspension") {
+    // A temporary, and a variable captured and changed while it's suspended
+    input = R"(fun gen() { var c = 0; fun bump() { { c = c + 1; } return c; }
+                 print "a" == (yield bump); print c; yield c; }
+               var g = gen(); var bump = next(g);
+               { bump(); bump(); }
+               print next(g); print bump();)";
+    want  = "false\n2\n2\n3\n";
+  }
+  SUBCASE("async") {
+    input = R"(async fun add(a, b) { return a + b; }
+               async fun twice(x) { var y = await add(x, x);
+                 print "twice"; return y * 2; }
+               var t = twice(10);
+               print t; print await t; print await t; print await 5;)";
+    want  = "twice\n<async>\n40\n40\n5\n";
+  }
+  SUBCASE("awaiting channels") {
+    // Both wait at once, on the one thread, and finish in the order the
+    // channels get something
+    input = R"(async fun wait(ch, name) { var v = await ch; print name + v;
+                 return v; }
+               var first = channel(); var second = channel();
+               var a = wait(first, "a"); var b = wait(second, "b");
+               { send(second, "2"); send(first, "1"); }
+               print await a + await b;
+               fun square(x) { return x * x; }
+               async fun squares() { return await spawn(square, 3) +
+                 await spawn(square, 4); }
+               print await squares();)";
+    want  = "b2\na1\n12\n25\n";
+  }
+  SUBCASE("unfinished async calls finish with the run") {
+    input = R"(async fun later(ch) { print await ch; }
+               var ch = channel(); var pending = later(ch);
+               { send(ch, "last"); } print "first";)";
+    want  = "first\nlast\n";
+  }
+  SUBCASE("errors") {
+    input = R"(fun gen() { yield 1; yield nil - 1; yield 3; }
+               var g = gen(); print next(g); print next(g);)";
+    want  = "1\n";
+  }
+  SUBCASE("generators stay with their task") {
+    // However a task reaches next, it can't resume the spawner's generator
+    input = R"(fun gen() { yield 1; yield 2; }
+               var g = gen(); var nx = next;
+               fun steal(x) { return nx(g); }
+               fun passed(n) { return n(g); }
+               print receive(spawn(steal, 0));
+               print receive(spawn(passed, next)); print next(g);)";
+    want  = "nil\nnil\n1\n";
+  }
+  SUBCASE("async calls stay with their task") {
+    // A task can't await the spawner's async call, finished or not
+    input = R"(async fun wait(ch) { return await ch; }
+               async fun now() { return "done"; }
+               var ch = channel(); var waiting = wait(ch); var done = now();
+               fun steal(call) { return await call; }
+               fun passed(x) { return await done; }
+               print receive(spawn(steal, waiting));
+               print receive(spawn(passed, 0)); { send(ch, "sent"); }
+               print await waiting; print await done;)";
+    want  = "nil\nnil\nsent\ndone\n";
+  }
+  SUBCASE("awaiting itself") {
+    input = R"(async fun f(ch) { var got = await ch; return await self; }
+               var ch = channel(); var self = f(ch);
+               { send(ch, 1); await self; } print "never";)";
+    want  = "";
+  }
+  SUBCASE("awaiting what nothing can send") {
+    // Even with a task running, which finishes without sending anything
+    input = R"(async fun wait(ch) { return await ch; }
+               fun idle(x) { return x; } var task = spawn(idle, 0);
+               var ch = channel(); var waiting = wait(ch);
+               print "before"; print await waiting; print "never";)";
+    want  = "before\n";
+  }
+
+  std::ostringstream buffer;
+  std::ostringstream errors;
+  lox::interpreter   interpreter{buffer};
+  interpreter.diagnostics().output = &errors;
+
+  auto const program = lox::compile(input, interpreter);
+  REQUIRE(program != nullptr);
+  interpreter.run(*program);
+
+  REQUIRE(want == buffer.str());
+  REQUIRE(interpreter.diagnostics().runtime_errored ==
+          not errors.str().empty());
+}
+
+TEST_CASE("arrays") {
+  std::string input;
+  std::string want;
+
+  SUBCASE("literals and indexing") {
+    input = R"(var a = [1, "two", nil, [3]];
+               print a; print a[1]; print a[3][0]; print len(a); print [];
+               { a[0] = a[0] + 10; } print a[0];)";
+    want  = "[1, two, nil, [3]]\ntwo\n3\n4\n[]\n11\n";
+  }
+  SUBCASE("push and pop") {
+    input = R"(var a = [];
+               for (var i = 0; i < 1000; i = i + 1) { push(a, i * i); }
+               var total = 0;
+               while (len(a) > 0) total = total + pop(a);
+               print total; print len("four");)";
+    want  = "332833500\n4\n";
+  }
+  SUBCASE("shared by reference") {
+    input = R"(fun fill(a, n) { for (var i = 0; i < n; i = i + 1) a[i] = i; }
+               var a = [nil, nil, nil]; var b = a;
+               { fill(b, 3); } print a; print a == b; print a == [0, 1, 2];
+               { push(a, a); } print a;)";
+    want  = "[0, 1, 2]\ntrue\nfalse\n[0, 1, 2, [...]]\n";
+  }
+  SUBCASE("copied for tasks") {
+    input = R"(fun change(a) { { a[0] = "changed"; } return a; }
+               var a = ["kept"];
+               print receive(spawn(change, a)); print a;)";
+    want  = "[changed]\n[kept]\n";
+  }
+  SUBCASE("index errors") {
+    input = R"(var a = [1, 2]; print a[1]; print a[2];)";
+    want  = "2\n";
+  }
+  SUBCASE("non-whole indices") {
+    input = R"(var a = [1, 2]; print a[0]; print a[0.5];)";
+    want  = "1\n";
+  }
+  SUBCASE("only arrays index") {
+    input = R"(var s = "str"; print s; print s[0];)";
+    want  = "str\n";
+  }
+  SUBCASE("popping empty arrays") {
+    input = R"(var a = [1]; print pop(a); print pop(a);)";
+    want  = "1\n";
+  }
+  SUBCASE("float arrays") {
+    input = R"(var xs = floats([3, -1, 4, 1.5]); var ys = floats(4);
+               for (var i = 0; i < len(ys); i = i + 1) { ys[i] = i; }
+               print xs; print sum(xs); print minimum(xs); print maximum(xs);
+               print dot(xs, ys); { scale(xs, 2); } print xs; print xs[1];)";
+    want  = "[3, -1, 4, 1.5]\n7.5\n-1\n4\n11.5\n[6, -2, 8, 3]\n-2\n";
+  }
+  SUBCASE("float arrays only hold numbers") {
+    input = R"(var xs = floats(2); print xs; { xs[0] = "a"; })";
+    want  = "[0, 0]\n";
+  }
+  SUBCASE("float arrays too big to allocate") {
+    input = R"(print len(floats(2)); print floats(1000000000000000000);)";
+    want  = "2\n";
+  }
+  SUBCASE("float arrays too big to count") {
+    // 2^60 doubles are 2^63 bytes, one more than the heap meter can count
+    input = R"(print len(floats(2)); print floats(1152921504606846976);)";
+    want  = "2\n";
+  }
+  SUBCASE("float arrays bigger than can be") {
+    input = R"(var n = 1000000000000000000; print floats(n * n);)";
+    want  = "";
+  }
+
+  std::ostringstream buffer;
+  std::ostringstream errors;
+  lox::interpreter   interpreter{buffer};
+  interpreter.diagnostics().output = &errors;
+
+  auto const program = lox::compile(input, interpreter);
+  REQUIRE(program != nullptr);
+  interpreter.run(*program);
+
+  REQUIRE(want == buffer.str());
+  REQUIRE(interpreter.diagnostics().runtime_errored ==
+          not errors.str().empty());
+}
+
+TEST_CASE("maps") {
+  std::string input;
+  std::string want;
+
+  SUBCASE("keys and values") {
+    input = R"(var m = map();
+               { m["a"] = 1; m[2] = "two"; m[true] = nil; m[nil] = false; }
+               print m["a"]; print m[2]; print m[nil]; print m["missing"];
+               print len(m); print has(m, true); print has(m, "b");
+               { m[-0] = "zero"; } print m[0];)";
+    want  = "1\ntwo\nfalse\nnil\n4\ntrue\nfalse\nzero\n";
+  }
+  SUBCASE("grouping") {
+    // Each key is built afresh, so equal keys are different strings
+    input = R"(var counts = map();
+               for (var j = 0; j < 300; j = j + 1) {
+                 for (var g = 0; g < 100; g = g + 1) {
+                   var key = "group" + g;
+                   counts[key] = (counts[key] or 0) + 1; } }
+               print len(counts); print counts["group42"];)";
+    want  = "100\n300\n";
+  }
+  SUBCASE("growing and removing") {
+    input = R"(var m = map();
+               for (var i = 0; i < 100000; i = i + 1) { m[i] = i * 2; }
+               for (var i = 0; i < 100000; i = i + 2) { remove(m, i); }
+               var total = 0; var k = keys(m);
+               for (var i = 0; i < len(k); i = i + 1) total = total + m[k[i]];
+               print len(m); print total; print m[99999]; print m[99998];
+               print remove(m, 1); print remove(m, 1);)";
+    want  = "50000\n5000000000\n199998\nnil\ntrue\nfalse\n";
+  }
+  SUBCASE("printing") {
+    input = R"(var m = map(); { m["self"] = m; } print m;)";
+    want  = "{self: {...}}\n";
+  }
+  SUBCASE("copied for tasks") {
+    input = R"(fun change(m) { { m["k"] = "changed"; } return m["k"]; }
+               var m = map(); { m["k"] = "kept"; }
+               print receive(spawn(change, m)); print m["k"];)";
+    want  = "changed\nkept\n";
+  }
+  SUBCASE("bad keys") {
+    input = R"(var m = map(); print len(m); { m[map()] = 1; })";
+    want  = "0\n";
+  }
+
+  std::ostringstream buffer;
+  std::ostringstream errors;
+  lox::interpreter   interpreter{buffer};
+  interpreter.diagnostics().output = &errors;
+
+  auto const program = lox::compile(input, interpreter);
+  REQUIRE(program != nullptr);
+  interpreter.run(*program);
+
+  REQUIRE(want == buffer.str());
+  REQUIRE(interpreter.diagnostics().runtime_errored ==
+          not errors.str().empty());
+}
+
+TEST_CASE("snapshots") {
+  std::ostringstream buffer;
+  lox::interpreter   interpreter{buffer};
+
+  auto const program = lox::compile(
+      R"(var greeting = "hi";
+         fun counter() { var n = 0; fun next() { { n = n + 1; } return n; }
+           return next; }
+         var next = counter(); var again = next;
+         var xs = [1, "two", nil]; { push(xs, xs); }
+         var m = map(); { m["next"] = next; m[2] = floats([1.5, 2.5]); }
+         var size = len;
+         { next(); }
+         fun main() { print greeting; print next(); print again();
+           print xs; print m["next"] == next; print sum(m[2]);
+           print size(greeting); })",
+      interpreter);
+  REQUIRE(program != nullptr);
+  interpreter.run(*program);
+  REQUIRE(buffer.str().empty());
+
+  std::ostringstream saved;
+  interpreter.save_snapshot(saved);
+  auto const bytes = saved.str();
+
+  // Carries on where the script left off, sharing what it shared, in any
+  // interpreter, as many times as it's loaded
+  for (bool const ir : {false, true}) {
+    CAPTURE(ir);
+
+    std::ostringstream output;
+    lox::interpreter   other{output, {.ir = ir}};
+    for (int run = 0; run < 2; ++run) {
+      auto const loaded = other.load_snapshot(bytes);
+      other.run_main(*loaded);
+    }
+    std::string const want = "hi\n2\n3\n[1, two, nil, [...]]\ntrue\n4\n2\n";
+    REQUIRE(want + want == output.str());
+    REQUIRE(not other.diagnostics().runtime_errored);
+  }
+
+  SUBCASE("bad snapshots") {
+    std::ostringstream output;
+    lox::interpreter   other{output};
+    REQUIRE_THROWS(other.load_snapshot(std::string_view{"LOXSNAP"}));
+    REQUIRE_THROWS(other.load_snapshot(std::string_view{"not a snapshot"}));
+    REQUIRE_THROWS(other.load_snapshot(
+        std::string_view{bytes}.substr(0, bytes.size() / 2)));
+
+    auto const corrupt = [&](auto const& change) {
+      auto snap = lox::read_snapshot(bytes, [](std::string const& name) {
+        return std::make_shared<lox::builtin>(lox::builtin{name, 0, {}});
+      });
+      change(snap);
+      std::ostringstream changed;
+      lox::write_snapshot(changed, snap);
+      REQUIRE_THROWS_WITH(other.load_snapshot(changed.str()),
+                          "snapshot is corrupt or cut short");
+    };
+    REQUIRE_THROWS_WITH(
+        other.load_snapshot(std::string_view{bytes}.substr(0, bytes.size() - 1)),
+        "snapshot is corrupt or cut short");
+    // Globals that don't match the program's
+    corrupt([](lox::snapshot& snap) { snap.globals.emplace_back(); });
+    // Operands that point past what they index
+    corrupt([](lox::snapshot& snap) {
+      for (auto& instr : snap.program->script->code) {
+        if (instr.op == lox::opcode::get_global) {
+          instr.arg = static_cast<std::int32_t>(snap.program->globals.size());
+        }
+      }
+    });
+    corrupt([](lox::snapshot& snap) {
+      auto& code = snap.program->script->code;
+      code.front() = {lox::opcode::jump, static_cast<std::int32_t>(code.size())};
+    });
+    // Code that would overflow its frame, pop from an empty one or reach an
+    // instruction with different numbers of values on the stack
+    auto const code = [&](int max_stack, std::vector<lox::instruction> code) {
+      corrupt([&](lox::snapshot& snap) {
+        auto& script     = *snap.program->script;
+        script.max_stack = max_stack;
+        script.origins.assign(code.size(), -1);
+        script.code = code;
+      });
+    };
+    code(0, {{lox::opcode::nil, 0}, {lox::opcode::nil, 0},
+             {lox::opcode::return_, 0}});
+    code(4, {{lox::opcode::pop, 0}, {lox::opcode::nil, 0},
+             {lox::opcode::return_, 0}});
+    code(4, {{lox::opcode::nil, 0}, {lox::opcode::add, 0},
+             {lox::opcode::return_, 0}});
+    code(4, {{lox::opcode::true_, 0}, {lox::opcode::jump_if_false, 3},
+             {lox::opcode::nil, 0}, {lox::opcode::return_, 0}});
+  }
+  SUBCASE("values that can't be saved") {
+    auto const channels = lox::compile("var ch = channel();", interpreter);
+    interpreter.run(*channels);
+
+    std::ostringstream out;
+    REQUIRE_THROWS(interpreter.save_snapshot(out));
+  }
+}
@@ -0,0 +1,219 @@
+#include <lox/interpreter/interpreter.hpp>
+#include <lox/ir/ir.hpp>
+#include <lox/parser/parser.hpp>
+#include <lox/resolver/resolver.hpp>
+#include <lox/scanner/scanner.hpp>
+#include <tests/util.hpp>
+
+#include <limits>
+#include <sstream>
+#include <string>
+
+TEST_CASE("ir") {
+  std::string input;
+  std::string want;
+
+  SUBCASE("common subexpressions") {
+    input = "fun f(a, b) { return a * b + a * b; }";
+    want  = "fun f/2\n"
+            "b0:\n"
+            "  v0 = param 0\n"
+            "  v1 = param 1\n"
+            "  v2 = multiply v0, v1\n"
+            "  v3 = add v2, v2\n"
+            "  return v3\n";
+  }
+  SUBCASE("loop invariants") {
+    // n - 1 might fail, but the header always runs so it's hoisted anyway
+    input = R"(fun f(n) { var s = 0;
+                 for (var i = 0; i < n - 1; i = i + 1) s = s + i * (2 + 3);
+                 return s; })";
+    want  = "fun f/1\n"
+            "b0:\n"
+            "  v0 = param 0\n"
+            "  v1 = const 0\n"
+            "  v2 = const 1\n"
+            "  v3 = subtract v0, v2\n"
+            "  v4 = const 2\n"
+            "  v5 = const 3\n"
+            "  v6 = add v4, v5\n"
+            "  jump -> b1\n"
+            "b1: <- b0, b3\n"
+            "  v8 = phi v1 (b0), v14 (b3)\n"
+            "  v9 = phi v1 (b0), v15 (b3)\n"
+            "  v10 = less v9, v3\n"
+            "  branch v10 -> b3, b2\n"
+            "b2: <- b1\n"
+            "  return v8\n"
+            "b3: <- b1\n"
+            "  v13 = multiply v9, v6\n"
+            "  v14 = add v8, v13\n"
+            "  v15 = add v9, v2\n"
+            "  jump -> b1\n";
+  }
+  SUBCASE("dead code") {
+    // a + 1 stays, it fails if a isn't a number or string
+    input = "fun f(a) { var x = a + 1; var y = -2; var z = y * 4; return a; }";
+    want  = "fun f/1\n"
+            "b0:\n"
+            "  v0 = param 0\n"
+            "  v1 = const 1\n"
+            "  v2 = add v0, v1\n"
+            "  return v0\n";
+  }
+  SUBCASE("phis") {
+    input = R"(fun f(a, b) { var c = a and b; if (c) c = "x"; return c; })";
+    want  = "fun f/2\n"
+            "b0:\n"
+            "  v0 = param 0\n"
+            "  v1 = param 1\n"
+            "  branch v0 -> b1, b2\n"
+            "b1: <- b0\n"
+            "  jump -> b2\n"
+            "b2: <- b0, b1\n"
+            "  v4 = phi v0 (b0), v1 (b1)\n"
+            "  branch v4 -> b3, b4\n"
+            "b3: <- b2\n"
+            "  v6 = const \"x\"\n"
+            "  jump -> b4\n"
+            "b4: <- b2, b3\n"
+            "  v8 = phi v4 (b2), v6 (b3)\n"
+            "  return v8\n";
+  }
+
+  std::ostringstream buffer;
+
+  lox::interpreter interpreter{buffer};
+  lox::scanner     scanner{input, interpreter.diagnostics()};
+  lox::parser      parser{scanner.scan(), interpreter.diagnostics()};
+
+  std::vector<lox::stmt> stmts = parser.parse();
+  lox::resolver          resolver{interpreter};
+  resolver.resolve(stmts);
+
+  auto const& decl = std::get<lox::box<lox::function_stmt>>(stmts[0]);
+  auto        fn   = lox::ir::lower(*decl, interpreter);
+  REQUIRE(fn != nullptr);
+  lox::ir::optimize(*fn);
+
+  REQUIRE(want == lox::ir::to_string(*fn));
+}
+
+TEST_CASE("ir constants") {
+  // NaN isn't equal to anything, so it can't share a constant with another
+  // number. Literals don't fold to NaN, so these are put in by hand.
+  std::ostringstream buffer;
+
+  lox::interpreter interpreter{buffer};
+  lox::scanner     scanner{"fun f() { print 5; print 0; print 7; print 0; }",
+                           interpreter.diagnostics()};
+  lox::parser      parser{scanner.scan(), interpreter.diagnostics()};
+
+  std::vector<lox::stmt> stmts = parser.parse();
+  lox::resolver          resolver{interpreter};
+  resolver.resolve(stmts);
+
+  auto& decl = std::get<lox::box<lox::function_stmt>>(stmts[0]);
+  for (int const i : {1, 3}) {
+    auto& print = std::get<lox::print_stmt>(decl->body[i]);
+    std::get<lox::literal_expr>(print.ex).literal =
+        std::numeric_limits<double>::quiet_NaN();
+  }
+
+  auto fn = lox::ir::lower(*decl, interpreter);
+  REQUIRE(fn != nullptr);
+  REQUIRE("fun f/0\n"
+          "b0:\n"
+          "  v0 = const 5\n"
+          "  print v0\n"
+          "  v2 = const nan\n"
+          "  print v2\n"
+          "  v4 = const 7\n"
+          "  print v4\n"
+          "  v6 = const nan\n"
+          "  print v6\n"
+          "  v8 = const nil\n"
+          "  return v8\n" == lox::ir::to_string(*fn));
+}
+
+TEST_CASE("ir executor") {
+  std::string input;
+  std::string want;
+
+  SUBCASE("fib") {
+    input = read_file("interpreter/fib.lox");
+    want  = read_file("interpreter/fib.out");
+  }
+  SUBCASE("swap in a loop") {
+    input = R"(fun f(n) { var a = 1; var b = 2;
+                 while (n > 0) { var t = a; a = b; b = t; n = n - 1; }
+                 return a; }
+               print f(3); print f(4);)";
+    want  = "2\n1\n";
+  }
+  SUBCASE("short circuits") {
+    input = R"(fun f(a, b) { return a and b or "x"; }
+               print f(1, nil); print f(1, 2); print f(false, 2);)";
+    want  = "x\n2\nx\n";
+  }
+  SUBCASE("breaks and globals") {
+    input = R"(var total = 0;
+               fun f(n) { while (true) { if (n == 0) break; total = total + n;
+                 n = n - 1; } g(); }
+               fun g() { print total; }
+               f(4);)";
+    want  = "10\nnil\nnil\n";
+  }
+  SUBCASE("closures fall back to bytecode") {
+    input = R"(fun make() { var x = "a"; fun get() { return x; } x = "b";
+                 return get; }
+               print make()();)";
+    want  = "b\nb\n";
+  }
+  SUBCASE("errors") {
+    input = R"(fun f(a) { var b = a - 1; print "before"; return -b; }
+               f("x");)";
+    want  = ""; // fails before printing anything
+  }
+  SUBCASE("tail calls") {
+    input = R"(fun count(n, acc) { if (n == 0) return acc;
+                 return count(n - 1, acc + 1); }
+               fun even(n) { if (n == 0) return true; return uneven(n - 1); }
+               fun uneven(n) { if (n == 0) return false; return even(n - 1); }
+               print count(100000, 0); print even(100001);)";
+    want  = "100000\nfalse\n";
+  }
+  SUBCASE("type changes") {
+    // Numbers, then strings where the machine code expects numbers
+    input = R"(fun f(a, b) { var c = a + b; if (c < b) return -c; return c; }
+               var i = 0; while (i < 3) { print f(i, 1); i = i + 1; }
+               print f("b", "a"); print f(nil == nil, 2);)";
+    want  = "1\n2\n3\nba\n";
+  }
+  SUBCASE("loops get hot") {
+    input = R"(fun f(n) { var s = 0; var i = 0;
+                 while (i < n) { s = s + i * 0.5; i = i + 1; }
+                 print s != s; return s; }
+               print f(100);)";
+    want  = "false\n2475\n";
+  }
+
+  // The same output interpreted and as machine code (straight away)
+  for (bool const jit : {false, true}) {
+    CAPTURE(jit);
+
+    std::ostringstream buffer;
+
+    lox::interpreter interpreter{
+        buffer, {.ir = true, .jit = jit, .jit_threshold = 1}};
+    lox::scanner scanner{input, interpreter.diagnostics()};
+    lox::parser  parser{scanner.scan(), interpreter.diagnostics()};
+
+    std::vector<lox::stmt> stmts = parser.parse();
+    lox::resolver          resolver{interpreter};
+    resolver.resolve(stmts);
+    interpreter.interpret(stmts);
+
+    REQUIRE(want == buffer.str());
+  }
+}
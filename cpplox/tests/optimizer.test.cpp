@@ -0,0 +1,76 @@
+#include <lox/ast/ast_printer.hpp>
+#include <lox/interpreter/interpreter.hpp>
+#include <lox/optimizer/optimizer.hpp>
+#include <lox/parser/parser.hpp>
+#include <lox/resolver/resolver.hpp>
+#include <lox/scanner/scanner.hpp>
+#include <tests/util.hpp>
+
+#include <fmt/ranges.h>
+
+#include <sstream>
+#include <string>
+
+TEST_CASE("optimizer") {
+  std::string input;
+  std::string want;
+  int         removed = 0;
+
+  SUBCASE("fold arithmetic") {
+    input   = "print 1 + 2 * 3; print -(4 - 1);";
+    want    = "print: 7\nprint: -3";
+    removed = 8;
+  }
+  SUBCASE("fold strings and comparisons") {
+    input   = R"(print "a" + "b" == "ab"; print "ab" * 2 < "b";)";
+    want    = "print: true\nprint: true";
+    removed = 8;
+  }
+  SUBCASE("propagate literal locals") {
+    input   = "{ var a = 2; var b = a * 3; var c = 1; c = b; print c; }";
+    want    = "{\n  var a = 2\n  var b = 6\n  var c = 1\n  expr: c = 6\n"
+              "  print: c\n}";
+    removed = 2;
+  }
+  SUBCASE("constant conditions") {
+    input   = R"(if (false) print "no"; else print "yes";
+                 while (nil) print 1;
+                 print true ? 1 : 2; print (3, 4); print nil or "x";)";
+    want    = "{\n  print: \"yes\"\n}\nprint: 1\nprint: 4\nprint: \"x\"";
+    removed = 15;
+  }
+  SUBCASE("unreachable code") {
+    input   = R"(fun f() { return 1; print "dead"; } while (true) { break; f(); })";
+    want    = "<fn f>\nwhile (true) {\n  break (depth: 1)\n}";
+    removed = 5;
+  }
+  SUBCASE("leave runtime errors alone") {
+    input   = R"(print -"a"; print 1 / 0; print "x" * 1000;)";
+    want    = "print: (-\"a\")\nprint: (1 / 0)\nprint: (\"x\" * 1000)";
+    removed = 0;
+  }
+  SUBCASE("leave NaN to runtime") {
+    std::string const inf = "1" + std::string(308, '0') + " * 10";
+    input   = "print 5; print " + inf + " - " + inf + "; print 7;";
+    want    = "print: 5\nprint: (inf - inf)\nprint: 7";
+    removed = 4;
+  }
+
+  std::ostringstream buffer;
+
+  lox::interpreter interpreter{buffer};
+  lox::scanner     scanner{input, interpreter.diagnostics()};
+  lox::parser      parser{scanner.scan(), interpreter.diagnostics()};
+
+  std::vector<lox::stmt> stmts = parser.parse();
+  lox::resolver          resolver{interpreter};
+  resolver.resolve(stmts);
+
+  lox::optimizer optimizer;
+  optimizer.optimize(stmts);
+
+  std::string got =
+      fmt::format("{}", fmt::join(lox::print(lox::ast_printer{}, stmts), "\n"));
+  REQUIRE(want == got);
+  REQUIRE(optimizer.statistics().removed() == removed);
+}
@@ -0,0 +1,59 @@
+#include <lox/pool/pool.hpp>
+#include <tests/util.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <thread>
+
+TEST_CASE("pool") {
+  lox::pool pool{4};
+  REQUIRE(pool.size() == 4);
+
+  SUBCASE("runs everything") {
+    std::atomic<int> sum{0};
+    for (int i = 1; i <= 1000; ++i) {
+      pool.submit([&sum, i] { sum += i; });
+    }
+    pool.wait();
+
+    REQUIRE(sum == 500500);
+  }
+  SUBCASE("tasks submit tasks") {
+    // A binary tree of tasks
+    std::atomic<int> leaves{0};
+
+    auto const split = [&](auto const& self, int depth) -> void {
+      if (depth == 0) {
+        ++leaves;
+        return;
+      }
+      pool.submit([&self, depth] { self(self, depth - 1); });
+      pool.submit([&self, depth] { self(self, depth - 1); });
+    };
+    pool.submit([&] { split(split, 10); });
+    pool.wait();
+
+    REQUIRE(leaves == 1024);
+  }
+  SUBCASE("work is stolen") {
+    // Every task lands on the submitting worker's deque, so any other thread
+    // running one has stolen it
+    std::mutex                mutex;
+    std::set<std::thread::id> ran;
+
+    pool.submit([&] {
+      for (int i = 0; i < 64; ++i) {
+        pool.submit([&] {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          std::scoped_lock const lock(mutex);
+          ran.insert(std::this_thread::get_id());
+        });
+      }
+    });
+    pool.wait();
+
+    REQUIRE(ran.size() > 1);
+  }
+}
@@ -123,7 +123,8 @@ TEST_CASE("check tokens") {
 
   const auto input = read_file(file);
 
-  lox::scanner scanner{input};
+  lox::errors  errors;
+  lox::scanner scanner{input, errors};
   const auto   got = scanner.scan();
 
   tokens_equal(want, got);
@@ -150,9 +151,9 @@ TEST_CASE("errors") {
   const auto input = read_file(file);
 
   std::ostringstream buffer;
-  lox::errors::output = &buffer;
+  lox::errors        errors{buffer};
 
-  lox::scanner scanner(input);
+  lox::scanner scanner(input, errors);
   const auto   _ = scanner.scan();
 
   CAPTURE(buffer.str());
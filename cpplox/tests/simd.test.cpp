@@ -0,0 +1,52 @@
+#include <lox/simd/simd.hpp>
+#include <tests/util.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+TEST_CASE("simd") {
+  CAPTURE(lox::simd::instruction_set());
+
+  // Every length up to a few times the widest loop, so that each tail gets
+  // run. Small whole numbers add up exactly in any order.
+  for (std::size_t n = 0; n <= 40; ++n) {
+    CAPTURE(n);
+
+    std::vector<double> xs(n);
+    std::vector<double> ys(n);
+    double              sum = 0;
+    double              dot = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      xs[i] = static_cast<double>((i * 7) % 13) - 6;
+      ys[i] = static_cast<double>(i % 5);
+      sum += xs[i];
+      dot += xs[i] * ys[i];
+    }
+
+    REQUIRE(lox::simd::sum(xs) == sum);
+    REQUIRE(lox::simd::dot(xs, ys) == dot);
+    if (n > 0) {
+      REQUIRE(lox::simd::min(xs) == *std::ranges::min_element(xs));
+      REQUIRE(lox::simd::max(xs) == *std::ranges::max_element(xs));
+    }
+
+    lox::simd::scale(xs, -2);
+    for (std::size_t i = 0; i < n; ++i) {
+      REQUIRE(xs[i] == -2 * (static_cast<double>((i * 7) % 13) - 6));
+    }
+  }
+
+  SUBCASE("extremes skip NaNs") {
+    double const        nan = std::numeric_limits<double>::quiet_NaN();
+    std::vector<double> xs(21, nan);
+    xs[3]  = 5;
+    xs[17] = -1;
+
+    REQUIRE(lox::simd::min(xs) == -1);
+    REQUIRE(lox::simd::max(xs) == 5);
+    REQUIRE(std::isinf(lox::simd::min(std::vector<double>(9, nan))));
+  }
+}